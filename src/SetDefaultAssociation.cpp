@@ -93,8 +93,14 @@ HRESULT SetDefaultAssociationForAfter1703(LPCWSTR szExtOrProtocol, IAssocHandler
 				&spszProgId
 			);
 
+			// The registration only has to be made once. When the application
+			// has been picked before, its "Applications\" ProgID is already
+			// there, and registering it again would just rewrite the same keys.
 			wil::com_ptr<IAssocHandlerMakeDefault> pMakeDefault = nullptr;
-			if (SUCCEEDED(pAssocHandler->QueryInterface(IID_PPV_ARGS(&pMakeDefault))))
+			if (
+				(!spszProgId || !CheckProgIdExists(spszProgId.get())) &&
+				SUCCEEDED(pAssocHandler->QueryInterface(IID_PPV_ARGS(&pMakeDefault)))
+			)
 			{
 				pMakeDefault->TryRegisterApplicationAssoc();
 			}
@@ -0,0 +1,513 @@
+#include "assoccli.h"
+#include "assocregistry.h" // for CUserChoiceComparer, AssocProgIdExists
+
+#include <stdio.h>
+
+// Registry key names are at most 255 characters.
+#define ASSOC_CLI_PROGID_CCH 256
+
+static bool IsOption(LPCWSTR psz, const char *pszName)
+{
+	size_t i = 0;
+	for (; pszName[i]; i++)
+	{
+		if (psz[i] != (WCHAR)pszName[i])
+			return false;
+	}
+	return psz[i] == 0;
+}
+
+static bool IsCommand(LPCWSTR psz, AssocCliCommand *pCommand)
+{
+	if (IsOption(psz, "--set"))
+		*pCommand = AssocCliCommand::SET;
+	else if (IsOption(psz, "--verify"))
+		*pCommand = AssocCliCommand::VERIFY;
+	else if (IsOption(psz, "--apply-profile"))
+		*pCommand = AssocCliCommand::APPLY_PROFILE;
+	else
+		return false;
+
+	return true;
+}
+
+static const char *CommandName(AssocCliCommand command)
+{
+	switch (command)
+	{
+		case AssocCliCommand::SET:
+			return "set";
+		case AssocCliCommand::VERIFY:
+			return "verify";
+		case AssocCliCommand::APPLY_PROFILE:
+			return "apply-profile";
+		default:
+			return nullptr;
+	}
+}
+
+#pragma region JSON
+// Appends UTF-16 as UTF-8. Unpaired surrogates become U+FFFD.
+static void AppendUtf8(std::string *pstr, LPCWSTR psz)
+{
+	for (size_t i = 0; psz[i]; i++)
+	{
+		DWORD ch = psz[i];
+		if (ch >= 0xD800 && ch <= 0xDFFF)
+		{
+			if (ch <= 0xDBFF && psz[i + 1] >= 0xDC00 && psz[i + 1] <= 0xDFFF)
+			{
+				ch = 0x10000 + ((ch - 0xD800) << 10) + (psz[i + 1] - 0xDC00);
+				i++;
+			}
+			else
+			{
+				ch = 0xFFFD;
+			}
+		}
+
+		if (ch < 0x80)
+		{
+			pstr->push_back((char)ch);
+		}
+		else if (ch < 0x800)
+		{
+			pstr->push_back((char)(0xC0 | (ch >> 6)));
+			pstr->push_back((char)(0x80 | (ch & 0x3F)));
+		}
+		else if (ch < 0x10000)
+		{
+			pstr->push_back((char)(0xE0 | (ch >> 12)));
+			pstr->push_back((char)(0x80 | ((ch >> 6) & 0x3F)));
+			pstr->push_back((char)(0x80 | (ch & 0x3F)));
+		}
+		else
+		{
+			pstr->push_back((char)(0xF0 | (ch >> 18)));
+			pstr->push_back((char)(0x80 | ((ch >> 12) & 0x3F)));
+			pstr->push_back((char)(0x80 | ((ch >> 6) & 0x3F)));
+			pstr->push_back((char)(0x80 | (ch & 0x3F)));
+		}
+	}
+}
+
+// Appends a UTF-8 string as a JSON string.
+static void AppendJsonString(std::string *pstr, const std::string &strValue)
+{
+	pstr->push_back('"');
+	for (char ch : strValue)
+	{
+		switch (ch)
+		{
+			case '"':
+				*pstr += "\\\"";
+				break;
+			case '\\':
+				*pstr += "\\\\";
+				break;
+			case '\n':
+				*pstr += "\\n";
+				break;
+			case '\r':
+				*pstr += "\\r";
+				break;
+			case '\t':
+				*pstr += "\\t";
+				break;
+			default:
+				if ((unsigned char)ch < 0x20)
+				{
+					char szEscape[8];
+					snprintf(szEscape, sizeof(szEscape), "\\u%04x", (unsigned)ch);
+					*pstr += szEscape;
+				}
+				else
+				{
+					pstr->push_back(ch);
+				}
+				break;
+		}
+	}
+	pstr->push_back('"');
+}
+
+// Appends a wide string as a JSON string, or null.
+static void AppendJsonString(std::string *pstr, LPCWSTR psz)
+{
+	if (!psz)
+	{
+		*pstr += "null";
+		return;
+	}
+
+	std::string strUtf8;
+	AppendUtf8(&strUtf8, psz);
+	AppendJsonString(pstr, strUtf8);
+}
+
+/**
+ * Builds a line of output, one field at a time.
+ */
+class CAssocCliLine
+{
+private:
+	std::string _str;
+
+	void _Name(const char *pszName)
+	{
+		_str += (_str.size() > 1) ? ",\"" : "\"";
+		_str += pszName;
+		_str += "\":";
+	}
+
+public:
+	CAssocCliLine(AssocCliCommand command)
+		: _str("{")
+	{
+		const char *pszCommand = CommandName(command);
+		if (pszCommand)
+		{
+			String("command", std::string(pszCommand));
+		}
+	}
+
+	CAssocCliLine &String(const char *pszName, const std::string &strValue)
+	{
+		_Name(pszName);
+		AppendJsonString(&_str, strValue);
+		return *this;
+	}
+
+	CAssocCliLine &String(const char *pszName, LPCWSTR pszValue)
+	{
+		_Name(pszName);
+		AppendJsonString(&_str, pszValue);
+		return *this;
+	}
+
+	CAssocCliLine &Number(const char *pszName, unsigned long long ullValue)
+	{
+		_Name(pszName);
+		_str += std::to_string(ullValue);
+		return *this;
+	}
+
+	CAssocCliLine &Real(const char *pszName, double dValue, bool fValid = true)
+	{
+		_Name(pszName);
+		if (fValid)
+		{
+			char szValue[32];
+			snprintf(szValue, sizeof(szValue), "%.3f", dValue);
+			_str += szValue;
+		}
+		else
+		{
+			_str += "null";
+		}
+		return *this;
+	}
+
+	CAssocCliLine &Bool(const char *pszName, bool fValue)
+	{
+		_Name(pszName);
+		_str += fValue ? "true" : "false";
+		return *this;
+	}
+
+	void Write(IAssocCliHost *pHost)
+	{
+		_str.push_back('}');
+		pHost->WriteLine(_str);
+	}
+};
+#pragma endregion
+
+#pragma region Parsing
+static AssocCliCommand Invalid(ASSOC_CLI_ARGS *pArgs, const char *pszError, LPCWSTR lpszArg)
+{
+	pArgs->command = AssocCliCommand::INVALID;
+	pArgs->strError = pszError;
+	if (lpszArg)
+	{
+		pArgs->strError += ": ";
+		AppendUtf8(&pArgs->strError, lpszArg);
+	}
+	return pArgs->command;
+}
+
+// Identifiers end up in a registry path, so anything which would reach
+// outside of the association's own key is refused.
+static bool IsValidIdentifier(const std::basic_string<WCHAR> &strIdentifier)
+{
+	return !strIdentifier.empty()
+		&& strIdentifier.find(WTEXT('\\')) == std::basic_string<WCHAR>::npos;
+}
+
+AssocCliCommand AssocCliParse(int argc, const LPCWSTR *argv, ASSOC_CLI_ARGS *pArgs)
+{
+	pArgs->command = AssocCliCommand::NONE;
+	pArgs->entries.clear();
+	pArgs->strProfilePath.clear();
+	pArgs->strError.clear();
+
+	int iCommand = -1;
+	AssocCliCommand command = AssocCliCommand::NONE;
+	for (int i = 0; i < argc && iCommand < 0; i++)
+	{
+		if (IsCommand(argv[i], &command))
+		{
+			iCommand = i;
+		}
+	}
+
+	if (iCommand < 0)
+	{
+		return AssocCliCommand::NONE;
+	}
+
+	if (iCommand > 0)
+	{
+		return Invalid(pArgs, "Unexpected argument before the command", argv[0]);
+	}
+
+	pArgs->command = command;
+
+	for (int i = 1; i < argc; i++)
+	{
+		LPCWSTR lpszArg = argv[i];
+		if (lpszArg[0] == '-' && lpszArg[1] == '-')
+		{
+			AssocCliCommand other;
+			return Invalid(pArgs, IsCommand(lpszArg, &other) ? "Only one command can be given" : "Unknown option", lpszArg);
+		}
+
+		if (command == AssocCliCommand::APPLY_PROFILE)
+		{
+			if (!pArgs->strProfilePath.empty())
+			{
+				return Invalid(pArgs, "--apply-profile takes one profile", lpszArg);
+			}
+
+			pArgs->strProfilePath = lpszArg;
+			continue;
+		}
+
+		std::basic_string<WCHAR> strArg(lpszArg);
+		size_t ichEquals = strArg.find(WTEXT('='));
+
+		ASSOC_PROFILE_ENTRY entry;
+		entry.strIdentifier = strArg.substr(0, ichEquals);
+		if (ichEquals != std::basic_string<WCHAR>::npos)
+		{
+			entry.strProgId = strArg.substr(ichEquals + 1);
+			if (entry.strProgId.empty())
+			{
+				return Invalid(pArgs, "Missing ProgID", lpszArg);
+			}
+		}
+		else if (command == AssocCliCommand::SET)
+		{
+			return Invalid(pArgs, "Associations are set as <extension or protocol>=<ProgID>", lpszArg);
+		}
+
+		if (!IsValidIdentifier(entry.strIdentifier))
+		{
+			return Invalid(pArgs, "Not an extension or protocol", lpszArg);
+		}
+
+		pArgs->entries.push_back(std::move(entry));
+	}
+
+	if (command == AssocCliCommand::APPLY_PROFILE ? pArgs->strProfilePath.empty() : pArgs->entries.empty())
+	{
+		return Invalid(
+			pArgs,
+			(command == AssocCliCommand::APPLY_PROFILE) ? "--apply-profile needs a profile" : "No associations given",
+			nullptr
+		);
+	}
+
+	return pArgs->command;
+}
+#pragma endregion
+
+#pragma region Commands
+static int WriteError(IAssocCliHost *pHost, AssocCliCommand command, const std::string &strError, int iExit)
+{
+	CAssocCliLine(command)
+		.String("error", strError)
+		.Number("exitCode", iExit)
+		.Write(pHost);
+	return iExit;
+}
+
+/**
+ * Writes the end of a summary: how long the command took, and how many
+ * associations it got through a second.
+ */
+static void FinishSummary(CAssocCliLine *pLine, IAssocCliHost *pHost, ULONGLONG ullStart, size_t cEntries, int iExit)
+{
+	ULONGLONG ullNow = pHost->GetClock()->Now();
+	double dMs = (ullNow > ullStart) ? (double)(ullNow - ullStart) / USERCHOICE_FILETIME_PER_MS : 0.0;
+
+	// A command can take no time at all on a coarse clock.
+	pLine->Real("elapsedMs", dMs)
+		.Real("entriesPerSecond", dMs ? cEntries * 1000.0 / dMs : 0.0, dMs != 0.0)
+		.Number("exitCode", iExit)
+		.Write(pHost);
+}
+
+static int RunVerify(const ASSOC_CLI_ARGS &args, IAssocCliHost *pHost, ULONGLONG ullStart)
+{
+	LPCWSTR lpszUserSid = pHost->GetUserSid();
+	if (!lpszUserSid)
+	{
+		return WriteError(pHost, args.command, "The current user couldn't be found", ASSOC_CLI_EXIT_ERROR);
+	}
+
+	CUserChoiceComparer comparer(pHost->GetRegistry(), lpszUserSid);
+
+	DWORD rgcStates[(size_t)AssocUserChoiceState::CURRENT + 1] = { 0 };
+	for (const ASSOC_PROFILE_ENTRY &entry : args.entries)
+	{
+		LPCWSTR lpszExpected = entry.strProgId.empty() ? nullptr : entry.strProgId.c_str();
+
+		WCHAR szProgId[ASSOC_CLI_PROGID_CCH];
+		AssocUserChoiceState state = comparer.Check(entry.strIdentifier.c_str(), lpszExpected, szProgId, ARRAYSIZE(szProgId));
+		rgcStates[(size_t)state]++;
+
+		CAssocCliLine(args.command)
+			.String("identifier", entry.strIdentifier.c_str())
+			.String("expectedProgId", lpszExpected)
+			.String("progId", (state == AssocUserChoiceState::NOT_SET) ? nullptr : szProgId)
+			.String("result", AssocUserChoiceStateName(state))
+			.Write(pHost);
+	}
+
+	DWORD cCurrent = rgcStates[(size_t)AssocUserChoiceState::CURRENT];
+	int iExit = (cCurrent == args.entries.size()) ? ASSOC_CLI_EXIT_OK : ASSOC_CLI_EXIT_FAILED;
+
+	CAssocCliLine line(args.command);
+	line.Bool("summary", true)
+		.Number("entries", args.entries.size())
+		.Number("current", cCurrent)
+		.Number("otherProgId", rgcStates[(size_t)AssocUserChoiceState::OTHER_PROGID])
+		.Number("staleHash", rgcStates[(size_t)AssocUserChoiceState::STALE_HASH])
+		.Number("notSet", rgcStates[(size_t)AssocUserChoiceState::NOT_SET]);
+	FinishSummary(&line, pHost, ullStart, args.entries.size(), iExit);
+	return iExit;
+}
+
+static const char *EntryResultName(AssocProfileEntryResult result)
+{
+	switch (result)
+	{
+		case AssocProfileEntryResult::UNCHANGED:
+			return "unchanged";
+		case AssocProfileEntryResult::WRITTEN:
+			return "written";
+		default:
+			return "failed";
+	}
+}
+
+static int RunApply(const ASSOC_CLI_ARGS &args, IAssocCliHost *pHost, ULONGLONG ullStart)
+{
+	std::vector<ASSOC_PROFILE_ENTRY> profile;
+	const std::vector<ASSOC_PROFILE_ENTRY> *pEntries = &args.entries;
+	if (args.command == AssocCliCommand::APPLY_PROFILE)
+	{
+		std::string strXml;
+		if (!pHost->ReadProfile(args.strProfilePath.c_str(), &strXml))
+		{
+			return WriteError(pHost, args.command, "The profile couldn't be read", ASSOC_CLI_EXIT_ERROR);
+		}
+
+		if (!AssocParseProfile(strXml.data(), strXml.size(), &profile))
+		{
+			return WriteError(pHost, args.command, "The profile isn't UTF-8, or has no associations", ASSOC_CLI_EXIT_ERROR);
+		}
+
+		pEntries = &profile;
+	}
+
+	// Windows would accept the hash of an association to a ProgID which
+	// doesn't exist, and the extension would then open nothing, so those
+	// fail without being set.
+	std::vector<ASSOC_PROFILE_ENTRY> existing;
+	std::vector<bool> missing(pEntries->size(), false);
+	size_t cMissing = 0;
+	for (size_t i = 0; i < pEntries->size(); i++)
+	{
+		if (AssocProgIdExists(pHost->GetRegistry(), (*pEntries)[i].strProgId.c_str()))
+		{
+			existing.push_back((*pEntries)[i]);
+		}
+		else
+		{
+			missing[i] = true;
+			cMissing++;
+		}
+	}
+
+	ASSOC_PROFILE_REPORT report = {};
+	std::string strError;
+	if (!existing.empty() && !pHost->Apply(existing.data(), existing.size(), &report, &strError))
+	{
+		return WriteError(pHost, args.command, strError, ASSOC_CLI_EXIT_ERROR);
+	}
+
+	for (size_t i = 0, iResult = 0; i < pEntries->size(); i++)
+	{
+		CAssocCliLine line(args.command);
+		line.String("identifier", (*pEntries)[i].strIdentifier.c_str())
+			.String("progId", (*pEntries)[i].strProgId.c_str());
+
+		if (missing[i])
+		{
+			line.String("result", std::string(EntryResultName(AssocProfileEntryResult::FAILED)))
+				.String("error", std::string("The ProgID doesn't exist"));
+		}
+		else if (iResult < report.results.size())
+		{
+			line.String("result", std::string(EntryResultName(report.results[iResult++])));
+		}
+		else
+		{
+			continue;
+		}
+
+		line.Write(pHost);
+	}
+
+	int iExit = (cMissing || report.cFailed || report.results.size() != existing.size()) ? ASSOC_CLI_EXIT_FAILED : ASSOC_CLI_EXIT_OK;
+
+	CAssocCliLine line(args.command);
+	line.Bool("summary", true)
+		.Number("entries", pEntries->size())
+		.Number("unchanged", report.cUnchanged)
+		.Number("written", report.cWritten)
+		.Number("failed", report.cFailed + cMissing);
+	FinishSummary(&line, pHost, ullStart, pEntries->size(), iExit);
+	return iExit;
+}
+
+int AssocCliRun(const ASSOC_CLI_ARGS &args, IAssocCliHost *pHost)
+{
+	ULONGLONG ullStart = pHost->GetClock()->Now();
+
+	switch (args.command)
+	{
+		case AssocCliCommand::SET:
+		case AssocCliCommand::APPLY_PROFILE:
+			return RunApply(args, pHost, ullStart);
+		case AssocCliCommand::VERIFY:
+			return RunVerify(args, pHost, ullStart);
+		case AssocCliCommand::INVALID:
+			return WriteError(pHost, args.command, args.strError, ASSOC_CLI_EXIT_USAGE);
+		default:
+			return WriteError(pHost, args.command, "No command given", ASSOC_CLI_EXIT_USAGE);
+	}
+}
+#pragma endregion
\ No newline at end of file
@@ -0,0 +1,144 @@
+#pragma once
+
+/**
+ * Sets and checks associations from the command line, without any UI.
+ *
+ * OpenWithEx used to only take a path, and always showed the dialog for it.
+ * Provisioning a machine needs the association engine on its own:
+ *
+ *     OpenWithEx --set .txt=txtfile .log=txtfile
+ *     OpenWithEx --verify .txt=txtfile http
+ *     OpenWithEx --apply-profile associations.xml
+ *
+ * --set and --apply-profile set associations the way ApplyUserChoiceProfile
+ * does: the ones already set are skipped, and the rest are written as one
+ * batch. An association to a ProgID which isn't registered fails, and isn't
+ * set. Both need Windows 10 1703 or later, whose UserChoice hash is the one
+ * known; on anything earlier they exit with ASSOC_CLI_EXIT_ERROR without
+ * setting anything, and associations can only be set from the dialog.
+ * --verify checks that each association is set, to the given ProgID
+ * if there is one, with a hash which Windows will accept. Profiles are the
+ * XML described in assocprofile.h.
+ *
+ * Results are written as JSON, one object per line: one for each
+ * association, then a summary with the counts, how long the command took and
+ * how many associations it got through a second. The exit code is one of the
+ * ASSOC_CLI_EXIT values.
+ *
+ * Nothing here knows about the shell, so commands can be run against a
+ * CMemoryRegistry through a test host.
+ */
+
+#include "wincompat.h"
+#include "assocprofile.h" // for ASSOC_PROFILE_ENTRY
+#include "registrybackend.h"
+#include "userchoicescheduler.h" // for IUserChoiceClock
+
+#include <string>
+#include <vector>
+
+// Everything was set, or is valid.
+#define ASSOC_CLI_EXIT_OK      0
+
+// Some associations couldn't be set, or aren't valid.
+#define ASSOC_CLI_EXIT_FAILED  1
+
+// The command line was wrong.
+#define ASSOC_CLI_EXIT_USAGE   2
+
+// The command couldn't run at all, e.g. because the profile couldn't be read
+// or the OS is too old.
+#define ASSOC_CLI_EXIT_ERROR   3
+
+enum class AssocCliCommand
+{
+	// No command, so the dialog is shown as before.
+	NONE,
+
+	// A command, but the command line is wrong.
+	INVALID,
+
+	SET,
+	VERIFY,
+	APPLY_PROFILE,
+};
+
+struct ASSOC_CLI_ARGS
+{
+	AssocCliCommand                   command;
+
+	// For --set and --verify. --verify's ProgIDs are empty where none was
+	// given.
+	std::vector<ASSOC_PROFILE_ENTRY>  entries;
+
+	// For --apply-profile.
+	std::basic_string<WCHAR>          strProfilePath;
+
+	// What is wrong with the command line, if it is INVALID.
+	std::string                       strError;
+};
+
+/**
+ * Parses the command line. Anything without one of the commands is left for
+ * the dialog; anything with one has to be just that command.
+ *
+ * @param argv  The arguments, without the program's name.
+ *
+ * @return The command, which is also put in pArgs.
+ */
+AssocCliCommand AssocCliParse(int argc, const LPCWSTR *argv, ASSOC_CLI_ARGS *pArgs);
+
+/**
+ * What commands run against.
+ */
+class IAssocCliHost
+{
+public:
+	virtual ~IAssocCliHost() {}
+
+	// Where associations are checked.
+	virtual IRegistryBackend *GetRegistry() = 0;
+
+	/**
+	 * The user whose associations are set and checked.
+	 *
+	 * @return null if it couldn't be found out.
+	 */
+	virtual LPCWSTR GetUserSid() = 0;
+
+	// Times commands, for the summary.
+	virtual IUserChoiceClock *GetClock() = 0;
+
+	/**
+	 * Sets associations, as AssocApplyProfile does.
+	 *
+	 * @return false, saying why in pstrError, if they couldn't be set at
+	 *         all. Associations which failed are in the report instead.
+	 */
+	virtual bool Apply(
+		const ASSOC_PROFILE_ENTRY *pEntries,
+		size_t cEntries,
+		ASSOC_PROFILE_REPORT *pReport,
+		std::string *pstrError
+	) = 0;
+
+	virtual bool ReadProfile(LPCWSTR lpszPath, std::string *pstrXml) = 0;
+
+	// Writes a line of output, given without its newline.
+	virtual void WriteLine(const std::string &strLine) = 0;
+};
+
+/**
+ * Runs a command, writing its results to the host.
+ *
+ * @return One of the ASSOC_CLI_EXIT values.
+ */
+int AssocCliRun(const ASSOC_CLI_ARGS &args, IAssocCliHost *pHost);
+
+#ifdef _WIN32
+/**
+ * Runs a command for the current user, writing its results to standard
+ * output, or to the console that started OpenWithEx if it has none.
+ */
+int AssocCliRunShell(const ASSOC_CLI_ARGS &args);
+#endif
\ No newline at end of file
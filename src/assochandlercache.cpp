@@ -0,0 +1,273 @@
+#include "assochandlercache.h"
+
+#include "assocregistry.h" // for AssocFormatKeyPath
+#include "userchoicehash.h" // for UserChoiceLowerCase
+
+#include <string.h>
+
+typedef std::basic_string<WCHAR> String;
+
+#pragma region Serialization
+static DWORD AppendCacheString(String *pStrings, LPCWSTR psz)
+{
+	DWORD ich = (DWORD)pStrings->size();
+	pStrings->append(psz);
+	pStrings->push_back(WTEXT('\0'));
+	return ich;
+}
+
+void AssocSerializeHandlerCache(
+	LPCWSTR lpszKey,
+	ULONGLONG ullStamp,
+	const CAssocHandlerTable &table,
+	std::vector<BYTE> *pData
+)
+{
+	String strStrings;
+	AppendCacheString(&strStrings, lpszKey);
+
+	std::vector<ASSOC_HANDLER_CACHE_ITEM> items(table.GetCount());
+	for (size_t i = 0; i < table.GetCount(); i++)
+	{
+		ASSOC_HANDLER_CACHE_ITEM &item = items[i];
+		item.ichName = AppendCacheString(&strStrings, table.GetName(i));
+		item.ichUIName = AppendCacheString(&strStrings, table.GetUIName(i));
+		item.ichIconPath = AppendCacheString(&strStrings, table.GetIconPath(i));
+		item.ichProgId = AppendCacheString(&strStrings, table.GetProgId(i));
+		item.iIcon = table.GetIconIndex(i);
+		item.dwType = table.GetType(i);
+		item.dwFlags = table.IsRecommended(i) ? ASSOC_HANDLER_CACHE_RECOMMENDED : 0;
+	}
+
+	size_t cbItems = items.size() * sizeof(ASSOC_HANDLER_CACHE_ITEM);
+	size_t cbStrings = strStrings.size() * sizeof(WCHAR);
+
+	ASSOC_HANDLER_CACHE_HEADER header = { 0 };
+	header.dwMagic = ASSOC_HANDLER_CACHE_MAGIC;
+	header.dwVersion = ASSOC_HANDLER_CACHE_VERSION;
+	header.cbEntry = (DWORD)(sizeof(header) + cbItems + cbStrings);
+	header.cHandlers = (DWORD)items.size();
+	header.ullStamp = ullStamp;
+	header.cchStrings = (DWORD)strStrings.size();
+
+	pData->resize(header.cbEntry);
+	BYTE *pb = pData->data();
+	memcpy(pb, &header, sizeof(header));
+	if (cbItems)
+		memcpy(pb + sizeof(header), items.data(), cbItems);
+	memcpy(pb + sizeof(header) + cbItems, strStrings.data(), cbStrings);
+}
+
+bool AssocParseHandlerCache(
+	const BYTE *pbData,
+	size_t cbData,
+	LPCWSTR lpszKey,
+	ULONGLONG ullStamp,
+	CAssocHandlerTable *pTable
+)
+{
+	ASSOC_HANDLER_CACHE_HEADER header;
+	if (!pbData || cbData < sizeof(header))
+	{
+		return false;
+	}
+
+	// Fields are copied out rather than read in place, since nothing says
+	// where a store maps its entries.
+	memcpy(&header, pbData, sizeof(header));
+	if (header.dwMagic != ASSOC_HANDLER_CACHE_MAGIC ||
+		header.dwVersion != ASSOC_HANDLER_CACHE_VERSION ||
+		header.cbEntry != cbData ||
+		header.ullStamp != ullStamp)
+	{
+		return false;
+	}
+
+	size_t cbItems = (size_t)header.cHandlers * sizeof(ASSOC_HANDLER_CACHE_ITEM);
+	if (cbItems > cbData - sizeof(header) ||
+		(cbData - sizeof(header) - cbItems) != (size_t)header.cchStrings * sizeof(WCHAR) ||
+		header.cchStrings == 0)
+	{
+		return false;
+	}
+
+	String strStrings(header.cchStrings, WTEXT('\0'));
+	memcpy(&strStrings[0], pbData + sizeof(header) + cbItems, header.cchStrings * sizeof(WCHAR));
+
+	// The last string is terminated, so every string is.
+	if (strStrings.back() != WTEXT('\0') || String(strStrings.c_str()) != lpszKey)
+	{
+		return false;
+	}
+
+	std::vector<ASSOC_HANDLER_CACHE_ITEM> items(header.cHandlers);
+	if (cbItems)
+		memcpy(items.data(), pbData + sizeof(header), cbItems);
+
+	for (const ASSOC_HANDLER_CACHE_ITEM &item : items)
+	{
+		if (item.ichName >= header.cchStrings ||
+			item.ichUIName >= header.cchStrings ||
+			item.ichIconPath >= header.cchStrings ||
+			item.ichProgId >= header.cchStrings)
+		{
+			return false;
+		}
+	}
+
+	for (const ASSOC_HANDLER_CACHE_ITEM &item : items)
+	{
+		ASSOC_HANDLER_SNAPSHOT snapshot = {};
+		snapshot.strName = &strStrings[item.ichName];
+		snapshot.strUIName = &strStrings[item.ichUIName];
+		snapshot.strIconPath = &strStrings[item.ichIconPath];
+		snapshot.iIcon = item.iIcon;
+		snapshot.dwType = item.dwType;
+		snapshot.strProgId = &strStrings[item.ichProgId];
+		snapshot.fRecommended = (item.dwFlags & ASSOC_HANDLER_CACHE_RECOMMENDED) != 0;
+		pTable->Add(snapshot);
+	}
+
+	return true;
+}
+#pragma endregion
+
+#pragma region CAssocHandlerCache
+CAssocHandlerCache::CAssocHandlerCache(IAssocHandlerCacheStore *pStore, IRegistryBackend *pRegistry)
+	: _pStore(pStore)
+	, _pRegistry(pRegistry)
+	, _counts{ 0 }
+{
+}
+
+ASSOC_HANDLER_CACHE_COUNTS CAssocHandlerCache::GetCounts()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _counts;
+}
+
+String CAssocHandlerCache::MakeKey(LPCWSTR lpszExtension, bool fIsUri)
+{
+	if (!lpszExtension || !*lpszExtension)
+	{
+		return String();
+	}
+
+	// Extensions start with a dot already.
+	String strKey = fIsUri ? WTEXT("url.") : WTEXT("file");
+	size_t ich = strKey.size();
+	strKey += lpszExtension;
+	UserChoiceLowerCase(&strKey[ich], strKey.size() - ich);
+	return strKey;
+}
+
+ULONGLONG CAssocHandlerCache::GetStamp(LPCWSTR lpszExtension, bool fIsUri)
+{
+	// Subkeys of the extension or protocol's key in HKCR, and of the user's
+	// association; null is the key itself.
+	static const LPCWSTR c_rgszExtensionClassKeys[] = { nullptr, WTEXT("OpenWithProgids"), WTEXT("OpenWithList") };
+	static const LPCWSTR c_rgszExtensionUserKeys[] = { nullptr, WTEXT("OpenWithProgids"), WTEXT("OpenWithList"), WTEXT("UserChoice") };
+	static const LPCWSTR c_rgszProtocolClassKeys[] = { nullptr };
+	static const LPCWSTR c_rgszProtocolUserKeys[] = { nullptr, WTEXT("UserChoice") };
+
+	// Each key's last write time goes into the stamp, or zero if it doesn't
+	// exist, so that a key being deleted changes it too. Combining them
+	// with FNV-1a rather than taking the latest means that a key going back
+	// to an older one does as well.
+	ULONGLONG ullStamp = 14695981039346656037uLL;
+	auto mix = [&](HKEY hkRoot, const String &strPath)
+	{
+		ULONGLONG ullLastWrite = 0;
+		CRegistryKey hk(_pRegistry);
+		if (_pRegistry->OpenKey(hkRoot, strPath.c_str(), hk.put()) == ERROR_SUCCESS)
+		{
+			_pRegistry->QueryInfo(hk.get(), nullptr, nullptr, &ullLastWrite);
+		}
+
+		for (int i = 0; i < 8; i++)
+		{
+			ullStamp ^= (ullLastWrite >> (i * 8)) & 0xFF;
+			ullStamp *= 1099511628211uLL;
+		}
+	};
+
+	auto mixSubKeys = [&](HKEY hkRoot, const String &strBase, const LPCWSTR *rgszSubKeys, size_t cSubKeys)
+	{
+		for (size_t i = 0; i < cSubKeys; i++)
+		{
+			mix(hkRoot, rgszSubKeys[i] ? strBase + WTEXT("\\") + rgszSubKeys[i] : strBase);
+		}
+	};
+
+	if (fIsUri)
+	{
+		mixSubKeys(HKEY_CLASSES_ROOT, lpszExtension, c_rgszProtocolClassKeys, ARRAYSIZE(c_rgszProtocolClassKeys));
+	}
+	else
+	{
+		mixSubKeys(HKEY_CLASSES_ROOT, lpszExtension, c_rgszExtensionClassKeys, ARRAYSIZE(c_rgszExtensionClassKeys));
+
+		// Applications registered for Open With.
+		mix(HKEY_CLASSES_ROOT, WTEXT("Applications"));
+	}
+
+	WCHAR szKeyPath[ASSOC_KEY_PATH_CCH_MAX];
+	if (AssocFormatKeyPath(lpszExtension, fIsUri, szKeyPath, ARRAYSIZE(szKeyPath)))
+	{
+		if (fIsUri)
+			mixSubKeys(HKEY_CURRENT_USER, szKeyPath, c_rgszProtocolUserKeys, ARRAYSIZE(c_rgszProtocolUserKeys));
+		else
+			mixSubKeys(HKEY_CURRENT_USER, szKeyPath, c_rgszExtensionUserKeys, ARRAYSIZE(c_rgszExtensionUserKeys));
+	}
+
+	return ullStamp;
+}
+
+bool CAssocHandlerCache::Load(LPCWSTR lpszExtension, bool fIsUri, ULONGLONG ullStamp, CAssocHandlerTable *pTable)
+{
+	String strKey = MakeKey(lpszExtension, fIsUri);
+	if (strKey.empty())
+	{
+		return false;
+	}
+
+	std::unique_ptr<IAssocHandlerCacheView> pView = _pStore->Open(strKey.c_str());
+	if (!pView)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_counts.cMisses++;
+		return false;
+	}
+
+	if (!AssocParseHandlerCache(pView->GetData(), pView->GetSize(), strKey.c_str(), ullStamp, pTable))
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_counts.cStale++;
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	_counts.cHits++;
+	return true;
+}
+
+bool CAssocHandlerCache::Save(LPCWSTR lpszExtension, bool fIsUri, ULONGLONG ullStamp, const CAssocHandlerTable &table)
+{
+	String strKey = MakeKey(lpszExtension, fIsUri);
+	if (strKey.empty())
+	{
+		return false;
+	}
+
+	std::vector<BYTE> data;
+	AssocSerializeHandlerCache(strKey.c_str(), ullStamp, table, &data);
+	if (!_pStore->Write(strKey.c_str(), data.data(), data.size()))
+	{
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	_counts.cWrites++;
+	return true;
+}
+#pragma endregion
\ No newline at end of file
@@ -0,0 +1,206 @@
+#pragma once
+
+/**
+ * Remembers the handlers of each extension or protocol between launches.
+ *
+ * Every time the dialog is shown, it is a new process which has to
+ * enumerate the handlers from scratch before the list is complete. The
+ * handler cache keeps what the last enumeration found for each extension or
+ * protocol, so the list can be shown straight away; the dialog still
+ * enumerates the handlers, and reconciles the list with what it finds,
+ * before writing the cache again.
+ *
+ * A cache entry is only used if nothing it depends on has changed since it
+ * was written. That is decided by a stamp made from the last write times of
+ * the registry keys that handlers are enumerated from: the extension or
+ * protocol's own keys, its OpenWithList and OpenWithProgids, the user's
+ * association, and the registered applications. A change anywhere else is
+ * caught by the reconciliation instead.
+ *
+ * Entries are stored with fixed-size, little-endian fields, so that the x86
+ * and x64 builds share them.
+ */
+
+#include "wincompat.h"
+#include "registrybackend.h"
+#include "assochandlertable.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define ASSOC_HANDLER_CACHE_MAGIC   0x4358574F // "OWXC"
+#define ASSOC_HANDLER_CACHE_VERSION 1
+
+#pragma pack(push, 4)
+/**
+ * The start of a cache entry. It is followed by the handlers, and then by
+ * every string, each null-terminated, starting with the entry's key.
+ */
+struct ASSOC_HANDLER_CACHE_HEADER
+{
+	DWORD      dwMagic;
+	DWORD      dwVersion;
+
+	// The size of the whole entry.
+	DWORD      cbEntry;
+	DWORD      cHandlers;
+
+	// The registry stamp the entry was written with.
+	ULONGLONG  ullStamp;
+
+	// The number of characters in the strings, including the nulls.
+	DWORD      cchStrings;
+	DWORD      dwReserved;
+};
+
+#define ASSOC_HANDLER_CACHE_RECOMMENDED 0x1
+
+/**
+ * A handler in a cache entry. Strings are character offsets.
+ */
+struct ASSOC_HANDLER_CACHE_ITEM
+{
+	DWORD  ichName;
+	DWORD  ichUIName;
+	DWORD  ichIconPath;
+	DWORD  ichProgId;
+	LONG   iIcon;
+	DWORD  dwType;
+	DWORD  dwFlags;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(ASSOC_HANDLER_CACHE_HEADER) == 32, "The cache layout is shared between builds");
+static_assert(sizeof(ASSOC_HANDLER_CACHE_ITEM) == 28, "The cache layout is shared between builds");
+
+/**
+ * A stored cache entry, mapped into memory.
+ */
+class IAssocHandlerCacheView
+{
+public:
+	virtual ~IAssocHandlerCacheView() {}
+
+	virtual const BYTE *GetData() = 0;
+	virtual size_t GetSize() = 0;
+};
+
+/**
+ * Where cache entries are kept. Several processes can use the same store at
+ * once, so writing an entry has to replace it in one go.
+ */
+class IAssocHandlerCacheStore
+{
+public:
+	virtual ~IAssocHandlerCacheStore() {}
+
+	/**
+	 * Maps an entry in.
+	 *
+	 * @return null if there is no entry.
+	 */
+	virtual std::unique_ptr<IAssocHandlerCacheView> Open(LPCWSTR lpszKey) = 0;
+
+	virtual bool Write(LPCWSTR lpszKey, const BYTE *pbData, size_t cbData) = 0;
+};
+
+/**
+ * Writes a table into a cache entry.
+ */
+void AssocSerializeHandlerCache(
+	LPCWSTR lpszKey,
+	ULONGLONG ullStamp,
+	const CAssocHandlerTable &table,
+	std::vector<BYTE> *pData
+);
+
+/**
+ * Reads a cache entry into a table, checking every offset in it.
+ *
+ * @return false, leaving the table alone, if the entry is damaged, from
+ *         another version, for another key, or has another stamp.
+ */
+bool AssocParseHandlerCache(
+	const BYTE *pbData,
+	size_t cbData,
+	LPCWSTR lpszKey,
+	ULONGLONG ullStamp,
+	CAssocHandlerTable *pTable
+);
+
+/**
+ * Handler cache counters.
+ */
+struct ASSOC_HANDLER_CACHE_COUNTS
+{
+	// Entries loaded.
+	DWORD cHits;
+
+	// Entries which didn't exist.
+	DWORD cMisses;
+
+	// Entries which were out of date or damaged.
+	DWORD cStale;
+
+	DWORD cWrites;
+};
+
+class CAssocHandlerCache
+{
+private:
+	IAssocHandlerCacheStore    *_pStore;
+	IRegistryBackend           *_pRegistry;
+
+	// Dialogs on several threads share the cache, and the store has to cope
+	// with that, but the counters are guarded here.
+	std::mutex                  _mutex;
+	ASSOC_HANDLER_CACHE_COUNTS  _counts;
+
+public:
+	/**
+	 * @param pStore     Where entries are kept.
+	 * @param pRegistry  Where stamps are read from.
+	 *
+	 * Both have to outlive the cache.
+	 */
+	CAssocHandlerCache(IAssocHandlerCacheStore *pStore, IRegistryBackend *pRegistry);
+
+	CAssocHandlerCache(const CAssocHandlerCache &) = delete;
+	CAssocHandlerCache &operator=(const CAssocHandlerCache &) = delete;
+
+	/**
+	 * The name an extension or protocol's entry is stored under: "file" or
+	 * "url", then the lowercased extension or protocol, with a dot
+	 * between them.
+	 *
+	 * @return An empty string if there is nothing to cache.
+	 */
+	static std::basic_string<WCHAR> MakeKey(LPCWSTR lpszExtension, bool fIsUri);
+
+	/**
+	 * Reads the registry stamp for an extension or protocol. Read it before
+	 * enumerating handlers, and save with it afterwards, so that anything
+	 * which changes during the enumeration makes the entry stale.
+	 */
+	ULONGLONG GetStamp(LPCWSTR lpszExtension, bool fIsUri);
+
+	/**
+	 * Loads the cached handlers into a table.
+	 *
+	 * @return false if there is no entry with the given stamp.
+	 */
+	bool Load(LPCWSTR lpszExtension, bool fIsUri, ULONGLONG ullStamp, CAssocHandlerTable *pTable);
+
+	bool Save(LPCWSTR lpszExtension, bool fIsUri, ULONGLONG ullStamp, const CAssocHandlerTable &table);
+
+	ASSOC_HANDLER_CACHE_COUNTS GetCounts();
+};
+
+#ifdef _WIN32
+/**
+ * Keeps entries as files under %LOCALAPPDATA%\OpenWithEx\HandlerCache.
+ */
+IAssocHandlerCacheStore *GetShellAssocHandlerCacheStore();
+#endif
\ No newline at end of file
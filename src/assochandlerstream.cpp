@@ -0,0 +1,176 @@
+#include "assochandlerstream.h"
+#include "tracespan.h"
+
+#pragma region CAssocHandlerQueue
+CAssocHandlerQueue::CAssocHandlerQueue()
+{
+	_pHead = new NODE;
+	_pHead->pNext.store(nullptr);
+	_pTail = _pHead;
+}
+
+CAssocHandlerQueue::~CAssocHandlerQueue()
+{
+	while (_pHead)
+	{
+		NODE *pNext = _pHead->pNext.load();
+		delete _pHead;
+		_pHead = pNext;
+	}
+}
+
+void CAssocHandlerQueue::Push(std::unique_ptr<ASSOC_HANDLER_BATCH> pBatch)
+{
+	NODE *pNode = new NODE;
+	pNode->pBatch = std::move(pBatch);
+	pNode->pNext.store(nullptr, std::memory_order_relaxed);
+
+	// Publishing the node is the only thing the consumer sees, so the batch
+	// is complete by the time it can be taken.
+	_pTail->pNext.store(pNode, std::memory_order_release);
+	_pTail = pNode;
+}
+
+std::unique_ptr<ASSOC_HANDLER_BATCH> CAssocHandlerQueue::Pop()
+{
+	NODE *pNext = _pHead->pNext.load(std::memory_order_acquire);
+	if (!pNext)
+	{
+		return nullptr;
+	}
+
+	// The node the batch came from becomes the new head; the old head isn't
+	// referenced by the producer any more, since it has moved past it.
+	std::unique_ptr<ASSOC_HANDLER_BATCH> pBatch = std::move(pNext->pBatch);
+	delete _pHead;
+	_pHead = pNext;
+	return pBatch;
+}
+#pragma endregion
+
+#pragma region CAssocHandlerStreamer
+CAssocHandlerStreamer::CAssocHandlerStreamer(IAssocHandlerSource *pSource, IAssocHandlerSink *pSink, size_t cBatchMax)
+	: _pSource(pSource)
+	, _pSink(pSink)
+	, _cBatchMax(cBatchMax ? cBatchMax : 1)
+	, _fCancelled(false)
+	, _fWoken(false)
+	, _cHandlers(0)
+	, _cBatches(0)
+	, _cWakes(0)
+{
+}
+
+void CAssocHandlerStreamer::_Publish(std::unique_ptr<ASSOC_HANDLER_BATCH> pBatch)
+{
+	_queue.Push(std::move(pBatch));
+	_cBatches++;
+
+	if (!_fWoken.exchange(true))
+	{
+		_cWakes++;
+		_pSink->OnHandlersReady();
+	}
+}
+
+void CAssocHandlerStreamer::Run()
+{
+	CTraceActivity activity(TRACE_GET_HANDLERS);
+
+	bool fRecommendedFirst = _pSource->IsRecommendedFirst();
+
+	// Whether everything read so far was recommended.
+	bool fOnlyRecommended = true;
+
+	// Other handlers, if the source mixes them in with recommended ones.
+	std::vector<ASSOC_HANDLER_SNAPSHOT> held;
+
+	std::unique_ptr<ASSOC_HANDLER_BATCH> pBatch(new ASSOC_HANDLER_BATCH{ {}, false });
+
+	ASSOC_HANDLER_SNAPSHOT snapshot;
+	while (!_fCancelled.load() && _pSource->Next(&snapshot))
+	{
+		_cHandlers++;
+
+		if (!snapshot.fRecommended)
+		{
+			if (!fRecommendedFirst)
+			{
+				held.push_back(std::move(snapshot));
+				snapshot = {};
+				continue;
+			}
+
+			// That was the last recommended handler, so they go now rather
+			// than waiting for the batch to fill up with others.
+			if (fOnlyRecommended && !pBatch->snapshots.empty())
+			{
+				_Publish(std::move(pBatch));
+				pBatch.reset(new ASSOC_HANDLER_BATCH{ {}, false });
+			}
+
+			fOnlyRecommended = false;
+		}
+
+		pBatch->snapshots.push_back(std::move(snapshot));
+		snapshot = {};
+
+		if (pBatch->snapshots.size() >= _cBatchMax)
+		{
+			_Publish(std::move(pBatch));
+			pBatch.reset(new ASSOC_HANDLER_BATCH{ {}, false });
+		}
+	}
+
+	activity.SetCount(_cHandlers.load());
+	if (_fCancelled.load())
+	{
+		return;
+	}
+
+	// Any recommended handlers still waiting go before the ones held back.
+	if (!held.empty() && !pBatch->snapshots.empty())
+	{
+		_Publish(std::move(pBatch));
+		pBatch.reset(new ASSOC_HANDLER_BATCH{ {}, false });
+	}
+
+	for (ASSOC_HANDLER_SNAPSHOT &heldSnapshot : held)
+	{
+		pBatch->snapshots.push_back(std::move(heldSnapshot));
+		if (pBatch->snapshots.size() >= _cBatchMax)
+		{
+			_Publish(std::move(pBatch));
+			pBatch.reset(new ASSOC_HANDLER_BATCH{ {}, false });
+		}
+	}
+
+	pBatch->fComplete = true;
+	_Publish(std::move(pBatch));
+}
+
+void CAssocHandlerStreamer::Cancel()
+{
+	_fCancelled.store(true);
+}
+
+std::unique_ptr<ASSOC_HANDLER_BATCH> CAssocHandlerStreamer::TakeBatch()
+{
+	// Clearing the flag before looking at the queue means a batch queued
+	// after this either gets taken now or wakes the sink again; it is never
+	// left behind. At worst the sink is woken for a batch already taken.
+	// The exchange also makes sure that everything queued before the last
+	// wake is visible here.
+	_fWoken.exchange(false);
+	return _queue.Pop();
+}
+
+ASSOC_HANDLER_STREAM_COUNTS CAssocHandlerStreamer::GetCounts() const
+{
+	ASSOC_HANDLER_STREAM_COUNTS counts;
+	counts.cHandlers = _cHandlers.load();
+	counts.cBatches = _cBatches.load();
+	counts.cWakes = _cWakes.load();
+	return counts;
+}
+#pragma endregion
\ No newline at end of file
@@ -0,0 +1,254 @@
+#pragma once
+
+/**
+ * Streams the handlers for an extension or protocol to the dialog.
+ *
+ * Enumerating handlers can take seconds when many apps are installed, so
+ * the dialog doesn't wait for it. A worker thread pulls handlers from an
+ * IAssocHandlerSource and hands them over in batches through a lock-free
+ * queue, waking the dialog through an IAssocHandlerSink whenever a batch is
+ * waiting. The list fills in as the batches arrive.
+ *
+ * Recommended handlers always come first, so the dialog can tell from the
+ * first handler whether there is a Recommended group at all: if the first
+ * one isn't recommended, none are.
+ *
+ * Nothing here knows about COM, so the streaming can be tested with a fake
+ * source.
+ */
+
+#include "wincompat.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Keeps a handler alive while its snapshot is on the way to the dialog.
+ * What it holds depends on the source.
+ */
+class IAssocHandlerRef
+{
+public:
+	virtual ~IAssocHandlerRef() {}
+};
+
+/**
+ * What the dialog needs to know about a handler, read on the worker thread.
+ */
+struct ASSOC_HANDLER_SNAPSHOT
+{
+	// IAssocHandler::GetName: the program's path, or an app's name.
+	std::basic_string<WCHAR>           strName;
+
+	// IAssocHandler::GetUIName.
+	std::basic_string<WCHAR>           strUIName;
+
+	// IAssocHandler::GetIconLocation.
+	std::basic_string<WCHAR>           strIconPath;
+	int                                iIcon;
+
+	// IAssocHandlerInfo::GetHandlerType, an AHTYPE.
+	DWORD                              dwType;
+
+	// IAssocHandlerInfo::GetInternalProgID, formatted the way setting the
+	// default would ask for it. Empty if there is none.
+	std::basic_string<WCHAR>           strProgId;
+
+	bool                               fRecommended;
+
+	std::unique_ptr<IAssocHandlerRef>  pHandler;
+};
+
+/**
+ * Handlers handed over to the dialog in one go.
+ */
+struct ASSOC_HANDLER_BATCH
+{
+	std::vector<ASSOC_HANDLER_SNAPSHOT> snapshots;
+
+	// Set on the last batch, which may be empty.
+	bool fComplete;
+};
+
+/**
+ * Where handlers come from. Only used on the worker thread.
+ */
+class IAssocHandlerSource
+{
+public:
+	virtual ~IAssocHandlerSource() {}
+
+	/**
+	 * Whether every recommended handler is returned before any other one.
+	 * If not, other handlers are held back until the source runs out.
+	 */
+	virtual bool IsRecommendedFirst() = 0;
+
+	/**
+	 * Reads the next handler.
+	 *
+	 * @return false once there are no more.
+	 */
+	virtual bool Next(ASSOC_HANDLER_SNAPSHOT *pSnapshot) = 0;
+};
+
+/**
+ * Wakes the dialog up.
+ */
+class IAssocHandlerSink
+{
+public:
+	virtual ~IAssocHandlerSink() {}
+
+	/**
+	 * Called on the worker thread when a batch is waiting. It isn't called
+	 * again until the dialog has called TakeBatch, so it can post a message
+	 * without flooding the queue.
+	 */
+	virtual void OnHandlersReady() = 0;
+};
+
+/**
+ * A single-producer, single-consumer queue of batches. Neither side ever
+ * blocks the other.
+ */
+class CAssocHandlerQueue
+{
+private:
+	struct NODE
+	{
+		std::unique_ptr<ASSOC_HANDLER_BATCH>  pBatch;
+		std::atomic<NODE *>                   pNext;
+	};
+
+	// The consumer's end, which is always a node that has already been
+	// taken, or the initial empty one.
+	NODE *_pHead;
+
+	// The producer's end.
+	NODE *_pTail;
+
+public:
+	CAssocHandlerQueue();
+	~CAssocHandlerQueue();
+
+	CAssocHandlerQueue(const CAssocHandlerQueue &) = delete;
+	CAssocHandlerQueue &operator=(const CAssocHandlerQueue &) = delete;
+
+	// Producer only.
+	void Push(std::unique_ptr<ASSOC_HANDLER_BATCH> pBatch);
+
+	// Consumer only. Returns null if the queue is empty.
+	std::unique_ptr<ASSOC_HANDLER_BATCH> Pop();
+};
+
+/**
+ * Streaming counters.
+ */
+struct ASSOC_HANDLER_STREAM_COUNTS
+{
+	// Handlers read from the source.
+	DWORD cHandlers;
+
+	// Batches queued, including the last, empty or not.
+	DWORD cBatches;
+
+	// Calls to IAssocHandlerSink::OnHandlersReady.
+	DWORD cWakes;
+};
+
+class CAssocHandlerStreamer
+{
+private:
+	IAssocHandlerSource   *_pSource;
+	IAssocHandlerSink     *_pSink;
+	size_t                 _cBatchMax;
+
+	CAssocHandlerQueue     _queue;
+	std::atomic<bool>      _fCancelled;
+
+	// Set when the sink has been woken, and cleared when the dialog comes
+	// to take batches.
+	std::atomic<bool>      _fWoken;
+
+	std::atomic<DWORD>     _cHandlers;
+	std::atomic<DWORD>     _cBatches;
+	std::atomic<DWORD>     _cWakes;
+
+	// Queues a batch and wakes the sink if it isn't awake already.
+	void _Publish(std::unique_ptr<ASSOC_HANDLER_BATCH> pBatch);
+
+public:
+	// How many handlers are handed over at once, at most.
+	static constexpr size_t DEFAULT_BATCH = 16;
+
+	/**
+	 * @param pSource    Where handlers come from.
+	 * @param pSink      Wakes the dialog up.
+	 * @param cBatchMax  Largest batch.
+	 *
+	 * Both have to outlive the streamer.
+	 */
+	CAssocHandlerStreamer(IAssocHandlerSource *pSource, IAssocHandlerSink *pSink, size_t cBatchMax = DEFAULT_BATCH);
+
+	CAssocHandlerStreamer(const CAssocHandlerStreamer &) = delete;
+	CAssocHandlerStreamer &operator=(const CAssocHandlerStreamer &) = delete;
+
+	/**
+	 * Reads every handler from the source and queues them. Runs on the
+	 * worker thread, and returns early if cancelled; a cancelled run never
+	 * queues its last batch.
+	 *
+	 * Recommended handlers are queued as soon as all of them have been
+	 * read, without waiting for the batch to fill up, so the Recommended
+	 * group shows up first.
+	 */
+	void Run();
+
+	/**
+	 * Stops Run after the handler it is reading. Any thread can call this.
+	 */
+	void Cancel();
+
+	/**
+	 * Takes the next batch, on the dialog's thread.
+	 *
+	 * @return null once the queue is empty. The sink will be woken again
+	 *         when there is more.
+	 */
+	std::unique_ptr<ASSOC_HANDLER_BATCH> TakeBatch();
+
+	ASSOC_HANDLER_STREAM_COUNTS GetCounts() const;
+};
+
+#ifdef _WIN32
+#include <shobjidl.h>
+
+/**
+ * Enumerates the handlers of an extension or protocol through
+ * SHAssocEnumHandlers, or SHAssocEnumHandlersForProtocolByApplication.
+ * Handlers are marshalled so that the dialog's thread can use them.
+ *
+ * The source can be created anywhere, but has to be used, and released,
+ * on a thread in the MTA.
+ */
+std::unique_ptr<IAssocHandlerSource> CreateShellAssocHandlerSource(LPCWSTR lpszExtOrProtocol, bool fUri);
+
+/**
+ * Unmarshals the handler in a snapshot from CreateShellAssocHandlerSource
+ * into the calling thread's apartment. It can only be done once.
+ */
+HRESULT AssocUnmarshalHandler(ASSOC_HANDLER_SNAPSHOT *pSnapshot, IAssocHandler **ppHandler);
+
+/**
+ * Reads a handler's metadata into a snapshot, without a handler reference.
+ * This is what CreateShellAssocHandlerSource does for each handler; the
+ * dialog uses it for programs it adds itself.
+ *
+ * @return S_FALSE if the handler has no UI name, which means it shouldn't
+ *         be listed.
+ */
+HRESULT AssocSnapshotHandler(IAssocHandler *pHandler, ASSOC_HANDLER_SNAPSHOT *pSnapshot);
+#endif
\ No newline at end of file
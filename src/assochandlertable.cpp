@@ -0,0 +1,344 @@
+#include "assochandlertable.h"
+
+#include "userchoicehash.h" // for UserChoiceLowerCase
+
+#include <string.h>
+
+// Slots the index starts with once the first name is added.
+static const size_t c_cMinSlots = 16;
+
+DWORD CAssocHandlerTable::_AddString(LPCWSTR psz, size_t cch)
+{
+	DWORD ich = (DWORD)_arena.size();
+	_arena.insert(_arena.end(), psz, psz + cch);
+	_arena.push_back(WTEXT('\0'));
+	return ich;
+}
+
+// FNV-1a, a character at a time.
+#define NAME_HASH_BASIS 2166136261u
+
+static inline DWORD HashChar(DWORD dwHash, WCHAR ch)
+{
+	return (dwHash ^ (DWORD)ch) * 16777619u;
+}
+
+/**
+ * A name, normalised as NormalizeName describes, and its hash.
+ *
+ * Names are normalised on every search, so this works in a buffer on the
+ * stack rather than allocating; only names longer than MAX_PATH, which the
+ * dialog never sees in practice, go to the heap.
+ */
+class CNameKey
+{
+private:
+	// Where each path segment kept so far starts in the key, and the hash
+	// up to there, so that ".." can go back to it.
+	struct SEGMENT
+	{
+		DWORD ich;
+		DWORD dwHash;
+	};
+
+	WCHAR                 _szKey[MAX_PATH];
+	SEGMENT               _rgSegments[MAX_PATH];
+	std::vector<WCHAR>    _longKey;
+	std::vector<SEGMENT>  _longSegments;
+
+	void _Normalize(LPCWSTR pch, size_t cch, WCHAR *pszKey, SEGMENT *pSegments);
+
+public:
+	LPCWSTR pszKey;
+	size_t  cchKey;
+	DWORD   dwHash;
+
+	CNameKey(LPCWSTR lpszName);
+
+	CNameKey(const CNameKey &) = delete;
+	CNameKey &operator=(const CNameKey &) = delete;
+};
+
+CNameKey::CNameKey(LPCWSTR lpszName)
+{
+	size_t cch = 0;
+	while (lpszName && lpszName[cch])
+		cch++;
+
+	if (cch >= 2 && lpszName[0] == WTEXT('"') && lpszName[cch - 1] == WTEXT('"'))
+	{
+		lpszName++;
+		cch -= 2;
+	}
+
+	// The key is never longer than the name, nor are there more segments
+	// than characters.
+	WCHAR *pszOut = _szKey;
+	SEGMENT *pSegments = _rgSegments;
+	if (cch >= MAX_PATH)
+	{
+		_longKey.resize(cch + 1);
+		_longSegments.resize(cch + 1);
+		pszOut = _longKey.data();
+		pSegments = _longSegments.data();
+	}
+
+	_Normalize(lpszName, cch, pszOut, pSegments);
+	pszKey = pszOut;
+}
+
+void CNameKey::_Normalize(LPCWSTR pch, size_t cch, WCHAR *pszOut, SEGMENT *pSegments)
+{
+	bool fPath = false;
+	for (size_t i = 0; i < cch; i++)
+	{
+		WCHAR ch = pch[i];
+		if (ch == WTEXT('/'))
+			ch = WTEXT('\\');
+
+		if (ch == WTEXT('\\'))
+			fPath = true;
+
+		pszOut[i] = ch;
+	}
+	pszOut[cch] = WTEXT('\0');
+
+	UserChoiceLowerCase(pszOut, cch);
+
+	DWORD dwHashOut = NAME_HASH_BASIS;
+
+	// App names, such as "Photos", are left as they are.
+	if (!fPath)
+	{
+		for (size_t i = 0; i < cch; i++)
+			dwHashOut = HashChar(dwHashOut, pszOut[i]);
+
+		cchKey = cch;
+		dwHash = dwHashOut;
+		return;
+	}
+
+	// The key is written over the name as it is read, which is safe because
+	// it never gets ahead of it. The root is kept: two backslashes for a
+	// UNC path, one for a path from the root of the current drive.
+	size_t ichRead = 0;
+	while (ichRead < 2 && ichRead < cch && pszOut[ichRead] == WTEXT('\\'))
+	{
+		dwHashOut = HashChar(dwHashOut, WTEXT('\\'));
+		ichRead++;
+	}
+
+	size_t ichWrite = ichRead;
+	size_t cSegments = 0;
+	while (ichRead < cch)
+	{
+		size_t ichEnd = ichRead;
+		while (ichEnd < cch && pszOut[ichEnd] != WTEXT('\\'))
+			ichEnd++;
+
+		size_t cchSegment = ichEnd - ichRead;
+		LPCWSTR pchSegment = pszOut + ichRead;
+		ichRead = ichEnd + 1;
+
+		if (cchSegment == 0 || (cchSegment == 1 && pchSegment[0] == WTEXT('.')))
+		{
+			continue;
+		}
+
+		if (cchSegment == 2 && pchSegment[0] == WTEXT('.') && pchSegment[1] == WTEXT('.'))
+		{
+			// A drive can't be gone above.
+			if (cSegments && !(cSegments == 1 && pszOut[ichWrite - 1] == WTEXT(':')))
+			{
+				cSegments--;
+				ichWrite = pSegments[cSegments].ich;
+				dwHashOut = pSegments[cSegments].dwHash;
+			}
+			continue;
+		}
+
+		pSegments[cSegments].ich = (DWORD)ichWrite;
+		pSegments[cSegments].dwHash = dwHashOut;
+
+		if (cSegments)
+		{
+			pszOut[ichWrite++] = WTEXT('\\');
+			dwHashOut = HashChar(dwHashOut, WTEXT('\\'));
+		}
+		cSegments++;
+
+		for (size_t i = 0; i < cchSegment; i++)
+		{
+			WCHAR ch = pchSegment[i];
+			pszOut[ichWrite++] = ch;
+			dwHashOut = HashChar(dwHashOut, ch);
+		}
+	}
+
+	pszOut[ichWrite] = WTEXT('\0');
+	cchKey = ichWrite;
+	dwHash = dwHashOut;
+}
+
+size_t CAssocHandlerTable::_FindSlot(LPCWSTR pszKey, size_t cchKey, DWORD dwHash) const
+{
+	// The index is never more than half full, so there is always an empty
+	// slot to stop at.
+	size_t mask = _rgSlots.size() - 1;
+	for (size_t iSlot = dwHash & mask; ; iSlot = (iSlot + 1) & mask)
+	{
+		DWORD dwSlot = _rgSlots[iSlot];
+		if (!dwSlot)
+		{
+			return iSlot;
+		}
+
+		size_t i = dwSlot - 1;
+		if (_rgdwNameHash[i] == dwHash &&
+			_rgcchNameKey[i] == cchKey &&
+			0 == memcmp(&_arena[_rgichNameKey[i]], pszKey, cchKey * sizeof(WCHAR)))
+		{
+			return iSlot;
+		}
+	}
+}
+
+void CAssocHandlerTable::_Rehash(size_t cSlots)
+{
+	_rgSlots.assign(cSlots, 0);
+
+	size_t mask = cSlots - 1;
+	for (size_t i = 0; i < _rgcchNameKey.size(); i++)
+	{
+		if (!_rgcchNameKey[i])
+		{
+			continue;
+		}
+
+		// Every name in the table is unique, so only the hash decides where
+		// it goes.
+		size_t iSlot = _rgdwNameHash[i] & mask;
+		while (_rgSlots[iSlot])
+		{
+			iSlot = (iSlot + 1) & mask;
+		}
+		_rgSlots[iSlot] = (DWORD)(i + 1);
+	}
+}
+
+std::basic_string<WCHAR> CAssocHandlerTable::NormalizeName(LPCWSTR lpszName)
+{
+	CNameKey key(lpszName);
+	return std::basic_string<WCHAR>(key.pszKey, key.cchKey);
+}
+
+size_t CAssocHandlerTable::Add(const ASSOC_HANDLER_SNAPSHOT &snapshot, bool *pfAdded)
+{
+	CNameKey key(snapshot.strName.c_str());
+
+	size_t iSlot = 0;
+	if (key.cchKey)
+	{
+		if (_rgSlots.empty())
+		{
+			_Rehash(c_cMinSlots);
+		}
+
+		iSlot = _FindSlot(key.pszKey, key.cchKey, key.dwHash);
+		if (_rgSlots[iSlot])
+		{
+			if (pfAdded)
+				*pfAdded = false;
+			return _rgSlots[iSlot] - 1;
+		}
+	}
+
+	const std::basic_string<WCHAR> &strName = snapshot.strName;
+
+	_rgichName.push_back(_AddString(strName.c_str(), strName.size()));
+	_rgichUIName.push_back(_AddString(snapshot.strUIName.c_str(), snapshot.strUIName.size()));
+	_rgichIconPath.push_back(_AddString(snapshot.strIconPath.c_str(), snapshot.strIconPath.size()));
+	_rgichProgId.push_back(_AddString(snapshot.strProgId.c_str(), snapshot.strProgId.size()));
+
+	_rgichNameKey.push_back(_AddString(key.pszKey, key.cchKey));
+	_rgcchNameKey.push_back((DWORD)key.cchKey);
+	_rgdwNameHash.push_back(key.dwHash);
+
+	_rgiIcon.push_back(snapshot.iIcon);
+	_rgdwType.push_back(snapshot.dwType);
+	_rgfRecommended.push_back(snapshot.fRecommended);
+
+	size_t i = _rgdwType.size() - 1;
+
+	if (key.cchKey)
+	{
+		_rgSlots[iSlot] = (DWORD)(i + 1);
+		_cIndexed++;
+		if (_cIndexed * 2 > _rgSlots.size())
+		{
+			_Rehash(_rgSlots.size() * 2);
+		}
+	}
+
+	if (pfAdded)
+		*pfAdded = true;
+	return i;
+}
+
+void CAssocHandlerTable::Update(size_t i, const ASSOC_HANDLER_SNAPSHOT &snapshot)
+{
+	// The old strings are left in the arena; updates are rare enough that
+	// it isn't worth compacting it.
+	_rgichUIName[i] = _AddString(snapshot.strUIName.c_str(), snapshot.strUIName.size());
+	_rgichIconPath[i] = _AddString(snapshot.strIconPath.c_str(), snapshot.strIconPath.size());
+	_rgichProgId[i] = _AddString(snapshot.strProgId.c_str(), snapshot.strProgId.size());
+	_rgiIcon[i] = snapshot.iIcon;
+	_rgdwType[i] = snapshot.dwType;
+	_rgfRecommended[i] = snapshot.fRecommended;
+}
+
+void CAssocHandlerTable::GetSnapshot(size_t i, ASSOC_HANDLER_SNAPSHOT *pSnapshot) const
+{
+	pSnapshot->strName = GetName(i);
+	pSnapshot->strUIName = GetUIName(i);
+	pSnapshot->strIconPath = GetIconPath(i);
+	pSnapshot->iIcon = GetIconIndex(i);
+	pSnapshot->dwType = GetType(i);
+	pSnapshot->strProgId = GetProgId(i);
+	pSnapshot->fRecommended = IsRecommended(i);
+	pSnapshot->pHandler.reset();
+}
+
+void CAssocHandlerTable::Clear()
+{
+	_arena.clear();
+	_rgichName.clear();
+	_rgichUIName.clear();
+	_rgichIconPath.clear();
+	_rgichProgId.clear();
+	_rgichNameKey.clear();
+	_rgcchNameKey.clear();
+	_rgdwNameHash.clear();
+	_rgiIcon.clear();
+	_rgdwType.clear();
+	_rgfRecommended.clear();
+	_rgSlots.clear();
+	_cIndexed = 0;
+}
+
+int CAssocHandlerTable::FindName(LPCWSTR lpszName) const
+{
+	if (!lpszName || _rgSlots.empty())
+	{
+		return -1;
+	}
+
+	CNameKey key(lpszName);
+	if (!key.cchKey)
+	{
+		return -1;
+	}
+
+	DWORD dwSlot = _rgSlots[_FindSlot(key.pszKey, key.cchKey, key.dwHash)];
+	return dwSlot ? (int)(dwSlot - 1) : -1;
+}
\ No newline at end of file
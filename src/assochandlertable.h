@@ -0,0 +1,163 @@
+#pragma once
+
+/**
+ * What the dialog knows about its handlers, read once per handler.
+ *
+ * The dialog used to ask each IAssocHandler for its name, icon and group
+ * whenever it needed them, which meant a COM call, and an allocation for
+ * every string, each time a handler was added, selected or searched for.
+ * CAssocHandlerTable keeps that metadata instead, filled in from the
+ * snapshots the handlers were read into on the worker thread.
+ *
+ * The table is a struct of arrays: each field has its own array, indexed
+ * the same way as the dialog's list of handlers, and every string lives in
+ * a single arena.
+ *
+ * Handlers are also indexed by their name, which for a program is the path
+ * to it, so that browsing for a program that is already listed selects it
+ * without looking through the list. The index hashes the name after
+ * normalising it the way the file system would compare it, so a program
+ * that is reached through two spellings of its path is only listed once.
+ */
+
+#include "assochandlerstream.h"
+
+#include <string>
+#include <vector>
+
+class CAssocHandlerTable
+{
+private:
+	// Every string in the table, each followed by a null.
+	std::vector<WCHAR> _arena;
+
+	// Where each handler's strings start in the arena.
+	std::vector<DWORD> _rgichName;
+	std::vector<DWORD> _rgichUIName;
+	std::vector<DWORD> _rgichIconPath;
+	std::vector<DWORD> _rgichProgId;
+
+	// The names again, normalised, with their lengths and hashes.
+	std::vector<DWORD> _rgichNameKey;
+	std::vector<DWORD> _rgcchNameKey;
+	std::vector<DWORD> _rgdwNameHash;
+
+	// Open-addressed hash index of the names: each slot holds a handler's
+	// index plus one, or zero if it is empty. Its size is a power of two,
+	// kept at least twice the number of handlers. Nameless handlers aren't
+	// indexed.
+	std::vector<DWORD> _rgSlots;
+	size_t             _cIndexed;
+
+	std::vector<int>   _rgiIcon;
+	std::vector<DWORD> _rgdwType;
+	std::vector<bool>  _rgfRecommended;
+
+	DWORD _AddString(LPCWSTR psz, size_t cch);
+
+	// Finds the slot holding a normalised name, or the empty slot where it
+	// would go.
+	size_t _FindSlot(LPCWSTR pszKey, size_t cchKey, DWORD dwHash) const;
+	void _Rehash(size_t cSlots);
+
+public:
+	CAssocHandlerTable()
+		: _cIndexed(0)
+	{
+	}
+
+	CAssocHandlerTable(const CAssocHandlerTable &) = delete;
+	CAssocHandlerTable &operator=(const CAssocHandlerTable &) = delete;
+
+	/**
+	 * Copies a handler's metadata into the table. The handler reference in
+	 * the snapshot is left alone.
+	 *
+	 * If a handler with the same name is already in the table, nothing is
+	 * added and pfAdded is set to false.
+	 *
+	 * @return The handler's index, which is one more than the last one if
+	 *         it was added.
+	 */
+	size_t Add(const ASSOC_HANDLER_SNAPSHOT &snapshot, bool *pfAdded = nullptr);
+
+	/**
+	 * Replaces what the table says about a handler, other than its name,
+	 * with what a newer snapshot says.
+	 */
+	void Update(size_t i, const ASSOC_HANDLER_SNAPSHOT &snapshot);
+
+	/**
+	 * Copies a handler's metadata back out, without a handler reference.
+	 */
+	void GetSnapshot(size_t i, ASSOC_HANDLER_SNAPSHOT *pSnapshot) const;
+
+	void Clear();
+
+	size_t GetCount() const
+	{
+		return _rgdwType.size();
+	}
+
+	/**
+	 * Each of these takes the index returned from Add. Strings are never
+	 * null, but only stay valid until the next Add or Clear.
+	 */
+	LPCWSTR GetName(size_t i) const
+	{
+		return &_arena[_rgichName[i]];
+	}
+
+	LPCWSTR GetUIName(size_t i) const
+	{
+		return &_arena[_rgichUIName[i]];
+	}
+
+	LPCWSTR GetIconPath(size_t i) const
+	{
+		return &_arena[_rgichIconPath[i]];
+	}
+
+	int GetIconIndex(size_t i) const
+	{
+		return _rgiIcon[i];
+	}
+
+	// An AHTYPE.
+	DWORD GetType(size_t i) const
+	{
+		return _rgdwType[i];
+	}
+
+	// Empty if the handler has none.
+	LPCWSTR GetProgId(size_t i) const
+	{
+		return &_arena[_rgichProgId[i]];
+	}
+
+	bool IsRecommended(size_t i) const
+	{
+		return _rgfRecommended[i];
+	}
+
+	/**
+	 * Finds a handler by its name, which for a program is its path. Names
+	 * are compared after normalising them with NormalizeName.
+	 *
+	 * @return The handler's index, or -1.
+	 */
+	int FindName(LPCWSTR lpszName) const;
+
+	/**
+	 * Lowercases a name and, if it is a path, canonicalises it: forward
+	 * slashes become backslashes, repeated backslashes are collapsed, "."
+	 * and ".." are resolved, and surrounding quotes are dropped.
+	 */
+	static std::basic_string<WCHAR> NormalizeName(LPCWSTR lpszName);
+
+	// How much the arena holds, in characters.
+	size_t GetArenaSize() const
+	{
+		return _arena.size();
+	}
+};
\ No newline at end of file
@@ -0,0 +1,237 @@
+#include "associconresolver.h"
+#include "tracespan.h"
+
+#include <thread>
+
+CAssocIconResolver::CAssocIconResolver(
+	IAssocIconSource *pSource,
+	IAssocIconSink *pSink,
+	IUserChoiceClock *pClock,
+	ULONGLONG ullBudget,
+	size_t cThreads
+)
+	: _pState(std::make_shared<STATE>())
+	, _cThreads(cThreads ? cThreads : 1)
+{
+	_pState->pSource = pSource;
+	_pState->pSink = pSink;
+	_pState->pClock = pClock;
+	_pState->ullBudget = ullBudget;
+	_pState->dwGeneration = 0;
+	_pState->fStarted = false;
+	_pState->fStopping = false;
+	_pState->fWoken = false;
+	_pState->counts = {};
+}
+
+CAssocIconResolver::~CAssocIconResolver()
+{
+	Stop();
+}
+
+void CAssocIconResolver::Start()
+{
+	std::lock_guard<std::mutex> lock(_pState->mutex);
+	if (_pState->fStopping || _pState->fStarted)
+	{
+		return;
+	}
+
+	_pState->fStarted = true;
+	for (size_t i = 0; i < _cThreads; i++)
+	{
+		// Each worker keeps the state alive for as long as it needs it.
+		std::thread(&CAssocIconResolver::s_WorkerThread, _pState).detach();
+	}
+}
+
+void CAssocIconResolver::Request(size_t iItem, LPCWSTR lpszIconPath, int iIcon)
+{
+	REQUEST request;
+	request.iItem = iItem;
+	request.strIconPath = lpszIconPath ? lpszIconPath : WTEXT("");
+	request.iIcon = iIcon;
+	request.ullDeadline = _pState->pClock->Now() + _pState->ullBudget;
+
+	{
+		std::lock_guard<std::mutex> lock(_pState->mutex);
+		if (_pState->fStopping)
+		{
+			return;
+		}
+
+		request.dwGeneration = _pState->dwGeneration;
+		_pState->requests.push_back(std::move(request));
+		_pState->counts.cRequested++;
+	}
+
+	_pState->cv.notify_one();
+}
+
+DWORD CAssocIconResolver::NextGeneration()
+{
+	std::lock_guard<std::mutex> lock(_pState->mutex);
+	_pState->counts.cCancelled += (DWORD)_pState->requests.size();
+	_pState->requests.clear();
+	return ++_pState->dwGeneration;
+}
+
+void CAssocIconResolver::s_WorkerThread(std::shared_ptr<STATE> pState)
+{
+	pState->pSource->BeginThread();
+
+	std::unique_lock<std::mutex> lock(pState->mutex);
+	for (;;)
+	{
+		pState->cv.wait(lock, [&pState]() { return pState->fStopping || !pState->requests.empty(); });
+		if (pState->fStopping)
+		{
+			break;
+		}
+
+		REQUEST request = std::move(pState->requests.front());
+		pState->requests.pop_front();
+
+		// The budget only counts against waiting; a lookup which started in
+		// time is allowed to finish.
+		if (pState->pClock->Now() > request.ullDeadline)
+		{
+			pState->counts.cTimedOut++;
+			continue;
+		}
+
+		lock.unlock();
+		int iImage;
+		{
+			CTraceActivity activity(TRACE_RESOLVE_ICON, request.strIconPath.c_str());
+			iImage = pState->pSource->ResolveIcon(request.strIconPath.c_str(), request.iIcon);
+			activity.SetResult((iImage < 0) ? ERROR_FILE_NOT_FOUND : ERROR_SUCCESS);
+		}
+		lock.lock();
+
+		// The dialog is going away, so the icon is no use to it.
+		if (pState->fStopping)
+		{
+			pState->counts.cCancelled++;
+			break;
+		}
+
+		if (iImage < 0)
+		{
+			pState->counts.cFailed++;
+			continue;
+		}
+
+		pState->counts.cResolved++;
+		pState->results.push_back({ request.iItem, iImage, request.dwGeneration });
+
+		// With the lock held, so that the sink can't be woken once Stop has
+		// returned.
+		if (!pState->fWoken)
+		{
+			pState->fWoken = true;
+			pState->counts.cWakes++;
+			pState->pSink->OnIconsReady();
+		}
+	}
+
+	lock.unlock();
+	pState->pSource->EndThread();
+}
+
+void CAssocIconResolver::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(_pState->mutex);
+		_pState->fStopping = true;
+		_pState->counts.cCancelled += (DWORD)_pState->requests.size();
+		_pState->requests.clear();
+	}
+
+	_pState->cv.notify_all();
+}
+
+bool CAssocIconResolver::TakeResults(std::vector<ASSOC_ICON_RESULT> *pResults)
+{
+	pResults->clear();
+
+	std::lock_guard<std::mutex> lock(_pState->mutex);
+	_pState->fWoken = false;
+	pResults->swap(_pState->results);
+	return !pResults->empty();
+}
+
+ASSOC_ICON_COUNTS CAssocIconResolver::GetCounts()
+{
+	std::lock_guard<std::mutex> lock(_pState->mutex);
+	return _pState->counts;
+}
+
+#pragma region CCachingAssocIconSource
+CCachingAssocIconSource::CCachingAssocIconSource(IAssocIconSource *pSource)
+	: _pSource(pSource)
+	, _cHits(0)
+	, _cMisses(0)
+{
+}
+
+void CCachingAssocIconSource::BeginThread()
+{
+	_pSource->BeginThread();
+}
+
+void CCachingAssocIconSource::EndThread()
+{
+	_pSource->EndThread();
+}
+
+int CCachingAssocIconSource::ResolveIcon(LPCWSTR lpszIconPath, int iIcon)
+{
+	// The icon's index goes in front of its path, so the key can't be
+	// mistaken for another path.
+	std::basic_string<WCHAR> strKey;
+	for (unsigned int u = (unsigned int)iIcon; ; u >>= 4)
+	{
+		strKey.push_back(WTEXT("0123456789abcdef")[u & 0xF]);
+		if (u < 0x10)
+			break;
+	}
+	strKey.push_back(WTEXT(','));
+	strKey += lpszIconPath;
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		auto it = _icons.find(strKey);
+		if (it != _icons.end())
+		{
+			_cHits++;
+			return it->second;
+		}
+		_cMisses++;
+	}
+
+	// Two dialogs may look the same icon up at once, which only costs the
+	// second one the time.
+	int iImage = _pSource->ResolveIcon(lpszIconPath, iIcon);
+	if (iImage != -1)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_icons[strKey] = iImage;
+	}
+
+	return iImage;
+}
+
+void CCachingAssocIconSource::Clear()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_icons.clear();
+}
+
+void CCachingAssocIconSource::GetCounts(DWORD *pcHits, DWORD *pcMisses)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	*pcHits = _cHits;
+	*pcMisses = _cMisses;
+}
+#pragma endregion
\ No newline at end of file
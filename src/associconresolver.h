@@ -0,0 +1,284 @@
+#pragma once
+
+/**
+ * Looks handlers' icons up in the background.
+ *
+ * Finding a handler's icon in the system image list can mean loading the
+ * program's file, which is slow when it lives on a network share or a slow
+ * disk, and UWP apps' icons have to be extracted. Doing that while adding
+ * each item held up the whole list. Instead, items go in straight away with
+ * a generic icon, and CAssocIconResolver looks the real icons up on a few
+ * worker threads, waking the dialog through an IAssocIconSink whenever
+ * icons are ready to be set.
+ *
+ * Each request has a time budget, counted from when it was made, which only
+ * limits how long it waits for a worker: a request still waiting when its
+ * budget runs out is dropped, and its item keeps the generic icon. A lookup
+ * can't be interrupted once it has started, so it holds its worker up for as
+ * long as it takes; there are enough workers that one stuck lookup leaves
+ * the rest to the others.
+ *
+ * The workers share the resolver's state, and the last of them to finish
+ * frees it, so stopping the resolver never waits for a lookup on the
+ * dialog's thread.
+ *
+ * Nothing here knows about the shell, so the resolver can be tested with a
+ * fake source.
+ */
+
+#include "wincompat.h"
+#include "userchoicescheduler.h" // for IUserChoiceClock
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Where icons come from. Called on the worker threads, so it has to be
+ * thread-safe, and it has to outlive them: a lookup which had already
+ * started when the resolver was stopped still finishes.
+ */
+class IAssocIconSource
+{
+public:
+	virtual ~IAssocIconSource() {}
+
+	// Called on each worker thread before its first lookup and after its
+	// last.
+	virtual void BeginThread() {}
+	virtual void EndThread() {}
+
+	/**
+	 * Looks an icon up.
+	 *
+	 * @param lpszIconPath  The icon's file, or an indirect string.
+	 * @param iIcon         The icon's index in the file.
+	 *
+	 * @return The icon's index in the system image list, or -1 if it
+	 *         couldn't be found.
+	 */
+	virtual int ResolveIcon(LPCWSTR lpszIconPath, int iIcon) = 0;
+};
+
+/**
+ * Remembers the icons another source found, for every dialog in the process.
+ *
+ * The COM server can show several dialogs at once, and keep showing them for
+ * as long as it stays up; they mostly list the same programs, whose icons
+ * only have to be looked up once. Failed lookups aren't remembered, so they
+ * are tried again.
+ */
+class CCachingAssocIconSource : public IAssocIconSource
+{
+private:
+	IAssocIconSource *_pSource;
+
+	// Guards everything below.
+	std::mutex                                         _mutex;
+	std::unordered_map<std::basic_string<WCHAR>, int>  _icons;
+	DWORD                                              _cHits;
+	DWORD                                              _cMisses;
+
+public:
+	/**
+	 * @param pSource  Where icons come from; it has to outlive the cache.
+	 */
+	CCachingAssocIconSource(IAssocIconSource *pSource);
+
+	CCachingAssocIconSource(const CCachingAssocIconSource &) = delete;
+	CCachingAssocIconSource &operator=(const CCachingAssocIconSource &) = delete;
+
+	void BeginThread() override;
+	void EndThread() override;
+	int ResolveIcon(LPCWSTR lpszIconPath, int iIcon) override;
+
+	// Forgets every icon, e.g. after the system image list was rebuilt.
+	void Clear();
+
+	// Lookups answered from the cache, and ones passed on to the source.
+	void GetCounts(DWORD *pcHits, DWORD *pcMisses);
+};
+
+/**
+ * Wakes the dialog up.
+ */
+class IAssocIconSink
+{
+public:
+	virtual ~IAssocIconSink() {}
+
+	/**
+	 * Called on a worker thread when icons are ready. It isn't called again
+	 * until the dialog has called TakeResults, nor at all once Stop has
+	 * returned. The resolver's lock is held, so it mustn't call back into
+	 * the resolver.
+	 */
+	virtual void OnIconsReady() = 0;
+};
+
+/**
+ * An icon which is ready to be set.
+ */
+struct ASSOC_ICON_RESULT
+{
+	// The item it was requested for.
+	size_t iItem;
+
+	// Its index in the system image list.
+	int    iImage;
+
+	// The generation it was requested in.
+	DWORD  dwGeneration;
+};
+
+/**
+ * Icon lookup counters.
+ */
+struct ASSOC_ICON_COUNTS
+{
+	DWORD cRequested;
+
+	// Lookups which found an icon.
+	DWORD cResolved;
+
+	// Lookups which didn't.
+	DWORD cFailed;
+
+	// Requests dropped because their budget ran out before a worker got to
+	// them.
+	DWORD cTimedOut;
+
+	// Requests dropped by NextGeneration or Stop.
+	DWORD cCancelled;
+
+	// Calls to IAssocIconSink::OnIconsReady.
+	DWORD cWakes;
+};
+
+class CAssocIconResolver
+{
+private:
+	struct REQUEST
+	{
+		size_t                    iItem;
+		std::basic_string<WCHAR>  strIconPath;
+		int                       iIcon;
+		DWORD                     dwGeneration;
+		ULONGLONG                 ullDeadline;
+	};
+
+	// What the workers share with the resolver.
+	struct STATE
+	{
+		IAssocIconSource  *pSource;
+		IAssocIconSink    *pSink;
+		IUserChoiceClock  *pClock;
+		ULONGLONG          ullBudget;
+
+		// Guards everything below.
+		std::mutex                      mutex;
+		std::condition_variable         cv;
+		std::deque<REQUEST>             requests;
+		std::vector<ASSOC_ICON_RESULT>  results;
+		DWORD                           dwGeneration;
+		bool                            fStarted;
+		bool                            fStopping;
+
+		// Set when the sink has been woken, and cleared when the dialog
+		// takes the results.
+		bool                            fWoken;
+
+		ASSOC_ICON_COUNTS               counts;
+	};
+
+	std::shared_ptr<STATE>  _pState;
+	size_t                  _cThreads;
+
+	static void s_WorkerThread(std::shared_ptr<STATE> pState);
+
+public:
+	// How long a request may wait for a worker: 2 seconds.
+	static constexpr ULONGLONG DEFAULT_BUDGET = 2000 * USERCHOICE_FILETIME_PER_MS;
+
+	// How many lookups can run at once.
+	static constexpr size_t DEFAULT_THREADS = 4;
+
+	/**
+	 * @param pSource    Where icons come from; it has to outlive the
+	 *                   worker threads.
+	 * @param pSink      Wakes the dialog up.
+	 * @param pClock     Measures the budget.
+	 * @param ullBudget  How long a request may wait, in FILETIME units.
+	 * @param cThreads   How many worker threads to look icons up on.
+	 *
+	 * The sink and the clock are only used until Stop returns.
+	 */
+	CAssocIconResolver(
+		IAssocIconSource *pSource,
+		IAssocIconSink *pSink,
+		IUserChoiceClock *pClock,
+		ULONGLONG ullBudget = DEFAULT_BUDGET,
+		size_t cThreads = DEFAULT_THREADS
+	);
+
+	// Stops the resolver if it is still running.
+	~CAssocIconResolver();
+
+	CAssocIconResolver(const CAssocIconResolver &) = delete;
+	CAssocIconResolver &operator=(const CAssocIconResolver &) = delete;
+
+	/**
+	 * Starts the worker threads. Requests made before this wait for it, and
+	 * their budgets are already running.
+	 */
+	void Start();
+
+	/**
+	 * Asks for an item's icon to be looked up, in the current generation.
+	 */
+	void Request(size_t iItem, LPCWSTR lpszIconPath, int iIcon);
+
+	/**
+	 * Starts a new generation, for when the items have been rebuilt and the
+	 * old indices mean nothing. Requests still waiting are dropped; icons
+	 * from lookups which have already started still come, but with the old
+	 * generation.
+	 *
+	 * @return The new generation.
+	 */
+	DWORD NextGeneration();
+
+	/**
+	 * Drops every request still waiting, and the results of the lookups
+	 * which have already started, without waiting for them. Results which
+	 * were ready before can still be taken.
+	 */
+	void Stop();
+
+	/**
+	 * Takes the icons which are ready, on the dialog's thread. The sink will
+	 * be woken again when there are more.
+	 *
+	 * @return false if there were none.
+	 */
+	bool TakeResults(std::vector<ASSOC_ICON_RESULT> *pResults);
+
+	ASSOC_ICON_COUNTS GetCounts();
+};
+
+#ifdef _WIN32
+/**
+ * Looks icons up in the system image list with GetAppIconIndex, through a
+ * cache shared by every dialog. Worker threads join the MTA.
+ */
+IAssocIconSource *GetShellAssocIconSource();
+
+/**
+ * The cache behind GetShellAssocIconSource.
+ */
+CCachingAssocIconSource *GetShellAssocIconCache();
+#endif
\ No newline at end of file
@@ -0,0 +1,236 @@
+#include "associdentity.h"
+
+#include <string.h>
+
+#include "protectedacl.h" // for ProtectedAclSidLength
+
+// S-1-5-18.
+static const BYTE c_rgbLocalSystemSid[] = {
+	1, 1, 0, 0, 0, 0, 0, 5,
+	18, 0, 0, 0,
+};
+
+// Writes the digits of ull, returning how many there were.
+static size_t FormatDecimal(WCHAR *psz, ULONGLONG ull)
+{
+	WCHAR szDigits[20];
+	size_t cch = 0;
+	do
+	{
+		szDigits[cch++] = (WCHAR)(WTEXT('0') + ull % 10);
+		ull /= 10;
+	}
+	while (ull);
+
+	for (size_t i = 0; i < cch; i++)
+		psz[i] = szDigits[cch - 1 - i];
+
+	return cch;
+}
+
+size_t AssocFormatStringSid(const BYTE *pbSid, size_t cbSid, WCHAR *pszOut, size_t cchOut)
+{
+	static const WCHAR c_szHexDigits[] = WTEXT("0123456789abcdef");
+
+	if (!ProtectedAclSidLength(pbSid, cbSid))
+	{
+		return 0;
+	}
+
+	WCHAR szSid[ASSOC_STRING_SID_CCH_MAX];
+	size_t cch = 0;
+	szSid[cch++] = WTEXT('S');
+	szSid[cch++] = WTEXT('-');
+	cch += FormatDecimal(&szSid[cch], pbSid[0]);
+	szSid[cch++] = WTEXT('-');
+
+	// The identifier authority is big endian. Like ConvertSidToStringSidW,
+	// it's written in hex if it doesn't fit in 32 bits.
+	if (pbSid[2] || pbSid[3])
+	{
+		szSid[cch++] = WTEXT('0');
+		szSid[cch++] = WTEXT('x');
+		for (int i = 2; i < 8; i++)
+		{
+			szSid[cch++] = c_szHexDigits[pbSid[i] >> 4];
+			szSid[cch++] = c_szHexDigits[pbSid[i] & 0xF];
+		}
+	}
+	else
+	{
+		DWORD dwAuthority = ((DWORD)pbSid[4] << 24) | ((DWORD)pbSid[5] << 16) | ((DWORD)pbSid[6] << 8) | pbSid[7];
+		cch += FormatDecimal(&szSid[cch], dwAuthority);
+	}
+
+	// Sub-authorities are little endian.
+	for (BYTE i = 0; i < pbSid[1]; i++)
+	{
+		const BYTE *pb = &pbSid[8 + 4 * i];
+		DWORD dwSubAuthority = (DWORD)pb[0] | ((DWORD)pb[1] << 8) | ((DWORD)pb[2] << 16) | ((DWORD)pb[3] << 24);
+		szSid[cch++] = WTEXT('-');
+		cch += FormatDecimal(&szSid[cch], dwSubAuthority);
+	}
+
+	if (cch + 1 > cchOut)
+	{
+		return 0;
+	}
+
+	memcpy(pszOut, szSid, cch * sizeof(WCHAR));
+	pszOut[cch] = 0;
+	return cch;
+}
+
+#pragma region CAssocIdentity
+CAssocIdentity::CAssocIdentity()
+	: _szSid{ 0 }
+	, _cchSid(0)
+	, _fImpersonating(false)
+{
+}
+
+bool CAssocIdentity::Init(const BYTE *pbSid, size_t cbSid, bool fImpersonating)
+{
+	_cchSid = AssocFormatStringSid(pbSid, cbSid, _szSid, ARRAYSIZE(_szSid));
+	if (!_cchSid)
+	{
+		return false;
+	}
+
+	_sid.assign(pbSid, pbSid + ProtectedAclSidLength(pbSid, cbSid));
+	_fImpersonating = fImpersonating;
+	return true;
+}
+
+bool CAssocIdentity::IsLocalSystem() const
+{
+	return _sid.size() == sizeof(c_rgbLocalSystemSid) &&
+		memcmp(_sid.data(), c_rgbLocalSystemSid, sizeof(c_rgbLocalSystemSid)) == 0;
+}
+#pragma endregion
+
+#pragma region CAssocIdentityCache
+/**
+ * The identity a thread last got from GetCurrent. Each thread only has the
+ * one slot, so a thread which goes back and forth between two caches
+ * resolves again each time; outside of tests there is only the one cache.
+ */
+struct ASSOC_IDENTITY_SLOT
+{
+	ULONGLONG                              ullCache;
+	DWORD                                  dwGeneration;
+	std::shared_ptr<const CAssocIdentity>  pIdentity;
+};
+
+static thread_local ASSOC_IDENTITY_SLOT t_identitySlot;
+
+static std::atomic<ULONGLONG> s_ullNextCacheId(1);
+
+CAssocIdentityCache::CAssocIdentityCache(IAssocIdentitySource *pSource)
+	: _pSource(pSource)
+	, _ullId(s_ullNextCacheId++)
+	, _dwGeneration(0)
+	, _cHits(0)
+	, _dwProcessGeneration(0)
+	, _counts{ 0 }
+{
+}
+
+std::shared_ptr<const CAssocIdentity> CAssocIdentityCache::_Resolve(DWORD dwGeneration)
+{
+	// The thread token has to be checked on every thread, since only it
+	// knows whether it is impersonating.
+	std::vector<BYTE> sid;
+	LSTATUS ls = _pSource->QueryUserSid(AssocTokenKind::THREAD, &sid);
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_counts.cThreadQueries++;
+	}
+
+	if (ls == ERROR_SUCCESS)
+	{
+		std::shared_ptr<CAssocIdentity> pIdentity = std::make_shared<CAssocIdentity>();
+		if (!pIdentity->Init(sid.data(), sid.size(), true))
+		{
+			return nullptr;
+		}
+
+		return pIdentity;
+	}
+	else if (ls != ERROR_NO_TOKEN)
+	{
+		return nullptr;
+	}
+
+	// Every thread which isn't impersonating shares the process identity.
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (!_pProcess || _dwProcessGeneration != dwGeneration)
+	{
+		_counts.cProcessQueries++;
+
+		sid.clear();
+		if (_pSource->QueryUserSid(AssocTokenKind::PROCESS, &sid) != ERROR_SUCCESS)
+		{
+			return nullptr;
+		}
+
+		std::shared_ptr<CAssocIdentity> pIdentity = std::make_shared<CAssocIdentity>();
+		if (!pIdentity->Init(sid.data(), sid.size(), false))
+		{
+			return nullptr;
+		}
+
+		_pProcess = pIdentity;
+		_dwProcessGeneration = dwGeneration;
+	}
+
+	return _pProcess;
+}
+
+std::shared_ptr<const CAssocIdentity> CAssocIdentityCache::GetCurrent()
+{
+	DWORD dwGeneration = _dwGeneration.load();
+
+	ASSOC_IDENTITY_SLOT &slot = t_identitySlot;
+	if (slot.pIdentity && slot.ullCache == _ullId && slot.dwGeneration == dwGeneration)
+	{
+		_cHits++;
+		return slot.pIdentity;
+	}
+
+	// Failures aren't kept, so the next call tries again.
+	std::shared_ptr<const CAssocIdentity> pIdentity = _Resolve(dwGeneration);
+	if (pIdentity)
+	{
+		slot.ullCache = _ullId;
+		slot.dwGeneration = dwGeneration;
+		slot.pIdentity = pIdentity;
+	}
+
+	return pIdentity;
+}
+
+void CAssocIdentityCache::InvalidateThread()
+{
+	ASSOC_IDENTITY_SLOT &slot = t_identitySlot;
+	if (slot.ullCache == _ullId)
+	{
+		slot.pIdentity.reset();
+	}
+}
+
+void CAssocIdentityCache::Invalidate()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_pProcess.reset();
+	_dwGeneration++;
+}
+
+ASSOC_IDENTITY_COUNTS CAssocIdentityCache::GetCounts()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	ASSOC_IDENTITY_COUNTS counts = _counts;
+	counts.cHits = _cHits.load();
+	return counts;
+}
+#pragma endregion
\ No newline at end of file
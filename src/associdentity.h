@@ -0,0 +1,197 @@
+#pragma once
+
+/**
+ * Resolves the user that associations are written for.
+ *
+ * Writing an association needs the user's SID twice: as a string, for the
+ * UserChoice hash, and as a binary SID, for the deny ACE which
+ * CShellProtectedRegLock puts on the key. Both come from the effective
+ * token, which is the thread's impersonation token if it has one, and the
+ * process token otherwise. Opening the token and querying TokenUser for
+ * every write costs a few system calls and an allocation, for an answer
+ * which only changes when a thread starts or stops impersonating.
+ *
+ * CAssocIdentityCache resolves each identity once and hands out shared,
+ * read-only CAssocIdentity objects. The process identity is resolved the
+ * first time it's needed, and each thread only checks once whether it has
+ * an impersonation token of its own. Code which changes a thread's
+ * impersonation calls InvalidateThread afterwards.
+ *
+ * The tokens are behind IAssocIdentitySource, so the cache can be tested
+ * without them.
+ */
+
+#include "wincompat.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// "S-1-", a 48-bit identifier authority in hex, and 15 sub-authorities of
+// up to 10 digits each, plus the null terminator.
+#define ASSOC_STRING_SID_CCH_MAX 184
+
+/**
+ * Formats a binary SID as a string SID, the way ConvertSidToStringSidW
+ * does.
+ *
+ * @param pbSid   The SID.
+ * @param cbSid   Size of the buffer holding the SID.
+ * @param pszOut  Receives the null-terminated string SID.
+ * @param cchOut  Size of pszOut, in characters.
+ *
+ * @return The length of the string SID, or zero if the SID isn't valid or
+ *         doesn't fit.
+ */
+size_t AssocFormatStringSid(const BYTE *pbSid, size_t cbSid, WCHAR *pszOut, size_t cchOut);
+
+/**
+ * A user's SID, in both forms.
+ */
+class CAssocIdentity
+{
+private:
+	std::vector<BYTE> _sid;
+	WCHAR             _szSid[ASSOC_STRING_SID_CCH_MAX];
+	size_t            _cchSid;
+	bool              _fImpersonating;
+
+public:
+	CAssocIdentity();
+
+	/**
+	 * @param fImpersonating  Whether the SID came from an impersonation
+	 *                        token.
+	 *
+	 * @return false if the SID isn't valid.
+	 */
+	bool Init(const BYTE *pbSid, size_t cbSid, bool fImpersonating);
+
+	const BYTE *GetSid() const
+	{
+		return _sid.data();
+	}
+
+	DWORD GetSidLength() const
+	{
+		return (DWORD)_sid.size();
+	}
+
+	LPCWSTR GetStringSid() const
+	{
+		return _szSid;
+	}
+
+	size_t GetStringSidLength() const
+	{
+		return _cchSid;
+	}
+
+	bool IsImpersonating() const
+	{
+		return _fImpersonating;
+	}
+
+	// Whether this is S-1-5-18, which protected values aren't locked for.
+	bool IsLocalSystem() const;
+};
+
+enum class AssocTokenKind
+{
+	// The process token.
+	PROCESS,
+
+	// The calling thread's impersonation token.
+	THREAD,
+};
+
+/**
+ * Where identities come from.
+ */
+class IAssocIdentitySource
+{
+public:
+	virtual ~IAssocIdentitySource() {}
+
+	/**
+	 * Gets the user SID of a token.
+	 *
+	 * @param kind  Which token to query.
+	 * @param pSid  Receives the binary SID.
+	 *
+	 * @return ERROR_SUCCESS; ERROR_NO_TOKEN if kind is THREAD and the thread
+	 *         isn't impersonating; or another error.
+	 */
+	virtual LSTATUS QueryUserSid(AssocTokenKind kind, std::vector<BYTE> *pSid) = 0;
+};
+
+/**
+ * Identity cache counters.
+ */
+struct ASSOC_IDENTITY_COUNTS
+{
+	// Queries made to the source, by kind.
+	DWORD cProcessQueries;
+	DWORD cThreadQueries;
+
+	// GetCurrent calls answered without any query.
+	DWORD cHits;
+};
+
+class CAssocIdentityCache
+{
+private:
+	IAssocIdentitySource *_pSource;
+
+	// Tells this cache's entries in the per-thread slots apart from other
+	// caches'.
+	ULONGLONG             _ullId;
+
+	// Bumped by Invalidate, which makes every thread resolve again.
+	std::atomic<DWORD>    _dwGeneration;
+	std::atomic<DWORD>    _cHits;
+
+	std::mutex                             _mutex;
+	std::shared_ptr<const CAssocIdentity>  _pProcess;
+	DWORD                                  _dwProcessGeneration;
+	ASSOC_IDENTITY_COUNTS                  _counts;
+
+	std::shared_ptr<const CAssocIdentity> _Resolve(DWORD dwGeneration);
+
+public:
+	/**
+	 * @param pSource  Where identities come from; it has to outlive the
+	 *                 cache.
+	 */
+	CAssocIdentityCache(IAssocIdentitySource *pSource);
+
+	CAssocIdentityCache(const CAssocIdentityCache &) = delete;
+	CAssocIdentityCache &operator=(const CAssocIdentityCache &) = delete;
+
+	/**
+	 * Returns the identity of the calling thread: its impersonation token's
+	 * user if it has one, and the process's user otherwise. After the first
+	 * call on a thread, this doesn't query any tokens.
+	 *
+	 * @return The identity, which stays valid for as long as it's held even
+	 *         if the cache is invalidated, or nullptr on failure.
+	 */
+	std::shared_ptr<const CAssocIdentity> GetCurrent();
+
+	// Forgets the calling thread's identity, e.g. after it starts or stops
+	// impersonating.
+	void InvalidateThread();
+
+	// Forgets every identity, including the process's.
+	void Invalidate();
+
+	ASSOC_IDENTITY_COUNTS GetCounts();
+};
+
+#ifdef _WIN32
+/**
+ * The process-wide identity cache, which reads the real tokens.
+ */
+CAssocIdentityCache *GetShellAssocIdentityCache();
+#endif
\ No newline at end of file
@@ -0,0 +1,118 @@
+#include "assoclookup.h"
+
+#include "assocregistry.h" // for AssocFormatKeyPath
+#include "userchoicehash.h" // for UserChoiceLowerCase
+
+#pragma region CAssocLookupEntry
+CAssocLookupEntry::CAssocLookupEntry(IRegistryBackend *pRegistry)
+	: _pRegistry(pRegistry)
+	, _hkProgId(nullptr)
+	, _fNoOpen(false)
+	, _fUserAssoc(false)
+{
+}
+
+CAssocLookupEntry::~CAssocLookupEntry()
+{
+	if (_hkProgId)
+		_pRegistry->CloseKey(_hkProgId);
+}
+
+void CAssocLookupEntry::Load(LPCWSTR lpszExtension, bool fIsUri)
+{
+	// The same reads as AssocOpenProgIdKey, keeping the ProgID.
+	WCHAR szProgId[256] = { 0 };
+	DWORD cbProgId = sizeof(szProgId);
+	DWORD dwType = REG_NONE;
+	if (_pRegistry->GetValue(HKEY_CLASSES_ROOT, lpszExtension, nullptr, &dwType, szProgId, &cbProgId) == ERROR_SUCCESS &&
+		dwType == REG_SZ && *szProgId)
+	{
+		_strProgId = szProgId;
+		if (_pRegistry->OpenKey(HKEY_CLASSES_ROOT, szProgId, &_hkProgId) != ERROR_SUCCESS)
+			_hkProgId = nullptr;
+	}
+
+	if (_hkProgId)
+	{
+		_fNoOpen = _pRegistry->GetValue(_hkProgId, nullptr, WTEXT("NoOpen"), nullptr, nullptr, nullptr) == ERROR_SUCCESS;
+	}
+
+	WCHAR szKeyPath[ASSOC_KEY_PATH_CCH_MAX];
+	if (AssocFormatKeyPath(lpszExtension, fIsUri, szKeyPath, ARRAYSIZE(szKeyPath)))
+	{
+		CRegistryKey hk(_pRegistry);
+		_fUserAssoc = _pRegistry->OpenKey(HKEY_CURRENT_USER, szKeyPath, hk.put()) == ERROR_SUCCESS && hk.get();
+	}
+}
+#pragma endregion
+
+#pragma region CAssocLookupCache
+CAssocLookupCache::CAssocLookupCache(IRegistryBackend *pRegistry)
+	: _pRegistry(pRegistry)
+	, _counts{ 0 }
+{
+}
+
+CAssocLookupCache::String CAssocLookupCache::s_MakeKey(LPCWSTR lpszExtension, bool fIsUri)
+{
+	// Extensions and protocols are looked up under different keys, so the
+	// same name can be in the cache as both.
+	String str(1, fIsUri ? WTEXT(':') : WTEXT('.'));
+	str += lpszExtension;
+	UserChoiceLowerCase(&str[1], str.size() - 1);
+	return str;
+}
+
+std::shared_ptr<const CAssocLookupEntry> CAssocLookupCache::Lookup(LPCWSTR lpszExtension, bool fIsUri)
+{
+	if (!lpszExtension || !*lpszExtension)
+	{
+		return nullptr;
+	}
+
+	String strKey = s_MakeKey(lpszExtension, fIsUri);
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		auto it = _entries.find(strKey);
+		if (it != _entries.end())
+		{
+			_counts.cHits++;
+			return it->second;
+		}
+
+		_counts.cMisses++;
+	}
+
+	// The registry is read without the lock held. If another thread looked
+	// the same name up meanwhile, its entry wins and this one is dropped.
+	std::shared_ptr<CAssocLookupEntry> pEntry = std::make_shared<CAssocLookupEntry>(_pRegistry);
+	pEntry->Load(lpszExtension, fIsUri);
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _entries.emplace(std::move(strKey), std::move(pEntry)).first->second;
+}
+
+void CAssocLookupCache::Invalidate(LPCWSTR lpszExtension)
+{
+	if (!lpszExtension)
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	_entries.erase(s_MakeKey(lpszExtension, false));
+	_entries.erase(s_MakeKey(lpszExtension, true));
+}
+
+void CAssocLookupCache::InvalidateAll()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_entries.clear();
+}
+
+ASSOC_LOOKUP_COUNTS CAssocLookupCache::GetCounts()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _counts;
+}
+#pragma endregion
\ No newline at end of file
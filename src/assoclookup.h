@@ -0,0 +1,133 @@
+#pragma once
+
+/**
+ * Caches what the registry says about an extension or protocol.
+ *
+ * Showing the dialog for a file looks its extension up several times: once
+ * to decide whether it is registered, again for the NoOpen flag, again for
+ * the type name in the NoOpen dialog, and once more when the description is
+ * changed. Each of those read the extension's default value and opened its
+ * ProgID key. CAssocLookupCache does that once per extension and keeps the
+ * result, including the open ProgID key, until it is invalidated.
+ *
+ * Nothing here notices changes made behind its back. Code which changes an
+ * association calls Invalidate for it, or InvalidateAll after changing many.
+ */
+
+#include "registrybackend.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/**
+ * What the registry said about one extension or protocol.
+ */
+class CAssocLookupEntry
+{
+private:
+	IRegistryBackend         *_pRegistry;
+	std::basic_string<WCHAR>  _strProgId;
+	HKEY                      _hkProgId;
+	bool                      _fNoOpen;
+	bool                      _fUserAssoc;
+
+public:
+	CAssocLookupEntry(IRegistryBackend *pRegistry);
+	~CAssocLookupEntry();
+
+	CAssocLookupEntry(const CAssocLookupEntry &) = delete;
+	CAssocLookupEntry &operator=(const CAssocLookupEntry &) = delete;
+
+	/**
+	 * Reads the ProgID the extension is registered to, opens its key, and
+	 * checks for NoOpen and a per-user association key.
+	 */
+	void Load(LPCWSTR lpszExtension, bool fIsUri);
+
+	// The ProgID in the extension's default value, or an empty string.
+	LPCWSTR GetProgId() const
+	{
+		return _strProgId.c_str();
+	}
+
+	// The ProgID's key in HKCR, or null if it couldn't be opened. The entry
+	// owns the key, so it must not be closed.
+	HKEY GetProgIdKey() const
+	{
+		return _hkProgId;
+	}
+
+	// Whether the ProgID is marked NoOpen.
+	bool IsNoOpen() const
+	{
+		return _fNoOpen;
+	}
+
+	// Whether there is a FileExts or UrlAssociations key for it.
+	bool HasUserAssoc() const
+	{
+		return _fUserAssoc;
+	}
+
+	// Same as AssocExists.
+	bool Exists() const
+	{
+		return _hkProgId || _fUserAssoc;
+	}
+};
+
+/**
+ * Lookup cache counters.
+ */
+struct ASSOC_LOOKUP_COUNTS
+{
+	// Lookups answered from the cache.
+	DWORD cHits;
+
+	// Lookups which went to the registry.
+	DWORD cMisses;
+};
+
+class CAssocLookupCache
+{
+private:
+	typedef std::basic_string<WCHAR> String;
+
+	IRegistryBackend *_pRegistry;
+
+	typedef std::unordered_map<String, std::shared_ptr<const CAssocLookupEntry>> EntryMap;
+
+	std::mutex          _mutex;
+	EntryMap            _entries;
+	ASSOC_LOOKUP_COUNTS _counts;
+
+	static String s_MakeKey(LPCWSTR lpszExtension, bool fIsUri);
+
+public:
+	/**
+	 * @param pRegistry  Where to look; it has to outlive the cache.
+	 */
+	CAssocLookupCache(IRegistryBackend *pRegistry);
+
+	CAssocLookupCache(const CAssocLookupCache &) = delete;
+	CAssocLookupCache &operator=(const CAssocLookupCache &) = delete;
+
+	/**
+	 * Looks an extension or protocol up, going to the registry only the
+	 * first time. Names are compared case-insensitively.
+	 *
+	 * @return The entry, which stays usable for as long as it is held, even
+	 *         if it is invalidated. Null if lpszExtension is empty.
+	 */
+	std::shared_ptr<const CAssocLookupEntry> Lookup(LPCWSTR lpszExtension, bool fIsUri);
+
+	// Forgets an extension or protocol, after its association changed.
+	void Invalidate(LPCWSTR lpszExtension);
+
+	// Forgets everything.
+	void InvalidateAll();
+
+	ASSOC_LOOKUP_COUNTS GetCounts();
+};
\ No newline at end of file
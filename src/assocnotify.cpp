@@ -0,0 +1,133 @@
+#include "assocnotify.h"
+
+CAssocChangeNotifier::CAssocChangeNotifier(IAssocChangeSink *pSink, IUserChoiceClock *pClock, ULONGLONG ullWindow)
+	: _pSink(pSink)
+	, _pClock(pClock)
+	, _ullWindow(ullWindow)
+	, _fPending(false)
+	, _ullFirstPost(0)
+	, _ullDeadline(0)
+	, _cBatchDepth(0)
+	, _counts{ 0 }
+{
+}
+
+bool CAssocChangeNotifier::_TakePending()
+{
+	if (!_fPending)
+	{
+		return false;
+	}
+
+	_fPending = false;
+	_counts.cSent++;
+	return true;
+}
+
+void CAssocChangeNotifier::_Send(bool fPending)
+{
+	if (fPending)
+	{
+		_pSink->SendAssocChanged();
+	}
+}
+
+void CAssocChangeNotifier::Post()
+{
+	ULONGLONG ullPollTime = 0;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		ULONGLONG ullNow = _pClock->Now();
+
+		_counts.cPosted++;
+		if (!_fPending)
+		{
+			_fPending = true;
+			_ullFirstPost = ullNow;
+		}
+
+		if (_cBatchDepth)
+		{
+			return;
+		}
+
+		// Each post pushes the notification back, up to a limit, so that a
+		// run of changes ends up as one notification after the last of them.
+		ULONGLONG ullDeadline = ullNow + _ullWindow;
+		ULONGLONG ullLatest = _ullFirstPost + MAX_WINDOWS * _ullWindow;
+		_ullDeadline = (ullDeadline < ullLatest) ? ullDeadline : ullLatest;
+		ullPollTime = _ullDeadline;
+	}
+
+	_pSink->RequestPoll(ullPollTime);
+}
+
+void CAssocChangeNotifier::Poll()
+{
+	bool fSend = false;
+	ULONGLONG ullPollTime = 0;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (!_fPending || _cBatchDepth)
+		{
+			return;
+		}
+
+		if (_pClock->Now() >= _ullDeadline)
+		{
+			fSend = _TakePending();
+		}
+		else
+		{
+			// The poll came early, or a post moved the deadline since it was
+			// requested.
+			ullPollTime = _ullDeadline;
+		}
+	}
+
+	if (fSend)
+	{
+		_Send(true);
+	}
+	else
+	{
+		_pSink->RequestPoll(ullPollTime);
+	}
+}
+
+void CAssocChangeNotifier::Flush()
+{
+	bool fPending;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		fPending = _TakePending();
+	}
+
+	_Send(fPending);
+}
+
+void CAssocChangeNotifier::BeginBatch()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_cBatchDepth++;
+}
+
+void CAssocChangeNotifier::EndBatch()
+{
+	bool fPending = false;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (--_cBatchDepth == 0)
+		{
+			fPending = _TakePending();
+		}
+	}
+
+	_Send(fPending);
+}
+
+ASSOC_NOTIFY_COUNTS CAssocChangeNotifier::GetCounts()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _counts;
+}
\ No newline at end of file
@@ -0,0 +1,155 @@
+#pragma once
+
+/**
+ * Coalesces SHCNE_ASSOCCHANGED notifications.
+ *
+ * Every SHCNE_ASSOCCHANGED makes the shell throw away its icon cache and
+ * redraw every view, so sending one per association changed is expensive
+ * and, when several change together, pointless. Code that changes an
+ * association posts to a CAssocChangeNotifier instead, which sends a single
+ * notification for everything posted within a short window, or at the end of
+ * a batch.
+ *
+ * The notification itself, and the timer that ends the window, are behind
+ * IAssocChangeSink, so the coalescing can be tested without a shell.
+ */
+
+#include "wincompat.h"
+#include "userchoicescheduler.h" // for IUserChoiceClock
+
+#include <mutex>
+
+/**
+ * Where coalesced notifications go.
+ */
+class IAssocChangeSink
+{
+public:
+	virtual ~IAssocChangeSink() {}
+
+	// Sends one SHCNE_ASSOCCHANGED.
+	virtual void SendAssocChanged() = 0;
+
+	/**
+	 * Asks for CAssocChangeNotifier::Poll to be called once ullTime has been
+	 * reached. A later request replaces an earlier one.
+	 */
+	virtual void RequestPoll(ULONGLONG ullTime) = 0;
+};
+
+/**
+ * Notification counters.
+ */
+struct ASSOC_NOTIFY_COUNTS
+{
+	// Changes posted.
+	DWORD cPosted;
+
+	// Notifications actually sent.
+	DWORD cSent;
+
+	// Posts which were folded into another post's notification.
+	DWORD Coalesced() const
+	{
+		return cPosted - cSent;
+	}
+};
+
+class CAssocChangeNotifier
+{
+private:
+	IAssocChangeSink *_pSink;
+	IUserChoiceClock *_pClock;
+	ULONGLONG         _ullWindow;
+
+	std::mutex          _mutex;
+	bool                _fPending;
+	ULONGLONG           _ullFirstPost;
+	ULONGLONG           _ullDeadline;
+	DWORD               _cBatchDepth;
+	ASSOC_NOTIFY_COUNTS _counts;
+
+	// Clears the pending notification and counts it as sent. Called with the
+	// lock held.
+	bool _TakePending();
+
+	// Sends a notification taken by _TakePending. Called without the lock
+	// held, so the sink can take its time.
+	void _Send(bool fPending);
+
+public:
+	// How long after the last post a notification is sent.
+	static constexpr ULONGLONG DEFAULT_WINDOW = 250 * USERCHOICE_FILETIME_PER_MS;
+
+	// A steady stream of posts still gets a notification out at least this
+	// often, measured in windows from the first post.
+	static constexpr ULONGLONG MAX_WINDOWS = 4;
+
+	/**
+	 * @param pSink      Sends notifications; it has to outlive the notifier.
+	 * @param pClock     Clock to measure the window with.
+	 * @param ullWindow  Debounce window, in FILETIME units.
+	 */
+	CAssocChangeNotifier(IAssocChangeSink *pSink, IUserChoiceClock *pClock, ULONGLONG ullWindow = DEFAULT_WINDOW);
+
+	/**
+	 * Records that an association changed. Outside a batch, this asks the
+	 * sink for a poll at the end of the window; inside one, the notification
+	 * waits for the batch to end.
+	 */
+	void Post();
+
+	/**
+	 * Sends the pending notification if its window has ended, and asks for
+	 * another poll if it hasn't.
+	 */
+	void Poll();
+
+	/**
+	 * Sends the pending notification straight away, e.g. before the process
+	 * exits or before launching something that should see the new
+	 * association.
+	 */
+	void Flush();
+
+	/**
+	 * Batches nest. While one is open, posts are only counted; when the
+	 * outermost one ends, anything posted is sent as one notification.
+	 */
+	void BeginBatch();
+	void EndBatch();
+
+	ASSOC_NOTIFY_COUNTS GetCounts();
+};
+
+/**
+ * Holds a notification batch open for a scope.
+ */
+class CAssocChangeBatch
+{
+private:
+	CAssocChangeNotifier *_pNotifier;
+
+public:
+	CAssocChangeBatch(CAssocChangeNotifier *pNotifier)
+		: _pNotifier(pNotifier)
+	{
+		_pNotifier->BeginBatch();
+	}
+
+	CAssocChangeBatch(const CAssocChangeBatch &) = delete;
+	CAssocChangeBatch &operator=(const CAssocChangeBatch &) = delete;
+
+	~CAssocChangeBatch()
+	{
+		_pNotifier->EndBatch();
+	}
+};
+
+#ifdef _WIN32
+/**
+ * The process-wide notifier, which sends through SHChangeNotify and polls
+ * from a thread pool timer.
+ */
+CAssocChangeNotifier *GetShellAssocChangeNotifier();
+#endif
\ No newline at end of file
@@ -0,0 +1,482 @@
+#include "assocprofile.h"
+
+#include "assocregistry.h"
+#include "tracespan.h"
+#include "userchoicehash.h"
+
+#include <string.h>
+
+#include <map>
+
+typedef std::basic_string<WCHAR> String;
+
+#pragma region Parsing
+/**
+ * Appends UTF-8 text to a UTF-16 string.
+ *
+ * @return false if the text isn't valid UTF-8.
+ */
+static bool AppendUtf8(const char *pch, size_t cch, String *pstr)
+{
+	const BYTE *pb = (const BYTE *)pch;
+	size_t i = 0;
+	while (i < cch)
+	{
+		DWORD dwChar = pb[i];
+		size_t cbChar;
+		DWORD dwMin;
+		if (dwChar < 0x80)
+		{
+			cbChar = 1;
+			dwMin = 0;
+		}
+		else if ((dwChar & 0xE0) == 0xC0)
+		{
+			dwChar &= 0x1F;
+			cbChar = 2;
+			dwMin = 0x80;
+		}
+		else if ((dwChar & 0xF0) == 0xE0)
+		{
+			dwChar &= 0x0F;
+			cbChar = 3;
+			dwMin = 0x800;
+		}
+		else if ((dwChar & 0xF8) == 0xF0)
+		{
+			dwChar &= 0x07;
+			cbChar = 4;
+			dwMin = 0x10000;
+		}
+		else
+		{
+			return false;
+		}
+
+		if (i + cbChar > cch)
+			return false;
+
+		for (size_t j = 1; j < cbChar; j++)
+		{
+			if ((pb[i + j] & 0xC0) != 0x80)
+				return false;
+			dwChar = (dwChar << 6) | (pb[i + j] & 0x3F);
+		}
+
+		// Overlong forms, surrogates and anything past the last code point
+		// are all invalid.
+		if (dwChar < dwMin || (dwChar >= 0xD800 && dwChar <= 0xDFFF) || dwChar > 0x10FFFF)
+			return false;
+
+		if (dwChar >= 0x10000)
+		{
+			dwChar -= 0x10000;
+			pstr->push_back((WCHAR)(0xD800 + (dwChar >> 10)));
+			pstr->push_back((WCHAR)(0xDC00 + (dwChar & 0x3FF)));
+		}
+		else
+		{
+			pstr->push_back((WCHAR)dwChar);
+		}
+
+		i += cbChar;
+	}
+	return true;
+}
+
+/**
+ * Decodes an attribute value, replacing the predefined XML entities and
+ * character references.
+ *
+ * @return false if the value isn't valid.
+ */
+static bool DecodeAttribute(const char *pch, size_t cch, String *pstr)
+{
+	static const struct
+	{
+		const char *pszName;
+		char        ch;
+	} c_rgEntities[] = {
+		{ "amp",  '&'  },
+		{ "lt",   '<'  },
+		{ "gt",   '>'  },
+		{ "quot", '"'  },
+		{ "apos", '\'' },
+	};
+
+	pstr->clear();
+
+	size_t iRun = 0;
+	for (size_t i = 0; i < cch; i++)
+	{
+		if (pch[i] != '&')
+			continue;
+
+		if (!AppendUtf8(&pch[iRun], i - iRun, pstr))
+			return false;
+
+		const char *pchEnd = (const char *)memchr(&pch[i], ';', cch - i);
+		if (!pchEnd)
+			return false;
+
+		const char *pchName = &pch[i + 1];
+		size_t cchName = pchEnd - pchName;
+
+		if (cchName > 1 && pchName[0] == '#')
+		{
+			DWORD dwChar = 0;
+			bool fHex = pchName[1] == 'x';
+			for (size_t j = fHex ? 2 : 1; j < cchName; j++)
+			{
+				char c = pchName[j];
+				DWORD dwDigit;
+				if (c >= '0' && c <= '9')
+					dwDigit = c - '0';
+				else if (fHex && c >= 'a' && c <= 'f')
+					dwDigit = c - 'a' + 10;
+				else if (fHex && c >= 'A' && c <= 'F')
+					dwDigit = c - 'A' + 10;
+				else
+					return false;
+
+				dwChar = dwChar * (fHex ? 16 : 10) + dwDigit;
+				if (dwChar > 0x10FFFF)
+					return false;
+			}
+
+			if (dwChar == 0 || (dwChar >= 0xD800 && dwChar <= 0xDFFF))
+				return false;
+
+			if (dwChar >= 0x10000)
+			{
+				dwChar -= 0x10000;
+				pstr->push_back((WCHAR)(0xD800 + (dwChar >> 10)));
+				pstr->push_back((WCHAR)(0xDC00 + (dwChar & 0x3FF)));
+			}
+			else
+			{
+				pstr->push_back((WCHAR)dwChar);
+			}
+		}
+		else
+		{
+			bool fFound = false;
+			for (const auto &entity : c_rgEntities)
+			{
+				if (strlen(entity.pszName) == cchName && memcmp(entity.pszName, pchName, cchName) == 0)
+				{
+					pstr->push_back((WCHAR)entity.ch);
+					fFound = true;
+					break;
+				}
+			}
+
+			if (!fFound)
+				return false;
+		}
+
+		i = pchEnd - pch;
+		iRun = i + 1;
+	}
+
+	return AppendUtf8(&pch[iRun], cch - iRun, pstr);
+}
+
+static bool IsXmlSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/**
+ * Returns the index just past the first occurrence of pszFind at or after i,
+ * or cch if there isn't one.
+ */
+static size_t SkipPast(const char *pch, size_t cch, size_t i, const char *pszFind)
+{
+	size_t cchFind = strlen(pszFind);
+	for (; i + cchFind <= cch; i++)
+	{
+		if (memcmp(&pch[i], pszFind, cchFind) == 0)
+			return i + cchFind;
+	}
+	return cch;
+}
+
+/**
+ * Reads the attributes of the element whose name ends at i, up to the end
+ * of its start tag.
+ *
+ * @param pIdentifier  Receives the Identifier attribute, if there is one.
+ * @param pProgId      Receives the ProgId attribute, if there is one.
+ *
+ * @return Index just past the tag, or zero if the tag is malformed.
+ */
+static size_t ParseAttributes(const char *pch, size_t cch, size_t i, String *pIdentifier, String *pProgId)
+{
+	while (i < cch)
+	{
+		while (i < cch && IsXmlSpace(pch[i]))
+			i++;
+
+		if (i < cch && pch[i] == '>')
+			return i + 1;
+		if (i + 1 < cch && pch[i] == '/' && pch[i + 1] == '>')
+			return i + 2;
+
+		size_t iName = i;
+		while (i < cch && pch[i] != '=' && !IsXmlSpace(pch[i]) && pch[i] != '>' && pch[i] != '/')
+			i++;
+		size_t cchName = i - iName;
+
+		while (i < cch && IsXmlSpace(pch[i]))
+			i++;
+		if (!cchName || i >= cch || pch[i] != '=')
+			return 0;
+		i++;
+		while (i < cch && IsXmlSpace(pch[i]))
+			i++;
+		if (i >= cch || (pch[i] != '"' && pch[i] != '\''))
+			return 0;
+
+		char chQuote = pch[i++];
+		const char *pchValueEnd = (const char *)memchr(&pch[i], chQuote, cch - i);
+		if (!pchValueEnd)
+			return 0;
+		size_t cchValue = pchValueEnd - &pch[i];
+
+		String *pstrOut = nullptr;
+		if (cchName == 10 && memcmp(&pch[iName], "Identifier", 10) == 0)
+			pstrOut = pIdentifier;
+		else if (cchName == 6 && memcmp(&pch[iName], "ProgId", 6) == 0)
+			pstrOut = pProgId;
+
+		if (pstrOut && !DecodeAttribute(&pch[i], cchValue, pstrOut))
+			return 0;
+
+		i += cchValue + 1;
+	}
+	return 0;
+}
+
+bool AssocParseProfile(const char *pchXml, size_t cchXml, std::vector<ASSOC_PROFILE_ENTRY> *pEntries)
+{
+	pEntries->clear();
+
+	// Identifiers are case-insensitive, so duplicates are found by their
+	// lowercased form.
+	std::map<String, size_t> indexes;
+
+	size_t i = 0;
+	if (cchXml >= 3 && memcmp(pchXml, "\xEF\xBB\xBF", 3) == 0)
+		i = 3;
+
+	while (i < cchXml)
+	{
+		const char *pchOpen = (const char *)memchr(&pchXml[i], '<', cchXml - i);
+		if (!pchOpen)
+			break;
+		i = pchOpen - pchXml;
+
+		if (cchXml - i >= 4 && memcmp(&pchXml[i], "<!--", 4) == 0)
+		{
+			i = SkipPast(pchXml, cchXml, i + 4, "-->");
+			continue;
+		}
+
+		size_t iName = i + 1;
+		size_t iNameEnd = iName;
+		while (iNameEnd < cchXml && !IsXmlSpace(pchXml[iNameEnd]) && pchXml[iNameEnd] != '>' && pchXml[iNameEnd] != '/')
+			iNameEnd++;
+
+		if (iNameEnd - iName != 11 || memcmp(&pchXml[iName], "Association", 11) != 0)
+		{
+			// Declarations, end tags and other elements. None of them have a
+			// '>' inside the attributes in a profile, so this is enough to
+			// step over them.
+			i = SkipPast(pchXml, cchXml, iNameEnd, ">");
+			continue;
+		}
+
+		ASSOC_PROFILE_ENTRY entry;
+		i = ParseAttributes(pchXml, cchXml, iNameEnd, &entry.strIdentifier, &entry.strProgId);
+		if (!i)
+		{
+			pEntries->clear();
+			return false;
+		}
+
+		if (entry.strIdentifier.empty() || entry.strProgId.empty())
+			continue;
+
+		String strKey = entry.strIdentifier;
+		UserChoiceLowerCase(&strKey[0], strKey.size());
+
+		auto it = indexes.find(strKey);
+		if (it != indexes.end())
+		{
+			(*pEntries)[it->second] = std::move(entry);
+		}
+		else
+		{
+			indexes.emplace(std::move(strKey), pEntries->size());
+			pEntries->push_back(std::move(entry));
+		}
+	}
+
+	return !pEntries->empty();
+}
+#pragma endregion
+
+#pragma region Applying
+/**
+ * Hashes and writes a batch of associations for CUserChoiceWriteScheduler.
+ * The whole batch is one write as far as the scheduler is concerned, so it
+ * all lands in the minute it was hashed for.
+ */
+class CAssocProfileWriter : public IUserChoiceWriter
+{
+private:
+	IRegistryBackend             *_pRegistry;
+	CAssocRenameProbe            *_pRenameProbe;
+	LPCWSTR                       _lpszUserSid;
+	std::vector<USERCHOICE_PAIR>  _pairs;
+	std::vector<WCHAR>            _hashes;
+	std::vector<LSTATUS>          _results;
+
+public:
+	CAssocProfileWriter(
+		IRegistryBackend               *pRegistry,
+		CAssocRenameProbe              *pRenameProbe,
+		LPCWSTR                         lpszUserSid,
+		std::vector<USERCHOICE_PAIR>  &&pairs
+	)
+		: _pRegistry(pRegistry)
+		, _pRenameProbe(pRenameProbe)
+		, _lpszUserSid(lpszUserSid)
+		, _pairs(std::move(pairs))
+		, _hashes(_pairs.size() * (USERCHOICE_HASH_CCH + 1), 0)
+		, _results(_pairs.size(), ERROR_INVALID_PARAMETER)
+	{
+	}
+
+	LSTATUS GetResult(size_t i) const
+	{
+		return _results[i];
+	}
+
+	bool Prepare(ULONGLONG ullHashTime) override
+	{
+		CTraceActivity activity(TRACE_HASH);
+
+		CUserChoiceHashContext context;
+		if (!context.Init(_lpszUserSid, ullHashTime))
+		{
+			activity.SetResult(ERROR_INVALID_PARAMETER);
+			return false;
+		}
+
+		// Pairs which can't be hashed are left empty, and fail in Write.
+		activity.SetCount(UserChoiceHashBatch(&context, _pairs.data(), _pairs.size(), _hashes.data()));
+		return true;
+	}
+
+	bool Write() override
+	{
+		// Every key is locked with the same token, so it is only queried
+		// once for the whole batch.
+		CProtectedWriteBatch batch(_pRegistry);
+
+		bool fAnyWritten = false;
+		for (size_t i = 0; i < _pairs.size(); i++)
+		{
+			LPCWSTR lpszHash = &_hashes[i * (USERCHOICE_HASH_CCH + 1)];
+			if (!*lpszHash)
+			{
+				_results[i] = ERROR_INVALID_PARAMETER;
+				continue;
+			}
+
+			_results[i] = AssocWriteUserChoice(
+				_pRegistry,
+				_pairs[i].lpszExtension,
+				_pairs[i].lpszProgId,
+				lpszHash,
+				_pRenameProbe
+			);
+			if (_results[i] == ERROR_SUCCESS)
+				fAnyWritten = true;
+		}
+
+		// One association failing, e.g. because a driver protects it, isn't
+		// a reason to give up on the rest.
+		return fAnyWritten;
+	}
+};
+
+bool AssocApplyProfile(
+	IRegistryBackend          *pRegistry,
+	CUserChoiceWriteScheduler *pScheduler,
+	const ASSOC_PROFILE_ENTRY *pEntries,
+	size_t                     cEntries,
+	LPCWSTR                    lpszUserSid,
+	ASSOC_PROFILE_REPORT      *pReport,
+	CAssocRenameProbe         *pRenameProbe
+)
+{
+	ASSOC_PROFILE_REPORT report = {};
+	report.results.assign(cEntries, AssocProfileEntryResult::UNCHANGED);
+
+	// Work out what actually needs writing first, so that associations which
+	// are already set cost a read and nothing else.
+	std::vector<size_t> pending;
+	std::vector<USERCHOICE_PAIR> pairs;
+	CUserChoiceComparer comparer(pRegistry, lpszUserSid);
+	for (size_t i = 0; i < cEntries; i++)
+	{
+		if (!comparer.IsCurrent(pEntries[i].strIdentifier.c_str(), pEntries[i].strProgId.c_str()))
+		{
+			pending.push_back(i);
+			pairs.push_back({ pEntries[i].strIdentifier.c_str(), pEntries[i].strProgId.c_str() });
+		}
+	}
+
+	if (!pending.empty())
+	{
+		CAssocProfileWriter writer(pRegistry, pRenameProbe, lpszUserSid, std::move(pairs));
+		bool fWritten = pScheduler->Write(&writer, &report.write);
+
+		// If the scheduler gave up, anything that was written has a hash for
+		// the wrong minute, so none of it counts.
+		for (size_t i = 0; i < pending.size(); i++)
+		{
+			report.results[pending[i]] = (fWritten && writer.GetResult(i) == ERROR_SUCCESS)
+				? AssocProfileEntryResult::WRITTEN
+				: AssocProfileEntryResult::FAILED;
+		}
+	}
+
+	for (AssocProfileEntryResult result : report.results)
+	{
+		switch (result)
+		{
+			case AssocProfileEntryResult::UNCHANGED:
+				report.cUnchanged++;
+				break;
+			case AssocProfileEntryResult::WRITTEN:
+				report.cWritten++;
+				break;
+			case AssocProfileEntryResult::FAILED:
+				report.cFailed++;
+				break;
+		}
+	}
+
+	bool fSucceeded = report.cFailed == 0;
+	if (pReport)
+	{
+		*pReport = std::move(report);
+	}
+
+	return fSucceeded;
+}
+#pragma endregion
\ No newline at end of file
@@ -0,0 +1,114 @@
+#pragma once
+
+/**
+ * Default association profiles.
+ *
+ * A profile is the same XML that "Dism /Export-DefaultAppAssociations" writes
+ * and the "Set a default associations configuration file" policy reads:
+ *
+ *     <?xml version="1.0" encoding="UTF-8"?>
+ *     <DefaultAssociations>
+ *       <Association Identifier=".txt" ProgId="txtfile" ApplicationName="Notepad" />
+ *       <Association Identifier="http" ProgId="ChromeHTML" ApplicationName="Chrome" />
+ *     </DefaultAssociations>
+ *
+ * Identifiers that start with a dot are file extensions, and anything else is
+ * a URL protocol.
+ *
+ * Applying a profile compares it against the associations already set and
+ * only writes the ones that differ. Those are hashed together as one batch
+ * and written by a single scheduled writer, so a whole profile costs one SID
+ * lookup and, on Windows, one shell notification.
+ *
+ * @see ApplyUserChoiceProfile in assocuserchoice.cpp for the Win32 entry
+ *      point.
+ */
+
+#include "assocregistry.h" // for CAssocRenameProbe
+#include "registrybackend.h"
+#include "userchoicescheduler.h" // for CUserChoiceWriteScheduler
+
+#include <string>
+#include <vector>
+
+/**
+ * One association from a profile.
+ */
+struct ASSOC_PROFILE_ENTRY
+{
+	// File extension or protocol.
+	std::basic_string<WCHAR> strIdentifier;
+
+	std::basic_string<WCHAR> strProgId;
+};
+
+/**
+ * Parses a profile.
+ *
+ * Only Association elements with both an Identifier and a ProgId are taken;
+ * everything else in the document is skipped. If an identifier appears more
+ * than once, the last one wins.
+ *
+ * @param pchXml    The profile, as UTF-8.
+ * @param cchXml    Size of the profile in bytes.
+ * @param pEntries  Receives the associations, in the order they first appear.
+ *
+ * @return false if the profile isn't valid UTF-8 or has no associations.
+ */
+bool AssocParseProfile(const char *pchXml, size_t cchXml, std::vector<ASSOC_PROFILE_ENTRY> *pEntries);
+
+/**
+ * What applying a profile did for one association.
+ */
+enum class AssocProfileEntryResult
+{
+	// It was already set to the profile's ProgID with a valid hash.
+	UNCHANGED,
+
+	// It was written.
+	WRITTEN,
+
+	// It needed writing, but the write failed.
+	FAILED,
+};
+
+/**
+ * Outcome of AssocApplyProfile.
+ */
+struct ASSOC_PROFILE_REPORT
+{
+	// One result per profile entry, in the same order.
+	std::vector<AssocProfileEntryResult> results;
+
+	DWORD cUnchanged;
+	DWORD cWritten;
+	DWORD cFailed;
+
+	// How the batch write was scheduled. Only filled in if anything needed
+	// writing.
+	USERCHOICE_WRITE_REPORT write;
+};
+
+/**
+ * Sets every association in a profile which isn't already set.
+ *
+ * The associations which need writing are written as one batch, which the
+ * scheduler fits into a single minute.
+ *
+ * @param pEntries      The profile.
+ * @param cEntries      Number of associations in the profile.
+ * @param lpszUserSid   String SID of the user to set them for.
+ * @param pReport       Optional; receives what was done for each entry.
+ * @param pRenameProbe  Optional; see AssocWriteUserChoice.
+ *
+ * @return true if every association in the profile is now set.
+ */
+bool AssocApplyProfile(
+	IRegistryBackend          *pRegistry,
+	CUserChoiceWriteScheduler *pScheduler,
+	const ASSOC_PROFILE_ENTRY *pEntries,
+	size_t                     cEntries,
+	LPCWSTR                    lpszUserSid,
+	ASSOC_PROFILE_REPORT      *pReport = nullptr,
+	CAssocRenameProbe         *pRenameProbe = nullptr
+);
\ No newline at end of file
@@ -0,0 +1,455 @@
+#include "assocregistry.h"
+#include "tracespan.h"
+
+#include <string.h>
+
+#include <random>
+
+static const WCHAR c_szFileExtsPath[] =
+	WTEXT("SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Explorer\\FileExts\\");
+static const WCHAR c_szUrlAssociationsPath[] =
+	WTEXT("SOFTWARE\\Microsoft\\Windows\\Shell\\Associations\\UrlAssociations\\");
+
+static size_t StringLength(LPCWSTR psz)
+{
+	size_t cch = 0;
+	while (psz[cch])
+		cch++;
+	return cch;
+}
+
+size_t AssocFormatKeyPath(LPCWSTR lpszExtension, bool fIsUri, WCHAR *pszOut, size_t cchOut)
+{
+	LPCWSTR pszPrefix = fIsUri ? c_szUrlAssociationsPath : c_szFileExtsPath;
+	size_t cchPrefix = (fIsUri ? ARRAYSIZE(c_szUrlAssociationsPath) : ARRAYSIZE(c_szFileExtsPath)) - 1;
+	size_t cchExtension = StringLength(lpszExtension);
+
+	if (cchPrefix + cchExtension >= cchOut)
+	{
+		return 0;
+	}
+
+	for (size_t i = 0; i < cchPrefix; i++)
+		pszOut[i] = pszPrefix[i];
+	for (size_t i = 0; i < cchExtension; i++)
+		pszOut[cchPrefix + i] = lpszExtension[i];
+	pszOut[cchPrefix + cchExtension] = '\0';
+
+	return cchPrefix + cchExtension;
+}
+
+bool AssocIsUri(LPCWSTR lpszExtension)
+{
+	return lpszExtension[0] != '.';
+}
+
+void AssocMakeTempKeyName(WCHAR pszOut[ASSOC_TEMP_KEY_NAME_CCH + 1])
+{
+	static const char c_szHex[] = "0123456789ABCDEF";
+	static const char c_szTemplate[] = "{XXXXXXXX-XXXX-XXXX-XXXX-XXXXXXXXXXXX}";
+
+	// The name only has to be unlikely to collide with a real key, so this
+	// doesn't need to be a proper version 4 UUID.
+	static thread_local std::mt19937_64 s_random(std::random_device{}());
+	ULONGLONG rgullBits[2] = { s_random(), s_random() };
+
+	size_t iDigit = 0;
+	for (size_t i = 0; i < ASSOC_TEMP_KEY_NAME_CCH; i++)
+	{
+		if (c_szTemplate[i] == 'X')
+		{
+			pszOut[i] = c_szHex[(rgullBits[iDigit / 16] >> ((iDigit % 16) * 4)) & 0xF];
+			iDigit++;
+		}
+		else
+		{
+			pszOut[i] = c_szTemplate[i];
+		}
+	}
+	pszOut[ASSOC_TEMP_KEY_NAME_CCH] = '\0';
+}
+
+bool AssocOpenProgIdKey(IRegistryBackend *pRegistry, LPCWSTR lpszExtension, HKEY *phkOut)
+{
+	if (!lpszExtension || !*lpszExtension || !phkOut)
+	{
+		return false;
+	}
+	*phkOut = nullptr;
+
+	// Registry key names are limited to 255 characters, so a ProgID that
+	// doesn't fit can't be opened anyway.
+	WCHAR szProgId[256] = { 0 };
+	DWORD cbProgId = sizeof(szProgId);
+	DWORD dwType = REG_NONE;
+	if (pRegistry->GetValue(HKEY_CLASSES_ROOT, lpszExtension, nullptr, &dwType, szProgId, &cbProgId) != ERROR_SUCCESS ||
+		dwType != REG_SZ || !*szProgId)
+	{
+		return false;
+	}
+
+	return pRegistry->OpenKey(HKEY_CLASSES_ROOT, szProgId, phkOut) == ERROR_SUCCESS && *phkOut;
+}
+
+bool AssocExists(IRegistryBackend *pRegistry, LPCWSTR lpszExtension, bool fIsUri)
+{
+	if (!lpszExtension)
+		return false;
+
+	CRegistryKey hk(pRegistry);
+	if (AssocOpenProgIdKey(pRegistry, lpszExtension, hk.put()))
+		return true;
+
+	WCHAR szKeyPath[ASSOC_KEY_PATH_CCH_MAX];
+	if (!AssocFormatKeyPath(lpszExtension, fIsUri, szKeyPath, ARRAYSIZE(szKeyPath)))
+		return false;
+
+	return pRegistry->OpenKey(HKEY_CURRENT_USER, szKeyPath, hk.put()) == ERROR_SUCCESS && hk.get();
+}
+
+bool AssocProgIdExists(IRegistryBackend *pRegistry, LPCWSTR lpszProgId)
+{
+	CRegistryKey hk(pRegistry);
+	return pRegistry->OpenKey(HKEY_CLASSES_ROOT, lpszProgId, hk.put()) == ERROR_SUCCESS;
+}
+
+LSTATUS AssocReadUserChoice(
+	IRegistryBackend *pRegistry,
+	LPCWSTR           lpszExtension,
+	WCHAR            *pszProgIdOut,
+	DWORD             cchProgId,
+	WCHAR             pszHashOut[USERCHOICE_HASH_CCH + 1],
+	ULONGLONG        *pullLastWrite
+)
+{
+	WCHAR szKeyPath[ASSOC_KEY_PATH_CCH_MAX];
+	size_t cchKeyPath = AssocFormatKeyPath(lpszExtension, AssocIsUri(lpszExtension), szKeyPath, ARRAYSIZE(szKeyPath));
+	static const WCHAR c_szUserChoice[] = WTEXT("\\UserChoice");
+	if (!cchKeyPath || cchKeyPath + ARRAYSIZE(c_szUserChoice) > ARRAYSIZE(szKeyPath))
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+	memcpy(&szKeyPath[cchKeyPath], c_szUserChoice, sizeof(c_szUserChoice));
+
+	CRegistryKey hKeyUserChoice(pRegistry);
+	LSTATUS ls = pRegistry->OpenKey(HKEY_CURRENT_USER, szKeyPath, hKeyUserChoice.put());
+	if (ls != ERROR_SUCCESS)
+	{
+		return ls;
+	}
+
+	DWORD dwType = REG_NONE;
+	DWORD cbProgId = cchProgId * sizeof(WCHAR);
+	ls = pRegistry->GetValue(hKeyUserChoice.get(), nullptr, WTEXT("ProgId"), &dwType, pszProgIdOut, &cbProgId);
+	if (ls == ERROR_SUCCESS && dwType != REG_SZ)
+	{
+		ls = ERROR_INVALID_PARAMETER;
+	}
+	if (ls != ERROR_SUCCESS)
+	{
+		return ls;
+	}
+
+	DWORD cbHash = (USERCHOICE_HASH_CCH + 1) * sizeof(WCHAR);
+	ls = pRegistry->GetValue(hKeyUserChoice.get(), nullptr, WTEXT("Hash"), &dwType, pszHashOut, &cbHash);
+	if (ls == ERROR_SUCCESS && dwType != REG_SZ)
+	{
+		ls = ERROR_INVALID_PARAMETER;
+	}
+	if (ls != ERROR_SUCCESS)
+	{
+		return ls;
+	}
+
+	return pRegistry->QueryInfo(hKeyUserChoice.get(), nullptr, nullptr, pullLastWrite);
+}
+
+CAssocRenameProbe::CAssocRenameProbe()
+	: _mode(AssocRenameMode::UNKNOWN)
+{
+}
+
+bool CAssocRenameProbe::Record(AssocRenameMode mode)
+{
+	if (mode == AssocRenameMode::RENAME)
+	{
+		return _mode.exchange(AssocRenameMode::RENAME) != AssocRenameMode::RENAME;
+	}
+
+	AssocRenameMode modeExpected = AssocRenameMode::UNKNOWN;
+	return mode != AssocRenameMode::UNKNOWN && _mode.compare_exchange_strong(modeExpected, mode);
+}
+
+void CAssocRenameProbe::Reset()
+{
+	_mode.store(AssocRenameMode::UNKNOWN);
+}
+
+LPCWSTR AssocRenameModeName(AssocRenameMode mode)
+{
+	switch (mode)
+	{
+		case AssocRenameMode::DIRECT:
+			return WTEXT("direct");
+		case AssocRenameMode::RENAME:
+			return WTEXT("rename");
+		default:
+			return WTEXT("unknown");
+	}
+}
+
+LPCWSTR AssocUserChoiceStateName(AssocUserChoiceState state)
+{
+	switch (state)
+	{
+		case AssocUserChoiceState::OTHER_PROGID:
+			return WTEXT("otherProgId");
+		case AssocUserChoiceState::STALE_HASH:
+			return WTEXT("staleHash");
+		case AssocUserChoiceState::CURRENT:
+			return WTEXT("current");
+		default:
+			return WTEXT("notSet");
+	}
+}
+
+static LSTATUS WriteUserChoiceKey(
+	IRegistryBackend  *pRegistry,
+	LPCWSTR            lpszExtension,
+	LPCWSTR            lpszProgId,
+	LPCWSTR            lpszHash,
+	CAssocRenameProbe *pRenameProbe
+)
+{
+	WCHAR szKeyPath[ASSOC_KEY_PATH_CCH_MAX];
+	if (!AssocFormatKeyPath(lpszExtension, AssocIsUri(lpszExtension), szKeyPath, ARRAYSIZE(szKeyPath)))
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	CRegistryKey hKeyAssoc(pRegistry);
+
+	LSTATUS ls;
+	ls = pRegistry->CreateKey(HKEY_CURRENT_USER, szKeyPath, hKeyAssoc.put());
+
+	if (ls != ERROR_SUCCESS)
+	{
+		return ls;
+	}
+
+	// UserChoice keys are read-only (Deny Set Value) for the user, so the
+	// values are written as protected values. Both go in under a single
+	// unlock and lock, which also creates the key if it is missing.
+	REGISTRY_PROTECTED_VALUE rgValues[] = {
+		{ WTEXT("ProgId"), lpszProgId, (DWORD)((StringLength(lpszProgId) + 1) * sizeof(WCHAR)) },
+		{ WTEXT("Hash"),   lpszHash,   (DWORD)((StringLength(lpszHash) + 1) * sizeof(WCHAR)) },
+	};
+
+	// Unless a driver is already known to get in the way, try writing the
+	// key where it is. Being denied is what a driver looks like; anything
+	// else would fail just the same under another name.
+	if (pRenameProbe && pRenameProbe->GetMode() != AssocRenameMode::RENAME)
+	{
+		ls = pRegistry->SetProtectedValues(hKeyAssoc.get(), rgValues, ARRAYSIZE(rgValues));
+		if (ls != ERROR_ACCESS_DENIED)
+		{
+			if (ls == ERROR_SUCCESS)
+				pRenameProbe->Record(AssocRenameMode::DIRECT);
+
+			return ls;
+		}
+
+		pRenameProbe->Record(AssocRenameMode::RENAME);
+	}
+
+	// According to Mozilla, some keys may be protected from modification by
+	// certain kernel drivers; renaming the keys to a random UUID is sufficient
+	// to bypass this.
+	// https://github.com/mozilla/gecko-dev/blob/master/toolkit/mozapps/defaultagent/SetDefaultBrowser.cpp#L186-L191
+	WCHAR szTempName[ASSOC_TEMP_KEY_NAME_CCH + 1];
+	AssocMakeTempKeyName(szTempName);
+	ls = pRegistry->RenameKey(hKeyAssoc.get(), szTempName);
+
+	if (ls != ERROR_SUCCESS)
+	{
+		return ls;
+	}
+
+	ls = pRegistry->SetProtectedValues(hKeyAssoc.get(), rgValues, ARRAYSIZE(rgValues));
+
+	// Always try to give the key its name back, even if the values couldn't
+	// be written.
+	LSTATUS lsRename = pRegistry->RenameKey(hKeyAssoc.get(), lpszExtension);
+
+	return (ls != ERROR_SUCCESS) ? ls : lsRename;
+}
+
+LSTATUS AssocWriteUserChoice(
+	IRegistryBackend  *pRegistry,
+	LPCWSTR            lpszExtension,
+	LPCWSTR            lpszProgId,
+	LPCWSTR            lpszHash,
+	CAssocRenameProbe *pRenameProbe
+)
+{
+	CTraceActivity activity(TRACE_WRITE_USERCHOICE, lpszExtension);
+	LSTATUS ls = WriteUserChoiceKey(pRegistry, lpszExtension, lpszProgId, lpszHash, pRenameProbe);
+	activity.SetResult(ls);
+	return ls;
+}
+
+CUserChoiceComparer::CUserChoiceComparer(IRegistryBackend *pRegistry, LPCWSTR lpszUserSid)
+	: _pRegistry(pRegistry)
+	, _lpszUserSid(lpszUserSid)
+	, _ullContextMinute(0)
+	, _fContextValid(false)
+{
+}
+
+bool CUserChoiceComparer::IsCurrent(LPCWSTR lpszExtension, LPCWSTR lpszProgId)
+{
+	return Check(lpszExtension, lpszProgId) == AssocUserChoiceState::CURRENT;
+}
+
+AssocUserChoiceState CUserChoiceComparer::Check(
+	LPCWSTR lpszExtension,
+	LPCWSTR lpszProgId,
+	WCHAR  *pszProgIdOut,
+	DWORD   cchProgIdOut
+)
+{
+	if (pszProgIdOut && cchProgIdOut)
+		pszProgIdOut[0] = 0;
+
+	// Registry key names are at most 255 characters, so a ProgId which
+	// doesn't fit here couldn't be the one wanted anyway.
+	WCHAR szProgId[256];
+	WCHAR szHash[USERCHOICE_HASH_CCH + 1];
+	ULONGLONG ullLastWrite = 0;
+	if (AssocReadUserChoice(
+		_pRegistry,
+		lpszExtension,
+		szProgId,
+		ARRAYSIZE(szProgId),
+		szHash,
+		&ullLastWrite
+	) != ERROR_SUCCESS)
+	{
+		return AssocUserChoiceState::NOT_SET;
+	}
+
+	size_t cchProgId = StringLength(szProgId);
+	if (pszProgIdOut && cchProgIdOut)
+	{
+		size_t cchCopy = (cchProgId < cchProgIdOut) ? cchProgId : cchProgIdOut - 1;
+		memcpy(pszProgIdOut, szProgId, cchCopy * sizeof(WCHAR));
+		pszProgIdOut[cchCopy] = 0;
+	}
+
+	// ProgIDs are compared the same way the hash sees them, so the hash
+	// can be checked against the ProgID as it was read.
+	if (lpszProgId)
+	{
+		if (cchProgId != StringLength(lpszProgId))
+			return AssocUserChoiceState::OTHER_PROGID;
+
+		WCHAR szWanted[ARRAYSIZE(szProgId)];
+		WCHAR szLower[ARRAYSIZE(szProgId)];
+		memcpy(szWanted, lpszProgId, cchProgId * sizeof(WCHAR));
+		memcpy(szLower, szProgId, cchProgId * sizeof(WCHAR));
+		UserChoiceLowerCase(szWanted, cchProgId);
+		UserChoiceLowerCase(szLower, cchProgId);
+		if (memcmp(szWanted, szLower, cchProgId * sizeof(WCHAR)) != 0)
+			return AssocUserChoiceState::OTHER_PROGID;
+	}
+
+	// A stale hash means Windows has reset, or is about to reset, the
+	// association, so it has to be written again.
+	ULONGLONG ullMinute = ullLastWrite / USERCHOICE_FILETIME_PER_MINUTE;
+	if (!_fContextValid || ullMinute != _ullContextMinute)
+	{
+		_fContextValid = _context.Init(_lpszUserSid, ullLastWrite);
+		_ullContextMinute = ullMinute;
+		if (!_fContextValid)
+			return AssocUserChoiceState::STALE_HASH;
+	}
+
+	WCHAR szExpected[USERCHOICE_HASH_CCH + 1];
+	if (!_context.Hash(lpszExtension, szProgId, szExpected) ||
+		memcmp(szExpected, szHash, sizeof(szExpected)) != 0)
+	{
+		return AssocUserChoiceState::STALE_HASH;
+	}
+
+	return AssocUserChoiceState::CURRENT;
+}
+
+CUserChoiceRegistryWriter::CUserChoiceRegistryWriter(
+	IRegistryBackend  *pRegistry,
+	LPCWSTR            lpszExtension,
+	LPCWSTR            lpszUserSid,
+	LPCWSTR            lpszProgId,
+	CAssocRenameProbe *pRenameProbe
+)
+	: _pRegistry(pRegistry)
+	, _pRenameProbe(pRenameProbe)
+	, _lpszExtension(lpszExtension)
+	, _lpszUserSid(lpszUserSid)
+	, _lpszProgId(lpszProgId)
+	, _szHash{ 0 }
+{
+}
+
+bool CUserChoiceRegistryWriter::Prepare(ULONGLONG ullHashTime)
+{
+	CTraceActivity activity(TRACE_HASH, _lpszExtension);
+	activity.SetCount(1);
+
+	CUserChoiceHashContext context;
+	if (!context.Init(_lpszUserSid, ullHashTime) ||
+		!context.Hash(_lpszExtension, _lpszProgId, _szHash))
+	{
+		activity.SetResult(ERROR_INVALID_PARAMETER);
+		return false;
+	}
+
+	return true;
+}
+
+bool CUserChoiceRegistryWriter::Write()
+{
+	return AssocWriteUserChoice(_pRegistry, _lpszExtension, _lpszProgId, _szHash, _pRenameProbe) == ERROR_SUCCESS;
+}
+
+bool AssocSetUserChoice(
+	IRegistryBackend          *pRegistry,
+	CUserChoiceWriteScheduler *pScheduler,
+	LPCWSTR                    lpszExtension,
+	LPCWSTR                    lpszProgId,
+	LPCWSTR                    lpszUserSid,
+	USERCHOICE_WRITE_REPORT   *pReport,
+	CAssocRenameProbe         *pRenameProbe
+)
+{
+	// Confirming the association which is already set is the common case.
+	// That costs a read, rather than the renames and the lock and unlock of
+	// a rewrite.
+	CUserChoiceComparer comparer(pRegistry, lpszUserSid);
+	if (comparer.IsCurrent(lpszExtension, lpszProgId))
+	{
+		if (pReport)
+		{
+			*pReport = {};
+			pReport->decision = UserChoiceWriteDecision::ALREADY_CURRENT;
+		}
+
+		return true;
+	}
+
+	// The hash changes at the end of each minute, so the write has to finish
+	// in the minute that the hash was generated for. The scheduler decides
+	// whether there is enough time left to write now, or whether to hash for
+	// the next minute and wait for it, and redoes writes which run over.
+	CUserChoiceRegistryWriter writer(pRegistry, lpszExtension, lpszUserSid, lpszProgId, pRenameProbe);
+	return pScheduler->Write(&writer, pReport);
+}
\ No newline at end of file
@@ -0,0 +1,286 @@
+#pragma once
+
+/**
+ * Association reads and writes, over an IRegistryBackend.
+ *
+ * This is the registry side of setting a UserChoice association: where the
+ * keys live, how the protected values are written, and how an existing
+ * association is looked up. It has no Windows dependencies of its own, so
+ * with CMemoryRegistry the whole flow of SetUserChoiceAndHash can run and be
+ * measured anywhere.
+ *
+ * @see assocuserchoice.cpp and util.cpp for the Win32 entry points.
+ */
+
+#include "registrybackend.h"
+#include "userchoicehash.h" // for USERCHOICE_HASH_CCH
+#include "userchoicescheduler.h" // for IUserChoiceWriter
+
+#include <atomic>
+
+// Upper bound on an association key path, including the terminator. The
+// longest prefix is 58 characters and key names are at most 255.
+#define ASSOC_KEY_PATH_CCH_MAX 320
+
+// Length of a temporary key name, "{XXXXXXXX-XXXX-XXXX-XXXX-XXXXXXXXXXXX}",
+// excluding the terminator.
+#define ASSOC_TEMP_KEY_NAME_CCH 38
+
+/**
+ * Formats the HKCU-relative path of the association key for a file
+ * extension or protocol.
+ *
+ * @return Length of the path excluding the terminator, or zero if it doesn't
+ *         fit in cchOut.
+ */
+size_t AssocFormatKeyPath(LPCWSTR lpszExtension, bool fIsUri, WCHAR *pszOut, size_t cchOut);
+
+/**
+ * Checks whether an association identifier is a URL protocol rather than a
+ * file extension, which always starts with a dot.
+ */
+bool AssocIsUri(LPCWSTR lpszExtension);
+
+/**
+ * Generates a random GUID-formatted key name to rename an association key to
+ * while it is written.
+ */
+void AssocMakeTempKeyName(WCHAR pszOut[ASSOC_TEMP_KEY_NAME_CCH + 1]);
+
+/**
+ * Opens the ProgID key in HKCR that a file extension is registered to.
+ *
+ * @param phkOut  Receives the ProgID key, or null on failure. The caller
+ *                closes it through the same backend.
+ *
+ * @return true if the ProgID key was opened.
+ */
+bool AssocOpenProgIdKey(IRegistryBackend *pRegistry, LPCWSTR lpszExtension, HKEY *phkOut);
+
+/**
+ * Checks if an association exists for a file extension or URL protocol,
+ * either as a registered ProgID or as a per-user association key.
+ */
+bool AssocExists(IRegistryBackend *pRegistry, LPCWSTR lpszExtension, bool fIsUri);
+
+/**
+ * Checks that the given ProgID exists in HKCR.
+ */
+bool AssocProgIdExists(IRegistryBackend *pRegistry, LPCWSTR lpszProgId);
+
+/**
+ * Reads the UserChoice ProgId and Hash of an extension or protocol.
+ *
+ * @param pszProgIdOut   Receives the ProgId, at most cchProgId characters
+ *                       including the terminator.
+ * @param pszHashOut     Receives the Hash.
+ * @param pullLastWrite  Receives when the UserChoice key was last written,
+ *                       which is the time the hash has to match.
+ *
+ * @return ERROR_SUCCESS, or the error from the first read which failed.
+ */
+LSTATUS AssocReadUserChoice(
+	IRegistryBackend *pRegistry,
+	LPCWSTR           lpszExtension,
+	WCHAR            *pszProgIdOut,
+	DWORD             cchProgId,
+	WCHAR             pszHashOut[USERCHOICE_HASH_CCH + 1],
+	ULONGLONG        *pullLastWrite
+);
+
+/**
+ * How association keys are written.
+ */
+enum class AssocRenameMode
+{
+	// Nothing has been written yet, so it isn't known whether anything
+	// blocks writes.
+	UNKNOWN,
+
+	// Writes under the key's own name work, so it is written in place.
+	DIRECT,
+
+	// A driver blocked a write, so each key is renamed to a random name
+	// while it is written.
+	RENAME,
+};
+
+/**
+ * Remembers whether association keys have to be renamed to be written.
+ *
+ * According to Mozilla, some kernel drivers protect association keys by
+ * name, which renaming the key gets around. Most machines don't have one,
+ * and there the two renames are wasted, so the first write is tried in
+ * place and the outcome kept for the rest of the session. A write which is
+ * denied in place switches to renaming for good.
+ */
+class CAssocRenameProbe
+{
+private:
+	std::atomic<AssocRenameMode> _mode;
+
+public:
+	CAssocRenameProbe();
+
+	CAssocRenameProbe(const CAssocRenameProbe &) = delete;
+	CAssocRenameProbe &operator=(const CAssocRenameProbe &) = delete;
+
+	AssocRenameMode GetMode() const
+	{
+		return _mode.load();
+	}
+
+	/**
+	 * Records the outcome of a write. DIRECT is only taken while the mode
+	 * is UNKNOWN, so that it never undoes RENAME.
+	 *
+	 * @return true if the mode changed.
+	 */
+	bool Record(AssocRenameMode mode);
+
+	// Forgets the decision, so that the next write probes again.
+	void Reset();
+};
+
+/**
+ * Returns a short name for a rename mode, for diagnostics.
+ */
+LPCWSTR AssocRenameModeName(AssocRenameMode mode);
+
+/**
+ * Writes the UserChoice ProgId and Hash for an extension or protocol.
+ * Protocols are written under UrlAssociations, and extensions under
+ * FileExts.
+ *
+ * @param lpszExtension  File extension or protocol being registered.
+ * @param lpszProgId     ProgID to associate with the extension.
+ * @param lpszHash       The generated UserChoice hash.
+ * @param pRenameProbe   Optional; decides whether the key is renamed while
+ *                       it is written. Without one, it always is.
+ */
+LSTATUS AssocWriteUserChoice(
+	IRegistryBackend  *pRegistry,
+	LPCWSTR            lpszExtension,
+	LPCWSTR            lpszProgId,
+	LPCWSTR            lpszHash,
+	CAssocRenameProbe *pRenameProbe = nullptr
+);
+
+/**
+ * Where an association stands, for CUserChoiceComparer::Check.
+ */
+enum class AssocUserChoiceState
+{
+	// There is no UserChoice key, or it couldn't be read.
+	NOT_SET,
+
+	// It is set to another ProgID than the one asked for.
+	OTHER_PROGID,
+
+	// Its hash doesn't match, so Windows will reset it.
+	STALE_HASH,
+
+	// It is set, with a hash which Windows will accept.
+	CURRENT,
+};
+
+/**
+ * Returns a short name for a state, for diagnostics and the command line.
+ */
+LPCWSTR AssocUserChoiceStateName(AssocUserChoiceState state);
+
+/**
+ * Checks whether associations are already set, with a hash which Windows
+ * will accept.
+ */
+class CUserChoiceComparer
+{
+private:
+	IRegistryBackend       *_pRegistry;
+	LPCWSTR                 _lpszUserSid;
+
+	// Most associations were written in the same few minutes, so the hash
+	// context is only prepared again when the minute changes.
+	CUserChoiceHashContext  _context;
+	ULONGLONG               _ullContextMinute;
+	bool                    _fContextValid;
+
+public:
+	CUserChoiceComparer(IRegistryBackend *pRegistry, LPCWSTR lpszUserSid);
+
+	/**
+	 * Reads the UserChoice key of an extension or protocol, and checks that
+	 * it has the given ProgID and that its hash matches the time the key
+	 * was last written, like CheckUserChoiceHash does.
+	 *
+	 * @return true if writing the association again would change nothing.
+	 */
+	bool IsCurrent(LPCWSTR lpszExtension, LPCWSTR lpszProgId);
+
+	/**
+	 * Reads the UserChoice key of an extension or protocol, and says where
+	 * it stands.
+	 *
+	 * @param lpszProgId    The ProgID it should have, or null for whichever
+	 *                      it has.
+	 * @param pszProgIdOut  Optional; receives the ProgID it has, cut short
+	 *                      to cchProgIdOut characters including the
+	 *                      terminator. Empty if it isn't set.
+	 */
+	AssocUserChoiceState Check(
+		LPCWSTR lpszExtension,
+		LPCWSTR lpszProgId,
+		WCHAR  *pszProgIdOut = nullptr,
+		DWORD   cchProgIdOut = 0
+	);
+};
+
+/**
+ * Hashes and writes one association for CUserChoiceWriteScheduler.
+ */
+class CUserChoiceRegistryWriter : public IUserChoiceWriter
+{
+private:
+	IRegistryBackend  *_pRegistry;
+	CAssocRenameProbe *_pRenameProbe;
+	LPCWSTR            _lpszExtension;
+	LPCWSTR            _lpszUserSid;
+	LPCWSTR            _lpszProgId;
+	WCHAR              _szHash[USERCHOICE_HASH_CCH + 1];
+
+public:
+	CUserChoiceRegistryWriter(
+		IRegistryBackend  *pRegistry,
+		LPCWSTR            lpszExtension,
+		LPCWSTR            lpszUserSid,
+		LPCWSTR            lpszProgId,
+		CAssocRenameProbe *pRenameProbe = nullptr
+	);
+
+	bool Prepare(ULONGLONG ullHashTime) override;
+	bool Write() override;
+};
+
+/**
+ * Sets the UserChoice association to a ProgID, scheduling the write so that
+ * it lands in the minute its hash was generated for.
+ *
+ * If the association is already set with a valid hash, nothing is written
+ * and the report's decision is ALREADY_CURRENT.
+ *
+ * This is SetUserChoiceAndHash without the OS version check, SID lookup and
+ * shell notification.
+ *
+ * @param pRenameProbe  Optional; see AssocWriteUserChoice.
+ *
+ * @return true if the association was written with a valid hash.
+ */
+bool AssocSetUserChoice(
+	IRegistryBackend          *pRegistry,
+	CUserChoiceWriteScheduler *pScheduler,
+	LPCWSTR                    lpszExtension,
+	LPCWSTR                    lpszProgId,
+	LPCWSTR                    lpszUserSid,
+	USERCHOICE_WRITE_REPORT   *pReport = nullptr,
+	CAssocRenameProbe         *pRenameProbe = nullptr
+);
\ No newline at end of file
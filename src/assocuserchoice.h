@@ -3,6 +3,11 @@
 #include <memory>
 #include <windows.h>
 
+#include "assocprofile.h" // for ASSOC_PROFILE_ENTRY
+#include "assocregistry.h" // for AssocRenameMode
+#include "userchoicehash.h" // for USERCHOICE_PAIR
+#include "userchoicescheduler.h" // for USERCHOICE_WRITE_REPORT
+
 /**
  * Result from SetUserChoiceAndHash. 
  */
@@ -24,14 +29,40 @@ enum class SetUserChoiceAndHashResult
  * @param lpszExtension  The extension or protocol for which to make the
  *                       association.
  * @param lpszProgId     The ProgID with which to be associated.
+ * @param pReport        Optional; receives when and how many times the
+ *                       association was written.
  */
-SetUserChoiceAndHashResult SetUserChoiceAndHash(LPCWSTR lpszExtension, LPCWSTR lpszProgId);
+SetUserChoiceAndHashResult SetUserChoiceAndHash(
+	LPCWSTR lpszExtension,
+	LPCWSTR lpszProgId,
+	USERCHOICE_WRITE_REPORT *pReport = nullptr
+);
+
+/**
+ * Sets every association in a default association profile for the current
+ * user, skipping the ones which are already set.
+ *
+ * The shell is only notified once, after the whole profile, and only if
+ * anything changed.
+ *
+ * @param pEntries  The profile, e.g. from AssocParseProfile.
+ * @param cEntries  Number of associations in the profile.
+ * @param pReport   Optional; receives what was done for each association.
+ *
+ * @return OK if every association in the profile is now set.
+ */
+SetUserChoiceAndHashResult ApplyUserChoiceProfile(
+	const ASSOC_PROFILE_ENTRY *pEntries,
+	size_t cEntries,
+	ASSOC_PROFILE_REPORT *pReport = nullptr
+);
 
 /**
  * Get the current user's SID.
  *
- * @return Pointer to string SID for the user of the current process,
- *         nullptr on failure.
+ * @return Pointer to string SID for the user of the calling thread's
+ *         impersonation token, or else of the current process; nullptr on
+ *         failure.
  */
 std::unique_ptr<WCHAR[]> GetCurrentUserStringSid();
 
@@ -64,6 +95,31 @@ std::unique_ptr<WCHAR[]> GenerateUserChoiceHash(
 	PSYSTEMTIME pTimestamp
 );
 
+/**
+ * Generate UserChoice hashes for many associations of one user at once.
+ *
+ * The SID and timestamp are only formatted once for the whole batch, and
+ * large batches are spread across worker threads.
+ *
+ * @param pPairs        Extension or protocol and ProgID pairs to hash.
+ * @param cPairs        Number of pairs.
+ * @param lpszUserSid   String SID of the current user
+ * @param pTimestamp    Approximate write time of the UserChoice keys
+ *                      (within the same minute)
+ * @param pszHashesOut  Receives cPairs null-terminated hashes back to back,
+ *                      each taking USERCHOICE_HASH_CCH + 1 characters.
+ *                      Entries which couldn't be generated are empty.
+ *
+ * @return The number of hashes generated, which is cPairs on full success.
+ */
+size_t GenerateUserChoiceHashBatch(
+	const USERCHOICE_PAIR *pPairs,
+	size_t                 cPairs,
+	LPCWSTR                lpszUserSid,
+	PSYSTEMTIME            pTimestamp,
+	WCHAR                 *pszHashesOut
+);
+
 /**
  * Check that the given ProgID exists in HKCR.
  *
@@ -72,14 +128,11 @@ std::unique_ptr<WCHAR[]> GenerateUserChoiceHash(
 bool CheckProgIdExists(LPCWSTR lpszProgId);
 
 /**
- * Update the User Choice association in the registry with new data.
+ * Get whether association keys are being renamed while they're written.
  *
- * @param lpszExtension  File extension or protocol being registered.
- * @param lpszProgId     ProgID to associate with the extension.
- * @param pszHash        The generated UserChoice hash.
+ * The first write finds out whether a driver blocks writing them in place,
+ * and the rest of the session goes by that.
+ *
+ * @return UNKNOWN until an association has been written.
  */
-static HRESULT WriteToRegistry(
-	LPCWSTR lpszExtension,
-	LPCWSTR lpszProgId,
-	std::unique_ptr<WCHAR[]> &pszHash
-);
\ No newline at end of file
+AssocRenameMode GetUserChoiceRenameMode();
\ No newline at end of file
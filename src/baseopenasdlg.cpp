@@ -4,6 +4,10 @@
 
 #include "iassochandler_internal.h"
 #include "SetDefaultAssociation.h"
+#include "assocnotify.h" // for GetShellAssocChangeNotifier
+#include "assoclookup.h" // for CAssocLookupCache
+#include "assochandlercache.h" // for CAssocHandlerCache
+#include "userchoicescheduler.h" // for GetSystemUserChoiceClock
 
 #include <memory>
 
@@ -144,28 +148,34 @@ INT_PTR CALLBACK CBaseOpenAsDlg::v_DlgProc(HWND hWnd, UINT uMsg, WPARAM wParam,
 				);
 			}
 
+			// The same icon GetAppIconIndex falls back to.
+			m_iGenericIcon = GetAppIconIndex(nullptr, -1);
+
 			_InitProgList();
-			_GetHandlers();
-			if (m_fRecommended)
-				_SetupCategories();
+			_StartIconResolver();
 
-			for (size_t i = 0; i < m_handlers.size(); i++)
-			{
-				// I haven't seen it experienced on any other system,
-				// but I'm getting handlers that are completely blank.
-				// The display name is simply not received rather than
-				// it being an empty string, so it should be safe to dismiss
-				// these handlers. They don't do anything anyway.
-				//     - aubymori
-				wil::com_ptr<IAssocHandler> &pHandler = m_handlers.at(i);
-				wil::unique_cotaskmem_string pszDisplayName;
-				pHandler->GetUIName(&pszDisplayName);
-				if (pszDisplayName.get())
-					_AddItem(pHandler, i, false);
-			}
+			// What the last enumeration found is shown first, if it is
+			// still current, and the list fills in, or is corrected, as
+			// the handlers are enumerated. Either way the dialog can be
+			// shown straight away.
+			_LoadCachedHandlers();
+			_StartHandlers();
 
 			return TRUE;
 		}
+		case WM_OWX_HANDLERSREADY:
+			_AddStreamedHandlers();
+			return TRUE;
+		case WM_OWX_ICONSREADY:
+			_SetResolvedIcons();
+			return TRUE;
+		case WM_PAINT:
+			// Only the first one is traced; the dialog still paints itself.
+			m_firstPaint.Stop();
+			break;
+		case WM_DESTROY:
+			_StopHandlers();
+			break;
 		case WM_CLOSE:
 			EndDialog(hWnd, IDCANCEL);
 			return TRUE;
@@ -190,10 +200,7 @@ INT_PTR CALLBACK CBaseOpenAsDlg::v_DlgProc(HWND hWnd, UINT uMsg, WPARAM wParam,
 			{
 				case TVN_SELCHANGED:
 				case LVN_ITEMCHANGED:
-					EnableWindow(
-						GetDlgItem(hWnd, IDOK),
-						_GetSelectedItem() != nullptr
-					);
+					_UpdateOkButton();
 					break;
 				case NM_CLICK:
 					if (nmh->idFrom == IDD_OPENWITH_LINK)
@@ -240,11 +247,27 @@ void CBaseOpenAsDlg::_SelectOrAddItem(LPCWSTR lpszPath)
 		{
 			wil::com_ptr<IAssocHandler> pHandler = nullptr;
 			SHCreateAssocHandler(AHTYPE_USER_APPLICATION, m_szExtOrProtocol, lpszPath, &pHandler);
-			if (pHandler)
+
+			ASSOC_HANDLER_SNAPSHOT snapshot = {};
+			if (pHandler && S_OK == AssocSnapshotHandler(pHandler.get(), &snapshot))
 			{
-				m_handlers.push_back(pHandler);
-				_AddItem(pHandler, m_handlers.size() - 1, true);
-				_SelectItemByIndex(m_handlers.size() - 1);
+				// The handler may name the program differently from how it
+				// was browsed to, and turn out to be listed already.
+				bool fAdded = false;
+				size_t i = m_handlerTable.Add(snapshot, &fAdded);
+				if (fAdded)
+				{
+					m_handlers.push_back(pHandler);
+					_AddItem(i, true);
+					_QueueIcon(i);
+				}
+				else if (!m_handlers.at(i))
+				{
+					// Listed from the cache, but not enumerated yet.
+					_AttachCachedHandler(i, pHandler, snapshot);
+				}
+				_SelectItemByIndex(i);
+				_UpdateOkButton();
 			}
 		}
 	}
@@ -252,49 +275,291 @@ void CBaseOpenAsDlg::_SelectOrAddItem(LPCWSTR lpszPath)
 
 int CBaseOpenAsDlg::_FindItemIndex(LPCWSTR lpszPath)
 {
-	wil::com_ptr<IAssocHandler> pResult = nullptr;
+	return m_handlerTable.FindName(lpszPath);
+}
+
+void CBaseOpenAsDlg::_LoadCachedHandlers()
+{
+	CAssocHandlerCache *pCache = GetAssocHandlerCache();
+	m_ullCacheStamp = pCache->GetStamp(m_szExtOrProtocol, m_fUri);
+	if (!pCache->Load(m_szExtOrProtocol, m_fUri, m_ullCacheStamp, &m_handlerTable) || !m_handlerTable.GetCount())
+	{
+		m_handlerTable.Clear();
+		return;
+	}
+
+	// The handlers themselves come from the enumeration.
+	m_fFromCache = true;
+	m_handlers.resize(m_handlerTable.GetCount());
+
+	// The cache was written in the order the handlers were enumerated in,
+	// so it has the recommended ones first as well.
+	m_fAnyStreamed = true;
+	if (m_handlerTable.IsRecommended(0))
+	{
+		m_fRecommended = true;
+		_SetupCategories();
+	}
+
+	for (size_t i = 0; i < m_handlerTable.GetCount(); i++)
+	{
+		_AddItem(i, false);
+		_QueueIcon(i);
+	}
+
+	_UpdateOkButton();
+}
+
+void CBaseOpenAsDlg::_StartIconResolver()
+{
+	m_pIconResolver = std::make_unique<CAssocIconResolver>(
+		GetShellAssocIconSource(), this, GetSystemUserChoiceClock()
+	);
+	m_pIconResolver->Start();
+}
+
+void CBaseOpenAsDlg::_StartHandlers()
+{
+	LOG_IF_FAILED(CoIncrementMTAUsage(m_mtaUsage.put()));
+
+	// The source is only used, and released, on the enumeration thread.
+	std::unique_ptr<IAssocHandlerSource> pSource = CreateShellAssocHandlerSource(m_szExtOrProtocol, m_fUri);
+	m_pHandlerStreamer = std::make_unique<CAssocHandlerStreamer>(pSource.get(), this);
+
+	m_enumThread = std::thread([this](std::unique_ptr<IAssocHandlerSource> pSource)
+	{
+		HRESULT hr = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+		m_pHandlerStreamer->Run();
+		pSource.reset();
+		if (SUCCEEDED(hr))
+			CoUninitialize();
+	}, std::move(pSource));
+}
+
+void CBaseOpenAsDlg::OnHandlersReady()
+{
+	PostMessageW(m_hWnd, WM_OWX_HANDLERSREADY, 0, 0);
+}
+
+void CBaseOpenAsDlg::_AddStreamedHandlers()
+{
+	if (!m_pHandlerStreamer)
+		return;
+
+	while (std::unique_ptr<ASSOC_HANDLER_BATCH> pBatch = m_pHandlerStreamer->TakeBatch())
+	{
+		for (ASSOC_HANDLER_SNAPSHOT &snapshot : pBatch->snapshots)
+		{
+			// Recommended handlers always come first, so the first handler
+			// says whether there are any.
+			if (!m_fAnyStreamed)
+			{
+				m_fAnyStreamed = true;
+				if (snapshot.fRecommended)
+				{
+					m_fRecommended = true;
+					_SetupCategories();
+				}
+			}
+
+			// Handlers which resolve to a program that is already listed,
+			// such as one added by browsing while the rest were enumerated,
+			// are dropped, unless the program was listed from the cache.
+			int iExisting = m_handlerTable.FindName(snapshot.strName.c_str());
+			if (iExisting != -1 && m_handlers.at(iExisting))
+				continue;
+
+			wil::com_ptr<IAssocHandler> pHandler;
+			if (FAILED(AssocUnmarshalHandler(&snapshot, &pHandler)))
+				continue;
+
+			if (iExisting != -1)
+			{
+				_AttachCachedHandler(iExisting, pHandler, snapshot);
+				continue;
+			}
+
+			// A new recommended handler belongs above the ones from the
+			// cache, so it is moved there once the enumeration is done.
+			if (m_fFromCache)
+			{
+				m_fCacheChanged = true;
+				if (snapshot.fRecommended)
+					m_fCacheRegroup = true;
+			}
+
+			m_handlers.push_back(pHandler);
+			m_handlerTable.Add(snapshot);
+			_AddItem(m_handlers.size() - 1, false);
+			_QueueIcon(m_handlers.size() - 1);
+		}
+
+		if (pBatch->fComplete)
+			_OnHandlersComplete();
+	}
+
+	_UpdateOkButton();
+}
+
+void CBaseOpenAsDlg::_AttachCachedHandler(int index, wil::com_ptr<IAssocHandler> pHandler, const ASSOC_HANDLER_SNAPSHOT &snapshot)
+{
+	bool fIconChanged =
+		m_handlerTable.GetIconIndex(index) != snapshot.iIcon ||
+		snapshot.strIconPath != m_handlerTable.GetIconPath(index);
+
+	// A handler which moved to the other group is put there once the
+	// enumeration is done.
+	if (m_handlerTable.IsRecommended(index) != snapshot.fRecommended)
+		m_fCacheRegroup = true;
+
+	if (fIconChanged ||
+		m_handlerTable.IsRecommended(index) != snapshot.fRecommended ||
+		m_handlerTable.GetType(index) != snapshot.dwType ||
+		snapshot.strUIName != m_handlerTable.GetUIName(index) ||
+		snapshot.strProgId != m_handlerTable.GetProgId(index))
+	{
+		m_fCacheChanged = true;
+	}
+
+	m_handlerTable.Update(index, snapshot);
+	m_handlers.at(index) = pHandler;
+	_UpdateItem(index);
+
+	if (fIconChanged)
+		_QueueIcon(index);
+}
+
+void CBaseOpenAsDlg::_OnHandlersComplete()
+{
+	if (m_fFromCache)
+	{
+		// Anything from the cache which the enumeration didn't find has
+		// gone.
+		bool fRebuild = m_fCacheRegroup;
+		for (const wil::com_ptr<IAssocHandler> &pHandler : m_handlers)
+		{
+			if (!pHandler)
+				fRebuild = true;
+		}
+
+		if (fRebuild)
+		{
+			m_fCacheChanged = true;
+			_RebuildItems();
+		}
+	}
+
+	if (!m_fFromCache || m_fCacheChanged)
+		GetAssocHandlerCache()->Save(m_szExtOrProtocol, m_fUri, m_ullCacheStamp, m_handlerTable);
+}
+
+void CBaseOpenAsDlg::_RebuildItems()
+{
+	// Icons on their way are for the old indices.
+	if (m_pIconResolver)
+		m_dwIconGeneration = m_pIconResolver->NextGeneration();
+
+	wil::com_ptr<IAssocHandler> pSelected = _GetSelectedItem();
 
+	std::vector<wil::com_ptr<IAssocHandler>> handlers;
+	std::vector<ASSOC_HANDLER_SNAPSHOT> snapshots;
 	for (size_t i = 0; i < m_handlers.size(); i++)
 	{
-		wil::com_ptr<IAssocHandler> pHandler = m_handlers.at(i);
-		wil::unique_cotaskmem_string lpszCurPath = nullptr;
-		pHandler->GetName(&lpszCurPath);
-		if (lpszCurPath)
+		if (!m_handlers[i])
+			continue;
+
+		handlers.push_back(m_handlers[i]);
+		snapshots.emplace_back();
+		m_handlerTable.GetSnapshot(i, &snapshots.back());
+	}
+
+	// The recommended handlers go first, as they came from the enumeration.
+	std::vector<size_t> order;
+	for (int fRecommended = 1; fRecommended >= 0; fRecommended--)
+	{
+		for (size_t i = 0; i < snapshots.size(); i++)
 		{
-			if (0 == _wcsicmp(lpszPath, lpszCurPath.get()))
-				pResult = pHandler;
+			if (snapshots[i].fRecommended == (fRecommended != 0))
+				order.push_back(i);
 		}
+	}
+
+	_ClearItems();
+	m_handlers.clear();
+	m_handlerTable.Clear();
+
+	m_fRecommended = !order.empty() && snapshots[order[0]].fRecommended;
+	if (m_fRecommended)
+		_SetupCategories();
 
-		if (pResult)
-			return i;
+	int iSelect = -1;
+	for (size_t i : order)
+	{
+		m_handlers.push_back(handlers[i]);
+		m_handlerTable.Add(snapshots[i]);
+		_AddItem(m_handlers.size() - 1, false);
+		_QueueIcon(m_handlers.size() - 1);
+
+		if (handlers[i] == pSelected)
+			iSelect = m_handlers.size() - 1;
 	}
-	return -1;
+
+	if (iSelect != -1)
+		_SelectItemByIndex(iSelect);
 }
 
-void CBaseOpenAsDlg::_GetHandlers()
+void CBaseOpenAsDlg::_UpdateOkButton()
 {
-	wil::com_ptr<IEnumAssocHandlers> pEnumHandler = nullptr;
-	if (m_fUri)
-		SHAssocEnumHandlersForProtocolByApplication(
-			m_szExtOrProtocol,
-			IID_PPV_ARGS(&pEnumHandler)
-		);
-	else
-		SHAssocEnumHandlers(
-			m_szExtOrProtocol,
-			ASSOC_FILTER_NONE,
-			&pEnumHandler
+	EnableWindow(
+		GetDlgItem(m_hWnd, IDOK),
+		_GetSelectedItem() != nullptr
+	);
+}
+
+void CBaseOpenAsDlg::_StopHandlers()
+{
+	if (m_pHandlerStreamer)
+		m_pHandlerStreamer->Cancel();
+
+	// This waits for the handler being read, at most.
+	if (m_enumThread.joinable())
+		m_enumThread.join();
+
+	// The icons being looked up aren't waited for; they are just dropped.
+	if (m_pIconResolver)
+		m_pIconResolver->Stop();
+}
+
+void CBaseOpenAsDlg::_QueueIcon(int index)
+{
+	if (m_pIconResolver)
+	{
+		m_pIconResolver->Request(
+			index,
+			m_handlerTable.GetIconPath(index),
+			m_handlerTable.GetIconIndex(index)
 		);
+	}
+}
+
+void CBaseOpenAsDlg::OnIconsReady()
+{
+	PostMessageW(m_hWnd, WM_OWX_ICONSREADY, 0, 0);
+}
 
-	wil::com_ptr<IAssocHandler> pAssoc = nullptr;
-	ULONG pceltFetched = 0;
-	while (SUCCEEDED(pEnumHandler->Next(1, &pAssoc, &pceltFetched)) && pAssoc)
+void CBaseOpenAsDlg::_SetResolvedIcons()
+{
+	if (!m_pIconResolver)
+		return;
+
+	std::vector<ASSOC_ICON_RESULT> results;
+	if (m_pIconResolver->TakeResults(&results))
 	{
-		if (!m_fRecommended && S_OK == pAssoc->IsRecommended())
+		for (const ASSOC_ICON_RESULT &result : results)
 		{
-			m_fRecommended = true;
+			if (result.dwGeneration == m_dwIconGeneration && result.iImage != m_iGenericIcon)
+				_SetItemIcon((int)result.iItem, result.iImage);
 		}
-		m_handlers.push_back(pAssoc);
 	}
 }
 
@@ -311,7 +576,7 @@ void CBaseOpenAsDlg::_BrowseForProgram()
 	LoadStringW(g_hInst, IDS_PROGRAMS, szPrograms, 128);
 	LoadStringW(g_hInst, IDS_ALLFILES, szAllFiles, 128);
 	LPCWSTR pszFormat = L"%s#*.exe;*.pif;*.com;*.bat;*.cmd#%s#*.*##";
-	if (g_style == OWXS_NT4) // NT4 has a (*.*) on all files that seems to be unchanged between locales
+	if (m_style == OWXS_NT4) // NT4 has a (*.*) on all files that seems to be unchanged between locales
 		pszFormat = L"%s#*.exe;*.pif;*.com;*.bat;*.cmd#%s (*.*)#*.*##";
 	swprintf_s(szFilter, pszFormat, szPrograms, szAllFiles);
 	
@@ -348,6 +613,10 @@ HRESULT CBaseOpenAsDlg::_ClearRecentlyInstalled()
 {
 	for (wil::com_ptr<IAssocHandler> pHandler : m_handlers)
 	{
+		// Listed from the cache, but never enumerated.
+		if (!pHandler)
+			continue;
+
 		wil::com_ptr<IAssocHandlerPromptCount> pPromptCount;
 		RETURN_IF_FAILED(pHandler->QueryInterface(&pPromptCount));
 		pPromptCount->UpdatePromptCount(ASSOCHANDLER_PROMPTUPDATE_BEHAVIOR_CLEAR);
@@ -372,6 +641,16 @@ void CBaseOpenAsDlg::_OnOk()
 	{
 		EndDialog(m_hWnd, IDOK);
 
+		// The new default and the description change go to the shell as one
+		// notification, sent before the program is launched.
+		CAssocChangeNotifier *pNotifier = GetShellAssocChangeNotifier();
+		pNotifier->BeginBatch();
+
+		// The extension was looked up when the dialog was shown. The entry is
+		// taken before setting the default invalidates it, so the ProgID for
+		// the description doesn't have to be read again.
+		std::shared_ptr<const CAssocLookupEntry> pLookup = GetAssocLookupCache()->Lookup(m_szExtOrProtocol, m_fUri);
+
 		if (fAssoc)
 		{
 			LOG_IF_FAILED(SetDefaultAssociation(m_szExtOrProtocol, pSelected.get()));
@@ -386,59 +665,27 @@ void CBaseOpenAsDlg::_OnOk()
 			std::unique_ptr<WCHAR[]> pszDescription = std::make_unique<WCHAR[]>(cchDescText + sizeof('\0'));
 			GetWindowTextW(hWndDescEditBox, pszDescription.get(), cchDescText + sizeof('\0'));
 
-			// Find the association handler path in the registry:
-			wil::unique_hkey hkAssocKey = nullptr;
-			RegOpenKeyExW(
-				HKEY_CLASSES_ROOT,
-				m_szExtOrProtocol,
-				NULL,
-				KEY_READ,
-				&hkAssocKey
-			);
-
-			DWORD cbProgId = 0;
-			RegGetValueW(
-				hkAssocKey.get(),
-				nullptr,
-				nullptr,
-				RRF_RT_REG_SZ,
-				nullptr,
-				nullptr,
-				&cbProgId
-			);
-			std::unique_ptr<WCHAR[]> pszProgId = std::make_unique<WCHAR[]>(cbProgId);
-			RegGetValueW(
-				hkAssocKey.get(),
-				nullptr,
-				nullptr,
-				RRF_RT_REG_SZ,
-				nullptr,
-				pszProgId.get(),
-				&cbProgId
-			);
-
-			wil::unique_hkey hkProgId = nullptr;
-			RegOpenKeyExW(
-				HKEY_CLASSES_ROOT,
-				pszProgId.get(),
-				NULL,
-				KEY_READ | KEY_WRITE,
-				&hkProgId
-			);
-
-			RegSetKeyValueW(
-				hkProgId.get(),
-				nullptr,
-				nullptr,
-				REG_SZ,
-				pszDescription.get(),
-				(cchDescText + 1) * sizeof(WCHAR)
-			);
+			if (pLookup && *pLookup->GetProgId())
+			{
+				RegSetKeyValueW(
+					HKEY_CLASSES_ROOT,
+					pLookup->GetProgId(),
+					nullptr,
+					REG_SZ,
+					pszDescription.get(),
+					(cchDescText + 1) * sizeof(WCHAR)
+				);
+			}
 
 			// Notify shell to refresh icons:
-			SHChangeNotify(SHCNE_ASSOCCHANGED, SHCNF_IDLIST, nullptr, nullptr);
+			pNotifier->Post();
 		}
 
+		// Whatever was looked up about the extension may have changed.
+		GetAssocLookupCache()->Invalidate(m_szExtOrProtocol);
+
+		pNotifier->EndBatch();
+
 		// Don't launch when changing default from properties.
 		if (!(m_flags & IMMERSIVE_OPENWITH_DONOT_EXEC))
 		{
@@ -464,7 +711,8 @@ void CBaseOpenAsDlg::_OnOk()
 
 					if (SUCCEEDED(hr))
 					{
-						pSelected->Invoke(pInvocationObj.get());
+						CTraceActivity activity(TRACE_INVOKE, m_szPath);
+						activity.SetResult(pSelected->Invoke(pInvocationObj.get()));
 					}
 				}
 			}
@@ -472,13 +720,22 @@ void CBaseOpenAsDlg::_OnOk()
 	}
 }
 
-CBaseOpenAsDlg::CBaseOpenAsDlg(LPCWSTR lpszPath, IMMERSIVE_OPENWITH_FLAGS flags, bool fUri, bool fPreregistered, UINT uDlgId, UINT uDlgWithDescId, UINT uDlgProtocolId)
+CBaseOpenAsDlg::CBaseOpenAsDlg(LPCWSTR lpszPath, IMMERSIVE_OPENWITH_FLAGS flags, OPENWITHEXSTYLE style, bool fUri, bool fPreregistered, UINT uDlgId, UINT uDlgWithDescId, UINT uDlgProtocolId)
 	: CImpDialog(g_hInst, uDlgWithDescId)
 	, m_szExtOrProtocol{ 0 }
 	, m_flags(flags)
+	, m_style(style)
 	, m_fUri(fUri)
 	, m_fPreregistered(fPreregistered)
 	, m_fRecommended(false)
+	, m_fAnyStreamed(false)
+	, m_dwIconGeneration(0)
+	, m_iGenericIcon(0)
+	, m_ullCacheStamp(0)
+	, m_fFromCache(false)
+	, m_fCacheChanged(false)
+	, m_fCacheRegroup(false)
+	, m_firstPaint(TRACE_FIRST_PAINT, lpszPath)
 {
 	wcscpy_s(m_szPath, lpszPath);
 	m_pszFileName = PathFindFileNameW(m_szPath);
@@ -513,6 +770,8 @@ CBaseOpenAsDlg::CBaseOpenAsDlg(LPCWSTR lpszPath, IMMERSIVE_OPENWITH_FLAGS flags,
 
 CBaseOpenAsDlg::~CBaseOpenAsDlg()
 {
+	_StopHandlers();
+
 	for (size_t i = 0; i < m_handlers.size(); i++)
 	{
 		wil::com_ptr<IAssocHandler> pItem = m_handlers.at(i);
@@ -522,4 +781,10 @@ CBaseOpenAsDlg::~CBaseOpenAsDlg()
 		}
 	}
 	m_handlers.clear();
+	m_handlerTable.Clear();
+
+	// Handlers which never made it to the list are released with it, before
+	// the MTA is let go.
+	m_pHandlerStreamer.reset();
+	m_mtaUsage.reset();
 }
\ No newline at end of file
@@ -2,8 +2,14 @@
 
 #include "openwithex.h"
 #include "impdialog.h"
+#include "assochandlerstream.h"
+#include "assochandlertable.h"
+#include "associconresolver.h"
+#include "tracespan.h"
 #include <shobjidl.h>
 #include <commctrl.h>
+#include <memory>
+#include <thread>
 #include <vector>
 
 #include "wil/com.h"
@@ -12,18 +18,68 @@
 #define I_RECOMMENDED 1
 #define I_OTHER       2
 
+// Posted by the handler enumeration thread when handlers are waiting.
+#define WM_OWX_HANDLERSREADY (WM_APP + 1)
+
+// Posted by the icon workers when icons are ready to be set.
+#define WM_OWX_ICONSREADY    (WM_APP + 2)
+
 int GetAppIconIndex(LPCWSTR lpszIconPath, int iIndex);
 
-class CBaseOpenAsDlg : public CImpDialog
+class CBaseOpenAsDlg : public CImpDialog, public IAssocHandlerSink, public IAssocIconSink
 {
 private:
 	IMMERSIVE_OPENWITH_FLAGS m_flags;
+	OPENWITHEXSTYLE          m_style;
 	bool   m_fPreregistered;
 
+	// Keeps the MTA, where the enumerated handlers live, around for as long
+	// as the dialog uses them.
+	wil::unique_mta_usage_cookie           m_mtaUsage;
+	std::unique_ptr<CAssocHandlerStreamer> m_pHandlerStreamer;
+	std::thread                            m_enumThread;
+	bool                                   m_fAnyStreamed;
+
+	std::unique_ptr<CAssocIconResolver>    m_pIconResolver;
+
+	// Icons from earlier generations were looked up for items which have
+	// since been rebuilt.
+	DWORD     m_dwIconGeneration;
+
+	// The registry stamp read before enumerating, which the handler cache
+	// is written with afterwards.
+	ULONGLONG m_ullCacheStamp;
+
+	// Whether the list was first filled from the handler cache, whether the
+	// enumeration found anything different, and whether a handler has to
+	// move to another group because of it.
+	bool      m_fFromCache;
+	bool      m_fCacheChanged;
+	bool      m_fCacheRegroup;
+
+	// Runs from the dialog being created until it is first painted.
+	CTraceActivity m_firstPaint;
+
 	INT_PTR CALLBACK v_DlgProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
-	void _GetHandlers();
+	void _LoadCachedHandlers();
+	void _StartHandlers();
+	void _StartIconResolver();
+	void _AttachCachedHandler(int index, wil::com_ptr<IAssocHandler> pHandler, const ASSOC_HANDLER_SNAPSHOT &snapshot);
+	void _OnHandlersComplete();
+	void _RebuildItems();
+	void _UpdateOkButton();
+	void _AddStreamedHandlers();
+	void _StopHandlers();
+	void _QueueIcon(int index);
+	void _SetResolvedIcons();
 	HRESULT _ClearRecentlyInstalled();
 
+	// IAssocHandlerSink
+	void OnHandlersReady() override;
+
+	// IAssocIconSink
+	void OnIconsReady() override;
+
 	void _OnOk();
 
 protected:
@@ -31,7 +87,16 @@ protected:
 	WCHAR  m_szPath[MAX_PATH];
 	LPWSTR m_pszFileName;
 	bool   m_fUri;
+	// Handlers shown from the handler cache are null here until the
+	// enumeration gets to them.
 	std::vector<wil::com_ptr<IAssocHandler>> m_handlers;
+
+	// What the handlers in m_handlers are called, where their icons are, and
+	// whether they are recommended, at the same indices.
+	CAssocHandlerTable m_handlerTable;
+
+	// What items show until their own icons have been looked up.
+	int    m_iGenericIcon;
 	bool   m_fRecommended;
 	
 	void _SelectOrAddItem(LPCWSTR lpszPath);
@@ -42,9 +107,19 @@ protected:
 	virtual wil::com_ptr<IAssocHandler> _GetSelectedItem() = 0;
 	virtual void _SelectItemByIndex(int index) = 0;
 	virtual void _SetupCategories() = 0;
-	virtual void _AddItem(wil::com_ptr<IAssocHandler> pItem, int index, bool fForceSelect) = 0;
+	// Items are added with m_iGenericIcon, and given their own icons later
+	// through _SetItemIcon.
+	virtual void _AddItem(int index, bool fForceSelect) = 0;
+	virtual void _SetItemIcon(int index, int iImage) = 0;
+
+	// Shows an item's text again, and its handler, once a handler shown
+	// from the cache has been enumerated.
+	virtual void _UpdateItem(int index) = 0;
+
+	// Removes every item, and the categories.
+	virtual void _ClearItems() = 0;
 
-	CBaseOpenAsDlg(LPCWSTR lpszPath, IMMERSIVE_OPENWITH_FLAGS flags, bool fUri, bool fPreregistered, UINT uDlgId, UINT uDlgWithDescId, UINT uDlgProtocolId);
+	CBaseOpenAsDlg(LPCWSTR lpszPath, IMMERSIVE_OPENWITH_FLAGS flags, OPENWITHEXSTYLE style, bool fUri, bool fPreregistered, UINT uDlgId, UINT uDlgWithDescId, UINT uDlgProtocolId);
 
 public:
 	~CBaseOpenAsDlg();
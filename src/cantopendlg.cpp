@@ -75,8 +75,8 @@ INT_PTR CALLBACK CCantOpenDlg::v_DlgProc(HWND hWnd, UINT uMsg, WPARAM wParam, LP
 	return FALSE;
 }
 
-CCantOpenDlg::CCantOpenDlg(LPCWSTR lpszPath)
-	: CImpDialog(g_hInst, (g_style == OWXS_VISTA) ? IDD_CANTOPEN : IDD_CANTOPEN_XP)
+CCantOpenDlg::CCantOpenDlg(LPCWSTR lpszPath, OPENWITHEXSTYLE style)
+	: CImpDialog(g_hInst, (style == OWXS_VISTA) ? IDD_CANTOPEN : IDD_CANTOPEN_XP)
 {
 	wcscpy_s(m_szPath, lpszPath);
 	m_pszFileName = PathFindFileNameW(m_szPath);
@@ -12,5 +12,5 @@ private:
 	INT_PTR CALLBACK v_DlgProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
 
 public:
-	CCantOpenDlg(LPCWSTR lpszPath);
+	CCantOpenDlg(LPCWSTR lpszPath, OPENWITHEXSTYLE style);
 };
\ No newline at end of file
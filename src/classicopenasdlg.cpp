@@ -84,8 +84,7 @@ void CClassicOpenAsDlg::_SelectItemByIndex(int index)
 		(LPARAM)&lvi
 	);
 
-	wil::com_ptr<IAssocHandler> pHandler = m_handlers.at(index);
-	if (pHandler)
+	if ((size_t)index < m_handlerTable.GetCount())
 	{
 		LVGROUP lvg = { sizeof(LVGROUP) };
 		lvg.mask = LVGF_STATE;
@@ -94,7 +93,7 @@ void CClassicOpenAsDlg::_SelectItemByIndex(int index)
 		SendDlgItemMessageW(
 			m_hWnd, IDD_OPENWITH_PROGLIST,
 			LVM_SETGROUPINFO,
-			(S_OK == pHandler->IsRecommended()) ? I_RECOMMENDED : I_OTHER,
+			m_handlerTable.IsRecommended(index) ? I_RECOMMENDED : I_OTHER,
 			(LPARAM)&lvg
 		);
 	}
@@ -111,14 +110,14 @@ void CClassicOpenAsDlg::_SetupCategories()
 
 }
 
-void CClassicOpenAsDlg::_AddItem(wil::com_ptr<IAssocHandler> pItem, int index, bool fForceSelect)
+void CClassicOpenAsDlg::_AddItem(int index, bool fForceSelect)
 {
+	wil::com_ptr<IAssocHandler> pItem = m_handlers.at(index);
+
 	LVITEMW lvi = { 0 };
-	wil::unique_cotaskmem_string pszDisplayName;
 	lvi.mask = LVIF_TEXT | LVIF_PARAM | LVIF_IMAGE;
 	lvi.iItem = index;
-	pItem->GetUIName(&pszDisplayName);
-	lvi.pszText = pszDisplayName.get();
+	lvi.pszText = (LPWSTR)m_handlerTable.GetUIName(index);
 	lvi.cchTextMax = wcslen(lvi.pszText) + 1;
 
 	// This is somewhat unsafe, but we're expecting that the item doesn't get
@@ -132,16 +131,7 @@ void CClassicOpenAsDlg::_AddItem(wil::com_ptr<IAssocHandler> pItem, int index, b
 		lvi.state = LVIS_SELECTED;
 	}
 
-	wil::unique_cotaskmem_string pszIconPath = nullptr;
-	int iIndex = 0;
-	pItem->GetIconLocation(
-		&pszIconPath,
-		&iIndex
-	);
-
-	lvi.iImage = GetAppIconIndex(
-		pszIconPath.get(), iIndex
-	);
+	lvi.iImage = m_iGenericIcon;
 
 	SendDlgItemMessageW(
 		m_hWnd,
@@ -152,12 +142,50 @@ void CClassicOpenAsDlg::_AddItem(wil::com_ptr<IAssocHandler> pItem, int index, b
 	);
 }
 
-CClassicOpenAsDlg::CClassicOpenAsDlg(LPCWSTR lpszPath, IMMERSIVE_OPENWITH_FLAGS flags, bool fUri, bool fPreregistered)
+void CClassicOpenAsDlg::_UpdateItem(int index)
+{
+	LVITEMW lvi = { 0 };
+	lvi.iItem = index;
+	lvi.mask = LVIF_TEXT | LVIF_PARAM;
+	lvi.pszText = (LPWSTR)m_handlerTable.GetUIName(index);
+	lvi.lParam = (LPARAM)m_handlers.at(index).get();
+
+	SendDlgItemMessageW(
+		m_hWnd, IDD_OPENWITH_PROGLIST,
+		LVM_SETITEMW, NULL,
+		(LPARAM)&lvi
+	);
+}
+
+void CClassicOpenAsDlg::_ClearItems()
+{
+	SendDlgItemMessageW(
+		m_hWnd, IDD_OPENWITH_PROGLIST,
+		LVM_DELETEALLITEMS, NULL,
+		NULL
+	);
+}
+
+void CClassicOpenAsDlg::_SetItemIcon(int index, int iImage)
+{
+	LVITEMW lvi = { 0 };
+	lvi.iItem = index;
+	lvi.mask = LVIF_IMAGE;
+	lvi.iImage = iImage;
+
+	SendDlgItemMessageW(
+		m_hWnd, IDD_OPENWITH_PROGLIST,
+		LVM_SETITEMW, NULL,
+		(LPARAM)&lvi
+	);
+}
+
+CClassicOpenAsDlg::CClassicOpenAsDlg(LPCWSTR lpszPath, IMMERSIVE_OPENWITH_FLAGS flags, OPENWITHEXSTYLE style, bool fUri, bool fPreregistered)
 	: CBaseOpenAsDlg(
-		lpszPath, flags, fUri, fPreregistered,
-		(g_style == OWXS_NT4) ? IDD_OPENWITH_NT4 : IDD_OPENWITH_2K,
-		(g_style == OWXS_NT4) ? IDD_OPENWITH_WITHDESC_NT4 : IDD_OPENWITH_WITHDESC_2K,
-		(g_style == OWXS_NT4) ? IDD_OPENWITH_PROTOCOL_NT4 : IDD_OPENWITH_PROTOCOL_2K)
+		lpszPath, flags, style, fUri, fPreregistered,
+		(style == OWXS_NT4) ? IDD_OPENWITH_NT4 : IDD_OPENWITH_2K,
+		(style == OWXS_NT4) ? IDD_OPENWITH_WITHDESC_NT4 : IDD_OPENWITH_WITHDESC_2K,
+		(style == OWXS_NT4) ? IDD_OPENWITH_PROTOCOL_NT4 : IDD_OPENWITH_PROTOCOL_2K)
 {
 
 }
\ No newline at end of file
@@ -0,0 +1,129 @@
+#include "launcherdispatcher.h"
+
+#include <vector>
+
+CLauncherDispatcher::CLauncherDispatcher(ILauncherTarget *pTarget, ILauncherDispatchSink *pSink, CLauncherLifetime *pLifetime)
+	: _pTarget(pTarget)
+	, _pSink(pSink)
+	, _pLifetime(pLifetime)
+	, _cActive(0)
+	, _counts{ 0 }
+{
+}
+
+CLauncherDispatcher::~CLauncherDispatcher()
+{
+	WaitAll();
+}
+
+void CLauncherDispatcher::_WorkerThread(std::list<WORKER>::iterator itWorker, OPENWITH_REQUEST request)
+{
+	_pTarget->BeginThread();
+	_pTarget->ShowDialog(request);
+	_pTarget->EndThread();
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_cActive--;
+		_counts.cCompleted++;
+
+		// The thread is joined by whoever reaps it next.
+		itWorker->fDone = true;
+	}
+
+	if (_pLifetime)
+	{
+		_pLifetime->EndRequest();
+	}
+
+	if (_pSink)
+	{
+		_pSink->OnRequestDone();
+	}
+}
+
+void CLauncherDispatcher::_Reap()
+{
+	std::vector<std::thread> done;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		for (auto it = _workers.begin(); it != _workers.end();)
+		{
+			if (it->fDone)
+			{
+				done.push_back(std::move(it->thread));
+				it = _workers.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+	}
+
+	for (std::thread &thread : done)
+	{
+		thread.join();
+	}
+}
+
+void CLauncherDispatcher::Dispatch(const OPENWITH_REQUEST &request)
+{
+	_Reap();
+
+	// Counted before the thread starts, so the server can't decide it is
+	// idle in between.
+	if (_pLifetime)
+	{
+		_pLifetime->BeginRequest(request.ullActivated);
+	}
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	_counts.cDispatched++;
+	if (++_cActive > _counts.cMaxConcurrent)
+	{
+		_counts.cMaxConcurrent = _cActive;
+	}
+
+	// The thread only touches its own entry once it is done, with the lock
+	// held, so it is safe to start it before the entry is filled in.
+	auto itWorker = _workers.insert(_workers.end(), WORKER{ std::thread(), false });
+	itWorker->thread = std::thread(&CLauncherDispatcher::_WorkerThread, this, itWorker, request);
+}
+
+void CLauncherDispatcher::WaitAll()
+{
+	for (;;)
+	{
+		std::list<WORKER>::iterator itWorker;
+		std::thread thread;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (_workers.empty())
+			{
+				return;
+			}
+
+			itWorker = _workers.begin();
+			thread = std::move(itWorker->thread);
+		}
+
+		// The entry stays until its thread is done with it.
+		thread.join();
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		_workers.erase(itWorker);
+	}
+}
+
+DWORD CLauncherDispatcher::GetActiveCount()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _cActive;
+}
+
+LAUNCHER_DISPATCH_COUNTS CLauncherDispatcher::GetCounts()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _counts;
+}
\ No newline at end of file
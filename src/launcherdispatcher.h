@@ -0,0 +1,163 @@
+#pragma once
+
+/**
+ * Shows each Open With request's dialog on its own thread.
+ *
+ * The COM server used to show the dialog inside IExecuteCommand::Execute,
+ * modally, on its only thread, so a request that came in while a dialog was
+ * open waited for it to close, or was shown nested inside its modal loop.
+ * CLauncherDispatcher copies everything a dialog needs out of the COM call
+ * into an OPENWITH_REQUEST, and shows it on a new thread, so the server
+ * thread is free for the next request straight away and dialogs don't wait
+ * on each other.
+ *
+ * Dialogs are shown through an ILauncherTarget, so the dispatching can be
+ * tested with a fake one.
+ */
+
+#include "wincompat.h"
+#include "launcherlifetime.h"
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/**
+ * Everything a dialog needs, copied out of the request so that nothing is
+ * shared with the server thread or any other dialog.
+ */
+struct OPENWITH_REQUEST
+{
+	HWND                      hWndParent;
+
+	// The file or URL. Empty if the request didn't say.
+	std::basic_string<WCHAR>  strPath;
+
+	// IMMERSIVE_OPENWITH_FLAGS.
+	DWORD                     dwFlags;
+
+	// The OPENWITHEXSTYLE the user had chosen when the request came in.
+	DWORD                     dwStyle;
+
+	// When the request's object was created, for CLauncherLifetime.
+	ULONGLONG                 ullActivated;
+};
+
+/**
+ * Where dialogs are shown. Called on the dialogs' threads.
+ */
+class ILauncherTarget
+{
+public:
+	virtual ~ILauncherTarget() {}
+
+	// Called on each dialog thread before its dialog and after it.
+	virtual void BeginThread() {}
+	virtual void EndThread() {}
+
+	/**
+	 * Shows a request's dialog, and returns once it is closed.
+	 */
+	virtual void ShowDialog(const OPENWITH_REQUEST &request) = 0;
+};
+
+/**
+ * Wakes the server up.
+ */
+class ILauncherDispatchSink
+{
+public:
+	virtual ~ILauncherDispatchSink() {}
+
+	/**
+	 * Called on a dialog's thread after its dialog closed, so the server can
+	 * check whether it should exit.
+	 */
+	virtual void OnRequestDone() = 0;
+};
+
+/**
+ * Dispatch counters.
+ */
+struct LAUNCHER_DISPATCH_COUNTS
+{
+	DWORD cDispatched;
+	DWORD cCompleted;
+
+	// The most dialogs that were open at once.
+	DWORD cMaxConcurrent;
+};
+
+class CLauncherDispatcher
+{
+private:
+	struct WORKER
+	{
+		std::thread thread;
+		bool        fDone;
+	};
+
+	ILauncherTarget           *_pTarget;
+	ILauncherDispatchSink     *_pSink;
+	CLauncherLifetime         *_pLifetime;
+
+	// Guards everything below.
+	std::mutex                 _mutex;
+	std::list<WORKER>          _workers;
+	DWORD                      _cActive;
+	LAUNCHER_DISPATCH_COUNTS   _counts;
+
+	void _WorkerThread(std::list<WORKER>::iterator itWorker, OPENWITH_REQUEST request);
+
+	// Joins the threads whose dialogs have closed.
+	void _Reap();
+
+public:
+	/**
+	 * @param pTarget    Shows the dialogs.
+	 * @param pSink      Wakes the server up when a dialog closes; may be null.
+	 * @param pLifetime  Told about every request, so that the server stays
+	 *                   up while dialogs are open; may be null.
+	 *
+	 * All three have to outlive the dispatcher.
+	 */
+	CLauncherDispatcher(ILauncherTarget *pTarget, ILauncherDispatchSink *pSink, CLauncherLifetime *pLifetime);
+
+	// Waits for every dialog to close.
+	~CLauncherDispatcher();
+
+	CLauncherDispatcher(const CLauncherDispatcher &) = delete;
+	CLauncherDispatcher &operator=(const CLauncherDispatcher &) = delete;
+
+	// Dispatch and WaitAll are only ever called on the server's thread.
+
+	/**
+	 * Starts a thread to show a request's dialog, and returns without
+	 * waiting for it. The request counts towards the lifetime from now on.
+	 */
+	void Dispatch(const OPENWITH_REQUEST &request);
+
+	/**
+	 * Waits for every dialog to close.
+	 */
+	void WaitAll();
+
+	// How many dialogs are open.
+	DWORD GetActiveCount();
+
+	LAUNCHER_DISPATCH_COUNTS GetCounts();
+};
+
+#ifdef _WIN32
+/**
+ * Shows dialogs with ShowOpenWithDialog. Each thread gets its own STA.
+ */
+ILauncherTarget *GetShellLauncherTarget();
+
+/**
+ * Wakes a thread's message loop up by posting it a WM_NULL.
+ */
+std::unique_ptr<ILauncherDispatchSink> CreateThreadWakeSink(DWORD dwThreadId);
+#endif
\ No newline at end of file
@@ -0,0 +1,99 @@
+#include "launcherlifetime.h"
+
+CLauncherLifetime::CLauncherLifetime(IUserChoiceClock *pClock, ULONGLONG ullIdleTimeout, ULONGLONG ullStarted)
+	: _pClock(pClock)
+	, _ullIdleTimeout(ullIdleTimeout)
+	, _ullStarted(ullStarted)
+	, _cRefs(0)
+	, _cRequestsActive(0)
+	, _ullIdleSince(pClock->Now())
+	, _counts{ 0 }
+{
+}
+
+void CLauncherLifetime::_Release()
+{
+	if (_cRefs && --_cRefs == 0)
+	{
+		_ullIdleSince = _pClock->Now();
+		_counts.cIdle++;
+	}
+}
+
+void CLauncherLifetime::AddRef()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_cRefs++;
+}
+
+void CLauncherLifetime::Release()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_Release();
+}
+
+void CLauncherLifetime::BeginRequest(ULONGLONG ullArrived)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_cRefs++;
+	_cRequestsActive++;
+
+	if (_counts.cRequests == 0)
+	{
+		ullArrived = _ullStarted;
+	}
+
+	ULONGLONG ullNow = _pClock->Now();
+	ULONGLONG ullLatency = (ullNow > ullArrived) ? ullNow - ullArrived : 0;
+	if (_counts.cRequests++ == 0)
+	{
+		_counts.ullColdLatency = ullLatency;
+	}
+	else
+	{
+		_counts.ullWarmLatency += ullLatency;
+		if (ullLatency > _counts.ullWarmLatencyMax)
+			_counts.ullWarmLatencyMax = ullLatency;
+	}
+}
+
+void CLauncherLifetime::EndRequest()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_cRequestsActive)
+		_cRequestsActive--;
+	_Release();
+}
+
+bool CLauncherLifetime::GetExitTime(ULONGLONG *pullTime)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	*pullTime = 0;
+
+	if (_ullIdleTimeout == 0)
+	{
+		// The one-shot server has always exited as soon as its request had
+		// been served, whether or not the client still held anything.
+		return _counts.cRequests && _cRequestsActive == 0;
+	}
+
+	if (_cRefs)
+	{
+		return false;
+	}
+
+	*pullTime = _ullIdleSince + _ullIdleTimeout;
+	return true;
+}
+
+bool CLauncherLifetime::ShouldExit()
+{
+	ULONGLONG ullTime;
+	return GetExitTime(&ullTime) && _pClock->Now() >= ullTime;
+}
+
+LAUNCHER_LIFETIME_COUNTS CLauncherLifetime::GetCounts()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _counts;
+}
\ No newline at end of file
@@ -0,0 +1,123 @@
+#pragma once
+
+/**
+ * Decides when a resident COM server should exit.
+ *
+ * Started with -embedding, OpenWithEx used to serve one request and exit, so
+ * every Open With paid for starting the process, initialising COM and
+ * registering the class object again, with every cache cold. In resident
+ * mode the server keeps serving requests until it has been idle for a while.
+ *
+ * The server is busy while there are objects handed out to clients, locks
+ * from IClassFactory::LockServer, or requests being served. Once it stops
+ * being busy, it may exit when the idle timeout has passed without it
+ * becoming busy again.
+ *
+ * Each request's activation latency is measured too: how long it took from
+ * the request arriving to it being served. The first request arrives when
+ * the process starts, so it includes the startup that the one-shot server
+ * paid for every request.
+ */
+
+#include "wincompat.h"
+#include "userchoicescheduler.h" // for IUserChoiceClock
+
+#include <mutex>
+
+/**
+ * Server lifetime counters. Latencies are in FILETIME units.
+ */
+struct LAUNCHER_LIFETIME_COUNTS
+{
+	DWORD     cRequests;
+
+	// Times the server went idle.
+	DWORD     cIdle;
+
+	// The first request's latency, from the process starting.
+	ULONGLONG ullColdLatency;
+
+	// Every later request's latency, added up, and the slowest.
+	ULONGLONG ullWarmLatency;
+	ULONGLONG ullWarmLatencyMax;
+
+	// The average latency of the requests after the first.
+	ULONGLONG AverageWarmLatency() const
+	{
+		return (cRequests > 1) ? ullWarmLatency / (cRequests - 1) : 0;
+	}
+};
+
+class CLauncherLifetime
+{
+private:
+	IUserChoiceClock         *_pClock;
+	ULONGLONG                 _ullIdleTimeout;
+	ULONGLONG                 _ullStarted;
+
+	std::mutex                _mutex;
+
+	// Objects, locks and requests in progress, and just the requests.
+	DWORD                     _cRefs;
+	DWORD                     _cRequestsActive;
+	ULONGLONG                 _ullIdleSince;
+	LAUNCHER_LIFETIME_COUNTS  _counts;
+
+	// Called with the lock held.
+	void _Release();
+
+public:
+	/**
+	 * @param pClock          Measures the idle time and latencies; it has to
+	 *                        outlive the lifetime.
+	 * @param ullIdleTimeout  How long the server stays up while idle, in
+	 *                        FILETIME units. Zero means one request only.
+	 * @param ullStarted      When the process started, which the first
+	 *                        request's latency is counted from.
+	 *
+	 * The server starts out idle, from the time it is created.
+	 */
+	CLauncherLifetime(IUserChoiceClock *pClock, ULONGLONG ullIdleTimeout, ULONGLONG ullStarted);
+
+	CLauncherLifetime(const CLauncherLifetime &) = delete;
+	CLauncherLifetime &operator=(const CLauncherLifetime &) = delete;
+
+	// Whether the server stays up after its first request.
+	bool IsResident() const
+	{
+		return _ullIdleTimeout != 0;
+	}
+
+	/**
+	 * Counts an object handed out to a client, or a lock, which keeps the
+	 * server up until it is released.
+	 */
+	void AddRef();
+	void Release();
+
+	/**
+	 * Brackets serving a request, which keeps the server up as well.
+	 *
+	 * @param ullArrived  When the request's object was created. The first
+	 *                    request's latency is counted from when the process
+	 *                    started instead.
+	 */
+	void BeginRequest(ULONGLONG ullArrived);
+	void EndRequest();
+
+	/**
+	 * When the server may exit.
+	 *
+	 * @return false while the server is busy. A one-shot server may exit as
+	 *         soon as it has served a request, even if the client still
+	 *         holds its object, and never before.
+	 */
+	bool GetExitTime(ULONGLONG *pullTime);
+
+	/**
+	 * Whether the server may exit now.
+	 */
+	bool ShouldExit();
+
+	LAUNCHER_LIFETIME_COUNTS GetCounts();
+};
\ No newline at end of file
@@ -0,0 +1,562 @@
+#include "memoryregistry.h"
+
+#include <string.h>
+
+#include "userchoicehash.h" // for UserChoiceLowerCase
+#include "tracespan.h"
+
+// Protected values aren't locked for LocalSystem; see
+// CShellProtectedRegLock::Lock.
+static const WCHAR c_szLocalSystemSid[] = WTEXT("S-1-5-18");
+
+CMemoryRegistry::CMemoryRegistry(IUserChoiceClock *pClock)
+	: _pClock(pClock)
+	, _pClassesRoot(std::make_shared<NODE>())
+	, _pCurrentUser(std::make_shared<NODE>())
+	, _strUserSid(WTEXT("S-1-5-21-1004336348-1177238915-682003330-1001"))
+	, _pIdentityCache(nullptr)
+	, _counts{}
+	, _cBatchDepth(0)
+	, _fBatchToken(false)
+{
+	_pClassesRoot->pParent = nullptr;
+	_pClassesRoot->fDeleted = false;
+	_pClassesRoot->ullLastWrite = 0;
+
+	_pCurrentUser->pParent = nullptr;
+	_pCurrentUser->fDeleted = false;
+	_pCurrentUser->ullLastWrite = 0;
+}
+
+CMemoryRegistry::~CMemoryRegistry()
+{
+}
+
+void CMemoryRegistry::SetUserSid(LPCWSTR pszSid)
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+	_strUserSid = pszSid;
+}
+
+void CMemoryRegistry::SetIdentityCache(CAssocIdentityCache *pCache)
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+	_pIdentityCache = pCache;
+}
+
+void CMemoryRegistry::ProtectKeyName(LPCWSTR pszName)
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+	_protectedNames.push_back(s_Fold(pszName, std::char_traits<WCHAR>::length(pszName)));
+}
+
+REGISTRY_OP_COUNTS CMemoryRegistry::GetOpCounts()
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+	return _counts;
+}
+
+void CMemoryRegistry::ResetOpCounts()
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+	_counts = {};
+}
+
+// static
+CMemoryRegistry::String CMemoryRegistry::s_Fold(LPCWSTR psz, size_t cch)
+{
+	String str(psz, cch);
+	if (cch)
+		UserChoiceLowerCase(&str[0], cch);
+	return str;
+}
+
+std::shared_ptr<CMemoryRegistry::NODE> CMemoryRegistry::_NodeFromKey(HKEY hKey)
+{
+	if (hKey == HKEY_CLASSES_ROOT)
+		return _pClassesRoot;
+	if (hKey == HKEY_CURRENT_USER)
+		return _pCurrentUser;
+	if (!hKey)
+		return nullptr;
+
+	return ((HANDLE_DATA *)hKey)->pNode;
+}
+
+std::shared_ptr<CMemoryRegistry::NODE> CMemoryRegistry::_Walk(
+	HKEY     hKey,
+	LPCWSTR  pszSubKey,
+	bool     fCreate,
+	LSTATUS *pls
+)
+{
+	std::shared_ptr<NODE> pNode = _NodeFromKey(hKey);
+	if (!pNode)
+	{
+		*pls = ERROR_INVALID_HANDLE;
+		return nullptr;
+	}
+
+	if (pNode->fDeleted)
+	{
+		*pls = ERROR_KEY_DELETED;
+		return nullptr;
+	}
+
+	LPCWSTR pch = pszSubKey;
+	while (pch && *pch)
+	{
+		LPCWSTR pchEnd = pch;
+		while (*pchEnd && *pchEnd != '\\')
+			pchEnd++;
+
+		if (pchEnd != pch)
+		{
+			String strFolded = s_Fold(pch, pchEnd - pch);
+			auto it = pNode->children.find(strFolded);
+			if (it != pNode->children.end())
+			{
+				pNode = it->second;
+			}
+			else if (fCreate)
+			{
+				if (_IsNameProtected(pNode.get()))
+				{
+					*pls = ERROR_ACCESS_DENIED;
+					return nullptr;
+				}
+
+				std::shared_ptr<NODE> pChild = std::make_shared<NODE>();
+				pChild->strName.assign(pch, pchEnd - pch);
+				pChild->pParent = pNode.get();
+				pChild->fDeleted = false;
+				pChild->ullLastWrite = _pClock->Now();
+				pNode->children[strFolded] = pChild;
+				_Touch(pNode.get());
+				pNode = pChild;
+			}
+			else
+			{
+				*pls = ERROR_FILE_NOT_FOUND;
+				return nullptr;
+			}
+		}
+
+		pch = *pchEnd ? pchEnd + 1 : pchEnd;
+	}
+
+	*pls = ERROR_SUCCESS;
+	return pNode;
+}
+
+HKEY CMemoryRegistry::_MakeHandle(const std::shared_ptr<NODE> &pNode)
+{
+	HANDLE_DATA *pHandle = new HANDLE_DATA;
+	pHandle->pNode = pNode;
+	return (HKEY)pHandle;
+}
+
+bool CMemoryRegistry::_IsSetValueDenied(const NODE *pNode) const
+{
+	for (const MEMORY_REGISTRY_ACE &ace : pNode->acl)
+	{
+		if (ace.fDeny && (ace.dwMask & KEY_SET_VALUE) && ace.strSid == _strUserSid)
+			return true;
+	}
+	return false;
+}
+
+bool CMemoryRegistry::_IsNameProtected(const NODE *pNode) const
+{
+	if (_protectedNames.empty())
+		return false;
+
+	for (; pNode; pNode = pNode->pParent)
+	{
+		String strFolded = s_Fold(pNode->strName.c_str(), pNode->strName.size());
+		for (const String &strName : _protectedNames)
+		{
+			if (strName == strFolded)
+				return true;
+		}
+	}
+	return false;
+}
+
+void CMemoryRegistry::_Touch(NODE *pNode)
+{
+	pNode->ullLastWrite = _pClock->Now();
+}
+
+void CMemoryRegistry::_Unlock(NODE *pNode)
+{
+	CTraceActivity activity(TRACE_ACL_UNLOCK);
+
+	// One GetSecurityInfo, then one SetSecurityInfo for all of the deny ACEs
+	// removed, if there were any.
+	_counts.cSecurity++;
+
+	size_t cAces = pNode->acl.size();
+	for (size_t i = cAces; i-- > 0;)
+	{
+		const MEMORY_REGISTRY_ACE &ace = pNode->acl[i];
+		if (ace.fDeny && ace.dwMask == KEY_SET_VALUE)
+		{
+			pNode->acl.erase(pNode->acl.begin() + i);
+		}
+	}
+
+	if (pNode->acl.size() != cAces)
+		_counts.cSecurity++;
+}
+
+void CMemoryRegistry::_Lock(NODE *pNode)
+{
+	CTraceActivity activity(TRACE_ACL_LOCK);
+
+	if (_strUserSid == c_szLocalSystemSid)
+		return;
+
+	MEMORY_REGISTRY_ACE ace;
+	ace.fDeny = true;
+	ace.dwMask = KEY_SET_VALUE;
+	ace.strSid = _strUserSid;
+	pNode->acl.insert(pNode->acl.begin(), ace);
+	_counts.cSecurity++;
+}
+
+void CMemoryRegistry::_QueryIdentity()
+{
+	if (!_pIdentityCache)
+	{
+		_counts.cToken++;
+		return;
+	}
+
+	ASSOC_IDENTITY_COUNTS before = _pIdentityCache->GetCounts();
+	std::shared_ptr<const CAssocIdentity> pIdentity = _pIdentityCache->GetCurrent();
+	ASSOC_IDENTITY_COUNTS after = _pIdentityCache->GetCounts();
+
+	_counts.cToken += (after.cProcessQueries - before.cProcessQueries) +
+		(after.cThreadQueries - before.cThreadQueries);
+
+	if (pIdentity)
+		_strUserSid.assign(pIdentity->GetStringSid(), pIdentity->GetStringSidLength());
+}
+
+void CMemoryRegistry::_QueryToken()
+{
+	if (_cBatchDepth && _fBatchToken)
+		return;
+
+	_QueryIdentity();
+	_fBatchToken = _cBatchDepth != 0;
+}
+
+bool CMemoryRegistry::GetAcl(HKEY hKey, LPCWSTR pszSubKey, std::vector<MEMORY_REGISTRY_ACE> *pAcl)
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+	LSTATUS ls;
+	std::shared_ptr<NODE> pNode = _Walk(hKey, pszSubKey, false, &ls);
+	if (!pNode)
+		return false;
+
+	*pAcl = pNode->acl;
+	return true;
+}
+
+LSTATUS CMemoryRegistry::CreateKey(HKEY hKey, LPCWSTR pszSubKey, HKEY *phkResult)
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+	_counts.cOpen++;
+
+	LSTATUS ls;
+	std::shared_ptr<NODE> pNode = _Walk(hKey, pszSubKey, true, &ls);
+	*phkResult = pNode ? _MakeHandle(pNode) : nullptr;
+	return ls;
+}
+
+LSTATUS CMemoryRegistry::OpenKey(HKEY hKey, LPCWSTR pszSubKey, HKEY *phkResult)
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+	_counts.cOpen++;
+
+	LSTATUS ls;
+	std::shared_ptr<NODE> pNode = _Walk(hKey, pszSubKey, false, &ls);
+	*phkResult = pNode ? _MakeHandle(pNode) : nullptr;
+	return ls;
+}
+
+void CMemoryRegistry::CloseKey(HKEY hKey)
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+	_counts.cClose++;
+
+	if (hKey && hKey != HKEY_CLASSES_ROOT && hKey != HKEY_CURRENT_USER)
+		delete (HANDLE_DATA *)hKey;
+}
+
+LSTATUS CMemoryRegistry::RenameKey(HKEY hKey, LPCWSTR pszNewName)
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+	_counts.cRename++;
+
+	std::shared_ptr<NODE> pNode = _NodeFromKey(hKey);
+	if (!pNode || !pNode->pParent || !pszNewName || !*pszNewName)
+		return ERROR_INVALID_PARAMETER;
+	if (pNode->fDeleted)
+		return ERROR_KEY_DELETED;
+
+	NODE *pParent = pNode->pParent;
+	String strOld = s_Fold(pNode->strName.c_str(), pNode->strName.size());
+	String strNew = s_Fold(pszNewName, std::char_traits<WCHAR>::length(pszNewName));
+
+	if (strNew != strOld && pParent->children.count(strNew))
+		return ERROR_ALREADY_EXISTS;
+
+	pParent->children.erase(strOld);
+	pNode->strName = pszNewName;
+	pParent->children[strNew] = pNode;
+	_Touch(pNode.get());
+	return ERROR_SUCCESS;
+}
+
+LSTATUS CMemoryRegistry::DeleteKey(HKEY hKey, LPCWSTR pszSubKey)
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+	_counts.cWrite++;
+
+	LSTATUS ls;
+	std::shared_ptr<NODE> pNode = _Walk(hKey, pszSubKey, false, &ls);
+	if (!pNode)
+		return ls;
+	if (!pNode->pParent)
+		return ERROR_ACCESS_DENIED;
+
+	// Like RegDeleteKeyExW, this doesn't delete subkeys.
+	if (!pNode->children.empty())
+		return ERROR_ACCESS_DENIED;
+
+	NODE *pParent = pNode->pParent;
+	pParent->children.erase(s_Fold(pNode->strName.c_str(), pNode->strName.size()));
+	pNode->fDeleted = true;
+	pNode->pParent = nullptr;
+	_Touch(pParent);
+	return ERROR_SUCCESS;
+}
+
+LSTATUS CMemoryRegistry::GetValue(
+	HKEY    hKey,
+	LPCWSTR pszSubKey,
+	LPCWSTR pszValue,
+	DWORD  *pdwType,
+	void   *pvData,
+	DWORD  *pcbData
+)
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+	_counts.cRead++;
+
+	LSTATUS ls;
+	std::shared_ptr<NODE> pNode = _Walk(hKey, pszSubKey, false, &ls);
+	if (!pNode)
+		return ls;
+
+	String strName = pszValue ? s_Fold(pszValue, std::char_traits<WCHAR>::length(pszValue)) : String();
+	auto it = pNode->values.find(strName);
+	if (it == pNode->values.end())
+		return ERROR_FILE_NOT_FOUND;
+
+	const VALUE &value = it->second;
+	if (pdwType)
+		*pdwType = value.dwType;
+
+	if (!pcbData)
+		return pvData ? ERROR_INVALID_PARAMETER : ERROR_SUCCESS;
+
+	DWORD cbValue = (DWORD)value.data.size();
+	if (pvData && *pcbData < cbValue)
+	{
+		*pcbData = cbValue;
+		return ERROR_MORE_DATA;
+	}
+
+	if (pvData && cbValue)
+		memcpy(pvData, value.data.data(), cbValue);
+	*pcbData = cbValue;
+	return ERROR_SUCCESS;
+}
+
+LSTATUS CMemoryRegistry::SetValue(
+	HKEY        hKey,
+	LPCWSTR     pszSubKey,
+	LPCWSTR     pszValue,
+	DWORD       dwType,
+	const void *pvData,
+	DWORD       cbData
+)
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+	_counts.cWrite++;
+
+	LSTATUS ls;
+	std::shared_ptr<NODE> pNode = _Walk(hKey, pszSubKey, true, &ls);
+	if (!pNode)
+		return ls;
+
+	if (_IsSetValueDenied(pNode.get()) || _IsNameProtected(pNode.get()))
+		return ERROR_ACCESS_DENIED;
+
+	String strName = pszValue ? s_Fold(pszValue, std::char_traits<WCHAR>::length(pszValue)) : String();
+	VALUE &value = pNode->values[strName];
+	value.dwType = dwType;
+	value.data.assign((const BYTE *)pvData, (const BYTE *)pvData + cbData);
+	_Touch(pNode.get());
+	return ERROR_SUCCESS;
+}
+
+LSTATUS CMemoryRegistry::DeleteValue(HKEY hKey, LPCWSTR pszSubKey, LPCWSTR pszValue)
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+	_counts.cWrite++;
+
+	LSTATUS ls;
+	std::shared_ptr<NODE> pNode = _Walk(hKey, pszSubKey, false, &ls);
+	if (!pNode)
+		return ls;
+
+	if (_IsSetValueDenied(pNode.get()) || _IsNameProtected(pNode.get()))
+		return ERROR_ACCESS_DENIED;
+
+	String strName = pszValue ? s_Fold(pszValue, std::char_traits<WCHAR>::length(pszValue)) : String();
+	if (!pNode->values.erase(strName))
+		return ERROR_FILE_NOT_FOUND;
+
+	_Touch(pNode.get());
+	return ERROR_SUCCESS;
+}
+
+LSTATUS CMemoryRegistry::QueryInfo(HKEY hKey, DWORD *pcSubKeys, DWORD *pcValues, ULONGLONG *pullLastWrite)
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+	_counts.cRead++;
+
+	std::shared_ptr<NODE> pNode = _NodeFromKey(hKey);
+	if (!pNode)
+		return ERROR_INVALID_HANDLE;
+	if (pNode->fDeleted)
+		return ERROR_KEY_DELETED;
+
+	if (pcSubKeys)
+		*pcSubKeys = (DWORD)pNode->children.size();
+	if (pcValues)
+		*pcValues = (DWORD)pNode->values.size();
+	if (pullLastWrite)
+		*pullLastWrite = pNode->ullLastWrite;
+	return ERROR_SUCCESS;
+}
+
+LSTATUS CMemoryRegistry::SetProtectedValue(HKEY hKey, LPCWSTR pszValue, const void *pvData, DWORD cbData)
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+	// CShellProtectedRegLock::Init looks up the user, and opens UserChoice
+	// for its DACL.
+	_QueryIdentity();
+	HKEY hUserChoice;
+	LSTATUS ls = CreateKey(hKey, WTEXT("UserChoice"), &hUserChoice);
+	if (ls != ERROR_SUCCESS)
+		return ls;
+
+	NODE *pUserChoice = _NodeFromKey(hUserChoice).get();
+
+	_Unlock(pUserChoice);
+	ls = SetValue(hKey, WTEXT("UserChoice"), pszValue, REG_SZ, pvData, cbData);
+	_Lock(pUserChoice);
+
+	CloseKey(hUserChoice);
+	return ls;
+}
+
+LSTATUS CMemoryRegistry::DeleteProtectedValue(HKEY hKey, LPCWSTR pszValue, bool fDeleteSubKeys)
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+	_QueryIdentity();
+	HKEY hUserChoice;
+	LSTATUS ls = CreateKey(hKey, WTEXT("UserChoice"), &hUserChoice);
+	if (ls != ERROR_SUCCESS)
+		return ls;
+
+	std::shared_ptr<NODE> pUserChoice = _NodeFromKey(hUserChoice);
+
+	_Unlock(pUserChoice.get());
+	ls = DeleteValue(hKey, WTEXT("UserChoice"), pszValue);
+
+	// An empty UserChoice key is deleted rather than locked again.
+	bool fShouldLock = true;
+	if (fDeleteSubKeys)
+	{
+		DWORD cSubKeys = 0;
+		DWORD cValues = 0;
+		if (QueryInfo(hUserChoice, &cSubKeys, &cValues, nullptr) == ERROR_SUCCESS &&
+			!cSubKeys && !cValues &&
+			DeleteKey(hKey, WTEXT("UserChoice")) == ERROR_SUCCESS)
+		{
+			fShouldLock = false;
+		}
+	}
+
+	if (fShouldLock)
+		_Lock(pUserChoice.get());
+
+	CloseKey(hUserChoice);
+	return ls;
+}
+
+LSTATUS CMemoryRegistry::SetProtectedValues(HKEY hKey, const REGISTRY_PROTECTED_VALUE *pValues, size_t cValues)
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+	// CShellProtectedRegLock::Open, which only queries the token once per
+	// batch.
+	_QueryToken();
+	HKEY hUserChoice;
+	LSTATUS ls = CreateKey(hKey, WTEXT("UserChoice"), &hUserChoice);
+	if (ls != ERROR_SUCCESS)
+		return ls;
+
+	NODE *pUserChoice = _NodeFromKey(hUserChoice).get();
+
+	_Unlock(pUserChoice);
+
+	// The values are written through one handle, opened once the key is
+	// unlocked.
+	_counts.cOpen++;
+	for (size_t i = 0; i < cValues; i++)
+	{
+		LSTATUS lsValue = SetValue(hUserChoice, nullptr, pValues[i].pszValue, REG_SZ, pValues[i].pvData, pValues[i].cbData);
+		if (ls == ERROR_SUCCESS)
+			ls = lsValue;
+	}
+	_counts.cClose++;
+
+	_Lock(pUserChoice);
+
+	CloseKey(hUserChoice);
+	return ls;
+}
+
+void CMemoryRegistry::BeginProtectedBatch()
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+	_cBatchDepth++;
+}
+
+void CMemoryRegistry::EndProtectedBatch()
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+	if (--_cBatchDepth == 0)
+		_fBatchToken = false;
+}
\ No newline at end of file
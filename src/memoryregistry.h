@@ -0,0 +1,192 @@
+#pragma once
+
+/**
+ * An in-memory registry for tests and benchmarks.
+ *
+ * This behaves like the parts of the real registry that the association
+ * code relies on: case-insensitive key names, key renames, last write times
+ * and the deny ACE which protects UserChoice keys. Protected values are set
+ * and deleted the same way CShellProtectedRegLock does it, with the same
+ * number of security round trips, so that operation counts taken here are
+ * what the real registry would see.
+ *
+ * It can also stand in for a driver which protects association keys by
+ * name; see ProtectKeyName.
+ *
+ * HKEY_CURRENT_USER and HKEY_CLASSES_ROOT are separate, empty trees.
+ */
+
+#include "associdentity.h" // for CAssocIdentityCache
+#include "registrybackend.h"
+#include "userchoicescheduler.h" // for IUserChoiceClock
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * How many registry operations were made, by kind.
+ */
+struct REGISTRY_OP_COUNTS
+{
+	// CreateKey and OpenKey.
+	DWORD cOpen;
+
+	DWORD cClose;
+
+	// GetValue and QueryInfo.
+	DWORD cRead;
+
+	// SetValue, DeleteValue and DeleteKey.
+	DWORD cWrite;
+
+	DWORD cRename;
+
+	// Reads and writes of a key's DACL.
+	DWORD cSecurity;
+
+	// Queries of the user's token for a protected write. With an identity
+	// cache, only the queries it passes on to its source are counted. These
+	// aren't registry operations, so they aren't part of the total.
+	DWORD cToken;
+
+	DWORD Total() const
+	{
+		return cOpen + cClose + cRead + cWrite + cRename + cSecurity;
+	}
+};
+
+/**
+ * An access control entry on an in-memory key.
+ */
+struct MEMORY_REGISTRY_ACE
+{
+	bool                      fDeny;
+	DWORD                     dwMask;
+	std::basic_string<WCHAR>  strSid;
+};
+
+class CMemoryRegistry : public IRegistryBackend
+{
+private:
+	typedef std::basic_string<WCHAR> String;
+
+	struct VALUE
+	{
+		DWORD             dwType;
+		std::vector<BYTE> data;
+	};
+
+	struct NODE
+	{
+		String                                 strName;
+		NODE                                  *pParent;
+		bool                                   fDeleted;
+		ULONGLONG                              ullLastWrite;
+		std::map<String, std::shared_ptr<NODE>> children;
+		std::map<String, VALUE>                values;
+		std::vector<MEMORY_REGISTRY_ACE>       acl;
+	};
+
+	// What an HKEY from this registry points to.
+	struct HANDLE_DATA
+	{
+		std::shared_ptr<NODE> pNode;
+	};
+
+	IUserChoiceClock      *_pClock;
+	std::recursive_mutex   _mutex;
+	std::shared_ptr<NODE>  _pClassesRoot;
+	std::shared_ptr<NODE>  _pCurrentUser;
+	String                 _strUserSid;
+	CAssocIdentityCache   *_pIdentityCache;
+	REGISTRY_OP_COUNTS     _counts;
+
+	// Folded names of keys that writes are blocked under.
+	std::vector<String>    _protectedNames;
+
+	// Protected write batches, which aren't kept per thread here. The token
+	// is only counted once per batch.
+	DWORD                  _cBatchDepth;
+	bool                   _fBatchToken;
+
+	static String s_Fold(LPCWSTR psz, size_t cch);
+
+	std::shared_ptr<NODE> _NodeFromKey(HKEY hKey);
+
+	// Walks pszSubKey from the key, creating missing keys if fCreate is set.
+	std::shared_ptr<NODE> _Walk(HKEY hKey, LPCWSTR pszSubKey, bool fCreate, LSTATUS *pls);
+
+	HKEY _MakeHandle(const std::shared_ptr<NODE> &pNode);
+
+	bool _IsSetValueDenied(const NODE *pNode) const;
+
+	// Whether the key, or a key above it, has a name from ProtectKeyName.
+	bool _IsNameProtected(const NODE *pNode) const;
+
+	// Looks up the user for a protected write, the way
+	// CShellProtectedRegLock::Init does.
+	void _QueryIdentity();
+
+	// Looks up the user for SetProtectedValues, once per batch.
+	void _QueryToken();
+
+	void _Touch(NODE *pNode);
+
+	// CShellProtectedRegLock::Unlock and Lock.
+	void _Unlock(NODE *pNode);
+	void _Lock(NODE *pNode);
+
+public:
+	/**
+	 * @param pClock  Source of last write times; it has to outlive the
+	 *                registry.
+	 */
+	CMemoryRegistry(IUserChoiceClock *pClock);
+	~CMemoryRegistry();
+
+	// SID that protected values are locked for, and access is checked as.
+	void SetUserSid(LPCWSTR pszSid);
+
+	/**
+	 * Takes the user from an identity cache, like the Win32 backend does,
+	 * rather than from SetUserSid. The cache has to outlive the registry.
+	 */
+	void SetIdentityCache(CAssocIdentityCache *pCache);
+
+	/**
+	 * Blocks writes under any key with this name, like the drivers which
+	 * protect association keys do: values can't be set or deleted in it or
+	 * below it, and no subkeys can be created under it. The key can still
+	 * be renamed, which lifts the block.
+	 */
+	void ProtectKeyName(LPCWSTR pszName);
+
+	REGISTRY_OP_COUNTS GetOpCounts();
+	void ResetOpCounts();
+
+	/**
+	 * Returns a copy of a key's ACL, for tests.
+	 *
+	 * @return false if the key doesn't exist.
+	 */
+	bool GetAcl(HKEY hKey, LPCWSTR pszSubKey, std::vector<MEMORY_REGISTRY_ACE> *pAcl);
+
+	// IRegistryBackend
+	LSTATUS CreateKey(HKEY hKey, LPCWSTR pszSubKey, HKEY *phkResult) override;
+	LSTATUS OpenKey(HKEY hKey, LPCWSTR pszSubKey, HKEY *phkResult) override;
+	void CloseKey(HKEY hKey) override;
+	LSTATUS RenameKey(HKEY hKey, LPCWSTR pszNewName) override;
+	LSTATUS DeleteKey(HKEY hKey, LPCWSTR pszSubKey) override;
+	LSTATUS GetValue(HKEY hKey, LPCWSTR pszSubKey, LPCWSTR pszValue, DWORD *pdwType, void *pvData, DWORD *pcbData) override;
+	LSTATUS SetValue(HKEY hKey, LPCWSTR pszSubKey, LPCWSTR pszValue, DWORD dwType, const void *pvData, DWORD cbData) override;
+	LSTATUS DeleteValue(HKEY hKey, LPCWSTR pszSubKey, LPCWSTR pszValue) override;
+	LSTATUS QueryInfo(HKEY hKey, DWORD *pcSubKeys, DWORD *pcValues, ULONGLONG *pullLastWrite) override;
+	LSTATUS SetProtectedValue(HKEY hKey, LPCWSTR pszValue, const void *pvData, DWORD cbData) override;
+	LSTATUS DeleteProtectedValue(HKEY hKey, LPCWSTR pszValue, bool fDeleteSubKeys) override;
+	LSTATUS SetProtectedValues(HKEY hKey, const REGISTRY_PROTECTED_VALUE *pValues, size_t cValues) override;
+	void BeginProtectedBatch() override;
+	void EndProtectedBatch() override;
+};
\ No newline at end of file
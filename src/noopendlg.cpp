@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <commctrl.h>
 #include <shlobj.h>
+#include "assoclookup.h"
 
 INT_PTR CALLBACK CNoOpenDlg::v_DlgProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 {
@@ -11,19 +12,17 @@ INT_PTR CALLBACK CNoOpenDlg::v_DlgProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPAR
 		case WM_INITDIALOG:
 		{
 		   /* Load friendly type name for display */
-			HKEY hk = NULL;
-			GetExtensionRegKey(m_pszExtension, &hk);
+			std::shared_ptr<const CAssocLookupEntry> pLookup = GetAssocLookupCache()->Lookup(m_pszExtension, false);
 			WCHAR szIndirectString[MAX_PATH + 200] = { 0 };
 			DWORD dwIndirectStringSize = sizeof(szIndirectString);
 			RegQueryValueExW(
-				hk,
+				pLookup ? pLookup->GetProgIdKey() : NULL,
 				L"FriendlyTypeName",
 				NULL,
 				NULL,
 				(LPBYTE)szIndirectString,
 				&dwIndirectStringSize
 			);
-			RegCloseKey(hk);
 
 			WCHAR szFriendlyTypeName[MAX_PATH] = { 0 };
 			if (*szIndirectString)
@@ -95,8 +94,8 @@ INT_PTR CALLBACK CNoOpenDlg::v_DlgProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPAR
 	return FALSE;
 }
 
-CNoOpenDlg::CNoOpenDlg(LPCWSTR lpszPath)
-	: CImpDialog(g_hInst, (g_style == OWXS_VISTA) ? IDD_NOOPEN : IDD_NOOPEN_XP)
+CNoOpenDlg::CNoOpenDlg(LPCWSTR lpszPath, OPENWITHEXSTYLE style)
+	: CImpDialog(g_hInst, (style == OWXS_VISTA) ? IDD_NOOPEN : IDD_NOOPEN_XP)
 {
 	wcscpy_s(m_szPath, lpszPath);
 	m_pszExtension = PathFindExtensionW(m_szPath);
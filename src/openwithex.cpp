@@ -6,6 +6,10 @@
 #include "noopendlg.h"
 #include "openwithexlauncher.h"
 #include "assocuserchoice.h"
+#include "assocnotify.h"
+#include "assoclookup.h"
+#include "tracespan.h"
+#include "assoccli.h"
 #include <shlobj.h>
 #include <shlwapi.h>
 #include <stdio.h>
@@ -16,8 +20,30 @@
 HMODULE         g_hInst     = nullptr;
 HMODULE         g_hShell32  = nullptr;
 OPENWITHEXSTYLE g_style     = OWXS_VISTA;
+DWORD           g_dwServerIdleTimeout = 0;
 
-WCHAR szPath[MAX_PATH] = { 0 };
+/**
+  * Read the user's options. A resident COM server reads them again for each
+  * request, so that a style change doesn't wait for it to exit.
+  */
+void ReadUserSettings()
+{
+	wil::unique_hkey hk;
+	RegOpenKeyExW(HKEY_CURRENT_USER, L"SOFTWARE\\OpenWithEx", NULL, KEY_READ, &hk);
+	if (hk.get())
+	{
+		DWORD dwValue = 0;
+		DWORD dwSize = sizeof(DWORD);
+		RegQueryValueExW(hk.get(), L"Style", nullptr, nullptr, (LPBYTE)&dwValue, &dwSize);
+		if (dwValue < OWXS_LAST)
+			g_style = (OPENWITHEXSTYLE)dwValue;
+
+		dwValue = 0;
+		dwSize = sizeof(DWORD);
+		if (ERROR_SUCCESS == RegQueryValueExW(hk.get(), L"ServerIdleTimeout", nullptr, nullptr, (LPBYTE)&dwValue, &dwSize))
+			g_dwServerIdleTimeout = dwValue;
+	}
+}
 
 void OpenDownloadURL(LPCWSTR pszExtension)
 {
@@ -33,7 +59,12 @@ void OpenDownloadURL(LPCWSTR pszExtension)
 	);
 }
 
-void ShowOpenWithDialog(HWND hWndParent, LPCWSTR lpszPath, IMMERSIVE_OPENWITH_FLAGS flags)
+/**
+  * Show the dialogs for a file or URL. Everything about the request is
+  * passed in, since the COM server shows several at once, each on its own
+  * thread.
+  */
+void ShowOpenWithDialog(HWND hWndParent, LPCWSTR lpszPath, IMMERSIVE_OPENWITH_FLAGS flags, OPENWITHEXSTYLE style)
 {
 	bool fUri = false;
 	bool fPreregistered = false;
@@ -42,24 +73,18 @@ void ShowOpenWithDialog(HWND hWndParent, LPCWSTR lpszPath, IMMERSIVE_OPENWITH_FL
 	if (!fUri)
 	{
 		LPWSTR pszExtension = PathFindExtensionW(lpszPath);
-		wil::unique_hkey hk;
-		GetExtensionRegKey(pszExtension, &hk);
-		fPreregistered = AssociationExists(pszExtension, fUri);
+
+		/* Everything below, and the dialogs, look the extension up in the
+		   same cache entry. */
+		std::shared_ptr<const CAssocLookupEntry> pLookup = GetAssocLookupCache()->Lookup(pszExtension, fUri);
+		fPreregistered = pLookup && pLookup->Exists();
 
 		/* Check if the file is a system file and open the no-open dialog if it is. */
-		if (g_style != OWXS_NT4 && pszExtension && *pszExtension)
+		if (style != OWXS_NT4 && pszExtension && *pszExtension)
 		{	
-			LSTATUS ls = RegQueryValueExW(
-				hk.get(),
-				L"NoOpen",
-				NULL,
-				NULL,
-				NULL,
-				NULL
-			);
-			if (ls == ERROR_SUCCESS)
+			if (pLookup && pLookup->IsNoOpen())
 			{
-				CNoOpenDlg noDlg(lpszPath);
+				CNoOpenDlg noDlg(lpszPath, style);
 				INT_PTR result = noDlg.ShowDialog(hWndParent);
 				if (result == IDCANCEL)
 				{
@@ -70,11 +95,11 @@ void ShowOpenWithDialog(HWND hWndParent, LPCWSTR lpszPath, IMMERSIVE_OPENWITH_FL
 
 		/* The Can't open dialog is only shown on files with an extension
 		   that is not already registered. */
-		if ((g_style == OWXS_VISTA || g_style == OWXS_XP)
+		if ((style == OWXS_VISTA || style == OWXS_XP)
 		&& !fPreregistered && !SHRestricted(REST_NOINTERNETOPENWITH)
 			&& pszExtension && *pszExtension)
 		{
-			CCantOpenDlg coDlg(lpszPath);
+			CCantOpenDlg coDlg(lpszPath, style);
 			INT_PTR result = coDlg.ShowDialog(hWndParent);
 			if (result == IDCANCEL)
 			{
@@ -89,7 +114,7 @@ void ShowOpenWithDialog(HWND hWndParent, LPCWSTR lpszPath, IMMERSIVE_OPENWITH_FL
 	}
 
 	CBaseOpenAsDlg *pDialog = nullptr;
-	switch (g_style)
+	switch (style)
 	{
 		case OWXS_VISTA:
 			pDialog = new CVistaOpenAsDlg(lpszPath, flags, fUri, fPreregistered);
@@ -99,7 +124,7 @@ void ShowOpenWithDialog(HWND hWndParent, LPCWSTR lpszPath, IMMERSIVE_OPENWITH_FL
 			break;
 		case OWXS_2K:
 		case OWXS_NT4:
-			pDialog = new CClassicOpenAsDlg(lpszPath, flags, fUri, fPreregistered);
+			pDialog = new CClassicOpenAsDlg(lpszPath, flags, style, fUri, fPreregistered);
 			break;
 	}
 	pDialog->ShowDialog(hWndParent);
@@ -118,26 +143,45 @@ int WINAPI wWinMain(
 	AllocConsole();
 	SetConsoleTitleW(L"OpenWithEx");
 	_wfreopen_s(&dummy, L"CONOUT$", L"w", stdout);
+	GetProcessRingLog()->SetEcho(stdout);
 #endif
 
+	/* The log is kept in every build, and dumped if the process crashes or
+	   anyone asks for it. */
+	RingLogInstallShellHandlers();
+
 	debuglog(L"OpenWithEx Debug Console\n\n");
 
 	g_hInst = hInstance;
 
-	(void)CoInitialize(nullptr);
+	/* Spans go to ETW, once something listens for them. The first one is
+	   counted from when the process was created. */
+	TraceSetSink(GetShellTraceSink(), GetShellTraceClock());
 
-	/* Read user style option */
-	wil::unique_hkey hk;
-	RegOpenKeyExW(HKEY_CURRENT_USER, L"SOFTWARE\\OpenWithEx", NULL, KEY_READ, &hk);
-	if (hk.get())
+	FILETIME ftCreation = { 0 }, ftExit, ftKernel, ftUser;
+	GetProcessTimes(GetCurrentProcess(), &ftCreation, &ftExit, &ftKernel, &ftUser);
+	ULONGLONG ullStarted = ((ULONGLONG)ftCreation.dwHighDateTime << 32) | ftCreation.dwLowDateTime;
+
+	CTraceActivity processStart(TRACE_PROCESS_START, nullptr, ullStarted);
+
+	int argc = 0;
+	LPWSTR *argv = CommandLineToArgvW(lpCmdLine, &argc);
+
+	/* Commands don't show any UI, so they are run before COM, the user's
+	   settings or anything the dialogs need. */
+	ASSOC_CLI_ARGS cliArgs;
+	if (argv && AssocCliParse(argc, (const LPCWSTR *)argv, &cliArgs) != AssocCliCommand::NONE)
 	{
-		DWORD dwValue = 0;
-		DWORD dwSize = sizeof(DWORD);
-		RegQueryValueExW(hk.get(), L"Style", nullptr, nullptr, (LPBYTE)&dwValue, &dwSize);
-		if (dwValue < OWXS_LAST)
-			g_style = (OPENWITHEXSTYLE)dwValue;
+		processStart.Stop();
+		LocalFree(argv);
+		return AssocCliRunShell(cliArgs);
 	}
 
+	(void)CoInitialize(nullptr);
+
+	/* Read user style option */
+	ReadUserSettings();
+
 	g_hShell32 = GetModuleHandleW(L"shell32.dll");
 
 	/**
@@ -149,18 +193,40 @@ int WINAPI wWinMain(
 	WCHAR szModulePath[MAX_PATH] = { 0 };
 	GetModuleFileNameW(hInstance, szModulePath, MAX_PATH);
 
-	int argc = 0;
-	LPWSTR *argv = CommandLineToArgvW(lpCmdLine, &argc);
+	WCHAR szPath[MAX_PATH] = { 0 };
+
 	for (int i = 0; i < argc; i++)
 	{
 		/* COM bullshit */
 		if (0 == _wcsicmp(argv[i], L"-embedding"))
 		{
-			debuglog(L"Started as COM server.\n");			
-			wil::com_ptr<COpenWithExLauncher> powl = new COpenWithExLauncher();
+			debuglog(L"Started as COM server.\n");
+
+			/* Objects handed out to clients point at these, so they have
+			   to outlive them. The first request's latency is counted from
+			   when the process started, to compare against later ones. */
+			CLauncherLifetime lifetime(
+				GetSystemUserChoiceClock(),
+				(ULONGLONG)g_dwServerIdleTimeout * USERCHOICE_FILETIME_PER_MS,
+				ullStarted
+			);
+
+			/* Each request's dialog is shown on its own thread, which wakes
+			   this one up when it closes. */
+			std::unique_ptr<ILauncherDispatchSink> pWakeSink = CreateThreadWakeSink(GetCurrentThreadId());
+			CLauncherDispatcher dispatcher(GetShellLauncherTarget(), pWakeSink.get(), &lifetime);
+
+			wil::com_ptr<COpenWithExLauncher> powl = new COpenWithExLauncher(&lifetime, &dispatcher);
 			if (powl)
 			{
+				processStart.Stop();
 				HRESULT hr = powl->RunMessageLoop();
+				dispatcher.WaitAll();
+
+				// Don't lose a notification that is still waiting out its
+				// window.
+				GetShellAssocChangeNotifier()->Flush();
+
 				if (FAILED(hr))
 				{
 					LocalizedMessageBox(
@@ -191,7 +257,11 @@ int WINAPI wWinMain(
 		return -1;
 	}
 
-	ShowOpenWithDialog(NULL, szPath, IMMERSIVE_OPENWITH_OVERRIDE);
+	processStart.SetSubject(szPath);
+	processStart.Stop();
+	ShowOpenWithDialog(NULL, szPath, IMMERSIVE_OPENWITH_OVERRIDE, g_style);
+
+	GetShellAssocChangeNotifier()->Flush();
 
 	CoUninitialize();
 	return 0;
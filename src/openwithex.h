@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <shobjidl.h>
 #include "util.h"
+#include "ringlog.h"
 
 #define VER_MAJOR              1
 #define VER_MINOR              2
@@ -12,6 +13,9 @@
 
 extern HMODULE g_hInst;
 extern HMODULE g_hShell32;
+
+// The style the user chose. Only the main thread reads it; each dialog is
+// shown with the style its request came in with.
 extern enum OPENWITHEXSTYLE
 {
 	OWXS_VISTA,
@@ -21,6 +25,10 @@ extern enum OPENWITHEXSTYLE
 	OWXS_LAST,
 } g_style;
 
+// How long the COM server stays up with nothing to do, in milliseconds. Zero
+// means it exits after one request.
+extern DWORD g_dwServerIdleTimeout;
+
 enum IMMERSIVE_OPENWITH_FLAGS
 {
 	IMMERSIVE_OPENWITH_NONE = 0x0,
@@ -37,22 +45,18 @@ enum IMMERSIVE_OPENWITH_FLAGS
 	IMMERSIVE_OPENWITH_CALLING_IN_APP = 0x800,
 };
 
+void ReadUserSettings();
 void OpenDownloadURL(LPCWSTR pszExtension);
-void ShowOpenWithDialog(HWND hWndParent, LPCWSTR lpszPath, IMMERSIVE_OPENWITH_FLAGS flags);
+void ShowOpenWithDialog(HWND hWndParent, LPCWSTR lpszPath, IMMERSIVE_OPENWITH_FLAGS flags, OPENWITHEXSTYLE style);
 
 EXTERN_C WINUSERAPI HRESULT WINAPI SHCreateAssocHandler(UINT uFlags, LPCWSTR pszExt, LPCWSTR pszApp, IAssocHandler **ppah);
 EXTERN_C WINUSERAPI bool WINAPI IsBlockedFromOpenWithBrowse(LPCWSTR lpszPath);
 
 DEFINE_GUID(CLSID_ExecuteUnknown, 0xE44E9428, 0xBDBC, 0x4987, 0xA0,0x99, 0x40,0xDC,0x8F,0xD2,0x55,0xE7);
 
-inline void debuglog(const wchar_t *format, ...)
-{
-#ifndef NDEBUG
-	va_list args;
-	va_start(args, format);
-	vwprintf_s(format, args);
-#endif
-}
+// Logs to the process's ring log, which can be dumped in any build. Debug
+// builds also echo it to the console.
+#define debuglog(FORMAT, ...) RINGLOG(FORMAT, ##__VA_ARGS__)
 
 /* Icons */
 #define IDI_OPENWITH 100
@@ -108,4 +112,4 @@ inline void debuglog(const wchar_t *format, ...)
 #define IDS_OTHER_XP              1009
 #define IDS_BROWSETITLE_XP        1010
 
-// Extra newline required because we are included in an .rc file:
+// Extra newline required because we are included in an .rc file:
\ No newline at end of file
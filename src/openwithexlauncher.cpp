@@ -1,46 +1,30 @@
 #include "openwithexlauncher.h"
 #include <stdio.h>
 #include <shlwapi.h>
-#include <stdarg.h>
 #include "wil/com.h"
 #include "wil/resource.h"
 #include "iobjectwithopenwithflags.h"
+#include "assoclookup.h" // for CAssocLookupCache
+#include "associconresolver.h" // for CCachingAssocIconSource
+#include "tracespan.h"
+#include "ringlog.h"
 
-// Disable debug calls if we are in release mode:
-#ifdef NDEBUG
-	#define Log(...)
-	#define DebugSetMethodName(METHOD_NAME)
-	#define LogReturn(RETURNVALUE) { return RETURNVALUE; }
-#endif
+// Every message goes to the process's ring log, in every build. It is only
+// formatted when the log is dumped, or echoed to the debug console.
+#define DebugSetMethodName(METHOD_NAME) LPCWSTR method = METHOD_NAME;
 
-#ifndef NDEBUG
-	#define DebugSetMethodName(METHOD_NAME) LPCWSTR method = METHOD_NAME;
+#define Log(METHODNAME, FORMAT, ...) \
+	RINGLOG_FROM(GetProcessRingLog(), METHODNAME, m_instId, FORMAT, ##__VA_ARGS__)
 
-	#define LogReturn(RETURNVALUE, METHODNAME, FORMAT, ...)       \
+#define LogReturn(RETURNVALUE, METHODNAME, FORMAT, ...)         \
 	{                                                             \
-		Log(METHODNAME, FORMAT, __VA_ARGS__);                     \
-        Log(METHODNAME, L"<return value = %s>", L#RETURNVALUE);   \
-        return RETURNVALUE;                                       \
+		Log(METHODNAME, FORMAT, ##__VA_ARGS__);                   \
+		Log(METHODNAME, L"<return value = %s>", L#RETURNVALUE);   \
+		return RETURNVALUE;                                       \
 	}
-#endif
 
 #pragma region "Debugging"
-#ifndef NDEBUG
 DWORD COpenWithExLauncher::s_instCounter = 0;
-
-void COpenWithExLauncher::Log(const wchar_t *szMethodName, const wchar_t *format, ...)
-{
-	va_list args;
-	va_start(args, format);
-
-	WCHAR buffer[2048];
-
-	vswprintf_s(buffer, format, args);
-	wprintf_s(L"[%s:%d] %s", szMethodName, m_instId, buffer);
-
-	va_end(args);
-}
-#endif
 #pragma endregion
 
 #pragma region "IUnknown"
@@ -59,13 +43,7 @@ STDMETHODIMP COpenWithExLauncher::QueryInterface(REFIID riid, LPVOID *ppvObj)
 
 	Log(method, L"Entered method\n");
 
-	LPWSTR lpString = nullptr;
-	(void)StringFromCLSID(riid, &lpString);
-	if (lpString && lpString[0])
-	{
-		Log(method, L"Querying %s\n", lpString);
-		CoTaskMemFree(lpString);
-	}
+	Log(method, L"Querying %g\n", riid);
 
 	if (!ppvObj)
 	{
@@ -176,16 +154,7 @@ STDMETHODIMP COpenWithExLauncher::QueryService(REFGUID guidService, REFIID riid,
 
 	Log(method, L"Entered method\n");
 
-	LPWSTR lpString = nullptr;
-	LPWSTR lpString2 = nullptr;
-	(void)StringFromCLSID(guidService, &lpString);
-	(void)StringFromCLSID(riid, &lpString2);
-	if (lpString && lpString[0] && lpString2 && lpString2[0])
-	{
-		Log(method, L"Querying service %s with SID %s\n", lpString, lpString2);
-		CoTaskMemFree(lpString);
-		CoTaskMemFree(lpString2);
-	}
+	Log(method, L"Querying service %g with SID %g\n", guidService, riid);
 
 	Log(method, L"Exiting method\n");
 	return E_NOTIMPL;// IUnknown_QueryService(this, guidService, riid, ppvObject);
@@ -399,19 +368,9 @@ STDMETHODIMP COpenWithExLauncher::Execute()
 			}
 		}
 	}
-	if (*szPath)
-	{
-		ShowOpenWithDialog(NULL, szPath, flags);
-	}
-	else
-	{
-		LocalizedMessageBox(
-			NULL,
-			IDS_ERR_NOPATH,
-			MB_ICONERROR
-		);
-	}
-	PostThreadMessageW(GetCurrentThreadId(), 0x8001, 0, 0);
+
+	// The dialog complains if there is no path, on its own thread as well.
+	_Dispatch(NULL, szPath, flags);
 	Log(method, L"Exiting method\n");
 	return S_OK;
 }
@@ -425,8 +384,7 @@ STDMETHODIMP COpenWithExLauncher::Launch(HWND hWndParent, LPCWSTR lpszPath, IMME
 		L"\nhWndParent: 0x%X\nlpszPath: %s\nflags : 0x%X\n",
 		hWndParent, lpszPath, flags
 	);
-	ShowOpenWithDialog(hWndParent, lpszPath, flags);
-	PostThreadMessageW(GetCurrentThreadId(), 0x8001, 0, 0);
+	_Dispatch(hWndParent, lpszPath, flags);
 	return S_OK;
 }
 #pragma endregion // "IOpenWithLauncher"
@@ -444,18 +402,22 @@ STDMETHODIMP COpenWithExLauncher::CreateInstance(IUnknown *pUnkOuter, REFIID rii
 		return E_INVALIDARG;
 	}
 
-	LPWSTR lpString = nullptr;
-	(void)StringFromCLSID(riid, &lpString);
-	Log(method, L"riid is %s\n", lpString);
+	*ppvObject = nullptr;
 
-	if (riid == IID_IUnknown)
+	if (pUnkOuter)
 	{
-		Log(method, L"riid is IUnknown, putting that out...\n");
-		*ppvObject = this;
+		LogReturn(CLASS_E_NOAGGREGATION, method, L"Exiting method\n");
 	}
 
+	Log(method, L"riid is %g\n", riid);
+
+	// Every client gets its own object, so that nothing one request set is
+	// left behind for the next one a resident server serves.
+	wil::com_ptr<COpenWithExLauncher> pInstance = new COpenWithExLauncher(m_pLifetime, m_pDispatcher, true);
+	HRESULT hr = pInstance->QueryInterface(riid, ppvObject);
+
 	Log(method, L"Exiting method\n");
-	return S_OK;
+	return hr;
 }
 
 STDMETHODIMP COpenWithExLauncher::LockServer(BOOL fLock)
@@ -463,15 +425,123 @@ STDMETHODIMP COpenWithExLauncher::LockServer(BOOL fLock)
 	DebugSetMethodName(L"COpenWithExLauncher::LockServer");
 
 	Log(method, L"Entered method\n");
+	if (m_pLifetime)
+	{
+		if (fLock)
+			m_pLifetime->AddRef();
+		else
+			m_pLifetime->Release();
+	}
 	Log(method, L"Exiting method\n");
 	return S_OK;
 }
 #pragma endregion // "IClassFactory"
 
+#pragma region "CAssocKeyWatcher"
+/**
+ * Watches the keys associations are read from. A resident server keeps the
+ * lookup cache between requests, and has to drop it when an association is
+ * changed by anything other than itself.
+ */
+class CAssocKeyWatcher
+{
+public:
+	static constexpr size_t MAX_KEYS = 4;
+
+private:
+	struct WATCH
+	{
+		wil::unique_hkey  hk;
+		wil::unique_event event;
+	};
+
+	WATCH  _rgWatches[MAX_KEYS];
+	size_t _cWatches;
+
+	// Asks for the watch's event to be set on the next change. Each request
+	// only fires once.
+	static bool s_Arm(WATCH &watch)
+	{
+		return ERROR_SUCCESS == RegNotifyChangeKeyValue(
+			watch.hk.get(),
+			TRUE,
+			REG_NOTIFY_CHANGE_NAME | REG_NOTIFY_CHANGE_LAST_SET,
+			watch.event.get(),
+			TRUE
+		);
+	}
+
+public:
+	CAssocKeyWatcher()
+		: _cWatches(0)
+	{
+	}
+
+	void Start()
+	{
+		static const struct
+		{
+			HKEY    hkRoot;
+			LPCWSTR pszSubKey;
+		} c_rgKeys[] = {
+			{ HKEY_CURRENT_USER,  L"SOFTWARE\\Classes" },
+			{ HKEY_LOCAL_MACHINE, L"SOFTWARE\\Classes" },
+			{ HKEY_CURRENT_USER,  L"SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Explorer\\FileExts" },
+			{ HKEY_CURRENT_USER,  L"SOFTWARE\\Microsoft\\Windows\\Shell\\Associations" },
+		};
+		static_assert(ARRAYSIZE(c_rgKeys) == MAX_KEYS, "Every key needs a watch");
+
+		for (const auto &key : c_rgKeys)
+		{
+			WATCH &watch = _rgWatches[_cWatches];
+			if (ERROR_SUCCESS != RegOpenKeyExW(key.hkRoot, key.pszSubKey, 0, KEY_NOTIFY, &watch.hk))
+				continue;
+
+			if (!watch.event.try_create(wil::EventOptions::None, nullptr) || !s_Arm(watch))
+			{
+				watch.hk.reset();
+				watch.event.reset();
+				continue;
+			}
+
+			_cWatches++;
+		}
+	}
+
+	// Fills in the events to wait for, and returns how many there are.
+	DWORD GetEvents(HANDLE *rghEvents)
+	{
+		for (size_t i = 0; i < _cWatches; i++)
+		{
+			rghEvents[i] = _rgWatches[i].event.get();
+		}
+		return (DWORD)_cWatches;
+	}
+
+	// Watches again for changes after a watch's event was set.
+	void Rearm(size_t i)
+	{
+		s_Arm(_rgWatches[i]);
+	}
+};
+#pragma endregion // "CAssocKeyWatcher"
+
 #pragma region "COpenWithExLauncher"
-COpenWithExLauncher::COpenWithExLauncher()
-	: m_pSite(nullptr)
+COpenWithExLauncher::COpenWithExLauncher(CLauncherLifetime *pLifetime, CLauncherDispatcher *pDispatcher, bool fInstance)
+	: m_cRef(0)
+	, m_pSite(nullptr)
+	, m_pAssocElm(nullptr)
 	, m_pSelection(nullptr)
+	, m_dwKeyState(0)
+	, m_pszParameters(nullptr)
+	, m_position{ 0 }
+	, m_nShow(SW_SHOWNORMAL)
+	, m_pszDirectory(nullptr)
+	, m_fNoShowUI(FALSE)
+	, m_pLifetime(pLifetime)
+	, m_pDispatcher(pDispatcher)
+	, m_fInstance(fInstance)
+	, m_ullActivated(GetSystemUserChoiceClock()->Now())
 {
 	DebugSetMethodName(L"COpenWithExLauncher::COpenWithExLauncher");
 
@@ -479,10 +549,11 @@ COpenWithExLauncher::COpenWithExLauncher()
 	// yet.
 	debuglog(L"[COpenWithExLauncher::COpenWithExLauncher] Entered method\n");
 
-#ifndef NDEBUG
 	m_instId = s_instCounter++;
 	Log(method, L"Set instance ID to %d\n", m_instId);
-#endif
+
+	if (m_pLifetime && m_fInstance)
+		m_pLifetime->AddRef();
 
 	Log(method, L"Exiting method\n");
 }
@@ -502,9 +573,34 @@ COpenWithExLauncher::~COpenWithExLauncher()
 	if (m_pSelection)
 		m_pSelection->Release();
 
+	Str_SetPtrW(&m_pszParameters, nullptr);
+	Str_SetPtrW(&m_pszDirectory, nullptr);
+
+	if (m_pLifetime && m_fInstance)
+		m_pLifetime->Release();
+
 	Log(method, L"Exiting method\n");
 }
 
+void COpenWithExLauncher::_Dispatch(HWND hWndParent, LPCWSTR lpszPath, IMMERSIVE_OPENWITH_FLAGS flags)
+{
+	// The system clock's time is on the same scale as the trace clock's, if
+	// less precise.
+	CTraceActivity activity(TRACE_ACTIVATION, lpszPath, m_ullActivated);
+
+	// Settings may have changed since the last request.
+	if (m_pLifetime->IsResident())
+		ReadUserSettings();
+
+	OPENWITH_REQUEST request;
+	request.hWndParent = hWndParent;
+	request.strPath = lpszPath ? lpszPath : L"";
+	request.dwFlags = flags;
+	request.dwStyle = g_style;
+	request.ullActivated = m_ullActivated;
+	m_pDispatcher->Dispatch(request);
+}
+
 HRESULT COpenWithExLauncher::RunMessageLoop()
 {
 	DebugSetMethodName(L"COpenWithExLauncher::RunMessageLoop");
@@ -524,36 +620,88 @@ HRESULT COpenWithExLauncher::RunMessageLoop()
 		return hr;
 	}
 
-	hr = CoRegisterClassObject(CLSID_ExecuteUnknown, pExec.get(), CLSCTX_LOCAL_SERVER, NULL, &dwRegister);
+	// A one-shot server leaves the next activation to a new process.
+	bool fResident = m_pLifetime->IsResident();
+	hr = CoRegisterClassObject(
+		CLSID_ExecuteUnknown,
+		pExec.get(),
+		CLSCTX_LOCAL_SERVER,
+		fResident ? REGCLS_MULTIPLEUSE : REGCLS_SINGLEUSE,
+		&dwRegister
+	);
 	Log(method, L"Exiting CoRegisterClassObject\n");
 	if (FAILED(hr))
 	{
 		return hr;
 	}
 
-	MSG msg;
-	while (true)
+	CAssocKeyWatcher watcher;
+	if (fResident)
+	{
+		watcher.Start();
+	}
+
+	IUserChoiceClock *pClock = GetSystemUserChoiceClock();
+	bool fQuit = false;
+	while (!fQuit)
 	{
-		if (GetMessageW(&msg, NULL, 0, 0) <= 0)
+		DWORD dwTimeout = INFINITE;
+		ULONGLONG ullExitTime = 0;
+		if (m_pLifetime->GetExitTime(&ullExitTime))
 		{
-			Log(method, L"Exiting because message loop is over\n");
-			CoRevokeClassObject(dwRegister);
-			return hr;
+			ULONGLONG ullNow = pClock->Now();
+			if (ullNow >= ullExitTime)
+			{
+				Log(method, L"Exiting because the server is idle\n");
+				break;
+			}
+
+			ULONGLONG ullWait = (ullExitTime - ullNow + USERCHOICE_FILETIME_PER_MS - 1) / USERCHOICE_FILETIME_PER_MS;
+			dwTimeout = (ullWait < INFINITE) ? (DWORD)ullWait : INFINITE - 1;
 		}
 
-		if (msg.message)
+		HANDLE rghEvents[CAssocKeyWatcher::MAX_KEYS];
+		DWORD cEvents = watcher.GetEvents(rghEvents);
+		DWORD dwWait = MsgWaitForMultipleObjectsEx(cEvents, rghEvents, dwTimeout, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+		if (dwWait >= WAIT_OBJECT_0 && dwWait < WAIT_OBJECT_0 + cEvents)
 		{
-			Log(method, L"Received message 0x%X 0x%X 0x%X 0x%X\n", msg.message, msg.hwnd, msg.wParam, msg.lParam);
-			if (msg.message == 0x8001)
+			// Something else changed an association, so what the caches say
+			// may not be true anymore. Changing an association also makes the
+			// shell rebuild its icon cache.
+			Log(method, L"Association keys changed, dropping the lookup and icon caches\n");
+			watcher.Rearm(dwWait - WAIT_OBJECT_0);
+			GetAssocLookupCache()->InvalidateAll();
+			GetShellAssocIconCache()->Clear();
+			continue;
+		}
+
+		MSG msg;
+		while (PeekMessageW(&msg, NULL, 0, 0, PM_REMOVE))
+		{
+			if (msg.message == WM_QUIT)
 			{
+				Log(method, L"Exiting because message loop is over\n");
+				fQuit = true;
 				break;
 			}
-		}
 
-		TranslateMessage(&msg);
-		DispatchMessageW(&msg);
+			TranslateMessage(&msg);
+			DispatchMessageW(&msg);
+		}
 	}
 
+	CoRevokeClassObject(dwRegister);
+
+	LAUNCHER_LIFETIME_COUNTS counts = m_pLifetime->GetCounts();
+	Log(
+		method,
+		L"Served %u requests: first in %llu ms, later ones in %llu ms on average, %llu ms at most\n",
+		counts.cRequests,
+		counts.ullColdLatency / USERCHOICE_FILETIME_PER_MS,
+		counts.AverageWarmLatency() / USERCHOICE_FILETIME_PER_MS,
+		counts.ullWarmLatencyMax / USERCHOICE_FILETIME_PER_MS
+	);
+
 	Log(method, L"Exiting method\n");
 	return S_OK;
 }
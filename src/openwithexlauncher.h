@@ -1,6 +1,8 @@
 #pragma once
 #include "iopenwithlauncher.h"
 #include "iobjectwithassociationelement.h"
+#include "launcherlifetime.h"
+#include "launcherdispatcher.h"
 
 class COpenWithExLauncher
 	: public IUnknown
@@ -34,6 +36,18 @@ private:
 	int    m_nShow;
 	LPWSTR m_pszDirectory;
 	BOOL   m_fNoShowUI;
+
+	// COpenWithExLauncher
+	CLauncherLifetime   *m_pLifetime;
+	CLauncherDispatcher *m_pDispatcher;
+
+	// Whether this object was handed out by CreateInstance, rather than
+	// being the class object, and when.
+	bool      m_fInstance;
+	ULONGLONG m_ullActivated;
+
+	// Copies a request out and shows its dialog on another thread.
+	void _Dispatch(HWND hWndParent, LPCWSTR lpszPath, IMMERSIVE_OPENWITH_FLAGS flags);
 public:
 	// IUnknown
 	STDMETHODIMP QueryInterface(REFIID riid, LPVOID *ppvObj) override;
@@ -78,14 +92,28 @@ STDMETHODIMP_(	ULONG) Release() override;
 	STDMETHODIMP LockServer(BOOL fLock) override;
 
 	// COpenWithExLauncher
-	COpenWithExLauncher();
+	/**
+	 * @param pLifetime    Told about every object, so it can decide when the
+	 *                     server exits.
+	 * @param pDispatcher  Shows requests' dialogs.
+	 * @param fInstance    Whether this object is being handed out to a
+	 *                     client.
+	 *
+	 * The class object passes both on to the objects it creates.
+	 */
+	COpenWithExLauncher(CLauncherLifetime *pLifetime, CLauncherDispatcher *pDispatcher, bool fInstance = false);
 	~COpenWithExLauncher();
 
+	/**
+	 * Registers the class object and takes requests until the lifetime says
+	 * to exit. Dialogs are shown on the dispatcher's threads, so requests
+	 * never wait for each other. A resident server also watches the
+	 * association keys, and drops the lookup and icon caches when anything
+	 * else changes them.
+	 */
 	HRESULT RunMessageLoop();
 
-#ifndef NDEBUG
+	// Tells objects apart in the log.
 	static DWORD s_instCounter;
 	DWORD m_instId;
-	inline void Log(const wchar_t *szMethodName, const wchar_t *format, ...);
-#endif
 };
\ No newline at end of file
@@ -0,0 +1,181 @@
+#include "protectedacl.h"
+
+#include <string.h>
+
+// ACL and ACE fields are little endian on every Windows platform, and can be
+// unaligned in the middle of an ACL, so they are read and written bytewise.
+static WORD ReadWord(const BYTE *pb)
+{
+	return (WORD)(pb[0] | (pb[1] << 8));
+}
+
+static DWORD ReadDword(const BYTE *pb)
+{
+	return (DWORD)pb[0] | ((DWORD)pb[1] << 8) | ((DWORD)pb[2] << 16) | ((DWORD)pb[3] << 24);
+}
+
+static void WriteWord(BYTE *pb, WORD w)
+{
+	pb[0] = (BYTE)w;
+	pb[1] = (BYTE)(w >> 8);
+}
+
+static void WriteDword(BYTE *pb, DWORD dw)
+{
+	pb[0] = (BYTE)dw;
+	pb[1] = (BYTE)(dw >> 8);
+	pb[2] = (BYTE)(dw >> 16);
+	pb[3] = (BYTE)(dw >> 24);
+}
+
+DWORD ProtectedAclSidLength(const BYTE *pbSid, size_t cbMax)
+{
+	// Revision, sub-authority count and a 6 byte identifier authority, then
+	// the sub-authorities.
+	constexpr BYTE SID_REVISION = 1;
+	constexpr BYTE SID_MAX_SUB_AUTHORITIES = 15;
+
+	if (!pbSid || cbMax < 8 || pbSid[0] != SID_REVISION || pbSid[1] > SID_MAX_SUB_AUTHORITIES)
+	{
+		return 0;
+	}
+
+	DWORD cbSid = 8 + 4 * (DWORD)pbSid[1];
+	return (cbSid <= cbMax) ? cbSid : 0;
+}
+
+CProtectedAcl::CProtectedAcl()
+	: _pbSource(nullptr)
+	, _bRevision(ACL_REVISION)
+	, _cRemoved(0)
+{
+}
+
+void CProtectedAcl::Reset()
+{
+	_pbSource = nullptr;
+	_cRemoved = 0;
+	_kept.clear();
+}
+
+bool CProtectedAcl::Parse(const BYTE *pbAcl, size_t cbAcl)
+{
+	Reset();
+
+	if (!pbAcl || cbAcl < PROTECTED_ACL_HEADER_CB)
+	{
+		return false;
+	}
+
+	WORD cbAclSize = ReadWord(&pbAcl[2]);
+	WORD cAces = ReadWord(&pbAcl[4]);
+	if (cbAclSize < PROTECTED_ACL_HEADER_CB || cbAclSize > cbAcl)
+	{
+		return false;
+	}
+
+	size_t ib = PROTECTED_ACL_HEADER_CB;
+	for (WORD i = 0; i < cAces; i++)
+	{
+		if (ib + 4 > cbAclSize)
+		{
+			return false;
+		}
+
+		BYTE bType = pbAcl[ib];
+		WORD cbAce = ReadWord(&pbAcl[ib + 2]);
+		if (cbAce < 4 || (cbAce & 3) || ib + cbAce > cbAclSize)
+		{
+			return false;
+		}
+
+		// Only the mask is compared, like TWinUI does, so the SID and flags
+		// of the ACE don't matter.
+		if (bType == ACCESS_DENIED_ACE_TYPE && cbAce >= PROTECTED_ACE_HEADER_CB &&
+			ReadDword(&pbAcl[ib + 4]) == KEY_SET_VALUE)
+		{
+			_cRemoved++;
+		}
+		else
+		{
+			_kept.push_back({ ib, cbAce });
+		}
+
+		ib += cbAce;
+	}
+
+	_pbSource = pbAcl;
+	_bRevision = pbAcl[0];
+	return true;
+}
+
+const BYTE *CProtectedAcl::_Build(const BYTE *pbFirstAce, WORD cbFirstAce, DWORD *pcbAcl)
+{
+	size_t cbAcl = PROTECTED_ACL_HEADER_CB + cbFirstAce;
+	for (const ACE_REF &ace : _kept)
+		cbAcl += ace.cbSize;
+
+	size_t cAces = _kept.size() + (pbFirstAce ? 1 : 0);
+	if (cbAcl > MAXWORD || cAces > MAXWORD)
+	{
+		return nullptr;
+	}
+
+	// The buffer only ever grows, so after the first lock and unlock this
+	// doesn't allocate.
+	if (_buffer.size() < cbAcl)
+		_buffer.resize(cbAcl);
+
+	BYTE *pb = _buffer.data();
+	pb[0] = _bRevision;
+	pb[1] = 0;
+	WriteWord(&pb[2], (WORD)cbAcl);
+	WriteWord(&pb[4], (WORD)cAces);
+	WriteWord(&pb[6], 0);
+
+	size_t ib = PROTECTED_ACL_HEADER_CB;
+	if (pbFirstAce)
+	{
+		memcpy(&pb[ib], pbFirstAce, cbFirstAce);
+		ib += cbFirstAce;
+	}
+
+	for (const ACE_REF &ace : _kept)
+	{
+		memcpy(&pb[ib], &_pbSource[ace.ibOffset], ace.cbSize);
+		ib += ace.cbSize;
+	}
+
+	*pcbAcl = (DWORD)cbAcl;
+	return pb;
+}
+
+const BYTE *CProtectedAcl::BuildUnlocked(DWORD *pcbAcl)
+{
+	if (!_pbSource)
+	{
+		return nullptr;
+	}
+
+	return _Build(nullptr, 0, pcbAcl);
+}
+
+const BYTE *CProtectedAcl::BuildLocked(const BYTE *pbSid, size_t cbSid, DWORD *pcbAcl)
+{
+	DWORD cbSidLength = ProtectedAclSidLength(pbSid, cbSid);
+	if (!_pbSource || !cbSidLength)
+	{
+		return nullptr;
+	}
+
+	// ACCESS_DENIED_ACE: the header, the mask and then the SID.
+	BYTE rgbAce[PROTECTED_ACE_HEADER_CB + 8 + 4 * 15];
+	WORD cbAce = (WORD)(PROTECTED_ACE_HEADER_CB + cbSidLength);
+	rgbAce[0] = ACCESS_DENIED_ACE_TYPE;
+	rgbAce[1] = 0;
+	WriteWord(&rgbAce[2], cbAce);
+	WriteDword(&rgbAce[4], KEY_SET_VALUE);
+	memcpy(&rgbAce[PROTECTED_ACE_HEADER_CB], pbSid, cbSidLength);
+
+	return _Build(rgbAce, cbAce, pcbAcl);
+}
\ No newline at end of file
@@ -0,0 +1,90 @@
+#pragma once
+
+/**
+ * Rewrites the DACL of a UserChoice key for CShellProtectedRegLock.
+ *
+ * Unlocking removes every "deny set value" ACE, and locking puts one back at
+ * the front for the current user. TWinUI does the first with DeleteAce and a
+ * SetSecurityInfo for each ACE removed, and the second by copying ACEs into a
+ * new ACL one AddAce at a time. Here the ACL is parsed once, and each
+ * transition is built in a single pass into a buffer that is kept between
+ * uses, so that it can be applied with one SetSecurityInfo.
+ *
+ * ACLs are handled as the self-relative bytes that GetSecurityInfo returns
+ * and SetSecurityInfo takes, without any Win32 calls, so the same code runs
+ * in the tests.
+ */
+
+#include "wincompat.h"
+
+#include <vector>
+
+// Size of an ACL header, and of an ACE header plus its access mask.
+#define PROTECTED_ACL_HEADER_CB 8
+#define PROTECTED_ACE_HEADER_CB 8
+
+/**
+ * Returns the length of a binary SID, or zero if it isn't valid or doesn't
+ * fit in cbMax bytes.
+ */
+DWORD ProtectedAclSidLength(const BYTE *pbSid, size_t cbMax);
+
+class CProtectedAcl
+{
+private:
+	// Where an ACE that survives unlocking is in the source ACL.
+	struct ACE_REF
+	{
+		size_t ibOffset;
+		WORD   cbSize;
+	};
+
+	const BYTE          *_pbSource;
+	BYTE                 _bRevision;
+	DWORD                _cRemoved;
+	std::vector<ACE_REF> _kept;
+	std::vector<BYTE>    _buffer;
+
+	// Builds an ACL of an optional new ACE followed by the kept ACEs.
+	const BYTE *_Build(const BYTE *pbFirstAce, WORD cbFirstAce, DWORD *pcbAcl);
+
+public:
+	CProtectedAcl();
+
+	/**
+	 * Parses an ACL. The ACL has to stay valid until the next Parse, since
+	 * the kept ACEs are copied from it when building.
+	 *
+	 * @return false if the ACL is malformed.
+	 */
+	bool Parse(const BYTE *pbAcl, size_t cbAcl);
+
+	// Forgets the parsed ACL, for when it is about to be freed.
+	void Reset();
+
+	// Number of "deny set value" ACEs found by the last Parse.
+	DWORD GetRemovedCount() const
+	{
+		return _cRemoved;
+	}
+
+	/**
+	 * Builds the parsed ACL without its "deny set value" ACEs.
+	 *
+	 * @param pcbAcl  Receives the size of the ACL.
+	 *
+	 * @return The ACL, which stays valid until the next Build call, or null
+	 *         if nothing has been parsed.
+	 */
+	const BYTE *BuildUnlocked(DWORD *pcbAcl);
+
+	/**
+	 * Builds the parsed ACL without its "deny set value" ACEs, and with a new
+	 * one for pbSid at the front.
+	 *
+	 * @return The ACL, which stays valid until the next Build call, or null
+	 *         if nothing has been parsed, the SID is invalid, or the ACL
+	 *         would be too big.
+	 */
+	const BYTE *BuildLocked(const BYTE *pbSid, size_t cbSid, DWORD *pcbAcl);
+};
\ No newline at end of file
@@ -0,0 +1,157 @@
+#include "registrybackend.h"
+
+#include <shlwapi.h>
+
+#include "shellprotectedreglock.h" // for SH***ProtectedValue APIs
+
+#include <memory>
+
+/**
+ * IRegistryBackend over the Win32 registry. The keys it hands out are real
+ * registry handles.
+ */
+class CWin32RegistryBackend : public IRegistryBackend
+{
+private:
+	// The lock shared by the protected writes of this thread's batch, which
+	// keeps the user's identity and the DACL buffer between keys.
+	static thread_local std::unique_ptr<CShellProtectedRegLock> t_pBatchLock;
+	static thread_local DWORD t_cBatchDepth;
+
+public:
+	LSTATUS CreateKey(HKEY hKey, LPCWSTR pszSubKey, HKEY *phkResult) override
+	{
+		return RegCreateKeyExW(
+			hKey,
+			pszSubKey,
+			0,
+			nullptr,
+			0,
+			KEY_READ | KEY_WRITE,
+			nullptr,
+			phkResult,
+			nullptr
+		);
+	}
+
+	LSTATUS OpenKey(HKEY hKey, LPCWSTR pszSubKey, HKEY *phkResult) override
+	{
+		return RegOpenKeyExW(hKey, pszSubKey, 0, KEY_READ, phkResult);
+	}
+
+	void CloseKey(HKEY hKey) override
+	{
+		RegCloseKey(hKey);
+	}
+
+	LSTATUS RenameKey(HKEY hKey, LPCWSTR pszNewName) override
+	{
+		return RegRenameKey(hKey, nullptr, pszNewName);
+	}
+
+	LSTATUS DeleteKey(HKEY hKey, LPCWSTR pszSubKey) override
+	{
+		return RegDeleteKeyExW(hKey, pszSubKey, 0, 0);
+	}
+
+	LSTATUS GetValue(HKEY hKey, LPCWSTR pszSubKey, LPCWSTR pszValue, DWORD *pdwType, void *pvData, DWORD *pcbData) override
+	{
+		return RegGetValueW(hKey, pszSubKey, pszValue, RRF_RT_ANY, pdwType, pvData, pcbData);
+	}
+
+	LSTATUS SetValue(HKEY hKey, LPCWSTR pszSubKey, LPCWSTR pszValue, DWORD dwType, const void *pvData, DWORD cbData) override
+	{
+		return SHSetValueW(hKey, pszSubKey, pszValue, dwType, pvData, cbData);
+	}
+
+	LSTATUS DeleteValue(HKEY hKey, LPCWSTR pszSubKey, LPCWSTR pszValue) override
+	{
+		return SHDeleteValueW(hKey, pszSubKey, pszValue);
+	}
+
+	LSTATUS QueryInfo(HKEY hKey, DWORD *pcSubKeys, DWORD *pcValues, ULONGLONG *pullLastWrite) override
+	{
+		FILETIME lastWrite;
+		LSTATUS ls = RegQueryInfoKeyW(
+			hKey,
+			nullptr, nullptr, nullptr,
+			pcSubKeys,
+			nullptr, nullptr,
+			pcValues,
+			nullptr, nullptr, nullptr,
+			&lastWrite
+		);
+
+		if (ls == ERROR_SUCCESS && pullLastWrite)
+		{
+			ULARGE_INTEGER lastWriteInt;
+			lastWriteInt.LowPart = lastWrite.dwLowDateTime;
+			lastWriteInt.HighPart = lastWrite.dwHighDateTime;
+			*pullLastWrite = lastWriteInt.QuadPart;
+		}
+
+		return ls;
+	}
+
+	LSTATUS SetProtectedValue(HKEY hKey, LPCWSTR pszValue, const void *pvData, DWORD cbData) override
+	{
+		return SHSetProtectedValue(hKey, L"UserChoice", pszValue, false, pvData, cbData);
+	}
+
+	LSTATUS DeleteProtectedValue(HKEY hKey, LPCWSTR pszValue, bool fDeleteSubKeys) override
+	{
+		return SHDeleteProtectedValue(hKey, L"UserChoice", pszValue, fDeleteSubKeys);
+	}
+
+	LSTATUS SetProtectedValues(HKEY hKey, const REGISTRY_PROTECTED_VALUE *pValues, size_t cValues) override
+	{
+		// Outside a batch, the lock only lives for this key.
+		CShellProtectedRegLock localLock;
+		CShellProtectedRegLock *pLock = t_pBatchLock ? t_pBatchLock.get() : &localLock;
+
+		LSTATUS ls = pLock->Open(hKey);
+		if (ls != ERROR_SUCCESS)
+		{
+			return ls;
+		}
+
+		pLock->Unlock();
+
+		for (size_t i = 0; i < cValues; i++)
+		{
+			LSTATUS lsValue = pLock->SetValue(pValues[i].pszValue, pValues[i].pvData, pValues[i].cbData);
+			if (ls == ERROR_SUCCESS)
+			{
+				ls = lsValue;
+			}
+		}
+
+		pLock->Lock();
+		return ls;
+	}
+
+	void BeginProtectedBatch() override
+	{
+		if (t_cBatchDepth++ == 0)
+		{
+			t_pBatchLock = std::make_unique<CShellProtectedRegLock>();
+		}
+	}
+
+	void EndProtectedBatch() override
+	{
+		if (--t_cBatchDepth == 0)
+		{
+			t_pBatchLock.reset();
+		}
+	}
+};
+
+thread_local std::unique_ptr<CShellProtectedRegLock> CWin32RegistryBackend::t_pBatchLock;
+thread_local DWORD CWin32RegistryBackend::t_cBatchDepth = 0;
+
+IRegistryBackend *GetSystemRegistryBackend()
+{
+	static CWin32RegistryBackend s_backend;
+	return &s_backend;
+}
\ No newline at end of file
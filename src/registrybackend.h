@@ -0,0 +1,177 @@
+#pragma once
+
+/**
+ * Registry access for the association core.
+ *
+ * Everything that reads or writes associations goes through an
+ * IRegistryBackend rather than calling the registry directly. On Windows,
+ * that is the real registry (GetSystemRegistryBackend). Tests and benchmarks
+ * use CMemoryRegistry instead, which lets the whole write path run without a
+ * Windows hive.
+ *
+ * The methods mirror the Win32 functions they replace, including returning
+ * Win32 error codes, so that calling code reads the same either way.
+ */
+
+#include "wincompat.h"
+
+/**
+ * A value for IRegistryBackend::SetProtectedValues.
+ */
+struct REGISTRY_PROTECTED_VALUE
+{
+	LPCWSTR     pszValue;
+	const void *pvData;
+	DWORD       cbData;
+};
+
+class IRegistryBackend
+{
+public:
+	virtual ~IRegistryBackend() {}
+
+	// RegCreateKeyExW with KEY_READ | KEY_WRITE.
+	virtual LSTATUS CreateKey(HKEY hKey, LPCWSTR pszSubKey, HKEY *phkResult) = 0;
+
+	// RegOpenKeyExW with KEY_READ.
+	virtual LSTATUS OpenKey(HKEY hKey, LPCWSTR pszSubKey, HKEY *phkResult) = 0;
+
+	virtual void CloseKey(HKEY hKey) = 0;
+
+	// RegRenameKey of hKey itself.
+	virtual LSTATUS RenameKey(HKEY hKey, LPCWSTR pszNewName) = 0;
+
+	// RegDeleteKeyExW; only a key without subkeys can be deleted.
+	virtual LSTATUS DeleteKey(HKEY hKey, LPCWSTR pszSubKey) = 0;
+
+	/**
+	 * RegGetValueW with RRF_RT_ANY. pszSubKey may be null, and a null or empty
+	 * pszValue is the default value. pvData may be null to get the size.
+	 */
+	virtual LSTATUS GetValue(HKEY hKey, LPCWSTR pszSubKey, LPCWSTR pszValue, DWORD *pdwType, void *pvData, DWORD *pcbData) = 0;
+
+	// SHSetValueW.
+	virtual LSTATUS SetValue(HKEY hKey, LPCWSTR pszSubKey, LPCWSTR pszValue, DWORD dwType, const void *pvData, DWORD cbData) = 0;
+
+	// SHDeleteValueW.
+	virtual LSTATUS DeleteValue(HKEY hKey, LPCWSTR pszSubKey, LPCWSTR pszValue) = 0;
+
+	/**
+	 * RegQueryInfoKeyW. Any of the outputs may be null.
+	 *
+	 * @param pullLastWrite  Receives the last write time as a FILETIME.
+	 */
+	virtual LSTATUS QueryInfo(HKEY hKey, DWORD *pcSubKeys, DWORD *pcValues, ULONGLONG *pullLastWrite) = 0;
+
+	/**
+	 * SHSetProtectedValue: sets a value under hKey\UserChoice, which is
+	 * locked against the user setting values.
+	 */
+	virtual LSTATUS SetProtectedValue(HKEY hKey, LPCWSTR pszValue, const void *pvData, DWORD cbData) = 0;
+
+	// SHDeleteProtectedValue.
+	virtual LSTATUS DeleteProtectedValue(HKEY hKey, LPCWSTR pszValue, bool fDeleteSubKeys) = 0;
+
+	/**
+	 * Sets several values under hKey\UserChoice, like SetProtectedValue, but
+	 * unlocking the key once before the first and locking it once after the
+	 * last.
+	 *
+	 * @return ERROR_SUCCESS, or the first error.
+	 */
+	virtual LSTATUS SetProtectedValues(HKEY hKey, const REGISTRY_PROTECTED_VALUE *pValues, size_t cValues) = 0;
+
+	/**
+	 * Protected writes made between these share the user's identity and their
+	 * buffers, rather than setting them up again for every key. Batches
+	 * nest, and belong to the calling thread.
+	 */
+	virtual void BeginProtectedBatch() = 0;
+	virtual void EndProtectedBatch() = 0;
+};
+
+/**
+ * Holds a protected write batch open for a scope.
+ */
+class CProtectedWriteBatch
+{
+private:
+	IRegistryBackend *_pRegistry;
+
+public:
+	CProtectedWriteBatch(IRegistryBackend *pRegistry)
+		: _pRegistry(pRegistry)
+	{
+		_pRegistry->BeginProtectedBatch();
+	}
+
+	CProtectedWriteBatch(const CProtectedWriteBatch &) = delete;
+	CProtectedWriteBatch &operator=(const CProtectedWriteBatch &) = delete;
+
+	~CProtectedWriteBatch()
+	{
+		_pRegistry->EndProtectedBatch();
+	}
+};
+
+/**
+ * Owns a key opened through a backend, like wil::unique_hkey does for the
+ * real registry.
+ */
+class CRegistryKey
+{
+private:
+	IRegistryBackend *_pRegistry;
+	HKEY              _hKey;
+
+public:
+	CRegistryKey(IRegistryBackend *pRegistry)
+		: _pRegistry(pRegistry)
+		, _hKey(nullptr)
+	{
+	}
+
+	CRegistryKey(const CRegistryKey &) = delete;
+	CRegistryKey &operator=(const CRegistryKey &) = delete;
+
+	~CRegistryKey()
+	{
+		reset();
+	}
+
+	HKEY get() const
+	{
+		return _hKey;
+	}
+
+	// Closes any key held, for passing to a method which opens one.
+	HKEY *put()
+	{
+		reset();
+		return &_hKey;
+	}
+
+	void reset()
+	{
+		if (_hKey)
+		{
+			_pRegistry->CloseKey(_hKey);
+			_hKey = nullptr;
+		}
+	}
+
+	// Gives up ownership without closing the key.
+	HKEY release()
+	{
+		HKEY hKey = _hKey;
+		_hKey = nullptr;
+		return hKey;
+	}
+};
+
+#ifdef _WIN32
+/**
+ * The real registry, through the Win32 API.
+ */
+IRegistryBackend *GetSystemRegistryBackend();
+#endif
\ No newline at end of file
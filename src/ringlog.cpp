@@ -0,0 +1,998 @@
+#include "ringlog.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#define RING_LOG_RECORD_WORDS (sizeof(RING_LOG_RECORD) / sizeof(ULONGLONG))
+
+// String lengths in payloads. Null strings are stored as RING_LOG_NULL_STRING,
+// and strings which were cut short have RING_LOG_TRUNCATED set.
+#define RING_LOG_NULL_STRING 0xFFFF
+#define RING_LOG_TRUNCATED   0x8000
+
+// Call sites by ID. ID 0 is for call sites past RING_LOG_MAX_EVENTS.
+static std::atomic<const CRingLogEvent *> s_rgEvents[RING_LOG_MAX_EVENTS];
+static std::atomic<DWORD>                 s_cEvents(0);
+
+static std::atomic<ULONGLONG>             s_ullNextLogId(1);
+static std::atomic<ULONGLONG>             s_ullNextThreadKey(1);
+
+/**
+ * Logs which haven't been destroyed, so that exiting threads only hand back
+ * rings which still exist. Never freed, since threads can exit after static
+ * destructors have run.
+ */
+struct RING_LOG_LIVE_LOGS
+{
+	std::mutex              mutex;
+	std::vector<ULONGLONG>  ids;
+};
+
+static RING_LOG_LIVE_LOGS *GetLiveLogs()
+{
+	static RING_LOG_LIVE_LOGS *s_pLiveLogs = new RING_LOG_LIVE_LOGS;
+	return s_pLiveLogs;
+}
+
+/**
+ * Each record is kept as words, so that a dump can read it while its thread
+ * is writing it. The first word is the record's sequence, and is zero while
+ * the rest are being written.
+ */
+struct CRingLog::RING
+{
+	std::unique_ptr<std::atomic<ULONGLONG>[]>  rgWords;
+
+	// How many records the owner has logged. Only the owner writes it.
+	std::atomic<ULONGLONG>                     ullNext;
+
+	// The key of the thread which owns the ring, or 0 if its thread exited.
+	std::atomic<ULONGLONG>                     ullOwner;
+	std::atomic<DWORD>                         dwThreadId;
+
+	RING                                      *pNext;
+
+	RING(size_t cRecords, ULONGLONG ullOwnerKey)
+		: rgWords(new std::atomic<ULONGLONG>[cRecords * RING_LOG_RECORD_WORDS])
+		, ullNext(0)
+		, ullOwner(ullOwnerKey)
+		, dwThreadId(0)
+		, pNext(nullptr)
+	{
+		for (size_t i = 0; i < cRecords * RING_LOG_RECORD_WORDS; i++)
+		{
+			rgWords[i].store(0, std::memory_order_relaxed);
+		}
+	}
+};
+
+/**
+ * The rings a thread owns, one for each log it has logged to.
+ */
+class CRingLogThread
+{
+public:
+	struct SLOT
+	{
+		ULONGLONG        ullLogId;
+		CRingLog::RING  *pRing;
+	};
+
+	ULONGLONG          ullKey;
+	DWORD              dwThreadId;
+	std::vector<SLOT>  slots;
+
+	CRingLogThread()
+		: ullKey(s_ullNextThreadKey++)
+	{
+#ifdef _WIN32
+		dwThreadId = GetCurrentThreadId();
+#else
+		dwThreadId = (DWORD)ullKey;
+#endif
+	}
+
+	// Hands the rings back for new threads to reuse. They keep their records
+	// until then.
+	~CRingLogThread()
+	{
+		RING_LOG_LIVE_LOGS *pLiveLogs = GetLiveLogs();
+		std::lock_guard<std::mutex> lock(pLiveLogs->mutex);
+
+		for (const SLOT &slot : slots)
+		{
+			if (std::find(pLiveLogs->ids.begin(), pLiveLogs->ids.end(), slot.ullLogId) != pLiveLogs->ids.end())
+			{
+				slot.pRing->ullOwner.store(0, std::memory_order_release);
+			}
+		}
+	}
+};
+
+static thread_local CRingLogThread t_ringLogThread;
+
+static ULONGLONG SystemNow()
+{
+	// The system clock counts from 1970, and FILETIMEs from 1601.
+	auto now = std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::system_clock::now().time_since_epoch()
+	);
+	return (ULONGLONG)now.count() * 10 + 116444736000000000ULL;
+}
+
+#pragma region UTF-8
+// Calls fn with each UTF-8 byte of a UTF-16 string. Unpaired surrogates
+// become U+FFFD.
+template <typename TFn>
+static void ForEachUtf8Byte(const BYTE *pbUtf16, size_t cch, TFn fn)
+{
+	for (size_t i = 0; i < cch; i++)
+	{
+		DWORD ch = pbUtf16[i * 2] | (pbUtf16[i * 2 + 1] << 8);
+		if (ch >= 0xD800 && ch <= 0xDFFF)
+		{
+			DWORD chNext = (i + 1 < cch) ? (pbUtf16[i * 2 + 2] | (pbUtf16[i * 2 + 3] << 8)) : 0;
+			if (ch <= 0xDBFF && chNext >= 0xDC00 && chNext <= 0xDFFF)
+			{
+				ch = 0x10000 + ((ch - 0xD800) << 10) + (chNext - 0xDC00);
+				i++;
+			}
+			else
+			{
+				ch = 0xFFFD;
+			}
+		}
+
+		if (ch < 0x80)
+		{
+			fn((char)ch);
+		}
+		else if (ch < 0x800)
+		{
+			fn((char)(0xC0 | (ch >> 6)));
+			fn((char)(0x80 | (ch & 0x3F)));
+		}
+		else if (ch < 0x10000)
+		{
+			fn((char)(0xE0 | (ch >> 12)));
+			fn((char)(0x80 | ((ch >> 6) & 0x3F)));
+			fn((char)(0x80 | (ch & 0x3F)));
+		}
+		else
+		{
+			fn((char)(0xF0 | (ch >> 18)));
+			fn((char)(0x80 | ((ch >> 12) & 0x3F)));
+			fn((char)(0x80 | ((ch >> 6) & 0x3F)));
+			fn((char)(0x80 | (ch & 0x3F)));
+		}
+	}
+}
+
+static size_t StringLength(LPCWSTR psz)
+{
+	size_t cch = 0;
+	while (psz[cch])
+	{
+		cch++;
+	}
+	return cch;
+}
+
+// WCHARs are UTF-16 on every host, and little-endian on every one that
+// OpenWithEx runs on, so they can be read back as bytes.
+static const BYTE *StringBytes(LPCWSTR psz)
+{
+	return (const BYTE *)psz;
+}
+
+static void AppendUtf8(std::string *pstr, LPCWSTR psz)
+{
+	if (psz)
+	{
+		ForEachUtf8Byte(StringBytes(psz), StringLength(psz), [pstr](char ch) { pstr->push_back(ch); });
+	}
+}
+#pragma endregion
+
+#pragma region CRingLogEvent
+CRingLogEvent::CRingLogEvent(LPCWSTR pszSource, LPCWSTR pszFormat)
+	: _pszSource(pszSource)
+	, _pszFormat(pszFormat)
+	, _wId(0)
+{
+	DWORD dwId = ++s_cEvents;
+	if (dwId < RING_LOG_MAX_EVENTS)
+	{
+		_wId = (WORD)dwId;
+		s_rgEvents[dwId].store(this, std::memory_order_release);
+	}
+}
+#pragma endregion
+
+#pragma region Argument encoding
+void RingLogEncodeArg(RING_LOG_PAYLOAD *pPayload, LPCWSTR pszValue)
+{
+	if (pPayload->cb + sizeof(WORD) > RING_LOG_PAYLOAD_SIZE)
+	{
+		return;
+	}
+
+	WORD wLength = RING_LOG_NULL_STRING;
+	size_t cch = 0;
+	if (pszValue)
+	{
+		size_t cchMax = (RING_LOG_PAYLOAD_SIZE - pPayload->cb - sizeof(WORD)) / sizeof(WCHAR);
+		while (pszValue[cch] && cch < cchMax)
+		{
+			cch++;
+		}
+
+		wLength = (WORD)cch;
+		if (pszValue[cch])
+		{
+			wLength |= RING_LOG_TRUNCATED;
+		}
+	}
+
+	memcpy(pPayload->rgb + pPayload->cb, &wLength, sizeof(wLength));
+	pPayload->cb += sizeof(wLength);
+	if (cch)
+	{
+		memcpy(pPayload->rgb + pPayload->cb, pszValue, cch * sizeof(WCHAR));
+		pPayload->cb += cch * sizeof(WCHAR);
+	}
+}
+
+void RingLogEncodeArg(RING_LOG_PAYLOAD *pPayload, const GUID &guid)
+{
+	if (pPayload->cb + 16 > RING_LOG_PAYLOAD_SIZE)
+	{
+		return;
+	}
+
+	BYTE *pb = pPayload->rgb + pPayload->cb;
+	memcpy(pb, &guid.Data1, 4);
+	memcpy(pb + 4, &guid.Data2, 2);
+	memcpy(pb + 6, &guid.Data3, 2);
+	memcpy(pb + 8, guid.Data4, 8);
+	pPayload->cb += 16;
+}
+#pragma endregion
+
+#pragma region CRingLog
+CRingLog::CRingLog(IUserChoiceClock *pClock, size_t cRecords)
+	: _pClock(pClock)
+	, _cRecords(cRecords ? cRecords : 1)
+	, _ullId(s_ullNextLogId++)
+	, _pRings(nullptr)
+	, _pEcho(nullptr)
+{
+	RING_LOG_LIVE_LOGS *pLiveLogs = GetLiveLogs();
+	std::lock_guard<std::mutex> lock(pLiveLogs->mutex);
+	pLiveLogs->ids.push_back(_ullId);
+}
+
+CRingLog::~CRingLog()
+{
+	{
+		RING_LOG_LIVE_LOGS *pLiveLogs = GetLiveLogs();
+		std::lock_guard<std::mutex> lock(pLiveLogs->mutex);
+		pLiveLogs->ids.erase(std::remove(pLiveLogs->ids.begin(), pLiveLogs->ids.end(), _ullId), pLiveLogs->ids.end());
+	}
+
+	// The destroying thread's own slot would otherwise outlive the ring.
+	std::vector<CRingLogThread::SLOT> &slots = t_ringLogThread.slots;
+	slots.erase(
+		std::remove_if(slots.begin(), slots.end(), [this](const CRingLogThread::SLOT &slot) { return slot.ullLogId == _ullId; }),
+		slots.end()
+	);
+
+	RING *pRing = _pRings.load(std::memory_order_acquire);
+	while (pRing)
+	{
+		RING *pNext = pRing->pNext;
+		delete pRing;
+		pRing = pNext;
+	}
+}
+
+CRingLog::RING *CRingLog::_GetRing()
+{
+	CRingLogThread &thread = t_ringLogThread;
+	for (const CRingLogThread::SLOT &slot : thread.slots)
+	{
+		if (slot.ullLogId == _ullId)
+		{
+			return slot.pRing;
+		}
+	}
+
+	// Reuse the ring of a thread which has exited, if there is one.
+	RING *pRing = nullptr;
+	for (RING *pFree = _pRings.load(std::memory_order_acquire); pFree; pFree = pFree->pNext)
+	{
+		ULONGLONG ullFree = 0;
+		if (pFree->ullOwner.load(std::memory_order_relaxed) == 0
+			&& pFree->ullOwner.compare_exchange_strong(ullFree, thread.ullKey, std::memory_order_acq_rel))
+		{
+			pRing = pFree;
+			break;
+		}
+	}
+
+	if (pRing)
+	{
+		// Its records belonged to the other thread.
+		pRing->ullNext.store(0, std::memory_order_release);
+	}
+	else
+	{
+		pRing = new RING(_cRecords, thread.ullKey);
+		pRing->pNext = _pRings.load(std::memory_order_relaxed);
+		while (!_pRings.compare_exchange_weak(pRing->pNext, pRing, std::memory_order_release, std::memory_order_relaxed))
+		{
+		}
+	}
+
+	pRing->dwThreadId.store(thread.dwThreadId, std::memory_order_relaxed);
+	thread.slots.push_back({ _ullId, pRing });
+	return pRing;
+}
+
+void CRingLog::_Commit(const CRingLogEvent &event, DWORD dwContext, const RING_LOG_PAYLOAD &payload)
+{
+	RING *pRing = _GetRing();
+	ULONGLONG ullIndex = pRing->ullNext.load(std::memory_order_relaxed);
+
+	RING_LOG_RECORD record;
+	memset(&record, 0, sizeof(record));
+	record.ullSequence = ullIndex + 1;
+	record.ullTime = _pClock ? _pClock->Now() : SystemNow();
+	record.wEvent = event.GetId();
+	record.cbPayload = (BYTE)payload.cb;
+	record.dwContext = dwContext;
+	memcpy(record.rgbPayload, payload.rgb, payload.cb);
+
+	ULONGLONG rgullWords[RING_LOG_RECORD_WORDS];
+	memcpy(rgullWords, &record, sizeof(record));
+
+	std::atomic<ULONGLONG> *pWords = &pRing->rgWords[(ullIndex % _cRecords) * RING_LOG_RECORD_WORDS];
+	// Releasing each word means a dump which sees any of them also sees
+	// that the record is being written.
+	pWords[0].store(0, std::memory_order_relaxed);
+	for (size_t i = 1; i < RING_LOG_RECORD_WORDS; i++)
+	{
+		pWords[i].store(rgullWords[i], std::memory_order_release);
+	}
+	pWords[0].store(rgullWords[0], std::memory_order_release);
+
+	pRing->ullNext.store(ullIndex + 1, std::memory_order_release);
+
+	FILE *pEcho = _pEcho.load(std::memory_order_relaxed);
+	if (pEcho)
+	{
+		_Echo(pEcho, event, dwContext, payload);
+	}
+}
+
+void CRingLog::_Echo(FILE *pFile, const CRingLogEvent &event, DWORD dwContext, const RING_LOG_PAYLOAD &payload)
+{
+	std::string strFormat;
+	AppendUtf8(&strFormat, event.GetFormat());
+
+	std::string strLine;
+	if (event.GetSource())
+	{
+		strLine.push_back('[');
+		AppendUtf8(&strLine, event.GetSource());
+		strLine += ":" + std::to_string(dwContext) + "] ";
+	}
+	RingLogFormat(strFormat.c_str(), payload.rgb, payload.cb, &strLine);
+
+	if (strLine.empty() || strLine.back() != '\n')
+	{
+		strLine.push_back('\n');
+	}
+
+	fputs(strLine.c_str(), pFile);
+}
+
+void CRingLog::SetEcho(FILE *pFile)
+{
+	_pEcho.store(pFile, std::memory_order_relaxed);
+}
+
+/**
+ * Writes UTF-8 through a buffer on the stack, so that dumps don't allocate.
+ */
+class CRingLogUtf8Writer
+{
+private:
+	IRingLogStream *_pStream;
+	char            _rgch[128];
+	size_t          _cch;
+	bool            _fOk;
+
+public:
+	CRingLogUtf8Writer(IRingLogStream *pStream)
+		: _pStream(pStream)
+		, _cch(0)
+		, _fOk(true)
+	{
+	}
+
+	void Put(char ch)
+	{
+		_rgch[_cch++] = ch;
+		if (_cch == sizeof(_rgch))
+		{
+			Flush();
+		}
+	}
+
+	bool Flush()
+	{
+		if (_cch && !_pStream->Write(_rgch, _cch))
+		{
+			_fOk = false;
+		}
+		_cch = 0;
+		return _fOk;
+	}
+};
+
+// Strings longer than a dump can say are cut short.
+static WORD Utf8Length(LPCWSTR psz)
+{
+	size_t cb = 0;
+	if (psz)
+	{
+		ForEachUtf8Byte(StringBytes(psz), StringLength(psz), [&cb](char) { cb++; });
+	}
+	return (WORD)std::min(cb, (size_t)0xFFFF);
+}
+
+static void WriteUtf8(CRingLogUtf8Writer *pWriter, LPCWSTR psz, WORD cb)
+{
+	if (psz)
+	{
+		size_t cbWritten = 0;
+		ForEachUtf8Byte(StringBytes(psz), StringLength(psz), [pWriter, cb, &cbWritten](char ch)
+		{
+			if (cbWritten < cb)
+			{
+				pWriter->Put(ch);
+				cbWritten++;
+			}
+		});
+	}
+}
+
+bool CRingLog::Dump(IRingLogStream *pStream)
+{
+	DWORD cEvents = std::min(s_cEvents.load(std::memory_order_acquire), (DWORD)RING_LOG_MAX_EVENTS - 1);
+
+	// Rings are only ever added to the front, so counting from the same head
+	// finds the same rings.
+	RING *pRings = _pRings.load(std::memory_order_acquire);
+	DWORD cRings = 0;
+	for (RING *pRing = pRings; pRing; pRing = pRing->pNext)
+	{
+		cRings++;
+	}
+
+	RING_LOG_DUMP_HEADER header = {};
+	header.dwMagic = RING_LOG_MAGIC;
+	header.dwVersion = RING_LOG_VERSION;
+	header.cEvents = cEvents;
+	header.cRings = cRings;
+#ifdef _WIN32
+	header.dwProcessId = GetCurrentProcessId();
+#else
+	header.dwProcessId = (DWORD)getpid();
+#endif
+	header.ullDumped = _pClock ? _pClock->Now() : SystemNow();
+	if (!pStream->Write(&header, sizeof(header)))
+	{
+		return false;
+	}
+
+	// Call sites which are still being registered are written without
+	// their strings.
+	for (DWORD dwId = 1; dwId <= cEvents; dwId++)
+	{
+		const CRingLogEvent *pEvent = s_rgEvents[dwId].load(std::memory_order_acquire);
+
+		RING_LOG_DUMP_EVENT event = {};
+		event.wEvent = (WORD)dwId;
+		event.cbSource = pEvent ? Utf8Length(pEvent->GetSource()) : 0;
+		event.cbFormat = pEvent ? Utf8Length(pEvent->GetFormat()) : 0;
+		if (!pStream->Write(&event, sizeof(event)))
+		{
+			return false;
+		}
+
+		if (pEvent)
+		{
+			CRingLogUtf8Writer writer(pStream);
+			WriteUtf8(&writer, pEvent->GetSource(), event.cbSource);
+			WriteUtf8(&writer, pEvent->GetFormat(), event.cbFormat);
+			if (!writer.Flush())
+			{
+				return false;
+			}
+		}
+	}
+
+	for (RING *pRing = pRings; pRing; pRing = pRing->pNext)
+	{
+		ULONGLONG ullNext = pRing->ullNext.load(std::memory_order_acquire);
+		ULONGLONG cRecords = std::min(ullNext, (ULONGLONG)_cRecords);
+
+		RING_LOG_DUMP_RING ring;
+		ring.dwThreadId = pRing->dwThreadId.load(std::memory_order_relaxed);
+		ring.cRecords = (DWORD)cRecords;
+		if (!pStream->Write(&ring, sizeof(ring)))
+		{
+			return false;
+		}
+
+		for (ULONGLONG ullIndex = ullNext - cRecords; ullIndex < ullNext; ullIndex++)
+		{
+			std::atomic<ULONGLONG> *pWords = &pRing->rgWords[(ullIndex % _cRecords) * RING_LOG_RECORD_WORDS];
+
+			ULONGLONG rgullWords[RING_LOG_RECORD_WORDS];
+			rgullWords[0] = pWords[0].load(std::memory_order_acquire);
+			for (size_t i = 1; i < RING_LOG_RECORD_WORDS; i++)
+			{
+				rgullWords[i] = pWords[i].load(std::memory_order_acquire);
+			}
+
+			// The thread may have started writing the record again, or
+			// even lapped the dump.
+			RING_LOG_RECORD record;
+			if (rgullWords[0] == ullIndex + 1 && pWords[0].load(std::memory_order_relaxed) == rgullWords[0])
+			{
+				memcpy(&record, rgullWords, sizeof(record));
+			}
+			else
+			{
+				memset(&record, 0, sizeof(record));
+			}
+
+			if (!pStream->Write(&record, sizeof(record)))
+			{
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+class CVectorRingLogStream : public IRingLogStream
+{
+private:
+	std::vector<BYTE> *_pData;
+
+public:
+	CVectorRingLogStream(std::vector<BYTE> *pData)
+		: _pData(pData)
+	{
+	}
+
+	bool Write(const void *pv, size_t cb) override
+	{
+		_pData->insert(_pData->end(), (const BYTE *)pv, (const BYTE *)pv + cb);
+		return true;
+	}
+};
+
+bool CRingLog::Dump(std::vector<BYTE> *pData)
+{
+	pData->clear();
+	CVectorRingLogStream stream(pData);
+	return Dump(&stream);
+}
+#pragma endregion
+
+CRingLog *GetProcessRingLog()
+{
+	// Never destroyed, so that threads can log, and crashes can be dumped,
+	// until the very end.
+	static CRingLog *s_pLog = new CRingLog;
+	return s_pLog;
+}
+
+#pragma region Decoding
+/**
+ * Reads a record's arguments back in order.
+ */
+class CRingLogPayloadReader
+{
+private:
+	const BYTE  *_pb;
+	size_t       _cb;
+	size_t       _ib;
+
+public:
+	CRingLogPayloadReader(const BYTE *pb, size_t cb)
+		: _pb(pb)
+		, _cb(cb)
+		, _ib(0)
+	{
+	}
+
+	bool ReadInteger(ULONGLONG *pullValue)
+	{
+		if (_ib + sizeof(ULONGLONG) > _cb)
+		{
+			return false;
+		}
+
+		memcpy(pullValue, _pb + _ib, sizeof(ULONGLONG));
+		_ib += sizeof(ULONGLONG);
+		return true;
+	}
+
+	bool ReadGuid(const BYTE **ppbGuid)
+	{
+		if (_ib + 16 > _cb)
+		{
+			return false;
+		}
+
+		*ppbGuid = _pb + _ib;
+		_ib += 16;
+		return true;
+	}
+
+	bool ReadString(std::string *pstr)
+	{
+		WORD wLength;
+		if (_ib + sizeof(wLength) > _cb)
+		{
+			return false;
+		}
+
+		memcpy(&wLength, _pb + _ib, sizeof(wLength));
+		_ib += sizeof(wLength);
+
+		if (wLength == RING_LOG_NULL_STRING)
+		{
+			*pstr += "(null)";
+			return true;
+		}
+
+		size_t cch = wLength & ~RING_LOG_TRUNCATED;
+		if (_ib + cch * 2 > _cb)
+		{
+			return false;
+		}
+
+		ForEachUtf8Byte(_pb + _ib, cch, [pstr](char ch) { pstr->push_back(ch); });
+		_ib += cch * 2;
+
+		if (wLength & RING_LOG_TRUNCATED)
+		{
+			*pstr += "...";
+		}
+		return true;
+	}
+};
+
+static void AppendCodePoint(std::string *pstr, DWORD ch)
+{
+	BYTE rgb[2] = { (BYTE)(ch & 0xFF), (BYTE)((ch >> 8) & 0xFF) };
+	ForEachUtf8Byte(rgb, 1, [pstr](char chUtf8) { pstr->push_back(chUtf8); });
+}
+
+void RingLogFormat(const char *pszFormat, const BYTE *pbPayload, size_t cbPayload, std::string *pstr)
+{
+	CRingLogPayloadReader reader(pbPayload, cbPayload);
+
+	for (const char *pch = pszFormat; *pch; pch++)
+	{
+		if (*pch != '%')
+		{
+			pstr->push_back(*pch);
+			continue;
+		}
+
+		const char *pchSpec = pch++;
+		if (*pch == '%')
+		{
+			pstr->push_back('%');
+			continue;
+		}
+
+		// Flags, width and precision are kept for snprintf; sizes don't
+		// matter, since every integer was logged as 64 bits.
+		std::string strFlags;
+		while (*pch && strchr("-+ #0", *pch))
+		{
+			strFlags.push_back(*pch++);
+		}
+		while ((*pch >= '0' && *pch <= '9') || *pch == '.')
+		{
+			strFlags.push_back(*pch++);
+		}
+		while (*pch == 'h' || *pch == 'l' || *pch == 'z' || *pch == 'I' || *pch == '6' || *pch == '4')
+		{
+			pch++;
+		}
+
+		char szField[64];
+		std::string strString;
+		ULONGLONG ullValue;
+		const BYTE *pbGuid;
+		bool fRead = true;
+		switch (*pch)
+		{
+			case 'd':
+			case 'i':
+			case 'u':
+			case 'x':
+			case 'X':
+			{
+				fRead = reader.ReadInteger(&ullValue);
+				if (fRead)
+				{
+					std::string strSpec = "%" + strFlags + "ll" + *pch;
+					if (*pch == 'd' || *pch == 'i')
+					{
+						snprintf(szField, sizeof(szField), strSpec.c_str(), (long long)ullValue);
+					}
+					else
+					{
+						snprintf(szField, sizeof(szField), strSpec.c_str(), (unsigned long long)ullValue);
+					}
+					*pstr += szField;
+				}
+				break;
+			}
+			case 'p':
+				fRead = reader.ReadInteger(&ullValue);
+				if (fRead)
+				{
+					snprintf(szField, sizeof(szField), "%016llX", (unsigned long long)ullValue);
+					*pstr += szField;
+				}
+				break;
+			case 'c':
+				fRead = reader.ReadInteger(&ullValue);
+				if (fRead)
+				{
+					AppendCodePoint(pstr, (DWORD)ullValue);
+				}
+				break;
+			case 's':
+				fRead = reader.ReadString(&strString);
+				if (fRead)
+				{
+					std::string strSpec = "%" + strFlags + "s";
+					std::vector<char> rgch(strString.size() + 64);
+					snprintf(rgch.data(), rgch.size(), strSpec.c_str(), strString.c_str());
+					*pstr += rgch.data();
+				}
+				break;
+			case 'g':
+				fRead = reader.ReadGuid(&pbGuid);
+				if (fRead)
+				{
+					DWORD dwData1;
+					WORD wData2, wData3;
+					memcpy(&dwData1, pbGuid, 4);
+					memcpy(&wData2, pbGuid + 4, 2);
+					memcpy(&wData3, pbGuid + 6, 2);
+					snprintf(
+						szField,
+						sizeof(szField),
+						"{%08X-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X}",
+						dwData1, wData2, wData3,
+						pbGuid[8], pbGuid[9], pbGuid[10], pbGuid[11],
+						pbGuid[12], pbGuid[13], pbGuid[14], pbGuid[15]
+					);
+					*pstr += szField;
+				}
+				break;
+			default:
+				// Not a conversion we know, so it is copied as it is.
+				pstr->append(pchSpec, (*pch ? pch + 1 : pch) - pchSpec);
+				break;
+		}
+
+		// Arguments which didn't fit in the record.
+		if (!fRead)
+		{
+			pstr->push_back('?');
+		}
+
+		if (!*pch)
+		{
+			break;
+		}
+	}
+}
+
+static void AppendTime(std::string *pstr, ULONGLONG ullTime)
+{
+	// Days since 1970, then the civil date, as in Howard Hinnant's
+	// civil_from_days.
+	long long llSeconds = (long long)(ullTime / 10000000) - 11644473600LL;
+	long long llDays = llSeconds / 86400;
+	long long llSecondOfDay = llSeconds % 86400;
+	if (llSecondOfDay < 0)
+	{
+		llSecondOfDay += 86400;
+		llDays--;
+	}
+
+	llDays += 719468;
+	long long llEra = (llDays >= 0 ? llDays : llDays - 146096) / 146097;
+	unsigned uDayOfEra = (unsigned)(llDays - llEra * 146097);
+	unsigned uYearOfEra = (uDayOfEra - uDayOfEra / 1460 + uDayOfEra / 36524 - uDayOfEra / 146096) / 365;
+	unsigned uDayOfYear = uDayOfEra - (365 * uYearOfEra + uYearOfEra / 4 - uYearOfEra / 100);
+	unsigned uMonthIndex = (5 * uDayOfYear + 2) / 153;
+	unsigned uDay = uDayOfYear - (153 * uMonthIndex + 2) / 5 + 1;
+	unsigned uMonth = uMonthIndex < 10 ? uMonthIndex + 3 : uMonthIndex - 9;
+	long long llYear = (long long)uYearOfEra + llEra * 400 + (uMonth <= 2);
+
+	char szTime[64];
+	snprintf(
+		szTime,
+		sizeof(szTime),
+		"%04lld-%02u-%02u %02lld:%02lld:%02lld.%07llu",
+		llYear, uMonth, uDay,
+		llSecondOfDay / 3600, (llSecondOfDay / 60) % 60, llSecondOfDay % 60,
+		(unsigned long long)(ullTime % 10000000)
+	);
+	*pstr += szTime;
+}
+
+struct RING_LOG_DECODED_EVENT
+{
+	std::string  strSource;
+	std::string  strFormat;
+};
+
+bool RingLogDecode(const BYTE *pbDump, size_t cbDump, std::string *pstrText)
+{
+	pstrText->clear();
+
+	RING_LOG_DUMP_HEADER header;
+	if (cbDump < sizeof(header))
+	{
+		return false;
+	}
+	memcpy(&header, pbDump, sizeof(header));
+	if (header.dwMagic != RING_LOG_MAGIC || header.dwVersion != RING_LOG_VERSION)
+	{
+		return false;
+	}
+
+	char szHeader[64];
+	snprintf(szHeader, sizeof(szHeader), "# Process %lu, dumped ", (unsigned long)header.dwProcessId);
+	*pstrText += szHeader;
+	AppendTime(pstrText, header.ullDumped);
+	pstrText->push_back('\n');
+
+	size_t ib = sizeof(header);
+	bool fOk = true;
+
+	std::vector<RING_LOG_DECODED_EVENT> events(RING_LOG_MAX_EVENTS);
+	for (DWORD i = 0; i < header.cEvents && fOk; i++)
+	{
+		RING_LOG_DUMP_EVENT event;
+		if (cbDump - ib < sizeof(event))
+		{
+			fOk = false;
+			break;
+		}
+		memcpy(&event, pbDump + ib, sizeof(event));
+		ib += sizeof(event);
+
+		if (cbDump - ib < (size_t)event.cbSource + event.cbFormat || event.wEvent >= RING_LOG_MAX_EVENTS)
+		{
+			fOk = false;
+			break;
+		}
+		events[event.wEvent].strSource.assign((const char *)pbDump + ib, event.cbSource);
+		ib += event.cbSource;
+		events[event.wEvent].strFormat.assign((const char *)pbDump + ib, event.cbFormat);
+		ib += event.cbFormat;
+	}
+
+	// Records are only 4-byte aligned in the dump, so they are copied out
+	// before they are read.
+	std::vector<RING_LOG_RECORD> sorted;
+	std::vector<DWORD> threadIds;
+	for (DWORD i = 0; i < header.cRings && fOk; i++)
+	{
+		RING_LOG_DUMP_RING ring;
+		if (cbDump - ib < sizeof(ring))
+		{
+			fOk = false;
+			break;
+		}
+		memcpy(&ring, pbDump + ib, sizeof(ring));
+		ib += sizeof(ring);
+
+		for (DWORD iRecord = 0; iRecord < ring.cRecords; iRecord++)
+		{
+			if (cbDump - ib < sizeof(RING_LOG_RECORD))
+			{
+				fOk = false;
+				break;
+			}
+
+			RING_LOG_RECORD record;
+			memcpy(&record, pbDump + ib, sizeof(record));
+			ib += sizeof(record);
+
+			if (record.ullSequence)
+			{
+				sorted.push_back(record);
+				threadIds.push_back(ring.dwThreadId);
+			}
+		}
+	}
+
+	std::vector<size_t> order(sorted.size());
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		order[i] = i;
+	}
+
+	// Each thread's records are already in order, so a stable sort by time
+	// keeps them that way even when the clock didn't move.
+	std::stable_sort(order.begin(), order.end(), [&sorted](size_t a, size_t b)
+	{
+		return sorted[a].ullTime < sorted[b].ullTime;
+	});
+
+	for (size_t i : order)
+	{
+		const RING_LOG_RECORD &record = sorted[i];
+
+		AppendTime(pstrText, record.ullTime);
+
+		char szThread[32];
+		snprintf(szThread, sizeof(szThread), " %5lu ", (unsigned long)threadIds[i]);
+		*pstrText += szThread;
+
+		const RING_LOG_DECODED_EVENT *pEvent = (record.wEvent < RING_LOG_MAX_EVENTS) ? &events[record.wEvent] : nullptr;
+		if (!pEvent || pEvent->strFormat.empty())
+		{
+			snprintf(szThread, sizeof(szThread), "<event %u>", (unsigned)record.wEvent);
+			*pstrText += szThread;
+		}
+		else
+		{
+			if (!pEvent->strSource.empty())
+			{
+				*pstrText += "[" + pEvent->strSource + ":" + std::to_string(record.dwContext) + "] ";
+			}
+
+			size_t cchLine = pstrText->size();
+			RingLogFormat(pEvent->strFormat.c_str(), record.rgbPayload, std::min((size_t)record.cbPayload, sizeof(record.rgbPayload)), pstrText);
+
+			// Messages still end in the newlines they were printed with.
+			while (pstrText->size() > cchLine && (pstrText->back() == '\n' || pstrText->back() == '\r'))
+			{
+				pstrText->pop_back();
+			}
+		}
+
+		pstrText->push_back('\n');
+	}
+
+	return fOk;
+}
+#pragma endregion
\ No newline at end of file
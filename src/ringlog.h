@@ -0,0 +1,331 @@
+#pragma once
+
+/**
+ * Keeps a binary log in memory, in every build, until it is asked for.
+ *
+ * The launcher's Log and debuglog used to format each message with
+ * vswprintf_s and print it to the debug console, so release builds logged
+ * nothing at all. CRingLog keeps the same messages in every build, as
+ * fixed-size binary records: the call site that logged it, when, and its
+ * arguments, still unformatted. Each thread writes to a ring of its own,
+ * without locking, and overwrites its oldest records once the ring is full.
+ *
+ * Nothing is formatted until the log is dumped, which happens when it is
+ * asked for, or when the process crashes. RingLogDecode, which owxlogdump
+ * wraps, turns a dump back into text on any host.
+ *
+ * Formats are printf-like, with wide strings. %d, %i, %u, %x and %X take any
+ * integer, with or without l or ll; %p takes a pointer, %c a character, %s a
+ * wide string and %g a GUID. Strings are copied into the record, and cut
+ * short if they don't fit.
+ */
+
+#include "wincompat.h"
+#include "userchoicescheduler.h" // for IUserChoiceClock
+
+#include <atomic>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#define RING_LOG_MAGIC   0x4C58574F // "OWXL"
+#define RING_LOG_VERSION 1
+
+// The most call sites which can log. Any more are logged as unknown.
+#define RING_LOG_MAX_EVENTS 4096
+
+// The arguments a record can hold, in bytes.
+#define RING_LOG_PAYLOAD_SIZE 104
+
+#pragma pack(push, 4)
+/**
+ * The start of a dump. It is followed by the call sites, and then by each
+ * thread's ring.
+ */
+struct RING_LOG_DUMP_HEADER
+{
+	DWORD      dwMagic;
+	DWORD      dwVersion;
+	DWORD      cEvents;
+	DWORD      cRings;
+	DWORD      dwProcessId;
+	DWORD      dwReserved;
+
+	// When the dump was taken, as a FILETIME.
+	ULONGLONG  ullDumped;
+};
+
+/**
+ * A call site in a dump. It is followed by its source and its format, in
+ * UTF-8, without nulls.
+ */
+struct RING_LOG_DUMP_EVENT
+{
+	WORD  wEvent;
+	WORD  cbSource;
+	WORD  cbFormat;
+	WORD  wReserved;
+};
+
+/**
+ * A thread's ring in a dump. It is followed by its records, oldest first.
+ */
+struct RING_LOG_DUMP_RING
+{
+	DWORD  dwThreadId;
+	DWORD  cRecords;
+};
+
+/**
+ * A record, as it is kept in a ring and written to a dump.
+ */
+struct RING_LOG_RECORD
+{
+	// Counts the thread's records from 1. Zero if the record was being
+	// written when the dump was taken.
+	ULONGLONG  ullSequence;
+
+	// When it was logged, as a FILETIME.
+	ULONGLONG  ullTime;
+
+	WORD       wEvent;
+	BYTE       cbPayload;
+	BYTE       bReserved;
+
+	// Whatever the call site logged it with, e.g. the launcher's instance.
+	DWORD      dwContext;
+
+	// Integers take 8 bytes, GUIDs 16, and strings 2 bytes for their length
+	// and 2 for each character.
+	BYTE       rgbPayload[RING_LOG_PAYLOAD_SIZE];
+};
+#pragma pack(pop)
+
+static_assert(sizeof(RING_LOG_DUMP_HEADER) == 32, "The dump layout is shared between builds");
+static_assert(sizeof(RING_LOG_DUMP_EVENT) == 8, "The dump layout is shared between builds");
+static_assert(sizeof(RING_LOG_DUMP_RING) == 8, "The dump layout is shared between builds");
+static_assert(sizeof(RING_LOG_RECORD) == 128, "The dump layout is shared between builds");
+
+/**
+ * A call site that logs. Each one is a function-local static, so it is only
+ * registered the first time it logs.
+ */
+class CRingLogEvent
+{
+private:
+	LPCWSTR  _pszSource;
+	LPCWSTR  _pszFormat;
+	WORD     _wId;
+
+public:
+	/**
+	 * @param pszSource  Where the call site is, e.g. a method's name, or null.
+	 * @param pszFormat  The message's format.
+	 *
+	 * Both have to outlive the process's logging, so they are usually
+	 * literals.
+	 */
+	CRingLogEvent(LPCWSTR pszSource, LPCWSTR pszFormat);
+
+	CRingLogEvent(const CRingLogEvent &) = delete;
+	CRingLogEvent &operator=(const CRingLogEvent &) = delete;
+
+	WORD GetId() const
+	{
+		return _wId;
+	}
+
+	LPCWSTR GetSource() const
+	{
+		return _pszSource;
+	}
+
+	LPCWSTR GetFormat() const
+	{
+		return _pszFormat;
+	}
+};
+
+#pragma region Argument encoding
+/**
+ * A record's arguments, while they are being encoded.
+ */
+struct RING_LOG_PAYLOAD
+{
+	BYTE    rgb[RING_LOG_PAYLOAD_SIZE];
+	size_t  cb;
+};
+
+inline void RingLogEncodeInteger(RING_LOG_PAYLOAD *pPayload, ULONGLONG ullValue)
+{
+	// Arguments which don't fit are left out, and decoded as missing.
+	if (pPayload->cb + sizeof(ullValue) <= RING_LOG_PAYLOAD_SIZE)
+	{
+		memcpy(pPayload->rgb + pPayload->cb, &ullValue, sizeof(ullValue));
+		pPayload->cb += sizeof(ullValue);
+	}
+}
+
+void RingLogEncodeArg(RING_LOG_PAYLOAD *pPayload, LPCWSTR pszValue);
+void RingLogEncodeArg(RING_LOG_PAYLOAD *pPayload, const GUID &guid);
+
+// Signed integers are sign-extended, so that %d reads them back whatever
+// their size.
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+RingLogEncodeArg(RING_LOG_PAYLOAD *pPayload, T value)
+{
+	typedef typename std::conditional<std::is_signed<T>::value, long long, unsigned long long>::type TWide;
+	RingLogEncodeInteger(pPayload, (ULONGLONG)(TWide)value);
+}
+
+template <typename T>
+inline void RingLogEncodeArg(RING_LOG_PAYLOAD *pPayload, const T *pValue)
+{
+	RingLogEncodeInteger(pPayload, (ULONGLONG)(uintptr_t)pValue);
+}
+
+inline void RingLogEncode(RING_LOG_PAYLOAD *pPayload)
+{
+}
+
+template <typename TFirst, typename... TRest>
+inline void RingLogEncode(RING_LOG_PAYLOAD *pPayload, const TFirst &first, const TRest &...rest)
+{
+	RingLogEncodeArg(pPayload, first);
+	RingLogEncode(pPayload, rest...);
+}
+#pragma endregion
+
+/**
+ * Where a dump goes. Dumps can be taken while the process is crashing, so
+ * Write shouldn't allocate.
+ */
+class IRingLogStream
+{
+public:
+	virtual ~IRingLogStream() {}
+
+	virtual bool Write(const void *pv, size_t cb) = 0;
+};
+
+class CRingLog
+{
+private:
+	struct RING;
+	friend class CRingLogThread;
+
+	IUserChoiceClock     *_pClock;
+	size_t                _cRecords;
+
+	// Tells logs apart in each thread's list of rings.
+	ULONGLONG             _ullId;
+
+	// Every ring there has been, newest first. Rings are only ever added,
+	// and freed with the log.
+	std::atomic<RING *>   _pRings;
+
+	std::atomic<FILE *>   _pEcho;
+
+	RING *_GetRing();
+	void _Commit(const CRingLogEvent &event, DWORD dwContext, const RING_LOG_PAYLOAD &payload);
+	void _Echo(FILE *pFile, const CRingLogEvent &event, DWORD dwContext, const RING_LOG_PAYLOAD &payload);
+
+public:
+	// How many records each thread keeps.
+	static constexpr size_t DEFAULT_RECORDS = 256;
+
+	/**
+	 * @param pClock    Times records; it has to outlive the log. Null for
+	 *                  the system clock.
+	 * @param cRecords  How many records each thread keeps.
+	 */
+	CRingLog(IUserChoiceClock *pClock = nullptr, size_t cRecords = DEFAULT_RECORDS);
+
+	// Nothing may log to it any more.
+	~CRingLog();
+
+	CRingLog(const CRingLog &) = delete;
+	CRingLog &operator=(const CRingLog &) = delete;
+
+	/**
+	 * Logs a record to the calling thread's ring. Only the first record a
+	 * thread logs allocates.
+	 */
+	template <typename... TArgs>
+	void Write(const CRingLogEvent &event, DWORD dwContext, const TArgs &...args)
+	{
+		RING_LOG_PAYLOAD payload;
+		payload.cb = 0;
+		RingLogEncode(&payload, args...);
+		_Commit(event, dwContext, payload);
+	}
+
+	/**
+	 * Also prints every record, formatted, as it is logged, for the debug
+	 * console. Null stops it. The file has to outlive the log.
+	 */
+	void SetEcho(FILE *pFile);
+
+	/**
+	 * Writes every thread's records out, without allocating. Threads can go
+	 * on logging while it runs; records they are halfway through writing
+	 * are dumped as empty.
+	 */
+	bool Dump(IRingLogStream *pStream);
+
+	bool Dump(std::vector<BYTE> *pData);
+};
+
+/**
+ * The process's log, which RINGLOG logs to.
+ */
+CRingLog *GetProcessRingLog();
+
+/**
+ * Formats a record's message, in UTF-8, as the decoder does.
+ *
+ * @param pszFormat  The call site's format, in UTF-8.
+ */
+void RingLogFormat(const char *pszFormat, const BYTE *pbPayload, size_t cbPayload, std::string *pstr);
+
+/**
+ * Turns a dump into text: one line for each record, from every thread,
+ * oldest first.
+ *
+ * @return false if the dump is damaged. Whatever could be read is still
+ *         written out.
+ */
+bool RingLogDecode(const BYTE *pbDump, size_t cbDump, std::string *pstrText);
+
+/**
+ * Logs a message from a call site, with a context of its own.
+ */
+#define RINGLOG_FROM(LOG, SOURCE, CONTEXT, FORMAT, ...) \
+	do \
+	{ \
+		static const CRingLogEvent s_ringLogEvent(SOURCE, FORMAT); \
+		(LOG)->Write(s_ringLogEvent, (DWORD)(CONTEXT), ##__VA_ARGS__); \
+	} while (0)
+
+/**
+ * Logs a message to the process's log.
+ */
+#define RINGLOG(FORMAT, ...) RINGLOG_FROM(GetProcessRingLog(), nullptr, 0, FORMAT, ##__VA_ARGS__)
+
+#ifdef _WIN32
+/**
+ * Gets the process's log dumped to
+ * %LOCALAPPDATA%\OpenWithEx\Logs\OpenWithEx-<pid>.owxlog when the process
+ * crashes, and whenever anyone sets the Local\OpenWithEx-DumpLog-<pid>
+ * event.
+ */
+void RingLogInstallShellHandlers();
+
+/**
+ * Dumps the process's log to its file, replacing the last dump.
+ */
+bool RingLogDumpToFile();
+#endif
\ No newline at end of file
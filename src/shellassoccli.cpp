@@ -0,0 +1,167 @@
+#include "assoccli.h"
+#include "assocuserchoice.h" // for ApplyUserChoiceProfile
+#include "associdentity.h" // for GetShellAssocIdentityCache
+#include "assocnotify.h" // for GetShellAssocChangeNotifier
+#include "tracespan.h" // for GetShellTraceClock
+
+#include <windows.h>
+
+#include <memory>
+
+#include "wil/resource.h"
+
+/**
+ * Runs commands against the real registry, for the current user.
+ *
+ * OpenWithEx is a GUI program, so it usually has no standard output. When it
+ * is run from a console without redirecting it, results go to that console
+ * instead; no window is ever created.
+ */
+class CShellAssocCliHost : public IAssocCliHost
+{
+private:
+	std::shared_ptr<const CAssocIdentity> m_pIdentity;
+	HANDLE                                m_hOutput;
+	wil::unique_hfile                     m_hConsole;
+	bool                                  m_fConsole;
+
+public:
+	CShellAssocCliHost()
+		: m_pIdentity(GetShellAssocIdentityCache()->GetCurrent())
+		, m_hOutput(GetStdHandle(STD_OUTPUT_HANDLE))
+		, m_fConsole(false)
+	{
+		if (!m_hOutput || m_hOutput == INVALID_HANDLE_VALUE)
+		{
+			m_hOutput = nullptr;
+			if (AttachConsole(ATTACH_PARENT_PROCESS))
+			{
+				m_hConsole.reset(CreateFileW(
+					L"CONOUT$",
+					GENERIC_READ | GENERIC_WRITE,
+					FILE_SHARE_READ | FILE_SHARE_WRITE,
+					nullptr,
+					OPEN_EXISTING,
+					0,
+					nullptr
+				));
+				m_hOutput = m_hConsole.get();
+			}
+		}
+
+		// Consoles are written in UTF-16, so that names outside their code
+		// page come out right; anything else gets the UTF-8 as it is.
+		DWORD dwMode;
+		m_fConsole = m_hOutput && GetConsoleMode(m_hOutput, &dwMode);
+	}
+
+	IRegistryBackend *GetRegistry() override
+	{
+		return GetSystemRegistryBackend();
+	}
+
+	LPCWSTR GetUserSid() override
+	{
+		return m_pIdentity ? m_pIdentity->GetStringSid() : nullptr;
+	}
+
+	IUserChoiceClock *GetClock() override
+	{
+		return GetShellTraceClock();
+	}
+
+	bool Apply(
+		const ASSOC_PROFILE_ENTRY *pEntries,
+		size_t cEntries,
+		ASSOC_PROFILE_REPORT *pReport,
+		std::string *pstrError
+	) override
+	{
+		SetUserChoiceAndHashResult result = ApplyUserChoiceProfile(pEntries, cEntries, pReport);
+		if (result == SetUserChoiceAndHashResult::UNSUPPORTED_OS)
+		{
+			*pstrError = "Associations can only be set on Windows 10 1703 or later";
+			return false;
+		}
+
+		// Failed writes are in the report; without one, nothing was tried.
+		if (pReport->results.size() != cEntries)
+		{
+			*pstrError = "The current user couldn't be found";
+			return false;
+		}
+
+		return true;
+	}
+
+	bool ReadProfile(LPCWSTR lpszPath, std::string *pstrXml) override
+	{
+		wil::unique_hfile hFile(CreateFileW(
+			lpszPath,
+			GENERIC_READ,
+			FILE_SHARE_READ,
+			nullptr,
+			OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL,
+			nullptr
+		));
+		if (!hFile)
+		{
+			return false;
+		}
+
+		pstrXml->clear();
+
+		char rgch[4096];
+		DWORD cbRead;
+		while (::ReadFile(hFile.get(), rgch, sizeof(rgch), &cbRead, nullptr))
+		{
+			if (!cbRead)
+			{
+				return true;
+			}
+			pstrXml->append(rgch, cbRead);
+		}
+
+		return false;
+	}
+
+	void WriteLine(const std::string &strLine) override
+	{
+		if (!m_hOutput)
+		{
+			return;
+		}
+
+		std::string strOutput = strLine + "\r\n";
+
+		if (m_fConsole)
+		{
+			int cch = MultiByteToWideChar(CP_UTF8, 0, strOutput.data(), (int)strOutput.size(), nullptr, 0);
+			std::unique_ptr<WCHAR[]> pszOutput(new WCHAR[cch]);
+			MultiByteToWideChar(CP_UTF8, 0, strOutput.data(), (int)strOutput.size(), pszOutput.get(), cch);
+
+			DWORD cchWritten;
+			WriteConsoleW(m_hOutput, pszOutput.get(), cch, &cchWritten, nullptr);
+			return;
+		}
+
+		DWORD cbWritten;
+		WriteFile(m_hOutput, strOutput.data(), (DWORD)strOutput.size(), &cbWritten, nullptr);
+	}
+};
+
+int AssocCliRunShell(const ASSOC_CLI_ARGS &args)
+{
+	int iExitCode;
+	{
+		CShellAssocCliHost host;
+		iExitCode = AssocCliRun(args, &host);
+	}
+
+	// The process is about to exit, so the shell has to hear about any
+	// change now rather than at the end of its window.
+	GetShellAssocChangeNotifier()->Flush();
+
+	return iExitCode;
+}
\ No newline at end of file
@@ -0,0 +1,65 @@
+#include "assocnotify.h"
+
+#include <windows.h>
+#include <shlobj.h> // for SHChangeNotify
+
+#include "wil/resource.h"
+
+/**
+ * Sends coalesced notifications to the shell, polling the notifier from a
+ * thread pool timer at the end of each window.
+ */
+class CShellAssocChangeNotifier : public IAssocChangeSink
+{
+private:
+	CAssocChangeNotifier         _notifier;
+	wil::unique_threadpool_timer _timer;
+
+	static void CALLBACK s_TimerCallback(PTP_CALLBACK_INSTANCE pInstance, PVOID pvContext, PTP_TIMER pTimer)
+	{
+		((CShellAssocChangeNotifier *)pvContext)->_notifier.Poll();
+	}
+
+public:
+	CShellAssocChangeNotifier()
+		: _notifier(this, GetSystemUserChoiceClock())
+		, _timer(CreateThreadpoolTimer(s_TimerCallback, this, nullptr))
+	{
+	}
+
+	CAssocChangeNotifier *GetNotifier()
+	{
+		return &_notifier;
+	}
+
+	void SendAssocChanged() override
+	{
+		SHChangeNotify(SHCNE_ASSOCCHANGED, SHCNF_IDLIST, nullptr, nullptr);
+	}
+
+	void RequestPoll(ULONGLONG ullTime) override
+	{
+		// Without a timer, the notification goes out at the next flush, at
+		// the latest when the process exits.
+		if (!_timer)
+		{
+			return;
+		}
+
+		// A positive due time is absolute, in UTC.
+		ULARGE_INTEGER dueTimeInt;
+		dueTimeInt.QuadPart = ullTime;
+
+		FILETIME dueTime;
+		dueTime.dwLowDateTime = dueTimeInt.LowPart;
+		dueTime.dwHighDateTime = dueTimeInt.HighPart;
+
+		SetThreadpoolTimer(_timer.get(), &dueTime, 0, 0);
+	}
+};
+
+CAssocChangeNotifier *GetShellAssocChangeNotifier()
+{
+	static CShellAssocChangeNotifier s_shellNotifier;
+	return s_shellNotifier.GetNotifier();
+}
\ No newline at end of file
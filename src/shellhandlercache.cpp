@@ -0,0 +1,179 @@
+#include "assochandlercache.h"
+
+#include <windows.h>
+#include <shlobj.h>
+
+#include "wil/resource.h"
+
+/**
+ * An entry mapped in read-only. A mapped file can't be replaced, so while the
+ * view is open, a newer entry has to wait for a later launch to be written.
+ */
+class CFileAssocHandlerCacheView : public IAssocHandlerCacheView
+{
+private:
+	wil::unique_hfile              _hFile;
+	wil::unique_handle             _hMapping;
+	wil::unique_mapview_ptr<BYTE>  _pView;
+	size_t                         _cbView;
+
+public:
+	CFileAssocHandlerCacheView()
+		: _cbView(0)
+	{
+	}
+
+	bool Map(LPCWSTR lpszPath)
+	{
+		_hFile.reset(CreateFileW(
+			lpszPath,
+			GENERIC_READ,
+			FILE_SHARE_READ | FILE_SHARE_DELETE,
+			nullptr,
+			OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL,
+			nullptr
+		));
+		if (!_hFile)
+		{
+			return false;
+		}
+
+		LARGE_INTEGER cbFile = { 0 };
+		if (!GetFileSizeEx(_hFile.get(), &cbFile) || cbFile.QuadPart == 0 || cbFile.QuadPart > MAXDWORD)
+		{
+			return false;
+		}
+
+		_hMapping.reset(CreateFileMappingW(_hFile.get(), nullptr, PAGE_READONLY, 0, 0, nullptr));
+		if (!_hMapping)
+		{
+			return false;
+		}
+
+		_pView.reset((BYTE *)MapViewOfFile(_hMapping.get(), FILE_MAP_READ, 0, 0, 0));
+		_cbView = (size_t)cbFile.QuadPart;
+		return _pView != nullptr;
+	}
+
+	const BYTE *GetData() override
+	{
+		return _pView.get();
+	}
+
+	size_t GetSize() override
+	{
+		return _cbView;
+	}
+};
+
+/**
+ * Keeps each entry in its own file, so processes working on different
+ * extensions never touch the same one.
+ */
+class CFileAssocHandlerCacheStore : public IAssocHandlerCacheStore
+{
+private:
+	bool _GetPath(LPCWSTR lpszKey, WCHAR *pszPath, size_t cchPath, bool fCreateDirectory)
+	{
+		wil::unique_cotaskmem_string pszLocalAppData;
+		if (FAILED(SHGetKnownFolderPath(FOLDERID_LocalAppData, KF_FLAG_DEFAULT, nullptr, &pszLocalAppData)))
+		{
+			return false;
+		}
+
+		if (_snwprintf_s(pszPath, cchPath, _TRUNCATE, L"%s\\OpenWithEx\\HandlerCache", pszLocalAppData.get()) < 0)
+		{
+			return false;
+		}
+
+		if (fCreateDirectory)
+		{
+			int err = SHCreateDirectoryExW(nullptr, pszPath, nullptr);
+			if (err != ERROR_SUCCESS && err != ERROR_ALREADY_EXISTS)
+			{
+				return false;
+			}
+		}
+
+		size_t cchDirectory = wcslen(pszPath);
+		return _snwprintf_s(pszPath + cchDirectory, cchPath - cchDirectory, _TRUNCATE, L"\\%s.cache", lpszKey) >= 0;
+	}
+
+public:
+	std::unique_ptr<IAssocHandlerCacheView> Open(LPCWSTR lpszKey) override
+	{
+		WCHAR szPath[MAX_PATH];
+		if (!_GetPath(lpszKey, szPath, ARRAYSIZE(szPath), false))
+		{
+			return nullptr;
+		}
+
+		std::unique_ptr<CFileAssocHandlerCacheView> pView(new CFileAssocHandlerCacheView);
+		if (!pView->Map(szPath))
+		{
+			return nullptr;
+		}
+
+		return std::move(pView);
+	}
+
+	bool Write(LPCWSTR lpszKey, const BYTE *pbData, size_t cbData) override
+	{
+		WCHAR szPath[MAX_PATH];
+		if (!_GetPath(lpszKey, szPath, ARRAYSIZE(szPath), true))
+		{
+			return false;
+		}
+
+		// The entry is written next to the old one and then moved over it,
+		// so that nobody ever maps half an entry. Dialogs on other threads
+		// may be writing the same entry, so the name is the thread's own.
+		WCHAR szTempPath[MAX_PATH];
+		if (_snwprintf_s(szTempPath, ARRAYSIZE(szTempPath), _TRUNCATE, L"%s.%08X.%08X.tmp", szPath, GetCurrentProcessId(), GetCurrentThreadId()) < 0)
+		{
+			return false;
+		}
+
+		{
+			wil::unique_hfile hFile(CreateFileW(
+				szTempPath,
+				GENERIC_WRITE,
+				0,
+				nullptr,
+				CREATE_ALWAYS,
+				FILE_ATTRIBUTE_NORMAL,
+				nullptr
+			));
+			if (!hFile)
+			{
+				return false;
+			}
+
+			DWORD cbWritten = 0;
+			if (!WriteFile(hFile.get(), pbData, (DWORD)cbData, &cbWritten, nullptr) || cbWritten != cbData)
+			{
+				hFile.reset();
+				DeleteFileW(szTempPath);
+				return false;
+			}
+		}
+
+		// This fails if another process has the old entry mapped, in which
+		// case the next launch writes it instead.
+		if (!MoveFileExW(szTempPath, szPath, MOVEFILE_REPLACE_EXISTING))
+		{
+			DeleteFileW(szTempPath);
+			return false;
+		}
+
+		return true;
+	}
+};
+
+static CFileAssocHandlerCacheStore s_fileCacheStore;
+
+IAssocHandlerCacheStore *GetShellAssocHandlerCacheStore()
+{
+	return &s_fileCacheStore;
+}
\ No newline at end of file
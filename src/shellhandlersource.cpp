@@ -0,0 +1,201 @@
+#include "assochandlerstream.h"
+
+#include <windows.h>
+#include <shobjidl.h>
+
+#include "iassochandler_internal.h"
+
+#include "wil/com.h"
+#include "wil/resource.h"
+
+/**
+ * A handler marshalled for another apartment. If the dialog never gets to
+ * it, the marshal data is released with it.
+ */
+class CMarshalledAssocHandler : public IAssocHandlerRef
+{
+private:
+	wil::com_ptr<IStream> _pStream;
+
+public:
+	// Takes over the reference to pStream.
+	CMarshalledAssocHandler(IStream *pStream)
+	{
+		_pStream.attach(pStream);
+	}
+
+	~CMarshalledAssocHandler()
+	{
+		if (_pStream)
+		{
+			LARGE_INTEGER liZero = { 0 };
+			_pStream->Seek(liZero, STREAM_SEEK_SET, nullptr);
+			CoReleaseMarshalData(_pStream.get());
+		}
+	}
+
+	HRESULT Unmarshal(IAssocHandler **ppHandler)
+	{
+		if (!_pStream)
+		{
+			return E_UNEXPECTED;
+		}
+
+		// This releases the stream, and the marshal data with it.
+		return CoGetInterfaceAndReleaseStream(_pStream.detach(), IID_PPV_ARGS(ppHandler));
+	}
+};
+
+/**
+ * Enumerates handlers on the worker thread.
+ *
+ * For extensions, the recommended handlers are enumerated on their own
+ * first, which is quick, and then everything else. Protocols can only be
+ * enumerated all at once.
+ */
+class CShellAssocHandlerSource : public IAssocHandlerSource
+{
+private:
+	WCHAR                            _szExtOrProtocol[MAX_PATH];
+	bool                             _fUri;
+
+	// 0 for the recommended handlers, 1 for the rest.
+	int                              _iPass;
+	wil::com_ptr<IEnumAssocHandlers> _pEnum;
+
+	bool _OpenPass()
+	{
+		HRESULT hr = E_FAIL;
+		if (_fUri && _iPass == 0)
+		{
+			hr = SHAssocEnumHandlersForProtocolByApplication(_szExtOrProtocol, IID_PPV_ARGS(&_pEnum));
+		}
+		else if (!_fUri && _iPass < 2)
+		{
+			hr = SHAssocEnumHandlers(
+				_szExtOrProtocol,
+				(_iPass == 0) ? ASSOC_FILTER_RECOMMENDED : ASSOC_FILTER_NONE,
+				&_pEnum
+			);
+		}
+
+		return SUCCEEDED(hr) && _pEnum;
+	}
+
+public:
+	CShellAssocHandlerSource(LPCWSTR lpszExtOrProtocol, bool fUri)
+		: _szExtOrProtocol{ 0 }
+		, _fUri(fUri)
+		, _iPass(0)
+	{
+		wcscpy_s(_szExtOrProtocol, lpszExtOrProtocol);
+	}
+
+	bool IsRecommendedFirst() override
+	{
+		return !_fUri;
+	}
+
+	bool Next(ASSOC_HANDLER_SNAPSHOT *pSnapshot) override
+	{
+		for (;;)
+		{
+			if (!_pEnum && !_OpenPass())
+			{
+				return false;
+			}
+
+			wil::com_ptr<IAssocHandler> pHandler;
+			ULONG cFetched = 0;
+			if (FAILED(_pEnum->Next(1, &pHandler, &cFetched)) || !pHandler)
+			{
+				_pEnum.reset();
+				_iPass++;
+				continue;
+			}
+
+			if (AssocSnapshotHandler(pHandler.get(), pSnapshot) != S_OK)
+			{
+				continue;
+			}
+
+			// The second pass lists the recommended handlers again.
+			if (_iPass == 1 && pSnapshot->fRecommended)
+			{
+				continue;
+			}
+
+			wil::com_ptr<IStream> pStream;
+			if (FAILED(CoMarshalInterThreadInterfaceInStream(__uuidof(IAssocHandler), pHandler.get(), &pStream)))
+			{
+				continue;
+			}
+
+			pSnapshot->pHandler.reset(new CMarshalledAssocHandler(pStream.detach()));
+			return true;
+		}
+	}
+};
+
+std::unique_ptr<IAssocHandlerSource> CreateShellAssocHandlerSource(LPCWSTR lpszExtOrProtocol, bool fUri)
+{
+	return std::unique_ptr<IAssocHandlerSource>(new CShellAssocHandlerSource(lpszExtOrProtocol, fUri));
+}
+
+HRESULT AssocUnmarshalHandler(ASSOC_HANDLER_SNAPSHOT *pSnapshot, IAssocHandler **ppHandler)
+{
+	*ppHandler = nullptr;
+	if (!pSnapshot->pHandler)
+	{
+		return E_INVALIDARG;
+	}
+
+	return static_cast<CMarshalledAssocHandler *>(pSnapshot->pHandler.get())->Unmarshal(ppHandler);
+}
+
+HRESULT AssocSnapshotHandler(IAssocHandler *pHandler, ASSOC_HANDLER_SNAPSHOT *pSnapshot)
+{
+	// I haven't seen it experienced on any other system,
+	// but I'm getting handlers that are completely blank.
+	// The display name is simply not received rather than
+	// it being an empty string, so it should be safe to dismiss
+	// these handlers. They don't do anything anyway.
+	//     - aubymori
+	wil::unique_cotaskmem_string pszUIName;
+	pHandler->GetUIName(&pszUIName);
+	if (!pszUIName.get())
+	{
+		return S_FALSE;
+	}
+
+	wil::unique_cotaskmem_string pszName;
+	pHandler->GetName(&pszName);
+
+	wil::unique_cotaskmem_string pszIconPath;
+	int iIcon = 0;
+	pHandler->GetIconLocation(&pszIconPath, &iIcon);
+
+	// The ProgID is asked for the same way SetDefaultAssociationForAfter1703
+	// does. Asking doesn't register the "Applications\" ProgID made up for
+	// handlers without one.
+	AHTYPE ahType = AHTYPE_APPLICATION;
+	wil::unique_cotaskmem_string pszProgId;
+	wil::com_ptr<IAssocHandlerInfo> pAssocInfo;
+	if (SUCCEEDED(pHandler->QueryInterface(IID_PPV_ARGS(&pAssocInfo))))
+	{
+		pAssocInfo->GetHandlerType(&ahType);
+		pAssocInfo->GetInternalProgID(
+			(ahType & (AHTYPE_ANY_PROGID | AHTYPE_PROGID | AHTYPE_MACHINEDEFAULT)) ? APF_DEFAULT : APF_APPLICATION,
+			&pszProgId
+		);
+	}
+
+	pSnapshot->strName = pszName ? pszName.get() : L"";
+	pSnapshot->strUIName = pszUIName.get();
+	pSnapshot->strIconPath = pszIconPath ? pszIconPath.get() : L"";
+	pSnapshot->iIcon = iIcon;
+	pSnapshot->dwType = ahType;
+	pSnapshot->strProgId = pszProgId ? pszProgId.get() : L"";
+	pSnapshot->fRecommended = S_OK == pHandler->IsRecommended();
+	return S_OK;
+}
\ No newline at end of file
@@ -0,0 +1,43 @@
+#include "associconresolver.h"
+
+#include <windows.h>
+#include <objbase.h>
+
+#include "baseopenasdlg.h" // for GetAppIconIndex
+
+/**
+ * Looks icons up in the system image list. Shell_GetCachedImageIndexW is
+ * thread-safe, so one source serves every dialog's workers, on any thread.
+ */
+class CShellAssocIconSource : public IAssocIconSource
+{
+public:
+	void BeginThread() override
+	{
+		// Extracting UWP apps' icons goes through COM.
+		CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+	}
+
+	void EndThread() override
+	{
+		CoUninitialize();
+	}
+
+	int ResolveIcon(LPCWSTR lpszIconPath, int iIcon) override
+	{
+		return GetAppIconIndex(*lpszIconPath ? lpszIconPath : nullptr, iIcon);
+	}
+};
+
+static CShellAssocIconSource s_shellIconSource;
+static CCachingAssocIconSource s_shellIconCache(&s_shellIconSource);
+
+IAssocIconSource *GetShellAssocIconSource()
+{
+	return &s_shellIconCache;
+}
+
+CCachingAssocIconSource *GetShellAssocIconCache()
+{
+	return &s_shellIconCache;
+}
\ No newline at end of file
@@ -0,0 +1,55 @@
+#include "associdentity.h"
+
+#include <windows.h>
+
+#include "wil/resource.h"
+
+/**
+ * Reads the real tokens for the identity cache.
+ *
+ * This does what SHOpenEffectiveToken and SHQueryToken<TOKEN_USER> do for
+ * CShellProtectedRegLock in TWinUI, except that the thread and process
+ * tokens are queried separately, so that the cache can share the process
+ * identity between threads.
+ */
+class CShellAssocIdentitySource : public IAssocIdentitySource
+{
+public:
+	LSTATUS QueryUserSid(AssocTokenKind kind, std::vector<BYTE> *pSid) override
+	{
+		wil::unique_handle token;
+		BOOL fOpened = (kind == AssocTokenKind::THREAD)
+			? OpenThreadToken(GetCurrentThread(), TOKEN_QUERY, FALSE, &token)
+			: OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token);
+		if (!fOpened)
+		{
+			return GetLastError();
+		}
+
+		// A TOKEN_USER is followed by its SID, which can't be bigger than
+		// SECURITY_MAX_SID_SIZE, so this never has to ask for the size
+		// first.
+		union
+		{
+			TOKEN_USER user;
+			BYTE       rgb[sizeof(TOKEN_USER) + SECURITY_MAX_SID_SIZE];
+		} tokenUser;
+
+		DWORD cbTokenUser = 0;
+		if (!GetTokenInformation(token.get(), TokenUser, &tokenUser, sizeof(tokenUser), &cbTokenUser))
+		{
+			return GetLastError();
+		}
+
+		const BYTE *pbSid = (const BYTE *)tokenUser.user.User.Sid;
+		pSid->assign(pbSid, pbSid + GetLengthSid(tokenUser.user.User.Sid));
+		return ERROR_SUCCESS;
+	}
+};
+
+CAssocIdentityCache *GetShellAssocIdentityCache()
+{
+	static CShellAssocIdentitySource s_source;
+	static CAssocIdentityCache s_cache(&s_source);
+	return &s_cache;
+}
\ No newline at end of file
@@ -0,0 +1,73 @@
+#include "launcherdispatcher.h"
+
+#include "openwithex.h"
+
+/**
+ * Shows the dialogs on their threads. Each thread is its own STA, as the
+ * server's only thread used to be.
+ */
+class CShellLauncherTarget : public ILauncherTarget
+{
+public:
+	void BeginThread() override
+	{
+		CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED);
+	}
+
+	void EndThread() override
+	{
+		CoUninitialize();
+	}
+
+	void ShowDialog(const OPENWITH_REQUEST &request) override
+	{
+		if (request.strPath.empty())
+		{
+			LocalizedMessageBox(
+				request.hWndParent,
+				IDS_ERR_NOPATH,
+				MB_ICONERROR
+			);
+			return;
+		}
+
+		ShowOpenWithDialog(
+			request.hWndParent,
+			request.strPath.c_str(),
+			(IMMERSIVE_OPENWITH_FLAGS)request.dwFlags,
+			(OPENWITHEXSTYLE)request.dwStyle
+		);
+	}
+};
+
+static CShellLauncherTarget s_shellLauncherTarget;
+
+ILauncherTarget *GetShellLauncherTarget()
+{
+	return &s_shellLauncherTarget;
+}
+
+/**
+ * Posts a WM_NULL, which the server's loop wakes up for and then ignores.
+ */
+class CThreadWakeSink : public ILauncherDispatchSink
+{
+private:
+	DWORD _dwThreadId;
+
+public:
+	CThreadWakeSink(DWORD dwThreadId)
+		: _dwThreadId(dwThreadId)
+	{
+	}
+
+	void OnRequestDone() override
+	{
+		PostThreadMessageW(_dwThreadId, WM_NULL, 0, 0);
+	}
+};
+
+std::unique_ptr<ILauncherDispatchSink> CreateThreadWakeSink(DWORD dwThreadId)
+{
+	return std::unique_ptr<ILauncherDispatchSink>(new CThreadWakeSink(dwThreadId));
+}
\ No newline at end of file
@@ -22,13 +22,21 @@
  * exactly reverse engineered from my local copy of TWinUI.dll.
  * 
  * The only things I took liberties on were:
- *    - I moved "SHQueryToken<TOKEN_USER>" and its dependency
- *      "SHOpenEffectiveToken" to private methods of CShellProtectedRegLock.
+ *    - I replaced "SHQueryToken<TOKEN_USER>" and its dependency
+ *      "SHOpenEffectiveToken" with GetShellAssocIdentityCache, which does
+ *      the same once per thread rather than once per lock.
  *    - I did not reimplement the helper class "CTLocalAllocPolicy". This
  *      can be found in the Windows Driver Kit, but it's a rather useless
  *      wrapper for LocalAlloc. It doesn't even manage RAII for C++, so I don't
  *      really know what it's meant for.
  *      https://github.com/wmliang/wdk-10/blob/master/Include/10.0.14393.0/um/memsafe.h#L359
+ *    - Unlock and Lock build the new DACL in one pass with CProtectedAcl and
+ *      apply it with a single SetSecurityInfo each. TWinUI calls
+ *      SetSecurityInfo once for every ACE that Unlock deletes, and builds
+ *      the locked DACL one AddAce at a time. The resulting DACLs are the
+ *      same.
+ *    - Open and SetValue let one lock write several values and go through
+ *      several keys, for IRegistryBackend::SetProtectedValues.
  * 
  * Also Microsoft has a patent on this mechanism LOL:
  * https://patents.google.com/patent/US20130198646A1/en
@@ -42,209 +50,136 @@
 #include <wchar.h>
 
 #include "shellprotectedreglock.h"
+#include "tracespan.h"
 
 SID c_sidLocalSystem = { 0x1, 0x1, { 0, 0, 0, 0, 0, 0x5 }, 0x12 };
 
+CShellProtectedRegLock::CShellProtectedRegLock()
+	: _hkeySecurity(nullptr)
+	, _pDacl(nullptr)
+	, _psd(nullptr)
+	, _hkeyValues(nullptr)
+{
+}
+
 CShellProtectedRegLock::~CShellProtectedRegLock()
 {
+	_CloseKeys();
+}
+
+void CShellProtectedRegLock::_CloseKeys()
+{
+	if (_hkeyValues)
+		RegCloseKey(_hkeyValues);
 	if (_hkeySecurity)
 		RegCloseKey(_hkeySecurity);
-	LocalFree(_pToken);
 	LocalFree(_psd);
+	_acl.Reset();
+
+	_hkeyValues = nullptr;
+	_hkeySecurity = nullptr;
+	_pDacl = nullptr;
+	_psd = nullptr;
 }
 
-HRESULT CShellProtectedRegLock::QueryUserToken(HKEY hKey, LPCWSTR lpwszValue)
+LSTATUS CShellProtectedRegLock::_OpenSecurityKey(HKEY hKey)
 {
-	constexpr int kTokenInfoBufferSize = 2048;
-	PSID pSid = nullptr;
-	HRESULT hr = s_OpenEffectiveToken(&pSid);
-	DWORD dwLastError = 0;
-
-	_pToken = (PTOKEN_USER)LocalAlloc(LPTR, kTokenInfoBufferSize);
-
-	if (_pToken)
-	{
-		DWORD dwTokenLength = kTokenInfoBufferSize;
-		if (!GetTokenInformation(pSid, TokenUser, _pToken, dwTokenLength, &dwTokenLength))
-		{
-			dwLastError = GetLastError();
-
-			if (dwLastError == ERROR_INSUFFICIENT_BUFFER)
-			{
-				LocalFree(_pToken);
-
-				_pToken = (PTOKEN_USER)LocalAlloc(LPTR, dwTokenLength);
+	return RegCreateKeyExW(
+		hKey, 
+		L"UserChoice", 
+		0, 
+		nullptr, 
+		0,
+		READ_CONTROL | WRITE_DAC,
+		nullptr,
+		&_hkeySecurity,
+		nullptr
+	);
+}
 
-				if (_pToken)
-				{
-					if (GetTokenInformation(pSid, TokenUser, _pToken, dwTokenLength, &dwTokenLength))
-					{
-						hr = S_OK;
-					}
-				}
-				else
-				{
-					hr = E_FAIL;
-				}
-			}
-			else
-			{
-				hr = HRESULT_FROM_WIN32(dwLastError);
-			}
-		}
-	}
-	else // !_pToken
+LSTATUS CShellProtectedRegLock::Init(HKEY hKey, LPCWSTR lpwszValue)
+{
+	_pIdentity = GetShellAssocIdentityCache()->GetCurrent();
+	if (_pIdentity)
 	{
-		hr = E_FAIL;
+		return _OpenSecurityKey(hKey);
 	}
-
-	if (FAILED(hr))
+	else
 	{
-		LocalFree(_pToken);
-		_pToken = nullptr;
+		return ERROR_NOT_ENOUGH_MEMORY;
 	}
+}
 
-	if (pSid)
+LSTATUS CShellProtectedRegLock::Open(HKEY hKey)
+{
+	if (!_pIdentity)
 	{
-		CloseHandle(pSid);
+		return Init(hKey, nullptr);
 	}
 
-	return hr;
+	_CloseKeys();
+	return _OpenSecurityKey(hKey);
 }
 
-// static
-HRESULT CShellProtectedRegLock::s_OpenEffectiveToken(OUT PSID *ppSid)
+LSTATUS CShellProtectedRegLock::SetValue(LPCWSTR pszValue, LPCVOID pvData, DWORD cbData)
 {
-	*ppSid = nullptr;
-
-	HANDLE hCurrentThread = GetCurrentThread();
-	if (OpenThreadToken(hCurrentThread, TOKEN_QUERY, FALSE, ppSid))
-	{
-		return S_OK;
-	}
-
-	DWORD dwLastError = GetLastError();
-	if (dwLastError == ERROR_NO_TOKEN)
+	// Access is checked when a key is opened, so this has to be opened after
+	// Unlock has taken the deny ACE off. It is kept until Lock.
+	if (!_hkeyValues)
 	{
-		HANDLE hCurrentProcess = GetCurrentProcess();
-		if (OpenProcessToken(hCurrentProcess, TOKEN_QUERY, ppSid))
+		LSTATUS ls = RegOpenKeyExW(_hkeySecurity, nullptr, 0, KEY_SET_VALUE, &_hkeyValues);
+		if (ls != ERROR_SUCCESS)
 		{
-			return S_OK;
+			return ls;
 		}
-
-		dwLastError = GetLastError();
 	}
 
-	WCHAR aaaa[1024];
-	DWORD error = GetLastError();
-	swprintf_s(aaaa, L"dude it's so FUCKING over: %d", dwLastError);
-	OutputDebugStringW(aaaa);
-
-	return HRESULT_FROM_WIN32(dwLastError);
+	return RegSetValueExW(_hkeyValues, pszValue, 0, REG_SZ, (const BYTE *)pvData, cbData);
 }
 
-LSTATUS CShellProtectedRegLock::Init(HKEY hKey, LPCWSTR lpwszValue)
+void CShellProtectedRegLock::Lock()
 {
-	if (SUCCEEDED(QueryUserToken(hKey, lpwszValue)))
-	{
-		return RegCreateKeyExW(
-			hKey, 
-			L"UserChoice", 
-			0, 
-			nullptr, 
-			0,
-			READ_CONTROL | WRITE_DAC,
-			nullptr,
-			&_hkeySecurity,
-			nullptr
-		);
-	}
-	else
+	CTraceActivity activity(TRACE_ACL_LOCK);
+
+	if (_hkeyValues)
 	{
-		return ERROR_NOT_ENOUGH_MEMORY;
+		RegCloseKey(_hkeyValues);
+		_hkeyValues = nullptr;
 	}
-}
-
-void CShellProtectedRegLock::Lock()
-{
-	ACL_SIZE_INFORMATION sizeInfo;
 
 	if (
 		_hkeySecurity &&
-		!EqualSid(&c_sidLocalSystem, _pToken->User.Sid) &&
-		GetAclInformation(_pDacl, &sizeInfo, sizeof(sizeInfo), AclSizeInformation)
+		_pIdentity &&
+		!EqualSid(&c_sidLocalSystem, (PSID)_pIdentity->GetSid())
 	)
 	{
-		DWORD dwBytesInUse = sizeInfo.AclBytesInUse;
-		DWORD dwRevision = 2;
-
-		ACL_REVISION_INFORMATION revisionInfo;
+		// Our deny ACE first, then everything Unlock left.
+		DWORD cbNewAcl = 0;
+		const BYTE *pbNewAcl = _acl.BuildLocked(
+			_pIdentity->GetSid(),
+			_pIdentity->GetSidLength(),
+			&cbNewAcl
+		);
 
-		if (GetAclInformation(_pDacl, &revisionInfo, sizeof(revisionInfo), AclRevisionInformation))
+		if (pbNewAcl)
 		{
-			dwRevision = revisionInfo.AclRevision;
+			SetSecurityInfo(
+				_hkeySecurity,
+				SE_REGISTRY_KEY,
+				DACL_SECURITY_INFORMATION | UNPROTECTED_DACL_SECURITY_INFORMATION,
+				nullptr,
+				nullptr,
+				(PACL)pbNewAcl,
+				nullptr
+			);
 		}
-
-		DWORD dwSidLen = GetLengthSid(_pToken->User.Sid);
-		DWORD dwAceListLength = dwSidLen + 8;
-		DWORD dwBufferSize = dwAceListLength + dwBytesInUse;
-		PACL pNewAcl = nullptr;
-
-		if (
-			dwAceListLength <= MAXWORD &&
-			dwBufferSize <= MAXWORD &&
-			(pNewAcl = (PACL)LocalAlloc(LPTR, dwBufferSize))
-		)
-		{
-			InitializeAcl(pNewAcl, dwBufferSize, dwRevision);
-
-			PACCESS_DENIED_ACE pNewAce = (PACCESS_DENIED_ACE)((PBYTE)pNewAcl + dwAceListLength);
-			pNewAce->Header.AceType = ACCESS_DENIED_ACE_TYPE;
-			pNewAce->Header.AceSize = dwAceListLength;
-			pNewAce->Mask = KEY_SET_VALUE;
-			memcpy(&pNewAce->SidStart, _pToken->User.Sid, dwSidLen);
-
-			if (AddAce(pNewAcl, dwRevision, MAXDWORD, pNewAce, dwAceListLength))
-			{
-				bool fGiveUp = false;
-
-				if (sizeInfo.AceCount)
-				{
-					for (int i = 0; i < sizeInfo.AceCount; i++)
-					{
-						PACL pCurrentAcl;
-						if (GetAce(_pDacl, i, (LPVOID *)&pCurrentAcl))
-						{
-							if (!AddAce(pNewAcl, dwRevision, MAXDWORD, pCurrentAcl, pCurrentAcl->AclSize))
-							{
-								fGiveUp = true;
-							}
-						}
-					}
-				}
-
-				if (!fGiveUp)
-				{
-					SetSecurityInfo(
-						_hkeySecurity,
-						SE_REGISTRY_KEY,
-						DACL_SECURITY_INFORMATION | UNPROTECTED_DACL_SECURITY_INFORMATION,
-						nullptr,
-						nullptr,
-						pNewAcl,
-						nullptr
-					);
-				}
-			}
-		}
-
-		if (pNewAcl)
-			LocalFree(pNewAcl);
 	}
 }
 
 void CShellProtectedRegLock::Unlock()
 {
+	CTraceActivity activity(TRACE_ACL_UNLOCK);
+
 	if (
 		GetSecurityInfo(
 			_hkeySecurity,
@@ -255,39 +190,27 @@ void CShellProtectedRegLock::Unlock()
 			&_pDacl,
 			nullptr,
 			&_psd
-		) == ERROR_SUCCESS
+		) == ERROR_SUCCESS &&
+		_pDacl &&
+		_acl.Parse((const BYTE *)_pDacl, _pDacl->AclSize) &&
+		_acl.GetRemovedCount()
 	)
 	{
-		ACL_SIZE_INFORMATION sizeInfo;
-		PACCESS_DENIED_ACE pAce;
+		// Every deny ACE goes in the same write.
+		DWORD cbNewAcl = 0;
+		const BYTE *pbNewAcl = _acl.BuildUnlocked(&cbNewAcl);
 
-		if (_pDacl)
+		if (pbNewAcl)
 		{
-			if (GetAclInformation(_pDacl, &sizeInfo, sizeof(sizeInfo), AclSizeInformation))
-			{
-				for (int i = sizeInfo.AceCount - 1; i >= 0; --i)
-				{
-					if (
-						GetAce(_pDacl, i, (LPVOID *)&pAce) &&
-						pAce->Header.AceType == ACCESS_DENIED_ACE_TYPE &&
-						pAce->Mask == KEY_SET_VALUE
-					)
-					{
-						if (DeleteAce(_pDacl, i))
-						{
-							SetSecurityInfo(
-								_hkeySecurity,
-								SE_REGISTRY_KEY,
-								DACL_SECURITY_INFORMATION,
-								nullptr,
-								nullptr,
-								_pDacl,
-								nullptr
-							);
-						}
-					}
-				}
-			}
+			SetSecurityInfo(
+				_hkeySecurity,
+				SE_REGISTRY_KEY,
+				DACL_SECURITY_INFORMATION,
+				nullptr,
+				nullptr,
+				(PACL)pbNewAcl,
+				nullptr
+			);
 		}
 	}
 }
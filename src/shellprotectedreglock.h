@@ -2,25 +2,53 @@
 
 #include <windows.h>
 
+#include "associdentity.h"
+#include "protectedacl.h"
+
+#include <memory>
+
 class CShellProtectedRegLock
 {
 protected:
-	PTOKEN_USER _pToken;
+	// Custom member: the user from the identity cache, in place of the
+	// TOKEN_USER that TWinUI queries for every lock.
+	std::shared_ptr<const CAssocIdentity> _pIdentity;
 	HKEY _hkeySecurity;
 	PACL _pDacl;
 	PSECURITY_DESCRIPTOR _psd;
 
-	// Custom method:
-	HRESULT QueryUserToken(HKEY hKey, LPCWSTR lpwszValue);
+	// Custom member: the DACL read by Unlock, and the buffer that both
+	// transitions are built in.
+	CProtectedAcl _acl;
+
+	// Custom member: UserChoice opened for writing values by SetValue.
+	HKEY _hkeyValues;
 
-	// Custom method:
-	static HRESULT s_OpenEffectiveToken(OUT PSID *ppSid);
+	// Custom method: opens UserChoice for its DACL.
+	LSTATUS _OpenSecurityKey(HKEY hKey);
+
+	// Custom method: closes the keys and frees the DACL, keeping the identity.
+	void _CloseKeys();
 
 public:
+	CShellProtectedRegLock();
 	~CShellProtectedRegLock();
 
 	LSTATUS Init(HKEY hKey, LPCWSTR lpwszValue);
 
+	/**
+	 * Custom method: like Init, but keeps the identity from an earlier call, so
+	 * that one lock can go through the UserChoice keys of many associations.
+	 */
+	LSTATUS Open(HKEY hKey);
+
+	/**
+	 * Custom method: sets a REG_SZ value in the unlocked UserChoice key. The
+	 * key is opened for writing once, on the first call after Unlock, rather
+	 * than for every value.
+	 */
+	LSTATUS SetValue(LPCWSTR pszValue, LPCVOID pvData, DWORD cbData);
+
 	void Lock();
 
 	void Unlock();
@@ -0,0 +1,116 @@
+#include "ringlog.h"
+
+#include <windows.h>
+#include <shlobj.h>
+
+#include "wil/resource.h"
+
+// Worked out up front, since there is no knowing what still works once the
+// process has crashed.
+static WCHAR s_szAppDirectory[MAX_PATH];
+static WCHAR s_szLogDirectory[MAX_PATH];
+static WCHAR s_szDumpPath[MAX_PATH];
+
+static LPTOP_LEVEL_EXCEPTION_FILTER s_pfnPreviousFilter = nullptr;
+
+/**
+ * Writes a dump straight to a file, without buffering.
+ */
+class CFileRingLogStream : public IRingLogStream
+{
+private:
+	HANDLE _hFile;
+
+public:
+	CFileRingLogStream(HANDLE hFile)
+		: _hFile(hFile)
+	{
+	}
+
+	bool Write(const void *pv, size_t cb) override
+	{
+		const BYTE *pb = (const BYTE *)pv;
+		while (cb)
+		{
+			DWORD cbWritten = 0;
+			if (!WriteFile(_hFile, pb, (DWORD)min(cb, (size_t)MAXDWORD), &cbWritten, nullptr) || !cbWritten)
+			{
+				return false;
+			}
+
+			pb += cbWritten;
+			cb -= cbWritten;
+		}
+
+		return true;
+	}
+};
+
+bool RingLogDumpToFile()
+{
+	if (!s_szDumpPath[0])
+	{
+		return false;
+	}
+
+	// The directories are only made once there is something to put in them.
+	CreateDirectoryW(s_szAppDirectory, nullptr);
+	CreateDirectoryW(s_szLogDirectory, nullptr);
+
+	wil::unique_hfile hFile(CreateFileW(
+		s_szDumpPath,
+		GENERIC_WRITE,
+		FILE_SHARE_READ,
+		nullptr,
+		CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL,
+		nullptr
+	));
+	if (!hFile)
+	{
+		return false;
+	}
+
+	CFileRingLogStream stream(hFile.get());
+	return GetProcessRingLog()->Dump(&stream);
+}
+
+static LONG WINAPI DumpOnCrash(EXCEPTION_POINTERS *pExceptionInfo)
+{
+	RingLogDumpToFile();
+	return s_pfnPreviousFilter ? s_pfnPreviousFilter(pExceptionInfo) : EXCEPTION_CONTINUE_SEARCH;
+}
+
+static VOID CALLBACK DumpOnRequest(PVOID pvContext, BOOLEAN fTimedOut)
+{
+	RingLogDumpToFile();
+}
+
+void RingLogInstallShellHandlers()
+{
+	wil::unique_cotaskmem_string pszLocalAppData;
+	if (FAILED(SHGetKnownFolderPath(FOLDERID_LocalAppData, KF_FLAG_DEFAULT, nullptr, &pszLocalAppData))
+		|| _snwprintf_s(s_szAppDirectory, ARRAYSIZE(s_szAppDirectory), _TRUNCATE, L"%s\\OpenWithEx", pszLocalAppData.get()) < 0
+		|| _snwprintf_s(s_szLogDirectory, ARRAYSIZE(s_szLogDirectory), _TRUNCATE, L"%s\\Logs", s_szAppDirectory) < 0
+		|| _snwprintf_s(s_szDumpPath, ARRAYSIZE(s_szDumpPath), _TRUNCATE, L"%s\\OpenWithEx-%lu.owxlog", s_szLogDirectory, GetCurrentProcessId()) < 0)
+	{
+		s_szDumpPath[0] = L'\0';
+	}
+
+	s_pfnPreviousFilter = SetUnhandledExceptionFilter(DumpOnCrash);
+
+	// Waited on by the thread pool, so that any process can be asked for
+	// its log, whether it is showing a dialog or serving requests. Both are
+	// kept for as long as the process runs.
+	WCHAR szEvent[64];
+	swprintf_s(szEvent, L"Local\\OpenWithEx-DumpLog-%lu", GetCurrentProcessId());
+	HANDLE hEvent = CreateEventW(nullptr, FALSE, FALSE, szEvent);
+	if (hEvent)
+	{
+		HANDLE hWait = nullptr;
+		if (!RegisterWaitForSingleObject(&hWait, hEvent, DumpOnRequest, nullptr, INFINITE, WT_EXECUTEDEFAULT))
+		{
+			CloseHandle(hEvent);
+		}
+	}
+}
\ No newline at end of file
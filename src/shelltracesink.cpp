@@ -0,0 +1,114 @@
+#include "tracespan.h"
+
+#include <windows.h>
+
+#include "wil/Tracelogging.h"
+
+/**
+ * The OpenWithEx provider. ETW sessions have to listen for it by its GUID.
+ */
+class COpenWithExTraceProvider final : public wil::TraceLoggingProvider
+{
+	// {66088CF9-28EF-4014-AD00-DFFECDAACB06}
+	IMPLEMENT_TRACELOGGING_CLASS_WITHOUT_TELEMETRY(
+		COpenWithExTraceProvider,
+		"OpenWithEx",
+		(0x66088cf9, 0x28ef, 0x4014, 0xad, 0x00, 0xdf, 0xfe, 0xcd, 0xaa, 0xcb, 0x06)
+	);
+};
+
+/**
+ * Writes each span as a start and stop event of a TraceLogging activity,
+ * related to the activity of the span it is nested in.
+ */
+class CShellTraceSink : public ITraceSink
+{
+private:
+	// Activity IDs only have to be unique, so they are made from the
+	// process and the span rather than kept somewhere for each span.
+	static void s_MakeActivityId(ULONGLONG ullSpanId, GUID *pGuid)
+	{
+		pGuid->Data1 = GetCurrentProcessId();
+		pGuid->Data2 = 0x4F57; // "OW"
+		pGuid->Data3 = 0x5845; // "EX"
+		memcpy(pGuid->Data4, &ullSpanId, sizeof(pGuid->Data4));
+	}
+
+public:
+	bool IsEnabled() override
+	{
+		return COpenWithExTraceProvider::IsEnabled(WINEVENT_LEVEL_VERBOSE);
+	}
+
+	void OnSpanBegin(const TRACE_SPAN &span) override
+	{
+		GUID activityId, parentId;
+		s_MakeActivityId(span.ullId, &activityId);
+		s_MakeActivityId(span.ullParentId, &parentId);
+
+		TraceLoggingWriteActivity(
+			COpenWithExTraceProvider::Provider(),
+			"Phase",
+			&activityId,
+			span.ullParentId ? &parentId : nullptr,
+			TraceLoggingOpcode(WINEVENT_OPCODE_START),
+			TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+			TraceLoggingString(TracePhaseName(span.phase), "Phase"),
+			TraceLoggingCountedWideString(span.strSubject.c_str(), (USHORT)min(span.strSubject.size(), (size_t)USHRT_MAX), "Subject"),
+			TraceLoggingUInt64(span.ullStart, "StartTime")
+		);
+	}
+
+	void OnSpanEnd(const TRACE_SPAN &span) override
+	{
+		GUID activityId;
+		s_MakeActivityId(span.ullId, &activityId);
+
+		TraceLoggingWriteActivity(
+			COpenWithExTraceProvider::Provider(),
+			"Phase",
+			&activityId,
+			nullptr,
+			TraceLoggingOpcode(WINEVENT_OPCODE_STOP),
+			TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+			TraceLoggingString(TracePhaseName(span.phase), "Phase"),
+			TraceLoggingCountedWideString(span.strSubject.c_str(), (USHORT)min(span.strSubject.size(), (size_t)USHRT_MAX), "Subject"),
+			TraceLoggingUInt64(span.ullDuration / 10, "DurationUs"),
+			TraceLoggingUInt64(span.ullCount, "Count"),
+			TraceLoggingInt32(span.lResult, "Result")
+		);
+	}
+};
+
+class CShellTraceClock : public IUserChoiceClock
+{
+public:
+	ULONGLONG Now() override
+	{
+		FILETIME fileTime;
+		GetSystemTimePreciseAsFileTime(&fileTime);
+
+		ULARGE_INTEGER fileTimeInt;
+		fileTimeInt.LowPart = fileTime.dwLowDateTime;
+		fileTimeInt.HighPart = fileTime.dwHighDateTime;
+		return fileTimeInt.QuadPart;
+	}
+
+	// Spans are only ever timed, never waited for.
+	void SleepUntil(ULONGLONG ullTime) override
+	{
+	}
+};
+
+static CShellTraceSink s_shellTraceSink;
+static CShellTraceClock s_shellTraceClock;
+
+ITraceSink *GetShellTraceSink()
+{
+	return &s_shellTraceSink;
+}
+
+IUserChoiceClock *GetShellTraceClock()
+{
+	return &s_shellTraceClock;
+}
\ No newline at end of file
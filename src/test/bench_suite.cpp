@@ -0,0 +1,447 @@
+#include "bench_suite.h"
+
+#include "../userchoicehash.h"
+#include "../assocregistry.h"
+#include "../assocprofile.h"
+#include "../assochandlertable.h"
+#include "../protectedacl.h"
+#include "../memoryregistry.h"
+#include "fakeclock.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+#include <memory>
+
+static LPCWSTR c_szBenchSid = WTEXT("S-1-5-21-1004336348-1177238915-682003330-1001");
+
+// The same SID, in binary.
+static const BYTE c_rgbBenchSid[] = {
+	1, 5, 0, 0, 0, 0, 0, 5,
+	21, 0, 0, 0,
+	0xDC, 0xF4, 0xDC, 0x3B,
+	0x83, 0x3D, 0x2B, 0x46,
+	0x82, 0x8B, 0xA6, 0x28,
+	0xE9, 0x03, 0x00, 0x00,
+};
+
+// 2024-01-01 12:34 UTC
+static const ULONGLONG c_ullBenchTimestamp = 0x01DA3CAECBADEC00uLL;
+
+// How many associations the registry benchmarks cycle through, which is
+// about what a provisioning profile sets.
+#define BENCH_ASSOC_COUNT 200
+
+// Results the compiler can't throw away.
+static volatile size_t s_cSink;
+
+CBenchRunner::CBenchRunner(IBenchAllocCounter *pAllocCounter, ULONGLONG ullMinNs, const char *pszFilter)
+	: _pAllocCounter(pAllocCounter)
+	, _ullMinNs(ullMinNs)
+	, _strFilter(pszFilter ? pszFilter : "")
+{
+}
+
+void CBenchRunner::Run(
+	const char *pszName,
+	CMemoryRegistry *pRegistry,
+	size_t cOpsPerCall,
+	const std::function<void(size_t cCalls)> &fn,
+	double dMaxAllocsPerOp
+)
+{
+	if (!_strFilter.empty() && !strstr(pszName, _strFilter.c_str()))
+		return;
+
+	size_t cCalls = 1;
+	for (;;)
+	{
+		ULONGLONG cAllocsBefore = _pAllocCounter ? _pAllocCounter->GetAllocCount() : 0;
+		DWORD cRegistryOpsBefore = pRegistry ? pRegistry->GetOpCounts().Total() : 0;
+
+		auto start = std::chrono::steady_clock::now();
+		fn(cCalls);
+		auto end = std::chrono::steady_clock::now();
+
+		ULONGLONG cAllocs = _pAllocCounter ? _pAllocCounter->GetAllocCount() - cAllocsBefore : 0;
+		DWORD cRegistryOps = pRegistry ? pRegistry->GetOpCounts().Total() - cRegistryOpsBefore : 0;
+		ULONGLONG ullNs = (ULONGLONG)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+
+		if (ullNs < _ullMinNs)
+		{
+			// Aim a little past the minimum, growing by at most a hundred
+			// times, since the first runs are too short to say much.
+			ULONGLONG ullScale = ullNs ? _ullMinNs * 6 / 5 / ullNs + 1 : 100;
+			cCalls *= (size_t)(ullScale < 2 ? 2 : ullScale > 100 ? 100 : ullScale);
+			continue;
+		}
+
+		double cOps = (double)cCalls * cOpsPerCall;
+
+		BENCH_RESULT result;
+		result.strName = pszName;
+		result.cOps = (ULONGLONG)cCalls * cOpsPerCall;
+		result.dNsPerOp = ullNs / cOps;
+		result.dAllocsPerOp = _pAllocCounter ? cAllocs / cOps : -1;
+		result.dRegistryOpsPerOp = pRegistry ? cRegistryOps / cOps : -1;
+		result.dMaxAllocsPerOp = _pAllocCounter ? dMaxAllocsPerOp : -1;
+		_results.push_back(result);
+		return;
+	}
+}
+
+static void AppendCount(std::string &str, const char *pszName, double dValue)
+{
+	char sz[64];
+	if (dValue < 0)
+		snprintf(sz, sizeof(sz), ",\"%s\":null", pszName);
+	else
+		snprintf(sz, sizeof(sz), ",\"%s\":%.2f", pszName, dValue);
+	str += sz;
+}
+
+std::string CBenchRunner::FormatJson() const
+{
+	std::string strJson = "{\"benchmarks\":[\n";
+
+	for (size_t i = 0; i < _results.size(); i++)
+	{
+		const BENCH_RESULT &result = _results[i];
+
+		// Names are all from this file, so they never need escaping.
+		char sz[128];
+		snprintf(sz, sizeof(sz), "{\"name\":\"%s\",\"ops\":%llu,\"nsPerOp\":%.1f",
+			result.strName.c_str(), (unsigned long long)result.cOps, result.dNsPerOp);
+		strJson += sz;
+		AppendCount(strJson, "allocsPerOp", result.dAllocsPerOp);
+		AppendCount(strJson, "registryOpsPerOp", result.dRegistryOpsPerOp);
+		AppendCount(strJson, "maxAllocsPerOp", result.dMaxAllocsPerOp);
+		strJson += (i + 1 < _results.size()) ? "},\n" : "}\n";
+	}
+
+	strJson += "]}\n";
+	return strJson;
+}
+
+std::string CBenchRunner::FormatTable() const
+{
+	char sz[128];
+	snprintf(sz, sizeof(sz), "%-26s %12s %12s %12s\n", "operation", "ns/op", "allocs/op", "reg ops/op");
+	std::string strTable = sz;
+
+	for (const BENCH_RESULT &result : _results)
+	{
+		char szAllocs[16] = "-";
+		char szRegistryOps[16] = "-";
+		if (result.dAllocsPerOp >= 0)
+			snprintf(szAllocs, sizeof(szAllocs), "%.2f", result.dAllocsPerOp);
+		if (result.dRegistryOpsPerOp >= 0)
+			snprintf(szRegistryOps, sizeof(szRegistryOps), "%.2f", result.dRegistryOpsPerOp);
+
+		snprintf(sz, sizeof(sz), "%-26s %12.1f %12s %12s%s\n",
+			result.strName.c_str(), result.dNsPerOp, szAllocs, szRegistryOps,
+			result.IsOverBudget() ? "  over budget" : "");
+		strTable += sz;
+	}
+
+	return strTable;
+}
+
+static std::basic_string<WCHAR> Widen(const char *psz)
+{
+	return std::basic_string<WCHAR>(psz, psz + strlen(psz));
+}
+
+/**
+ * Some plausible looking associations, with two sets of ProgIDs to switch
+ * between so that every write changes something.
+ */
+struct BENCH_ASSOCS
+{
+	std::vector<std::basic_string<WCHAR>> extensions;
+	std::vector<std::basic_string<WCHAR>> progIds[2];
+	std::vector<ASSOC_PROFILE_ENTRY>      profiles[2];
+
+	BENCH_ASSOCS()
+	{
+		for (unsigned i = 0; i < BENCH_ASSOC_COUNT; i++)
+		{
+			char sz[32];
+			snprintf(sz, sizeof(sz), ".ext%u", i);
+			extensions.push_back(Widen(sz));
+
+			for (unsigned j = 0; j < 2; j++)
+			{
+				snprintf(sz, sizeof(sz), "%s.Document.%u", j ? "Other" : "Vendor", i);
+				progIds[j].push_back(Widen(sz));
+				profiles[j].push_back({ extensions[i], progIds[j][i] });
+			}
+		}
+	}
+};
+
+static void BenchHash(CBenchRunner *pRunner, const BENCH_ASSOCS &assocs)
+{
+	CUserChoiceHashContext context;
+	context.Init(c_szBenchSid, c_ullBenchTimestamp);
+
+	LPCWSTR lpszExtension = assocs.extensions[42].c_str();
+	LPCWSTR lpszProgId = assocs.progIds[0][42].c_str();
+
+	WCHAR szInput[USERCHOICE_INPUT_CCH_MAX];
+	size_t cchInput = context.Format(lpszExtension, lpszProgId, szInput, ARRAYSIZE(szInput));
+
+	WCHAR szHash[USERCHOICE_HASH_CCH + 1];
+
+	// Once for every SID and minute, however many associations there are.
+	pRunner->Run("hash/init", nullptr, 1, [&](size_t cCalls)
+	{
+		for (size_t i = 0; i < cCalls; i++)
+		{
+			CUserChoiceHashContext initContext;
+			s_cSink += initContext.Init(c_szBenchSid, c_ullBenchTimestamp);
+		}
+	});
+
+	// The pieces of the hash, as FormatUserChoiceString and HashString were
+	// in TWinUI:
+	pRunner->Run("hash/format", nullptr, 1, [&](size_t cCalls)
+	{
+		for (size_t i = 0; i < cCalls; i++)
+			s_cSink += context.Format(lpszExtension, lpszProgId, szInput, ARRAYSIZE(szInput));
+	});
+
+	pRunner->Run("hash/bytes", nullptr, 1, [&](size_t cCalls)
+	{
+		for (size_t i = 0; i < cCalls; i++)
+			s_cSink += UserChoiceHashBytes((LPCBYTE)szInput, (cchInput + 1) * sizeof(WCHAR), szHash);
+	});
+
+	// What a write does, streaming the pieces straight into the hash.
+	pRunner->Run("hash/stream", nullptr, 1, [&](size_t cCalls)
+	{
+		for (size_t i = 0; i < cCalls; i++)
+			s_cSink += context.Hash(lpszExtension, lpszProgId, szHash);
+	});
+
+	std::vector<USERCHOICE_PAIR> pairs;
+	for (size_t i = 0; i < BENCH_ASSOC_COUNT; i++)
+		pairs.push_back({ assocs.extensions[i].c_str(), assocs.progIds[0][i].c_str() });
+	std::vector<WCHAR> hashes(BENCH_ASSOC_COUNT * (USERCHOICE_HASH_CCH + 1));
+
+	// What a profile does, counted per association.
+	pRunner->Run("hash/batch", nullptr, BENCH_ASSOC_COUNT, [&](size_t cCalls)
+	{
+		for (size_t i = 0; i < cCalls; i++)
+			s_cSink += UserChoiceHashBatch(&context, pairs.data(), pairs.size(), hashes.data());
+	});
+}
+
+static void BenchKeyPath(CBenchRunner *pRunner)
+{
+	WCHAR szKeyPath[ASSOC_KEY_PATH_CCH_MAX];
+
+	pRunner->Run("keypath/extension", nullptr, 1, [&](size_t cCalls)
+	{
+		for (size_t i = 0; i < cCalls; i++)
+			s_cSink += AssocFormatKeyPath(WTEXT(".txt"), false, szKeyPath, ARRAYSIZE(szKeyPath));
+	});
+
+	pRunner->Run("keypath/protocol", nullptr, 1, [&](size_t cCalls)
+	{
+		for (size_t i = 0; i < cCalls; i++)
+			s_cSink += AssocFormatKeyPath(WTEXT("https"), true, szKeyPath, ARRAYSIZE(szKeyPath));
+	});
+
+	// What GetAssociationKeyPath does on top, which is Win32 only: copy the
+	// path to the heap for the caller.
+	pRunner->Run("keypath/allocated", nullptr, 1, [&](size_t cCalls)
+	{
+		for (size_t i = 0; i < cCalls; i++)
+		{
+			size_t cchKeyPath = AssocFormatKeyPath(WTEXT(".txt"), false, szKeyPath, ARRAYSIZE(szKeyPath));
+			std::unique_ptr<WCHAR[]> lpszKeyPath = std::make_unique<WCHAR[]>(cchKeyPath + 1);
+			memcpy(lpszKeyPath.get(), szKeyPath, (cchKeyPath + 1) * sizeof(WCHAR));
+			s_cSink += lpszKeyPath[cchKeyPath - 1];
+		}
+	});
+}
+
+static void BenchHandlerTable(CBenchRunner *pRunner)
+{
+	// Lookups are made while the user browses, and the table is there so
+	// that they don't allocate.
+	for (size_t cHandlers : { 16, 1024 })
+	{
+		CAssocHandlerTable table;
+		std::basic_string<WCHAR> strLast;
+		for (size_t i = 0; i < cHandlers; i++)
+		{
+			char szName[64];
+			snprintf(szName, sizeof(szName), "C:\\Program Files\\Vendor %u\\App%u.exe", (unsigned)i, (unsigned)i);
+
+			ASSOC_HANDLER_SNAPSHOT snapshot = {};
+			snapshot.strName = Widen(szName);
+			snapshot.strUIName = WTEXT("App");
+			table.Add(snapshot);
+			strLast = snapshot.strName;
+		}
+
+		// Differently cased, as paths from a file picker often are.
+		strLast[0] = 'c';
+
+		char szName[32];
+		snprintf(szName, sizeof(szName), "handlers/find-%u", (unsigned)cHandlers);
+		pRunner->Run(szName, nullptr, 1, [&](size_t cCalls)
+		{
+			for (size_t i = 0; i < cCalls; i++)
+				s_cSink += table.FindName(strLast.c_str());
+		}, 0);
+
+		snprintf(szName, sizeof(szName), "handlers/miss-%u", (unsigned)cHandlers);
+		pRunner->Run(szName, nullptr, 1, [&](size_t cCalls)
+		{
+			for (size_t i = 0; i < cCalls; i++)
+				s_cSink += table.FindName(WTEXT("C:\\Windows\\notepad.exe"));
+		}, 0);
+	}
+}
+
+static void AppendAce(std::vector<BYTE> &acl, BYTE bType, DWORD dwMask)
+{
+	size_t cbAce = PROTECTED_ACE_HEADER_CB + sizeof(c_rgbBenchSid);
+	BYTE rgbHeader[PROTECTED_ACE_HEADER_CB] = {
+		bType, 0, (BYTE)cbAce, (BYTE)(cbAce >> 8),
+		(BYTE)dwMask, (BYTE)(dwMask >> 8), (BYTE)(dwMask >> 16), (BYTE)(dwMask >> 24),
+	};
+	acl.insert(acl.end(), rgbHeader, rgbHeader + sizeof(rgbHeader));
+	acl.insert(acl.end(), c_rgbBenchSid, c_rgbBenchSid + sizeof(c_rgbBenchSid));
+	acl[2] = (BYTE)acl.size();
+	acl[3] = (BYTE)(acl.size() >> 8);
+	acl[4]++;
+}
+
+static void BenchProtectedAcl(CBenchRunner *pRunner)
+{
+	// A locked key has one deny ACE; one fought over by several programs
+	// picks up more. Both have the usual inherited ones.
+	for (size_t cDenyAces : { 1, 4 })
+	{
+		std::vector<BYTE> acl(PROTECTED_ACL_HEADER_CB, 0);
+		acl[0] = ACL_REVISION;
+		for (size_t i = 0; i < cDenyAces; i++)
+			AppendAce(acl, ACCESS_DENIED_ACE_TYPE, KEY_SET_VALUE);
+		for (size_t i = 0; i < 4; i++)
+			AppendAce(acl, ACCESS_ALLOWED_ACE_TYPE, 0xF003F);
+
+		// Unlocking and locking again, as every protected write does.
+		CProtectedAcl editor;
+		pRunner->Run(cDenyAces == 1 ? "acl/rewrite-locked" : "acl/rewrite-contested", nullptr, 1, [&](size_t cCalls)
+		{
+			for (size_t i = 0; i < cCalls; i++)
+			{
+				DWORD cbAcl = 0;
+				editor.Parse(acl.data(), acl.size());
+				s_cSink += editor.BuildUnlocked(&cbAcl) ? cbAcl : 0;
+				s_cSink += editor.BuildLocked(c_rgbBenchSid, sizeof(c_rgbBenchSid), &cbAcl) ? cbAcl : 0;
+			}
+		});
+	}
+}
+
+static void BenchRegistry(CBenchRunner *pRunner, const BENCH_ASSOCS &assocs)
+{
+	// The clock never moves, so no write ever has to wait for a minute.
+	CFakeClock clock(c_ullBenchTimestamp);
+	CMemoryRegistry registry(&clock);
+	registry.SetUserSid(c_szBenchSid);
+	CUserChoiceWriteScheduler scheduler(&clock);
+	CAssocRenameProbe probe;
+
+	// Each write switches an association to the other ProgID, carrying on
+	// from where the last run left off, so that every one is a real write.
+	size_t iNext = 0;
+	auto replace = [&](size_t cCalls, CAssocRenameProbe *pProbe)
+	{
+		for (size_t i = 0; i < cCalls; i++, iNext++)
+		{
+			size_t iAssoc = iNext % BENCH_ASSOC_COUNT;
+			size_t iSet = (iNext / BENCH_ASSOC_COUNT) % 2;
+			s_cSink += AssocSetUserChoice(&registry, &scheduler,
+				assocs.extensions[iAssoc].c_str(), assocs.progIds[iSet][iAssoc].c_str(),
+				c_szBenchSid, nullptr, pProbe);
+		}
+	};
+
+	// Every association is set before anything is timed.
+	replace(BENCH_ASSOC_COUNT, nullptr);
+
+	pRunner->Run("write/replace", &registry, 1, [&](size_t cCalls)
+	{
+		replace(cCalls, nullptr);
+	});
+
+	// As SetUserChoiceAndHash does, once the probe has found that nothing
+	// blocks writes in place.
+	pRunner->Run("write/replace-probed", &registry, 1, [&](size_t cCalls)
+	{
+		replace(cCalls, &probe);
+	});
+
+	// Settle on one set, so that confirming and checking find them current.
+	AssocApplyProfile(&registry, &scheduler, assocs.profiles[0].data(), BENCH_ASSOC_COUNT, c_szBenchSid, nullptr, &probe);
+
+	pRunner->Run("write/confirm", &registry, 1, [&](size_t cCalls)
+	{
+		for (size_t i = 0; i < cCalls; i++)
+		{
+			size_t iAssoc = i % BENCH_ASSOC_COUNT;
+			s_cSink += AssocSetUserChoice(&registry, &scheduler,
+				assocs.extensions[iAssoc].c_str(), assocs.progIds[0][iAssoc].c_str(),
+				c_szBenchSid, nullptr, &probe);
+		}
+	});
+
+	CUserChoiceComparer comparer(&registry, c_szBenchSid);
+	pRunner->Run("verify/current", &registry, 1, [&](size_t cCalls)
+	{
+		for (size_t i = 0; i < cCalls; i++)
+		{
+			size_t iAssoc = i % BENCH_ASSOC_COUNT;
+			s_cSink += (size_t)comparer.Check(assocs.extensions[iAssoc].c_str(), assocs.progIds[0][iAssoc].c_str());
+		}
+	});
+
+	// A whole profile at a time, per association in it.
+	pRunner->Run("profile/unchanged", &registry, BENCH_ASSOC_COUNT, [&](size_t cCalls)
+	{
+		for (size_t i = 0; i < cCalls; i++)
+		{
+			s_cSink += AssocApplyProfile(&registry, &scheduler,
+				assocs.profiles[0].data(), BENCH_ASSOC_COUNT, c_szBenchSid, nullptr, &probe);
+		}
+	});
+
+	size_t iProfile = 0;
+	pRunner->Run("profile/replace", &registry, BENCH_ASSOC_COUNT, [&](size_t cCalls)
+	{
+		for (size_t i = 0; i < cCalls; i++)
+		{
+			iProfile ^= 1;
+			s_cSink += AssocApplyProfile(&registry, &scheduler,
+				assocs.profiles[iProfile].data(), BENCH_ASSOC_COUNT, c_szBenchSid, nullptr, &probe);
+		}
+	});
+}
+
+void BenchSuiteRun(CBenchRunner *pRunner)
+{
+	BENCH_ASSOCS assocs;
+
+	BenchHash(pRunner, assocs);
+	BenchKeyPath(pRunner);
+	BenchHandlerTable(pRunner);
+	BenchProtectedAcl(pRunner);
+	BenchRegistry(pRunner, assocs);
+}
\ No newline at end of file
@@ -0,0 +1,123 @@
+#pragma once
+
+/**
+ * Per-operation benchmarks for the portable association core.
+ *
+ * Unlike the tables from bench_userchoice.h, which compare old and new ways
+ * of doing things, these report the same few numbers for every operation so
+ * that runs can be compared between releases: how long an operation takes,
+ * how many heap allocations it makes, and, where it goes through a registry,
+ * how many registry operations it makes. The allocation and registry counts
+ * don't depend on the machine, so any change in them is a real one.
+ *
+ * tools/owxbench.cpp runs the suite.
+ */
+
+#include "../wincompat.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+class CMemoryRegistry;
+
+/**
+ * Counts heap allocations for the runner. Only a program of its own can
+ * replace operator new, so this is supplied by whatever runs the suite.
+ */
+class IBenchAllocCounter
+{
+public:
+	virtual ~IBenchAllocCounter() {}
+
+	// Allocations made so far, by any thread.
+	virtual ULONGLONG GetAllocCount() = 0;
+};
+
+struct BENCH_RESULT
+{
+	std::string strName;
+
+	// Operations in the timed run.
+	ULONGLONG   cOps;
+
+	double      dNsPerOp;
+
+	// Negative if they weren't counted.
+	double      dAllocsPerOp;
+
+	// Negative if the operation doesn't go through a registry.
+	double      dRegistryOpsPerOp;
+
+	// Most allocations the operation is allowed, or negative if it has no
+	// budget.
+	double      dMaxAllocsPerOp;
+
+	bool IsOverBudget() const
+	{
+		return dMaxAllocsPerOp >= 0 && dAllocsPerOp > dMaxAllocsPerOp;
+	}
+};
+
+/**
+ * Times operations, running each enough times to take at least a minimum
+ * time. Only the last run counts, so earlier ones warm it up.
+ */
+class CBenchRunner
+{
+private:
+	IBenchAllocCounter        *_pAllocCounter;
+	ULONGLONG                  _ullMinNs;
+	std::string                _strFilter;
+	std::vector<BENCH_RESULT>  _results;
+
+public:
+	/**
+	 * @param pAllocCounter  Optional; without one, allocations aren't
+	 *                       counted.
+	 * @param ullMinNs       How long each operation is run for, at least.
+	 * @param pszFilter      Optional; only operations whose names contain it
+	 *                       are run.
+	 */
+	CBenchRunner(IBenchAllocCounter *pAllocCounter, ULONGLONG ullMinNs, const char *pszFilter);
+
+	/**
+	 * Runs an operation.
+	 *
+	 * @param pszName       Stable name, e.g. "hash/stream", which is what
+	 *                      runs are compared by.
+	 * @param pRegistry     Optional; the registry the operation uses.
+	 * @param cOpsPerCall   How many operations each call of fn makes, for
+	 *                      operations which can only be done in batches.
+	 * @param fn            Calls the operation the given number of times.
+	 * @param dMaxAllocsPerOp  Optional; how many allocations the operation
+	 *                       may make, for operations which are meant not
+	 *                       to allocate.
+	 */
+	void Run(
+		const char *pszName,
+		CMemoryRegistry *pRegistry,
+		size_t cOpsPerCall,
+		const std::function<void(size_t cCalls)> &fn,
+		double dMaxAllocsPerOp = -1
+	);
+
+	const std::vector<BENCH_RESULT> &GetResults() const
+	{
+		return _results;
+	}
+
+	/**
+	 * Formats the results as JSON, with each operation on its own line so
+	 * that two runs can be diffed.
+	 */
+	std::string FormatJson() const;
+
+	// Formats the results as a table, for reading.
+	std::string FormatTable() const;
+};
+
+/**
+ * Runs every benchmark in the suite.
+ */
+void BenchSuiteRun(CBenchRunner *pRunner);
\ No newline at end of file
@@ -0,0 +1,636 @@
+#include "bench_userchoice.h"
+
+#include "../userchoicehash.h"
+#include "../assocregistry.h"
+#include "../assocprofile.h"
+#include "../associdentity.h"
+#include "../assochandlerstream.h"
+#include "../assochandlertable.h"
+#include "../protectedacl.h"
+#include "../memoryregistry.h"
+#include "fakeclock.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static LPCWSTR c_szBenchSid = WTEXT("S-1-5-21-1004336348-1177238915-682003330-1001");
+
+// The same SID, in binary.
+static const BYTE c_rgbBenchSid[] = {
+	1, 5, 0, 0, 0, 0, 0, 5,
+	21, 0, 0, 0,
+	0xDC, 0xF4, 0xDC, 0x3B,
+	0x83, 0x3D, 0x2B, 0x46,
+	0x82, 0x8B, 0xA6, 0x28,
+	0xE9, 0x03, 0x00, 0x00,
+};
+
+// 2024-01-01 12:34 UTC
+static const ULONGLONG c_ullBenchTimestamp = 0x01DA3CAECBADEC00uLL;
+
+/**
+ * Generates some plausible looking extensions and ProgIDs.
+ */
+static void MakePairs(size_t cPairs, std::vector<WCHAR> &names, std::vector<USERCHOICE_PAIR> &pairs, const char *pszVendor = "Vendor")
+{
+	names.assign(cPairs * 48, 0);
+	pairs.resize(cPairs);
+
+	for (size_t i = 0; i < cPairs; i++)
+	{
+		char szExtension[16];
+		char szProgId[32];
+		snprintf(szExtension, sizeof(szExtension), ".ext%u", (unsigned)i);
+		snprintf(szProgId, sizeof(szProgId), "%s.Document.%u", pszVendor, (unsigned)i);
+
+		WCHAR *pszExtension = &names[i * 48];
+		WCHAR *pszProgId = &names[i * 48 + 16];
+		for (size_t j = 0; j < sizeof(szExtension); j++)
+			pszExtension[j] = szExtension[j];
+		for (size_t j = 0; j < sizeof(szProgId); j++)
+			pszProgId[j] = szProgId[j];
+
+		pairs[i] = { pszExtension, pszProgId };
+	}
+}
+
+template <typename T>
+static double TimeSeconds(T fn)
+{
+	auto start = std::chrono::steady_clock::now();
+	fn();
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double>(end - start).count();
+}
+
+void BenchUserChoiceHash()
+{
+	static const size_t c_rgcBatchSizes[] = { 1, 200, 5000, 50000 };
+
+	printf("%-10s %18s %18s\n", "pairs", "per-call hash/s", "batch hash/s");
+
+	for (size_t cPairs : c_rgcBatchSizes)
+	{
+		std::vector<WCHAR> names;
+		std::vector<USERCHOICE_PAIR> pairs;
+		MakePairs(cPairs, names, pairs);
+		std::vector<WCHAR> hashes(cPairs * (USERCHOICE_HASH_CCH + 1));
+
+		// Repeat small batches so that the timings mean something.
+		size_t cRepeat = 100000 / cPairs;
+		if (cRepeat == 0)
+			cRepeat = 1;
+
+		// One hash at a time, preparing the SID and timestamp every time like
+		// GenerateUserChoiceHash does:
+		double secPerCall = TimeSeconds([&]()
+		{
+			for (size_t r = 0; r < cRepeat; r++)
+			{
+				for (size_t i = 0; i < cPairs; i++)
+				{
+					CUserChoiceHashContext context;
+					context.Init(c_szBenchSid, c_ullBenchTimestamp);
+					context.Hash(pairs[i].lpszExtension, pairs[i].lpszProgId, &hashes[i * (USERCHOICE_HASH_CCH + 1)]);
+				}
+			}
+		});
+
+		double secBatch = TimeSeconds([&]()
+		{
+			for (size_t r = 0; r < cRepeat; r++)
+			{
+				CUserChoiceHashContext context;
+				context.Init(c_szBenchSid, c_ullBenchTimestamp);
+				UserChoiceHashBatch(&context, pairs.data(), cPairs, hashes.data());
+			}
+		});
+
+		double cTotal = (double)cPairs * cRepeat;
+		printf("%-10zu %18.0f %18.0f\n", cPairs, cTotal / secPerCall, cTotal / secBatch);
+	}
+}
+
+void BenchUserChoiceHashStream()
+{
+	constexpr size_t PAIR_COUNT = 1000;
+	constexpr size_t REPEAT_COUNT = 200;
+
+	std::vector<WCHAR> names;
+	std::vector<USERCHOICE_PAIR> pairs;
+	MakePairs(PAIR_COUNT, names, pairs);
+
+	CUserChoiceHashContext context;
+	context.Init(c_szBenchSid, c_ullBenchTimestamp);
+
+	WCHAR szHash[USERCHOICE_HASH_CCH + 1];
+
+	// What GenerateUserChoiceHash used to do: size the input, allocate it,
+	// format it, lowercase it, then measure it again and hash it.
+	double secAllocate = TimeSeconds([&]()
+	{
+		for (size_t r = 0; r < REPEAT_COUNT; r++)
+		{
+			for (const USERCHOICE_PAIR &pair : pairs)
+			{
+				WCHAR szSizing[USERCHOICE_INPUT_CCH_MAX];
+				size_t cchInput = context.Format(pair.lpszExtension, pair.lpszProgId, szSizing, ARRAYSIZE(szSizing));
+
+				std::unique_ptr<WCHAR[]> pszInput = std::make_unique<WCHAR[]>(cchInput + 1);
+				context.Format(pair.lpszExtension, pair.lpszProgId, pszInput.get(), cchInput + 1);
+				UserChoiceLowerCase(pszInput.get(), cchInput);
+
+				size_t cchMeasured = 0;
+				while (pszInput[cchMeasured])
+					cchMeasured++;
+				UserChoiceHashBytes((LPCBYTE)pszInput.get(), (cchMeasured + 1) * sizeof(WCHAR), szHash);
+			}
+		}
+	});
+
+	// Format the whole input into a buffer, then hash the buffer:
+	double secFormat = TimeSeconds([&]()
+	{
+		for (size_t r = 0; r < REPEAT_COUNT; r++)
+		{
+			for (const USERCHOICE_PAIR &pair : pairs)
+			{
+				WCHAR szInput[USERCHOICE_INPUT_CCH_MAX];
+				size_t cchInput = context.Format(pair.lpszExtension, pair.lpszProgId, szInput, ARRAYSIZE(szInput));
+				UserChoiceHashBytes((LPCBYTE)szInput, (cchInput + 1) * sizeof(WCHAR), szHash);
+			}
+		}
+	});
+
+	// Stream the pieces straight into the hash:
+	double secStream = TimeSeconds([&]()
+	{
+		for (size_t r = 0; r < REPEAT_COUNT; r++)
+		{
+			for (const USERCHOICE_PAIR &pair : pairs)
+				context.Hash(pair.lpszExtension, pair.lpszProgId, szHash);
+		}
+	});
+
+	double cTotal = (double)PAIR_COUNT * REPEAT_COUNT;
+	printf("\n%-18s %18s\n", "path", "hash/s");
+	printf("%-18s %18.0f\n", "allocate + format", cTotal / secAllocate);
+	printf("%-18s %18.0f\n", "format then hash", cTotal / secFormat);
+	printf("%-18s %18.0f\n", "stream", cTotal / secStream);
+}
+
+/**
+ * A process token with the bench SID, and no impersonation.
+ */
+class CBenchIdentitySource : public IAssocIdentitySource
+{
+public:
+	LSTATUS QueryUserSid(AssocTokenKind kind, std::vector<BYTE> *pSid) override
+	{
+		if (kind == AssocTokenKind::THREAD)
+			return ERROR_NO_TOKEN;
+
+		pSid->assign(c_rgbBenchSid, c_rgbBenchSid + sizeof(c_rgbBenchSid));
+		return ERROR_SUCCESS;
+	}
+};
+
+void BenchUserChoiceWrite()
+{
+	constexpr size_t PAIR_COUNT = 200;
+
+	std::vector<WCHAR> names;
+	std::vector<USERCHOICE_PAIR> pairs;
+	MakePairs(PAIR_COUNT, names, pairs);
+
+	// The clock never moves, so no write ever has to wait for a minute.
+	CFakeClock clock(c_ullBenchTimestamp);
+	CMemoryRegistry registry(&clock);
+	registry.SetUserSid(c_szBenchSid);
+	CUserChoiceWriteScheduler scheduler(&clock);
+
+	std::vector<WCHAR> otherNames;
+	std::vector<USERCHOICE_PAIR> otherPairs;
+	MakePairs(PAIR_COUNT, otherNames, otherPairs, "Other");
+
+	// First set, onto a registry with no associations yet, and then replacing
+	// them all, first looking up the user for every write and then through
+	// an identity cache, as the Win32 backend does. Then replacing them once
+	// more with a rename probe, which finds that nothing blocks writes in
+	// place. Last, confirming them all as they are, which shouldn't write
+	// anything.
+	struct WRITE_PASS
+	{
+		const char                         *pszName;
+		const std::vector<USERCHOICE_PAIR> *pPairs;
+	};
+	const WRITE_PASS rgPasses[] = {
+		{ "new",     &pairs },
+		{ "replace", &otherPairs },
+		{ "cached",  &pairs },
+		{ "probed",  &otherPairs },
+		{ "confirm", &otherPairs },
+	};
+
+	CBenchIdentitySource source;
+	CAssocIdentityCache cache(&source);
+	CAssocRenameProbe probe;
+	CAssocRenameProbe *pProbe = nullptr;
+
+	printf("\n%-10s %8s %8s %8s %8s %8s %8s %8s %8s %12s\n",
+		"write", "open", "close", "read", "write", "rename", "security", "total", "token", "us/assoc");
+
+	for (const WRITE_PASS &pass : rgPasses)
+	{
+		const char *pszPass = pass.pszName;
+		if (strcmp(pszPass, "cached") == 0)
+			registry.SetIdentityCache(&cache);
+		else if (strcmp(pszPass, "probed") == 0)
+			pProbe = &probe;
+
+		registry.ResetOpCounts();
+
+		double sec = TimeSeconds([&]()
+		{
+			for (const USERCHOICE_PAIR &pair : *pass.pPairs)
+				AssocSetUserChoice(&registry, &scheduler, pair.lpszExtension, pair.lpszProgId, c_szBenchSid, nullptr, pProbe);
+		});
+
+		REGISTRY_OP_COUNTS counts = registry.GetOpCounts();
+		double c = (double)PAIR_COUNT;
+		printf("%-10s %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %12.2f\n",
+			pszPass,
+			counts.cOpen / c, counts.cClose / c, counts.cRead / c, counts.cWrite / c,
+			counts.cRename / c, counts.cSecurity / c, counts.Total() / c,
+			counts.cToken / c, sec * 1e6 / c);
+	}
+}
+
+void BenchAssocProfile()
+{
+	constexpr size_t PAIR_COUNT = 200;
+
+	std::vector<WCHAR> names;
+	std::vector<USERCHOICE_PAIR> pairs;
+	MakePairs(PAIR_COUNT, names, pairs);
+
+	std::vector<ASSOC_PROFILE_ENTRY> entries;
+	for (const USERCHOICE_PAIR &pair : pairs)
+		entries.push_back({ pair.lpszExtension, pair.lpszProgId });
+
+	CFakeClock clock(c_ullBenchTimestamp);
+	CMemoryRegistry registry(&clock);
+	registry.SetUserSid(c_szBenchSid);
+	CUserChoiceWriteScheduler scheduler(&clock);
+
+	// Applying onto a registry with nothing set, and then applying the same
+	// profile again, which should find nothing to do.
+	static const char *c_rgpszPasses[] = { "new", "unchanged" };
+
+	printf("\n%-10s %8s %8s %8s %8s %8s %10s\n",
+		"profile", "entries", "written", "ops", "writes", "tokens", "ms");
+
+	for (const char *pszPass : c_rgpszPasses)
+	{
+		registry.ResetOpCounts();
+
+		ASSOC_PROFILE_REPORT report;
+		double sec = TimeSeconds([&]()
+		{
+			AssocApplyProfile(&registry, &scheduler, entries.data(), entries.size(), c_szBenchSid, &report);
+		});
+
+		REGISTRY_OP_COUNTS counts = registry.GetOpCounts();
+		printf("%-10s %8u %8u %8u %8u %8u %10.2f\n",
+			pszPass,
+			(unsigned)entries.size(), (unsigned)report.cWritten,
+			(unsigned)counts.Total(), (unsigned)counts.cWrite,
+			(unsigned)counts.cToken, sec * 1e3);
+	}
+}
+
+static void AppendAce(std::vector<BYTE> &acl, BYTE bType, DWORD dwMask)
+{
+	size_t cbAce = PROTECTED_ACE_HEADER_CB + sizeof(c_rgbBenchSid);
+	BYTE rgbHeader[PROTECTED_ACE_HEADER_CB] = {
+		bType, 0, (BYTE)cbAce, (BYTE)(cbAce >> 8),
+		(BYTE)dwMask, (BYTE)(dwMask >> 8), (BYTE)(dwMask >> 16), (BYTE)(dwMask >> 24),
+	};
+	acl.insert(acl.end(), rgbHeader, rgbHeader + sizeof(rgbHeader));
+	acl.insert(acl.end(), c_rgbBenchSid, c_rgbBenchSid + sizeof(c_rgbBenchSid));
+	acl[2] = (BYTE)acl.size();
+	acl[3] = (BYTE)(acl.size() >> 8);
+	acl[4]++;
+}
+
+/**
+ * Unlocks and locks like TWinUI: DeleteAce and a SetSecurityInfo for each
+ * deny ACE, then a new ACL built by AddAce, which walks to the end of the
+ * ACL every time.
+ *
+ * @return Number of SetSecurityInfo calls it would have made.
+ */
+static DWORD PerAceUnlockAndLock(std::vector<BYTE> &dacl, std::vector<BYTE> &newAcl)
+{
+	DWORD cSetSecurity = 0;
+
+	size_t cAces = dacl[4];
+	for (size_t i = cAces; i-- > 0;)
+	{
+		size_t ib = PROTECTED_ACL_HEADER_CB;
+		for (size_t j = 0; j < i; j++)
+			ib += dacl[ib + 2] | (dacl[ib + 3] << 8);
+
+		size_t cbAce = dacl[ib + 2] | (dacl[ib + 3] << 8);
+		if (dacl[ib] == ACCESS_DENIED_ACE_TYPE && dacl[ib + 4] == KEY_SET_VALUE)
+		{
+			dacl.erase(dacl.begin() + ib, dacl.begin() + ib + cbAce);
+			dacl[2] = (BYTE)dacl.size();
+			dacl[3] = (BYTE)(dacl.size() >> 8);
+			dacl[4]--;
+			cSetSecurity++;
+		}
+	}
+
+	newAcl.assign(PROTECTED_ACL_HEADER_CB, 0);
+	newAcl[0] = ACL_REVISION;
+	AppendAce(newAcl, ACCESS_DENIED_ACE_TYPE, KEY_SET_VALUE);
+	size_t ibSource = PROTECTED_ACL_HEADER_CB;
+	for (size_t i = 0; i < dacl[4]; i++)
+	{
+		size_t ibEnd = PROTECTED_ACL_HEADER_CB;
+		for (size_t j = 0; j < newAcl[4]; j++)
+			ibEnd += newAcl[ibEnd + 2] | (newAcl[ibEnd + 3] << 8);
+
+		size_t cbAce = dacl[ibSource + 2] | (dacl[ibSource + 3] << 8);
+		newAcl.insert(newAcl.begin() + ibEnd, dacl.begin() + ibSource, dacl.begin() + ibSource + cbAce);
+		newAcl[2] = (BYTE)newAcl.size();
+		newAcl[3] = (BYTE)(newAcl.size() >> 8);
+		newAcl[4]++;
+		ibSource += cbAce;
+	}
+
+	return cSetSecurity + 1;
+}
+
+void BenchProtectedAcl()
+{
+	constexpr size_t ITERATIONS = 200000;
+
+	// A locked UserChoice key usually has one deny ACE and a handful of
+	// inherited ones. Keys that have been fought over by several programs
+	// pick up more deny ACEs.
+	static const size_t c_rgcDenyAces[] = { 1, 4 };
+	constexpr size_t INHERITED_ACES = 4;
+
+	printf("\n%-10s %8s %14s %14s %14s %14s\n",
+		"dacl", "aces", "per-ace ns", "per-ace sets", "1-pass ns", "1-pass sets");
+
+	for (size_t cDenyAces : c_rgcDenyAces)
+	{
+		std::vector<BYTE> source(PROTECTED_ACL_HEADER_CB, 0);
+		source[0] = ACL_REVISION;
+		for (size_t i = 0; i < cDenyAces; i++)
+			AppendAce(source, ACCESS_DENIED_ACE_TYPE, KEY_SET_VALUE);
+		for (size_t i = 0; i < INHERITED_ACES; i++)
+			AppendAce(source, ACCESS_ALLOWED_ACE_TYPE, 0xF003F);
+
+		std::vector<BYTE> dacl;
+		std::vector<BYTE> newAcl;
+		DWORD cPerAceSets = 0;
+		double secPerAce = TimeSeconds([&]()
+		{
+			for (size_t i = 0; i < ITERATIONS; i++)
+			{
+				dacl = source;
+				cPerAceSets = PerAceUnlockAndLock(dacl, newAcl);
+			}
+		});
+
+		CProtectedAcl editor;
+		DWORD cOnePassSets = 0;
+		size_t cbCheck = 0;
+		double secOnePass = TimeSeconds([&]()
+		{
+			for (size_t i = 0; i < ITERATIONS; i++)
+			{
+				DWORD cbAcl = 0;
+				editor.Parse(source.data(), source.size());
+				cOnePassSets = editor.GetRemovedCount() ? 1 : 0;
+				cbCheck += editor.BuildUnlocked(&cbAcl) ? cbAcl : 0;
+				cbCheck += editor.BuildLocked(c_rgbBenchSid, sizeof(c_rgbBenchSid), &cbAcl) ? cbAcl : 0;
+				cOnePassSets++;
+			}
+		});
+
+		printf("%-10s %8u %14.1f %14u %14.1f %14u\n",
+			cDenyAces == 1 ? "locked" : "contested",
+			(unsigned)(cDenyAces + INHERITED_ACES),
+			secPerAce * 1e9 / ITERATIONS, (unsigned)cPerAceSets,
+			secOnePass * 1e9 / ITERATIONS, (unsigned)cOnePassSets);
+
+		// Keeps the one-pass loop from being optimised away.
+		if (!cbCheck)
+			printf("(no ACLs built)\n");
+	}
+}
+
+/**
+ * A handler source which takes a while over each handler, like
+ * SHAssocEnumHandlers does on a machine with many apps installed.
+ */
+class CBenchHandlerSource : public IAssocHandlerSource
+{
+private:
+	size_t                    _cHandlers;
+	size_t                    _cRecommended;
+	std::chrono::microseconds _cost;
+	size_t                    _iNext;
+
+public:
+	CBenchHandlerSource(size_t cHandlers, size_t cRecommended, std::chrono::microseconds cost)
+		: _cHandlers(cHandlers)
+		, _cRecommended(cRecommended)
+		, _cost(cost)
+		, _iNext(0)
+	{
+	}
+
+	bool IsRecommendedFirst() override
+	{
+		return true;
+	}
+
+	bool Next(ASSOC_HANDLER_SNAPSHOT *pSnapshot) override
+	{
+		if (_iNext == _cHandlers)
+			return false;
+
+		auto until = std::chrono::steady_clock::now() + _cost;
+		while (std::chrono::steady_clock::now() < until)
+		{
+		}
+
+		pSnapshot->strName = WTEXT("C:\\Program Files\\App\\app.exe");
+		pSnapshot->strUIName = WTEXT("App");
+		pSnapshot->fRecommended = _iNext < _cRecommended;
+		_iNext++;
+		return true;
+	}
+};
+
+class CBenchHandlerSink : public IAssocHandlerSink
+{
+public:
+	std::mutex               _mutex;
+	std::condition_variable  _cv;
+	DWORD                    _cWakes;
+
+	CBenchHandlerSink()
+		: _cWakes(0)
+	{
+	}
+
+	void OnHandlersReady() override
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_cWakes++;
+		_cv.notify_all();
+	}
+};
+
+void BenchAssocHandlerStream()
+{
+	constexpr size_t HANDLER_COUNT = 400;
+	constexpr size_t RECOMMENDED_COUNT = 8;
+	const std::chrono::microseconds cost(50);
+
+	printf("\n%-10s %8s %8s %8s %12s %12s\n",
+		"handlers", "count", "batches", "wakes", "first ms", "all ms");
+
+	// Enumerating everything before showing anything, as the dialog used to.
+	{
+		CBenchHandlerSource source(HANDLER_COUNT, RECOMMENDED_COUNT, cost);
+		CBenchHandlerSink sink;
+		CAssocHandlerStreamer streamer(&source, &sink);
+
+		double sec = TimeSeconds([&]()
+		{
+			streamer.Run();
+		});
+
+		ASSOC_HANDLER_STREAM_COUNTS counts = streamer.GetCounts();
+		printf("%-10s %8u %8u %8u %12.2f %12.2f\n",
+			"blocking",
+			(unsigned)counts.cHandlers, (unsigned)counts.cBatches, (unsigned)counts.cWakes,
+			sec * 1e3, sec * 1e3);
+	}
+
+	// Streaming from a worker, timing when the first batch, which has the
+	// recommended handlers, and the last one arrive.
+	{
+		CBenchHandlerSource source(HANDLER_COUNT, RECOMMENDED_COUNT, cost);
+		CBenchHandlerSink sink;
+		CAssocHandlerStreamer streamer(&source, &sink);
+
+		auto start = std::chrono::steady_clock::now();
+		std::thread worker([&]()
+		{
+			streamer.Run();
+		});
+
+		double secFirst = 0;
+		bool fComplete = false;
+		DWORD cWakesSeen = 0;
+		while (!fComplete)
+		{
+			{
+				std::unique_lock<std::mutex> lock(sink._mutex);
+				sink._cv.wait(lock, [&]() { return sink._cWakes != cWakesSeen; });
+				cWakesSeen = sink._cWakes;
+			}
+
+			while (std::unique_ptr<ASSOC_HANDLER_BATCH> pBatch = streamer.TakeBatch())
+			{
+				if (secFirst == 0)
+					secFirst = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+				fComplete |= pBatch->fComplete;
+			}
+		}
+
+		double secAll = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		worker.join();
+
+		ASSOC_HANDLER_STREAM_COUNTS counts = streamer.GetCounts();
+		printf("%-10s %8u %8u %8u %12.2f %12.2f\n",
+			"streamed",
+			(unsigned)counts.cHandlers, (unsigned)counts.cBatches, (unsigned)counts.cWakes,
+			secFirst * 1e3, secAll * 1e3);
+	}
+}
+
+void BenchAssocHandlerTable()
+{
+	printf("\n%-10s %18s %18s\n", "handlers", "scan lookup/s", "index lookup/s");
+
+	for (size_t cHandlers : { 16, 128, 1024 })
+	{
+		CAssocHandlerTable table;
+		std::vector<std::basic_string<WCHAR>> names;
+		for (size_t i = 0; i < cHandlers; i++)
+		{
+			char szName[64];
+			snprintf(szName, sizeof(szName), "C:\\Program Files\\Vendor %u\\App%u.exe", (unsigned)i, (unsigned)i);
+
+			ASSOC_HANDLER_SNAPSHOT snapshot = {};
+			snapshot.strName.assign(szName, szName + strlen(szName));
+			snapshot.strUIName = WTEXT("App");
+			names.push_back(snapshot.strName);
+			table.Add(snapshot);
+		}
+
+		// Looking for the last handler, which is the worst case for the scan
+		// and the common case when browsing for a program that isn't listed.
+		std::basic_string<WCHAR> strQuery = names.back();
+		UserChoiceLowerCase(&strQuery[0], strQuery.size());
+
+		const size_t cLookups = 200000 / cHandlers + 1000;
+		volatile int iFound = 0;
+
+		// What _FindItemIndex used to do, less the COM calls: copy every
+		// handler's name and compare it case-insensitively.
+		double secScan = TimeSeconds([&]()
+		{
+			for (size_t n = 0; n < cLookups; n++)
+			{
+				int iResult = -1;
+				for (size_t i = 0; i < names.size() && iResult == -1; i++)
+				{
+					std::basic_string<WCHAR> strName = names[i];
+					UserChoiceLowerCase(&strName[0], strName.size());
+					if (strName == strQuery)
+						iResult = (int)i;
+				}
+				iFound = iResult;
+			}
+		});
+
+		double secIndex = TimeSeconds([&]()
+		{
+			for (size_t n = 0; n < cLookups; n++)
+			{
+				iFound = table.FindName(strQuery.c_str());
+			}
+		});
+
+		printf("%-10zu %18.0f %18.0f\n", cHandlers, cLookups / secScan, cLookups / secIndex);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,44 @@
+#pragma once
+
+/**
+ * Throughput benchmarks for UserChoice hashing.
+ *
+ * Results are printed to stdout.
+ */
+void BenchUserChoiceHash();
+
+/**
+ * Compares formatting the hash input and then hashing it against streaming
+ * the pieces straight into CUserChoiceHashStream.
+ */
+void BenchUserChoiceHashStream();
+
+/**
+ * Sets associations on an in-memory registry and reports how many registry
+ * operations each one took, and how long.
+ */
+void BenchUserChoiceWrite();
+
+/**
+ * Applies a profile of associations to an in-memory registry, first with
+ * none of them set and then again with all of them already set.
+ */
+void BenchAssocProfile();
+
+/**
+ * Compares rewriting a UserChoice key's DACL the way TWinUI does it, an ACE
+ * at a time, against CProtectedAcl's single pass.
+ */
+void BenchProtectedAcl();
+
+/**
+ * Times how long the dialog waits for handlers from a slow source, all at
+ * once and streamed from a worker thread.
+ */
+void BenchAssocHandlerStream();
+
+/**
+ * Compares finding a handler by its path with a scan, as the dialog used
+ * to, against CAssocHandlerTable's index.
+ */
+void BenchAssocHandlerTable();
\ No newline at end of file
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "../userchoicescheduler.h"
+
+#include <atomic>
+
+// 2024-01-01 12:34 UTC
+static const ULONGLONG c_ullTestMinute = 0x01DA3CAECBADEC00uLL;
+
+/**
+ * Time only moves when it's told to.
+ */
+class CFakeClock : public IUserChoiceClock
+{
+public:
+	ULONGLONG _ullNow;
+	ULONGLONG _ullSlept;
+
+	CFakeClock(ULONGLONG ullNow)
+		: _ullNow(ullNow)
+		, _ullSlept(0)
+	{
+	}
+
+	ULONGLONG Now() override
+	{
+		return _ullNow;
+	}
+
+	void SleepUntil(ULONGLONG ullTime) override
+	{
+		if (ullTime > _ullNow)
+		{
+			_ullSlept += ullTime - _ullNow;
+			_ullNow = ullTime;
+		}
+	}
+};
+
+/**
+ * A clock which only moves when it's told to, and can be read from other
+ * threads while the test moves it. Nothing sleeps on it.
+ */
+class CAtomicFakeClock : public IUserChoiceClock
+{
+public:
+	std::atomic<ULONGLONG> _ullNow;
+
+	CAtomicFakeClock()
+		: _ullNow(c_ullTestMinute)
+	{
+	}
+
+	ULONGLONG Now() override
+	{
+		return _ullNow.load();
+	}
+
+	void SleepUntil(ULONGLONG) override
+	{
+	}
+};
\ No newline at end of file
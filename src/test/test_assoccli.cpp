@@ -0,0 +1,300 @@
+#include "test_assoccli.h"
+
+#include "../assoccli.h"
+#include "../assocregistry.h"
+#include "../memoryregistry.h"
+#include "fakeclock.h"
+#include "testutil.h"
+
+#include <stdio.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * Runs commands against a memory registry, and keeps what they write.
+ */
+class CTestAssocCliHost : public IAssocCliHost
+{
+public:
+	CFakeClock                                               _clock;
+	CMemoryRegistry                                          _registry;
+	CUserChoiceWriteScheduler                                _scheduler;
+	LPCWSTR                                                  _lpszUserSid;
+	std::map<std::basic_string<WCHAR>, std::string>          _profiles;
+	std::vector<std::string>                                 _lines;
+
+	// Set to make Apply fail outright.
+	const char                                              *_pszApplyError;
+
+	CTestAssocCliHost()
+		: _clock(c_ullTestMinute + 20 * 1000 * USERCHOICE_FILETIME_PER_MS)
+		, _registry(&_clock)
+		, _scheduler(&_clock)
+		, _lpszUserSid(c_szTestSid)
+		, _pszApplyError(nullptr)
+	{
+		_registry.SetUserSid(c_szTestSid);
+
+		AddProgId(WTEXT("txtfile"));
+		AddProgId(WTEXT("htmlfile"));
+		AddProgId(WTEXT("Chrome\"HTML"));
+	}
+
+	void AddProgId(LPCWSTR lpszProgId)
+	{
+		CRegistryKey hk(&_registry);
+		_registry.CreateKey(HKEY_CLASSES_ROOT, lpszProgId, hk.put());
+	}
+
+	IRegistryBackend *GetRegistry() override
+	{
+		return &_registry;
+	}
+
+	LPCWSTR GetUserSid() override
+	{
+		return _lpszUserSid;
+	}
+
+	IUserChoiceClock *GetClock() override
+	{
+		return &_clock;
+	}
+
+	bool Apply(
+		const ASSOC_PROFILE_ENTRY *pEntries,
+		size_t cEntries,
+		ASSOC_PROFILE_REPORT *pReport,
+		std::string *pstrError
+	) override
+	{
+		if (_pszApplyError)
+		{
+			*pstrError = _pszApplyError;
+			return false;
+		}
+
+		AssocApplyProfile(&_registry, &_scheduler, pEntries, cEntries, c_szTestSid, pReport);
+
+		// Something to time.
+		_clock._ullNow += cEntries * USERCHOICE_FILETIME_PER_MS;
+		return true;
+	}
+
+	bool ReadProfile(LPCWSTR lpszPath, std::string *pstrXml) override
+	{
+		auto it = _profiles.find(lpszPath);
+		if (it == _profiles.end())
+		{
+			return false;
+		}
+
+		*pstrXml = it->second;
+		return true;
+	}
+
+	void WriteLine(const std::string &strLine) override
+	{
+		_lines.push_back(strLine);
+	}
+
+	int Run(std::vector<LPCWSTR> args)
+	{
+		_lines.clear();
+
+		ASSOC_CLI_ARGS cliArgs;
+		AssocCliParse((int)args.size(), args.data(), &cliArgs);
+		return AssocCliRun(cliArgs, this);
+	}
+};
+
+static AssocCliCommand Parse(std::vector<LPCWSTR> args, ASSOC_CLI_ARGS *pArgs)
+{
+	return AssocCliParse((int)args.size(), args.data(), pArgs);
+}
+
+static bool TestParse()
+{
+	ASSOC_CLI_ARGS args;
+
+	// Anything without a command is left for the dialog.
+	EXPECT(Parse({}, &args) == AssocCliCommand::NONE);
+	EXPECT(Parse({ WTEXT("C:\\file.txt") }, &args) == AssocCliCommand::NONE);
+	EXPECT(Parse({ WTEXT("-embedding") }, &args) == AssocCliCommand::NONE);
+
+	EXPECT(Parse({ WTEXT("--set"), WTEXT(".txt=txtfile"), WTEXT("http=Chrome=HTML") }, &args) == AssocCliCommand::SET);
+	EXPECT(args.command == AssocCliCommand::SET);
+	EXPECT(args.entries.size() == 2);
+	EXPECT(args.entries[0].strIdentifier == WTEXT(".txt"));
+	EXPECT(args.entries[0].strProgId == WTEXT("txtfile"));
+	EXPECT(args.entries[1].strIdentifier == WTEXT("http"));
+	EXPECT(args.entries[1].strProgId == WTEXT("Chrome=HTML"));
+
+	EXPECT(Parse({ WTEXT("--verify"), WTEXT(".txt"), WTEXT(".htm=htmlfile") }, &args) == AssocCliCommand::VERIFY);
+	EXPECT(args.entries.size() == 2);
+	EXPECT(args.entries[0].strProgId.empty());
+	EXPECT(args.entries[1].strProgId == WTEXT("htmlfile"));
+
+	EXPECT(Parse({ WTEXT("--apply-profile"), WTEXT("C:\\profile.xml") }, &args) == AssocCliCommand::APPLY_PROFILE);
+	EXPECT(args.strProfilePath == WTEXT("C:\\profile.xml"));
+	EXPECT(args.entries.empty());
+
+	// Everything else about a command is an error.
+	static const std::vector<LPCWSTR> c_rgInvalid[] = {
+		{ WTEXT("--set") },
+		{ WTEXT("--set"), WTEXT(".txt") },
+		{ WTEXT("--set"), WTEXT(".txt=") },
+		{ WTEXT("--set"), WTEXT("=txtfile") },
+		{ WTEXT("--set"), WTEXT("..\\..\\Run=evil") },
+		{ WTEXT("--verify"), WTEXT(".txt"), WTEXT("--set"), WTEXT(".txt=txtfile") },
+		{ WTEXT("--verify"), WTEXT(".txt"), WTEXT("--quiet") },
+		{ WTEXT("C:\\file.txt"), WTEXT("--verify"), WTEXT(".txt") },
+		{ WTEXT("--apply-profile") },
+		{ WTEXT("--apply-profile"), WTEXT("a.xml"), WTEXT("b.xml") },
+	};
+	for (const std::vector<LPCWSTR> &invalid : c_rgInvalid)
+	{
+		EXPECT(Parse(invalid, &args) == AssocCliCommand::INVALID);
+		EXPECT(args.command == AssocCliCommand::INVALID);
+		EXPECT(!args.strError.empty());
+	}
+
+	return true;
+}
+
+static bool TestSet()
+{
+	CTestAssocCliHost host;
+
+	EXPECT(host.Run({ WTEXT("--set"), WTEXT(".txt=txtfile"), WTEXT("http=Chrome\"HTML") }) == ASSOC_CLI_EXIT_OK);
+	EXPECT(host._lines.size() == 3);
+	EXPECT(host._lines[0] == "{\"command\":\"set\",\"identifier\":\".txt\",\"progId\":\"txtfile\",\"result\":\"written\"}");
+	EXPECT(host._lines[1] == "{\"command\":\"set\",\"identifier\":\"http\",\"progId\":\"Chrome\\\"HTML\",\"result\":\"written\"}");
+	EXPECT(host._lines[2] ==
+		"{\"command\":\"set\",\"summary\":true,\"entries\":2,\"unchanged\":0,\"written\":2,\"failed\":0,"
+		"\"elapsedMs\":2.000,\"entriesPerSecond\":1000.000,\"exitCode\":0}");
+
+	// Setting them again changes nothing.
+	EXPECT(host.Run({ WTEXT("--set"), WTEXT(".txt=TXTFILE") }) == ASSOC_CLI_EXIT_OK);
+	EXPECT(host._lines[0] == "{\"command\":\"set\",\"identifier\":\".txt\",\"progId\":\"TXTFILE\",\"result\":\"unchanged\"}");
+
+	// Nothing is written if associations can't be set at all.
+	host._pszApplyError = "Unsupported";
+	EXPECT(host.Run({ WTEXT("--set"), WTEXT(".htm=htmlfile") }) == ASSOC_CLI_EXIT_ERROR);
+	EXPECT(host._lines.size() == 1);
+	EXPECT(host._lines[0] == "{\"command\":\"set\",\"error\":\"Unsupported\",\"exitCode\":3}");
+
+	// Nor for a ProgID which doesn't exist; the rest are still set.
+	host._pszApplyError = nullptr;
+	EXPECT(host.Run({ WTEXT("--set"), WTEXT(".txt=txtfiel"), WTEXT(".htm=htmlfile") }) == ASSOC_CLI_EXIT_FAILED);
+	EXPECT(host._lines.size() == 3);
+	EXPECT(host._lines[0] ==
+		"{\"command\":\"set\",\"identifier\":\".txt\",\"progId\":\"txtfiel\",\"result\":\"failed\","
+		"\"error\":\"The ProgID doesn't exist\"}");
+	EXPECT(host._lines[1] == "{\"command\":\"set\",\"identifier\":\".htm\",\"progId\":\"htmlfile\",\"result\":\"written\"}");
+	EXPECT(host._lines[2].find("\"entries\":2,\"unchanged\":0,\"written\":1,\"failed\":1,") != std::string::npos);
+	EXPECT(host._lines[2].find("\"exitCode\":1}") != std::string::npos);
+
+	WCHAR szProgId[256];
+	WCHAR szHash[USERCHOICE_HASH_CCH + 1];
+	ULONGLONG ullLastWrite;
+	EXPECT(AssocReadUserChoice(&host._registry, WTEXT(".txt"), szProgId, ARRAYSIZE(szProgId), szHash, &ullLastWrite) == ERROR_SUCCESS);
+	EXPECT(StringEquals(szProgId, WTEXT("txtfile")));
+
+	// Neither is anything for a bad command line.
+	EXPECT(host.Run({ WTEXT("--set"), WTEXT(".htm") }) == ASSOC_CLI_EXIT_USAGE);
+	EXPECT(host._lines.size() == 1);
+	EXPECT(host._lines[0].find("\"error\":\"Associations are set as") != std::string::npos);
+	EXPECT(host._lines[0].find("\"exitCode\":2}") != std::string::npos);
+
+	return true;
+}
+
+static bool TestVerify()
+{
+	CTestAssocCliHost host;
+	EXPECT(host.Run({ WTEXT("--set"), WTEXT(".txt=txtfile"), WTEXT(".htm=htmlfile") }) == ASSOC_CLI_EXIT_OK);
+
+	// A hash which Windows would reset.
+	EXPECT(AssocWriteUserChoice(&host._registry, WTEXT(".log"), WTEXT("txtfile"), WTEXT("AAAAAAAAAAA=")) == ERROR_SUCCESS);
+
+	EXPECT(host.Run({ WTEXT("--verify"), WTEXT(".txt"), WTEXT(".htm=HTMLFILE"), WTEXT(".htm=ChromeHTML") }) == ASSOC_CLI_EXIT_FAILED);
+	EXPECT(host._lines.size() == 4);
+	EXPECT(host._lines[0] == "{\"command\":\"verify\",\"identifier\":\".txt\",\"expectedProgId\":null,\"progId\":\"txtfile\",\"result\":\"current\"}");
+	EXPECT(host._lines[1] == "{\"command\":\"verify\",\"identifier\":\".htm\",\"expectedProgId\":\"HTMLFILE\",\"progId\":\"htmlfile\",\"result\":\"current\"}");
+	EXPECT(host._lines[2] == "{\"command\":\"verify\",\"identifier\":\".htm\",\"expectedProgId\":\"ChromeHTML\",\"progId\":\"htmlfile\",\"result\":\"otherProgId\"}");
+
+	EXPECT(host.Run({ WTEXT("--verify"), WTEXT(".log"), WTEXT(".xyz"), WTEXT(".txt=txtfile") }) == ASSOC_CLI_EXIT_FAILED);
+	EXPECT(host._lines[0].find("\"result\":\"staleHash\"") != std::string::npos);
+	EXPECT(host._lines[1] == "{\"command\":\"verify\",\"identifier\":\".xyz\",\"expectedProgId\":null,\"progId\":null,\"result\":\"notSet\"}");
+	EXPECT(host._lines[3].find("\"entries\":3,\"current\":1,\"otherProgId\":0,\"staleHash\":1,\"notSet\":1,") != std::string::npos);
+
+	// Verifying takes no time on the fake clock.
+	EXPECT(host._lines[3].find("\"elapsedMs\":0.000,\"entriesPerSecond\":null,\"exitCode\":1}") != std::string::npos);
+
+	EXPECT(host.Run({ WTEXT("--verify"), WTEXT(".txt=txtfile") }) == ASSOC_CLI_EXIT_OK);
+
+	host._lpszUserSid = nullptr;
+	EXPECT(host.Run({ WTEXT("--verify"), WTEXT(".txt=txtfile") }) == ASSOC_CLI_EXIT_ERROR);
+	EXPECT(host._lines.size() == 1);
+
+	return true;
+}
+
+static bool TestApplyProfile()
+{
+	CTestAssocCliHost host;
+
+	// A profile the size a fleet would push.
+	std::string strXml = "<DefaultAssociations>\n";
+	std::vector<std::basic_string<WCHAR>> verifyArgs;
+	for (int i = 0; i < 500; i++)
+	{
+		std::string strExtension = ".ext" + std::to_string(i);
+		strXml += "<Association Identifier=\"" + strExtension + "\" ProgId=\"Vendor.File." + std::to_string(i % 7) + "\" />\n";
+		verifyArgs.push_back(std::basic_string<WCHAR>(strExtension.begin(), strExtension.end()));
+	}
+	strXml += "</DefaultAssociations>\n";
+	for (int i = 0; i < 7; i++)
+	{
+		std::basic_string<WCHAR> strProgId = WTEXT("Vendor.File.");
+		strProgId += (WCHAR)(WTEXT('0') + i);
+		host.AddProgId(strProgId.c_str());
+	}
+	host._profiles[WTEXT("fleet.xml")] = strXml;
+	host._profiles[WTEXT("empty.xml")] = "<DefaultAssociations />";
+
+	EXPECT(host.Run({ WTEXT("--apply-profile"), WTEXT("fleet.xml") }) == ASSOC_CLI_EXIT_OK);
+	EXPECT(host._lines.size() == 501);
+	EXPECT(host._lines[499] == "{\"command\":\"apply-profile\",\"identifier\":\".ext499\",\"progId\":\"Vendor.File.2\",\"result\":\"written\"}");
+	EXPECT(host._lines[500].find("\"entries\":500,\"unchanged\":0,\"written\":500,\"failed\":0,") != std::string::npos);
+	EXPECT(host._lines[500].find("\"entriesPerSecond\":1000.000,") != std::string::npos);
+
+	std::vector<LPCWSTR> args = { WTEXT("--verify") };
+	for (const std::basic_string<WCHAR> &strArg : verifyArgs)
+	{
+		args.push_back(strArg.c_str());
+	}
+	EXPECT(host.Run(args) == ASSOC_CLI_EXIT_OK);
+	EXPECT(host._lines[500].find("\"entries\":500,\"current\":500,") != std::string::npos);
+
+	EXPECT(host.Run({ WTEXT("--apply-profile"), WTEXT("fleet.xml") }) == ASSOC_CLI_EXIT_OK);
+	EXPECT(host._lines[500].find("\"unchanged\":500,\"written\":0,") != std::string::npos);
+
+	EXPECT(host.Run({ WTEXT("--apply-profile"), WTEXT("missing.xml") }) == ASSOC_CLI_EXIT_ERROR);
+	EXPECT(host._lines.size() == 1);
+	EXPECT(host.Run({ WTEXT("--apply-profile"), WTEXT("empty.xml") }) == ASSOC_CLI_EXIT_ERROR);
+	EXPECT(host._lines.size() == 1);
+
+	return true;
+}
+
+bool TestAssocCli()
+{
+	return TestParse()
+		&& TestSet()
+		&& TestVerify()
+		&& TestApplyProfile();
+}
\ No newline at end of file
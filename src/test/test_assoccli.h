@@ -0,0 +1,7 @@
+#pragma once
+
+/**
+ * Tests for the headless command line: parsing it, and what --set, --verify
+ * and --apply-profile write and exit with.
+ */
+bool TestAssocCli();
\ No newline at end of file
@@ -0,0 +1,289 @@
+#include "test_assochandlercache.h"
+
+#include "../assochandlercache.h"
+#include "../assocregistry.h"
+#include "../memoryregistry.h"
+#include "fakeclock.h"
+#include "testutil.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+
+typedef std::basic_string<WCHAR> String;
+
+/**
+ * Keeps entries in memory.
+ */
+class CFakeCacheStore : public IAssocHandlerCacheStore
+{
+private:
+	class CView : public IAssocHandlerCacheView
+	{
+	private:
+		std::vector<BYTE> _data;
+
+	public:
+		CView(const std::vector<BYTE> &data)
+			: _data(data)
+		{
+		}
+
+		const BYTE *GetData() override
+		{
+			return _data.data();
+		}
+
+		size_t GetSize() override
+		{
+			return _data.size();
+		}
+	};
+
+public:
+	std::map<String, std::vector<BYTE>> _entries;
+
+	std::unique_ptr<IAssocHandlerCacheView> Open(LPCWSTR lpszKey) override
+	{
+		auto it = _entries.find(lpszKey);
+		if (it == _entries.end())
+		{
+			return nullptr;
+		}
+		return std::unique_ptr<IAssocHandlerCacheView>(new CView(it->second));
+	}
+
+	bool Write(LPCWSTR lpszKey, const BYTE *pbData, size_t cbData) override
+	{
+		_entries[lpszKey].assign(pbData, pbData + cbData);
+		return true;
+	}
+};
+
+static void AddHandler(CAssocHandlerTable *pTable, LPCWSTR pszName, LPCWSTR pszUIName, LPCWSTR pszProgId, bool fRecommended)
+{
+	ASSOC_HANDLER_SNAPSHOT snapshot = {};
+	snapshot.strName = pszName;
+	snapshot.strUIName = pszUIName;
+	snapshot.strIconPath = pszName;
+	snapshot.iIcon = -101;
+	snapshot.dwType = 4;
+	snapshot.strProgId = pszProgId;
+	snapshot.fRecommended = fRecommended;
+	pTable->Add(snapshot);
+}
+
+static void FillTable(CAssocHandlerTable *pTable)
+{
+	AddHandler(pTable, WTEXT("C:\\Windows\\notepad.exe"), WTEXT("Notepad"), WTEXT("txtfile"), true);
+	AddHandler(pTable, WTEXT("C:\\Tools\\edit.exe"), WTEXT("Editor"), WTEXT(""), false);
+	AddHandler(pTable, WTEXT(""), WTEXT("Nameless"), WTEXT(""), false);
+}
+
+static bool TestRoundTrip()
+{
+	CAssocHandlerTable table;
+	FillTable(&table);
+
+	std::vector<BYTE> data;
+	AssocSerializeHandlerCache(WTEXT("file.txt"), 42, table, &data);
+	EXPECT(data.size() > sizeof(ASSOC_HANDLER_CACHE_HEADER) + 3 * sizeof(ASSOC_HANDLER_CACHE_ITEM));
+
+	CAssocHandlerTable loaded;
+	EXPECT(AssocParseHandlerCache(data.data(), data.size(), WTEXT("file.txt"), 42, &loaded));
+	EXPECT(loaded.GetCount() == 3);
+	for (size_t i = 0; i < table.GetCount(); i++)
+	{
+		EXPECT(StringEquals(loaded.GetName(i), table.GetName(i)));
+		EXPECT(StringEquals(loaded.GetUIName(i), table.GetUIName(i)));
+		EXPECT(StringEquals(loaded.GetIconPath(i), table.GetIconPath(i)));
+		EXPECT(StringEquals(loaded.GetProgId(i), table.GetProgId(i)));
+		EXPECT(loaded.GetIconIndex(i) == -101);
+		EXPECT(loaded.GetType(i) == 4);
+		EXPECT(loaded.IsRecommended(i) == table.IsRecommended(i));
+	}
+
+	// Loaded names are indexed like any others.
+	EXPECT(loaded.FindName(WTEXT("c:/tools/EDIT.exe")) == 1);
+
+	// An empty table is an entry too.
+	CAssocHandlerTable empty;
+	AssocSerializeHandlerCache(WTEXT("url.mailto"), 7, empty, &data);
+	EXPECT(AssocParseHandlerCache(data.data(), data.size(), WTEXT("url.mailto"), 7, &empty));
+	EXPECT(empty.GetCount() == 0);
+
+	return true;
+}
+
+static bool TestRejected()
+{
+	CAssocHandlerTable table;
+	FillTable(&table);
+
+	std::vector<BYTE> data;
+	AssocSerializeHandlerCache(WTEXT("file.txt"), 42, table, &data);
+
+	CAssocHandlerTable loaded;
+	EXPECT(!AssocParseHandlerCache(data.data(), data.size(), WTEXT("file.txt"), 43, &loaded));
+	EXPECT(!AssocParseHandlerCache(data.data(), data.size(), WTEXT("file.log"), 42, &loaded));
+	EXPECT(!AssocParseHandlerCache(nullptr, 0, WTEXT("file.txt"), 42, &loaded));
+
+	// Every length it could be cut to.
+	for (size_t cb = 0; cb < data.size(); cb++)
+	{
+		EXPECT(!AssocParseHandlerCache(data.data(), cb, WTEXT("file.txt"), 42, &loaded));
+	}
+
+	std::vector<BYTE> damaged = data;
+	damaged[0] ^= 0xFF;
+	EXPECT(!AssocParseHandlerCache(damaged.data(), damaged.size(), WTEXT("file.txt"), 42, &loaded));
+
+	damaged = data;
+	ASSOC_HANDLER_CACHE_HEADER header;
+	memcpy(&header, damaged.data(), sizeof(header));
+	header.dwVersion++;
+	memcpy(damaged.data(), &header, sizeof(header));
+	EXPECT(!AssocParseHandlerCache(damaged.data(), damaged.size(), WTEXT("file.txt"), 42, &loaded));
+
+	// More handlers than there is room for.
+	memcpy(&header, data.data(), sizeof(header));
+	header.cHandlers = 0x40000000;
+	damaged = data;
+	memcpy(damaged.data(), &header, sizeof(header));
+	EXPECT(!AssocParseHandlerCache(damaged.data(), damaged.size(), WTEXT("file.txt"), 42, &loaded));
+
+	// A string offset past the end, in the last handler so that the first
+	// ones would otherwise be fine.
+	ASSOC_HANDLER_CACHE_ITEM item;
+	size_t ibLast = sizeof(header) + 2 * sizeof(item);
+	damaged = data;
+	memcpy(&item, damaged.data() + ibLast, sizeof(item));
+	item.ichProgId = 0xFFFF;
+	memcpy(damaged.data() + ibLast, &item, sizeof(item));
+	EXPECT(!AssocParseHandlerCache(damaged.data(), damaged.size(), WTEXT("file.txt"), 42, &loaded));
+
+	// Strings without a final null.
+	damaged = data;
+	damaged[damaged.size() - 1] = 'x';
+	EXPECT(!AssocParseHandlerCache(damaged.data(), damaged.size(), WTEXT("file.txt"), 42, &loaded));
+
+	// Nothing was added by any of them.
+	EXPECT(loaded.GetCount() == 0);
+	return true;
+}
+
+static bool TestMakeKey()
+{
+	EXPECT(CAssocHandlerCache::MakeKey(WTEXT(".TXT"), false) == WTEXT("file.txt"));
+	EXPECT(CAssocHandlerCache::MakeKey(WTEXT("MailTo"), true) == WTEXT("url.mailto"));
+	EXPECT(CAssocHandlerCache::MakeKey(WTEXT(""), false).empty());
+	EXPECT(CAssocHandlerCache::MakeKey(nullptr, true).empty());
+	return true;
+}
+
+static bool TestStamp()
+{
+	CFakeClock clock(c_ullTestMinute);
+	CMemoryRegistry registry(&clock);
+	CFakeCacheStore store;
+	CAssocHandlerCache cache(&store, &registry);
+
+	// Nothing there is a stamp as well.
+	ULONGLONG ullEmpty = cache.GetStamp(WTEXT(".txt"), false);
+	EXPECT(ullEmpty == cache.GetStamp(WTEXT(".txt"), false));
+
+	CRegistryKey hk(&registry);
+	clock._ullNow += USERCHOICE_FILETIME_PER_MS;
+	EXPECT(registry.CreateKey(HKEY_CLASSES_ROOT, WTEXT(".txt\\OpenWithProgids"), hk.put()) == ERROR_SUCCESS);
+	ULONGLONG ullProgIds = cache.GetStamp(WTEXT(".txt"), false);
+	EXPECT(ullProgIds != ullEmpty);
+	EXPECT(ullProgIds == cache.GetStamp(WTEXT(".txt"), false));
+
+	// Other extensions, and protocols, don't depend on it.
+	EXPECT(cache.GetStamp(WTEXT(".log"), false) == cache.GetStamp(WTEXT(".log"), false));
+	ULONGLONG ullMailTo = cache.GetStamp(WTEXT("mailto"), true);
+
+	clock._ullNow += USERCHOICE_FILETIME_PER_MS;
+	WCHAR szKeyPath[ASSOC_KEY_PATH_CCH_MAX];
+	EXPECT(AssocFormatKeyPath(WTEXT(".txt"), false, szKeyPath, ARRAYSIZE(szKeyPath)));
+	String strUserChoice = String(szKeyPath) + WTEXT("\\UserChoice");
+	EXPECT(registry.CreateKey(HKEY_CURRENT_USER, strUserChoice.c_str(), hk.put()) == ERROR_SUCCESS);
+	ULONGLONG ullUserChoice = cache.GetStamp(WTEXT(".txt"), false);
+	EXPECT(ullUserChoice != ullProgIds);
+	EXPECT(cache.GetStamp(WTEXT("mailto"), true) == ullMailTo);
+
+	// A registered application.
+	clock._ullNow += USERCHOICE_FILETIME_PER_MS;
+	EXPECT(registry.CreateKey(HKEY_CLASSES_ROOT, WTEXT("Applications\\edit.exe"), hk.put()) == ERROR_SUCCESS);
+	ULONGLONG ullApplication = cache.GetStamp(WTEXT(".txt"), false);
+	EXPECT(ullApplication != ullUserChoice);
+
+	// Deleting a key changes it as well.
+	clock._ullNow += USERCHOICE_FILETIME_PER_MS;
+	hk.reset();
+	EXPECT(registry.DeleteKey(HKEY_CURRENT_USER, strUserChoice.c_str()) == ERROR_SUCCESS);
+	EXPECT(cache.GetStamp(WTEXT(".txt"), false) != ullApplication);
+
+	// Protocols have their own keys.
+	clock._ullNow += USERCHOICE_FILETIME_PER_MS;
+	EXPECT(registry.CreateKey(HKEY_CLASSES_ROOT, WTEXT("mailto"), hk.put()) == ERROR_SUCCESS);
+	EXPECT(cache.GetStamp(WTEXT("mailto"), true) != ullMailTo);
+
+	return true;
+}
+
+static bool TestLoadSave()
+{
+	CFakeClock clock(c_ullTestMinute);
+	CMemoryRegistry registry(&clock);
+	CFakeCacheStore store;
+	CAssocHandlerCache cache(&store, &registry);
+
+	CAssocHandlerTable loaded;
+	ULONGLONG ullStamp = cache.GetStamp(WTEXT(".TXT"), false);
+	EXPECT(!cache.Load(WTEXT(".TXT"), false, ullStamp, &loaded));
+	EXPECT(cache.GetCounts().cMisses == 1);
+
+	CAssocHandlerTable table;
+	FillTable(&table);
+	EXPECT(cache.Save(WTEXT(".TXT"), false, ullStamp, table));
+	EXPECT(cache.GetCounts().cWrites == 1);
+	EXPECT(store._entries.count(WTEXT("file.txt")) == 1);
+
+	// Found under either case.
+	EXPECT(cache.Load(WTEXT(".txt"), false, ullStamp, &loaded));
+	EXPECT(loaded.GetCount() == 3);
+	EXPECT(cache.GetCounts().cHits == 1);
+
+	// The protocol of the same name is another entry.
+	CAssocHandlerTable other;
+	EXPECT(!cache.Load(WTEXT("txt"), true, ullStamp, &other));
+	EXPECT(cache.GetCounts().cMisses == 2);
+
+	// Changing the registry makes the entry stale.
+	clock._ullNow += USERCHOICE_FILETIME_PER_MS;
+	EXPECT(registry.SetValue(HKEY_CLASSES_ROOT, WTEXT(".txt"), nullptr, REG_SZ, WTEXT("txtfile"), sizeof(WTEXT("txtfile"))) == ERROR_SUCCESS);
+	ULONGLONG ullNewStamp = cache.GetStamp(WTEXT(".txt"), false);
+	EXPECT(!cache.Load(WTEXT(".txt"), false, ullNewStamp, &other));
+	EXPECT(other.GetCount() == 0);
+	EXPECT(cache.GetCounts().cStale == 1);
+
+	// Nothing to cache without an extension.
+	EXPECT(!cache.Save(WTEXT(""), false, ullStamp, table));
+	EXPECT(!cache.Load(WTEXT(""), false, ullStamp, &other));
+	EXPECT(cache.GetCounts().cWrites == 1);
+	EXPECT(cache.GetCounts().cMisses == 2);
+
+	return true;
+}
+
+bool TestAssocHandlerCache()
+{
+	return TestRoundTrip()
+		&& TestRejected()
+		&& TestMakeKey()
+		&& TestStamp()
+		&& TestLoadSave();
+}
\ No newline at end of file
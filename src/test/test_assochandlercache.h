@@ -0,0 +1,7 @@
+#pragma once
+
+/**
+ * Tests for CAssocHandlerCache: the entry layout, what makes an entry stale,
+ * and loading and saving through a store.
+ */
+bool TestAssocHandlerCache();
\ No newline at end of file
@@ -0,0 +1,319 @@
+#include "test_assochandlerstream.h"
+
+#include "../assochandlerstream.h"
+#include "testutil.h"
+
+#include <stdio.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// How many handler references are alive. They are made on the worker
+// thread and released on the dialog's.
+static std::atomic<int> s_cLiveRefs(0);
+
+class CFakeHandlerRef : public IAssocHandlerRef
+{
+public:
+	int _id;
+
+	CFakeHandlerRef(int id)
+		: _id(id)
+	{
+		s_cLiveRefs++;
+	}
+
+	~CFakeHandlerRef()
+	{
+		s_cLiveRefs--;
+	}
+};
+
+static int HandlerId(const ASSOC_HANDLER_SNAPSHOT &snapshot)
+{
+	return static_cast<CFakeHandlerRef *>(snapshot.pHandler.get())->_id;
+}
+
+/**
+ * Hands out handlers numbered from 0, the ones listed as recommended being
+ * recommended.
+ */
+class CFakeHandlerSource : public IAssocHandlerSource
+{
+public:
+	std::vector<bool>       _recommended;
+	bool                    _fRecommendedFirst;
+	size_t                  _iNext;
+
+	// Called before each handler is read, if set.
+	CAssocHandlerStreamer  *_pCancelAt;
+	size_t                  _iCancelAt;
+
+	CFakeHandlerSource(size_t cHandlers, bool fRecommendedFirst)
+		: _recommended(cHandlers, false)
+		, _fRecommendedFirst(fRecommendedFirst)
+		, _iNext(0)
+		, _pCancelAt(nullptr)
+		, _iCancelAt(0)
+	{
+	}
+
+	bool IsRecommendedFirst() override
+	{
+		return _fRecommendedFirst;
+	}
+
+	bool Next(ASSOC_HANDLER_SNAPSHOT *pSnapshot) override
+	{
+		if (_pCancelAt && _iNext == _iCancelAt)
+			_pCancelAt->Cancel();
+
+		if (_iNext == _recommended.size())
+			return false;
+
+		pSnapshot->strName = WTEXT("C:\\Program Files\\App\\app.exe");
+		pSnapshot->strUIName = WTEXT("App");
+		pSnapshot->fRecommended = _recommended[_iNext];
+		pSnapshot->pHandler.reset(new CFakeHandlerRef((int)_iNext));
+		_iNext++;
+		return true;
+	}
+};
+
+/**
+ * Counts wakes, and lets another thread wait for them.
+ */
+class CFakeHandlerSink : public IAssocHandlerSink
+{
+public:
+	std::mutex               _mutex;
+	std::condition_variable  _cv;
+	DWORD                    _cWakes;
+
+	CFakeHandlerSink()
+		: _cWakes(0)
+	{
+	}
+
+	void OnHandlersReady() override
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_cWakes++;
+		_cv.notify_all();
+	}
+};
+
+/**
+ * Takes every batch waiting, noting the handlers' ids and each batch's
+ * size.
+ *
+ * @return true if the last batch was among them.
+ */
+static bool DrainBatches(CAssocHandlerStreamer *pStreamer, std::vector<int> *pIds, std::vector<size_t> *pSizes)
+{
+	bool fComplete = false;
+	while (std::unique_ptr<ASSOC_HANDLER_BATCH> pBatch = pStreamer->TakeBatch())
+	{
+		for (const ASSOC_HANDLER_SNAPSHOT &snapshot : pBatch->snapshots)
+			pIds->push_back(HandlerId(snapshot));
+
+		pSizes->push_back(pBatch->snapshots.size());
+		fComplete |= pBatch->fComplete;
+	}
+	return fComplete;
+}
+
+static bool TestHandlerQueue()
+{
+	CAssocHandlerQueue queue;
+	EXPECT(!queue.Pop());
+
+	for (int i = 0; i < 3; i++)
+	{
+		std::unique_ptr<ASSOC_HANDLER_BATCH> pBatch(new ASSOC_HANDLER_BATCH{ {}, i == 2 });
+		pBatch->snapshots.resize(i + 1);
+		queue.Push(std::move(pBatch));
+	}
+
+	for (int i = 0; i < 3; i++)
+	{
+		std::unique_ptr<ASSOC_HANDLER_BATCH> pBatch = queue.Pop();
+		EXPECT(pBatch);
+		EXPECT(pBatch->snapshots.size() == (size_t)(i + 1));
+		EXPECT(pBatch->fComplete == (i == 2));
+	}
+	EXPECT(!queue.Pop());
+
+	// Batches which are never taken are freed with the queue.
+	{
+		CAssocHandlerQueue abandoned;
+		std::unique_ptr<ASSOC_HANDLER_BATCH> pBatch(new ASSOC_HANDLER_BATCH{ {}, false });
+		pBatch->snapshots.resize(1);
+		pBatch->snapshots[0].pHandler.reset(new CFakeHandlerRef(0));
+		abandoned.Push(std::move(pBatch));
+		EXPECT(s_cLiveRefs == 1);
+	}
+	EXPECT(s_cLiveRefs == 0);
+	return true;
+}
+
+static bool TestRecommendedFirst()
+{
+	// Three recommended handlers, and then 40 others.
+	CFakeHandlerSource source(43, true);
+	for (size_t i = 0; i < 3; i++)
+		source._recommended[i] = true;
+
+	CFakeHandlerSink sink;
+	CAssocHandlerStreamer streamer(&source, &sink, 16);
+	streamer.Run();
+
+	// The recommended handlers go on their own, without waiting for the
+	// batch to fill up.
+	std::vector<int> ids;
+	std::vector<size_t> sizes;
+	EXPECT(DrainBatches(&streamer, &ids, &sizes));
+	EXPECT((sizes == std::vector<size_t>{ 3, 16, 16, 8 }));
+	for (int i = 0; i < 43; i++)
+		EXPECT(ids[i] == i);
+
+	// Nobody took anything while it ran, so the sink was only woken once.
+	ASSOC_HANDLER_STREAM_COUNTS counts = streamer.GetCounts();
+	EXPECT(counts.cHandlers == 43);
+	EXPECT(counts.cBatches == 4);
+	EXPECT(counts.cWakes == 1);
+	EXPECT(sink._cWakes == 1);
+	EXPECT(s_cLiveRefs == 0);
+	return true;
+}
+
+static bool TestRecommendedMixedIn()
+{
+	// Recommended handlers are scattered through the source, so the others
+	// are held back until the end.
+	CFakeHandlerSource source(10, false);
+	source._recommended[2] = true;
+	source._recommended[7] = true;
+
+	CFakeHandlerSink sink;
+	CAssocHandlerStreamer streamer(&source, &sink, 4);
+	streamer.Run();
+
+	std::vector<int> ids;
+	std::vector<size_t> sizes;
+	EXPECT(DrainBatches(&streamer, &ids, &sizes));
+	EXPECT((ids == std::vector<int>{ 2, 7, 0, 1, 3, 4, 5, 6, 8, 9 }));
+	EXPECT((sizes == std::vector<size_t>{ 2, 4, 4, 0 }));
+
+	// Without any recommended handlers, the first one says so.
+	CFakeHandlerSource plain(5, false);
+	CAssocHandlerStreamer plainStreamer(&plain, &sink, 4);
+	plainStreamer.Run();
+
+	std::unique_ptr<ASSOC_HANDLER_BATCH> pBatch = plainStreamer.TakeBatch();
+	EXPECT(pBatch && !pBatch->snapshots.empty());
+	EXPECT(!pBatch->snapshots[0].fRecommended);
+
+	// Nothing at all still ends with a batch.
+	CFakeHandlerSource empty(0, true);
+	CAssocHandlerStreamer emptyStreamer(&empty, &sink);
+	emptyStreamer.Run();
+
+	ids.clear();
+	sizes.clear();
+	EXPECT(DrainBatches(&emptyStreamer, &ids, &sizes));
+	EXPECT((sizes == std::vector<size_t>{ 0 }));
+	return true;
+}
+
+static bool TestCancel()
+{
+	CFakeHandlerSink sink;
+	{
+		CFakeHandlerSource source(100, true);
+		CAssocHandlerStreamer streamer(&source, &sink, 8);
+		source._pCancelAt = &streamer;
+		source._iCancelAt = 20;
+		streamer.Run();
+
+		// What was read before the cancel stays queued, but the last batch
+		// never comes.
+		EXPECT(source._iNext == 21);
+		std::vector<int> ids;
+		std::vector<size_t> sizes;
+		EXPECT(!DrainBatches(&streamer, &ids, &sizes));
+		EXPECT(ids.size() == 16);
+
+		// Handlers which are never taken are released with the streamer.
+		CAssocHandlerStreamer abandoned(&source, &sink, 2);
+		source._pCancelAt = nullptr;
+		source._iNext = 90;
+		abandoned.Run();
+		EXPECT(s_cLiveRefs == 10);
+	}
+	EXPECT(s_cLiveRefs == 0);
+	return true;
+}
+
+static bool TestStreamAcrossThreads()
+{
+	constexpr size_t HANDLER_COUNT = 5000;
+	CFakeHandlerSource source(HANDLER_COUNT, true);
+	for (size_t i = 0; i < 10; i++)
+		source._recommended[i] = true;
+
+	CFakeHandlerSink sink;
+	CAssocHandlerStreamer streamer(&source, &sink, 7);
+	std::thread worker([&]()
+	{
+		streamer.Run();
+	});
+
+	// Wait to be woken, and take everything, like the dialog does on
+	// WM_OWX_HANDLERSREADY, until the last batch has arrived.
+	std::vector<int> ids;
+	std::vector<size_t> sizes;
+	DWORD cWakesSeen = 0;
+	bool fComplete = false;
+	while (!fComplete)
+	{
+		{
+			std::unique_lock<std::mutex> lock(sink._mutex);
+			sink._cv.wait(lock, [&]() { return sink._cWakes != cWakesSeen; });
+			cWakesSeen = sink._cWakes;
+		}
+
+		fComplete = DrainBatches(&streamer, &ids, &sizes);
+	}
+	worker.join();
+
+	EXPECT(ids.size() == HANDLER_COUNT);
+	for (size_t i = 0; i < HANDLER_COUNT; i++)
+		EXPECT(ids[i] == (int)i);
+	EXPECT(sizes[0] == 7 && sizes[1] == 3);
+
+	// Every wake was for something new, or arrived while the last one was
+	// being handled.
+	ASSOC_HANDLER_STREAM_COUNTS counts = streamer.GetCounts();
+	EXPECT(counts.cWakes <= counts.cBatches);
+	EXPECT(counts.cWakes == sink._cWakes);
+
+	// Nothing is left over.
+	EXPECT(!streamer.TakeBatch());
+	EXPECT(s_cLiveRefs == 0);
+	return true;
+}
+
+bool TestAssocHandlerStream()
+{
+	bool fPassed = true;
+	fPassed &= TestHandlerQueue();
+	fPassed &= TestRecommendedFirst();
+	fPassed &= TestRecommendedMixedIn();
+	fPassed &= TestCancel();
+	fPassed &= TestStreamAcrossThreads();
+	return fPassed;
+}
\ No newline at end of file
@@ -0,0 +1,8 @@
+#pragma once
+
+/**
+ * Tests for CAssocHandlerStreamer with a fake handler source: batching,
+ * recommended handlers going first, cancelling, and streaming across
+ * threads.
+ */
+bool TestAssocHandlerStream();
\ No newline at end of file
@@ -0,0 +1,216 @@
+#include "test_assochandlertable.h"
+
+#include "../assochandlertable.h"
+#include "testutil.h"
+
+#include <stdio.h>
+
+#include <string>
+
+static ASSOC_HANDLER_SNAPSHOT MakeSnapshot(
+	LPCWSTR pszName, LPCWSTR pszUIName, LPCWSTR pszIconPath, int iIcon,
+	DWORD dwType, LPCWSTR pszProgId, bool fRecommended)
+{
+	ASSOC_HANDLER_SNAPSHOT snapshot = {};
+	snapshot.strName = pszName;
+	snapshot.strUIName = pszUIName;
+	snapshot.strIconPath = pszIconPath;
+	snapshot.iIcon = iIcon;
+	snapshot.dwType = dwType;
+	snapshot.strProgId = pszProgId;
+	snapshot.fRecommended = fRecommended;
+	return snapshot;
+}
+
+static bool TestTableFields()
+{
+	CAssocHandlerTable table;
+	EXPECT(table.GetCount() == 0);
+	EXPECT(table.FindName(WTEXT("C:\\Windows\\notepad.exe")) == -1);
+
+	EXPECT(table.Add(MakeSnapshot(
+		WTEXT("C:\\Windows\\notepad.exe"), WTEXT("Notepad"),
+		WTEXT("C:\\Windows\\notepad.exe"), 0, 0x1, WTEXT("txtfile"), true
+	)) == 0);
+	EXPECT(table.Add(MakeSnapshot(
+		WTEXT("Photos"), WTEXT("Photos"),
+		WTEXT("@{Microsoft.Windows.Photos?ms-resource://Logo}"), -1, 0x20, WTEXT(""), false
+	)) == 1);
+
+	EXPECT(table.GetCount() == 2);
+
+	EXPECT(StringEquals(table.GetName(0), WTEXT("C:\\Windows\\notepad.exe")));
+	EXPECT(StringEquals(table.GetUIName(0), WTEXT("Notepad")));
+	EXPECT(StringEquals(table.GetIconPath(0), WTEXT("C:\\Windows\\notepad.exe")));
+	EXPECT(table.GetIconIndex(0) == 0);
+	EXPECT(table.GetType(0) == 0x1);
+	EXPECT(StringEquals(table.GetProgId(0), WTEXT("txtfile")));
+	EXPECT(table.IsRecommended(0));
+
+	EXPECT(StringEquals(table.GetName(1), WTEXT("Photos")));
+	EXPECT(StringEquals(table.GetIconPath(1), WTEXT("@{Microsoft.Windows.Photos?ms-resource://Logo}")));
+	EXPECT(table.GetIconIndex(1) == -1);
+	EXPECT(table.GetType(1) == 0x20);
+	EXPECT(*table.GetProgId(1) == WTEXT('\0'));
+	EXPECT(!table.IsRecommended(1));
+
+	table.Clear();
+	EXPECT(table.GetCount() == 0);
+	EXPECT(table.GetArenaSize() == 0);
+	EXPECT(table.FindName(WTEXT("Photos")) == -1);
+
+	return true;
+}
+
+static bool TestTableFindName()
+{
+	CAssocHandlerTable table;
+	table.Add(MakeSnapshot(WTEXT("C:\\Windows\\notepad.exe"), WTEXT("Notepad"), WTEXT(""), 0, 0, WTEXT(""), true));
+	table.Add(MakeSnapshot(WTEXT("C:\\Windows\\write.exe"), WTEXT("WordPad"), WTEXT(""), 0, 0, WTEXT(""), false));
+	table.Add(MakeSnapshot(WTEXT(""), WTEXT("Nameless"), WTEXT(""), 0, 0, WTEXT(""), false));
+
+	// Paths are compared case-insensitively, the way the file system does.
+	EXPECT(table.FindName(WTEXT("C:\\Windows\\notepad.exe")) == 0);
+	EXPECT(table.FindName(WTEXT("c:\\WINDOWS\\Notepad.EXE")) == 0);
+	EXPECT(table.FindName(WTEXT("C:\\Windows\\write.exe")) == 1);
+
+	// A prefix or an extension of a name isn't a match.
+	EXPECT(table.FindName(WTEXT("C:\\Windows\\notepad")) == -1);
+	EXPECT(table.FindName(WTEXT("C:\\Windows\\notepad.exe2")) == -1);
+
+	// Nameless handlers are listed, but can't be found.
+	EXPECT(table.GetCount() == 3);
+	EXPECT(table.FindName(WTEXT("")) == -1);
+	EXPECT(table.FindName(nullptr) == -1);
+
+	// Different spellings of the same path.
+	EXPECT(table.FindName(WTEXT("C:/Windows/notepad.exe")) == 0);
+	EXPECT(table.FindName(WTEXT("C:\\Windows\\\\notepad.exe")) == 0);
+	EXPECT(table.FindName(WTEXT("C:\\Windows\\System32\\..\\.\\notepad.exe")) == 0);
+	EXPECT(table.FindName(WTEXT("\"C:\\Windows\\notepad.exe\"")) == 0);
+
+	// The handler's own strings are left as they were.
+	EXPECT(StringEquals(table.GetName(0), WTEXT("C:\\Windows\\notepad.exe")));
+
+	return true;
+}
+
+static bool TestTableNormalizeName()
+{
+	typedef std::basic_string<WCHAR> String;
+
+	EXPECT(CAssocHandlerTable::NormalizeName(WTEXT("Photos")) == String(WTEXT("photos")));
+	EXPECT(CAssocHandlerTable::NormalizeName(WTEXT("C:\\Program Files\\App\\App.EXE")) == String(WTEXT("c:\\program files\\app\\app.exe")));
+	EXPECT(CAssocHandlerTable::NormalizeName(WTEXT("C:/a//b/./c/../d.exe")) == String(WTEXT("c:\\a\\b\\d.exe")));
+
+	// Going above the drive stops at the drive.
+	EXPECT(CAssocHandlerTable::NormalizeName(WTEXT("C:\\..\\..\\x.exe")) == String(WTEXT("c:\\x.exe")));
+
+	// UNC and rooted paths keep their roots.
+	EXPECT(CAssocHandlerTable::NormalizeName(WTEXT("\\\\Server\\Share\\\\x.exe")) == String(WTEXT("\\\\server\\share\\x.exe")));
+	EXPECT(CAssocHandlerTable::NormalizeName(WTEXT("\\Tools\\x.exe")) == String(WTEXT("\\tools\\x.exe")));
+
+	EXPECT(CAssocHandlerTable::NormalizeName(WTEXT("\"C:\\x.exe\"")) == String(WTEXT("c:\\x.exe")));
+	EXPECT(CAssocHandlerTable::NormalizeName(WTEXT("")).empty());
+	EXPECT(CAssocHandlerTable::NormalizeName(nullptr).empty());
+
+	// Going back past earlier segments, and relative paths with nothing
+	// left to go back to.
+	EXPECT(CAssocHandlerTable::NormalizeName(WTEXT("C:\\a\\b\\..\\..\\c\\..\\d.exe")) == String(WTEXT("c:\\d.exe")));
+	EXPECT(CAssocHandlerTable::NormalizeName(WTEXT("..\\a\\..\\..\\b\\x.exe")) == String(WTEXT("b\\x.exe")));
+
+	// Names longer than MAX_PATH are normalised the same way.
+	String strLong = WTEXT("\\\\?\\C:");
+	String strLongKey = WTEXT("\\\\?\\c:");
+	for (int i = 0; i < 40; i++)
+	{
+		strLong += WTEXT("\\Folder\\.\\Sub\\..");
+		strLongKey += WTEXT("\\folder");
+	}
+	strLong += WTEXT("\\App.EXE");
+	strLongKey += WTEXT("\\app.exe");
+	EXPECT(strLong.size() > MAX_PATH);
+	EXPECT(CAssocHandlerTable::NormalizeName(strLong.c_str()) == strLongKey);
+
+	CAssocHandlerTable table;
+	table.Add(MakeSnapshot(strLong.c_str(), WTEXT("App"), WTEXT(""), 0, 0, WTEXT(""), false));
+	EXPECT(table.FindName(strLongKey.c_str()) == 0);
+
+	return true;
+}
+
+static bool TestTableDeduplicate()
+{
+	CAssocHandlerTable table;
+
+	bool fAdded = false;
+	EXPECT(table.Add(MakeSnapshot(WTEXT("C:\\Windows\\notepad.exe"), WTEXT("Notepad"), WTEXT(""), 0, 0x1, WTEXT("txtfile"), true), &fAdded) == 0);
+	EXPECT(fAdded);
+
+	// The same program by another path is the handler already there, and
+	// what was first read about it is kept.
+	EXPECT(table.Add(MakeSnapshot(WTEXT("c:/windows/NOTEPAD.exe"), WTEXT("Other"), WTEXT(""), 0, 0x2, WTEXT(""), false), &fAdded) == 0);
+	EXPECT(!fAdded);
+	EXPECT(table.GetCount() == 1);
+	EXPECT(table.IsRecommended(0));
+	EXPECT(StringEquals(table.GetUIName(0), WTEXT("Notepad")));
+
+	// Nameless handlers have nothing to be told apart by, so they are all
+	// kept.
+	EXPECT(table.Add(MakeSnapshot(WTEXT(""), WTEXT("A"), WTEXT(""), 0, 0, WTEXT(""), false), &fAdded) == 1);
+	EXPECT(fAdded);
+	EXPECT(table.Add(MakeSnapshot(WTEXT(""), WTEXT("B"), WTEXT(""), 0, 0, WTEXT(""), false), &fAdded) == 2);
+	EXPECT(fAdded);
+
+	EXPECT(table.Add(MakeSnapshot(WTEXT("C:\\Windows\\write.exe"), WTEXT("WordPad"), WTEXT(""), 0, 0, WTEXT(""), false), &fAdded) == 3);
+	EXPECT(fAdded);
+	EXPECT(table.GetCount() == 4);
+
+	return true;
+}
+
+static bool TestTableArena()
+{
+	CAssocHandlerTable table;
+
+	// Strings stay put relative to the arena as it grows, so they read back
+	// the same after many more have been added.
+	for (int i = 0; i < 1000; i++)
+	{
+		std::basic_string<WCHAR> strName = WTEXT("C:\\Apps\\app");
+		strName += (WCHAR)(WTEXT('0') + i % 10);
+		strName += (WCHAR)(WTEXT('0') + i / 10 % 10);
+		strName += (WCHAR)(WTEXT('0') + i / 100);
+		strName += WTEXT(".exe");
+
+		ASSOC_HANDLER_SNAPSHOT snapshot = MakeSnapshot(
+			strName.c_str(), WTEXT("App"), strName.c_str(), i, 0, WTEXT(""), i < 10
+		);
+		EXPECT(table.Add(snapshot) == (size_t)i);
+	}
+
+	EXPECT(table.GetCount() == 1000);
+	EXPECT(StringEquals(table.GetName(0), WTEXT("C:\\Apps\\app000.exe")));
+	EXPECT(StringEquals(table.GetIconPath(999), WTEXT("C:\\Apps\\app999.exe")));
+	EXPECT(table.GetIconIndex(512) == 512);
+	EXPECT(table.IsRecommended(9) && !table.IsRecommended(10));
+	EXPECT(table.FindName(WTEXT("c:\\apps\\APP215.exe")) == 512);
+
+	// Every handler can still be found after the index has grown.
+	for (int i = 0; i < 1000; i++)
+	{
+		EXPECT(table.FindName(table.GetName(i)) == i);
+	}
+	EXPECT(table.FindName(WTEXT("C:\\Apps\\app1000.exe")) == -1);
+
+	return true;
+}
+
+bool TestAssocHandlerTable()
+{
+	return TestTableFields() &&
+		TestTableFindName() &&
+		TestTableNormalizeName() &&
+		TestTableDeduplicate() &&
+		TestTableArena();
+}
\ No newline at end of file
@@ -0,0 +1,7 @@
+#pragma once
+
+/**
+ * Tests for CAssocHandlerTable: reading back what was added, the string
+ * arena, and finding and deduplicating handlers by normalised path.
+ */
+bool TestAssocHandlerTable();
\ No newline at end of file
@@ -0,0 +1,447 @@
+#include "test_associconresolver.h"
+
+#include "../associconresolver.h"
+#include "fakeclock.h"
+#include "testutil.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const ULONGLONG c_ullTestBudget = 500 * USERCHOICE_FILETIME_PER_MS;
+
+/**
+ * Icon paths of the form "iconN" resolve to N * 10 plus the icon index.
+ * "missing" can't be found, and "slow" waits until it's let go.
+ */
+class CFakeIconSource : public IAssocIconSource
+{
+private:
+	std::mutex              _mutex;
+	std::condition_variable _cv;
+	bool                    _fSlowStarted;
+	bool                    _fSlowReleased;
+
+public:
+	std::atomic<int> _cBegun;
+	std::atomic<int> _cEnded;
+	std::atomic<int> _cLookups;
+
+	CFakeIconSource()
+		: _fSlowStarted(false)
+		, _fSlowReleased(false)
+		, _cBegun(0)
+		, _cEnded(0)
+		, _cLookups(0)
+	{
+	}
+
+	void BeginThread() override
+	{
+		_cBegun++;
+	}
+
+	void EndThread() override
+	{
+		_cEnded++;
+	}
+
+	int ResolveIcon(LPCWSTR lpszIconPath, int iIcon) override
+	{
+		_cLookups++;
+
+		std::basic_string<WCHAR> strPath(lpszIconPath);
+		if (strPath == WTEXT("missing"))
+		{
+			return -1;
+		}
+
+		if (strPath == WTEXT("slow"))
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_fSlowStarted = true;
+			_cv.notify_all();
+			_cv.wait(lock, [this]() { return _fSlowReleased; });
+			return 1000 + iIcon;
+		}
+
+		int n = 0;
+		for (size_t i = 4; i < strPath.size(); i++)
+		{
+			n = n * 10 + (strPath[i] - WTEXT('0'));
+		}
+		return n * 10 + iIcon;
+	}
+
+	void WaitForSlow()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_cv.wait(lock, [this]() { return _fSlowStarted; });
+	}
+
+	void ReleaseSlow()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_fSlowReleased = true;
+		_cv.notify_all();
+	}
+};
+
+class CFakeIconSink : public IAssocIconSink
+{
+public:
+	std::atomic<int> _cWakes;
+
+	CFakeIconSink()
+		: _cWakes(0)
+	{
+	}
+
+	void OnIconsReady() override
+	{
+		_cWakes++;
+	}
+};
+
+static std::basic_string<WCHAR> IconPath(int n)
+{
+	std::basic_string<WCHAR> str = WTEXT("icon");
+	str += (WCHAR)(WTEXT('0') + n);
+	return str;
+}
+
+// Waits for the resolver to finish with the given number of requests.
+static bool WaitForDone(CAssocIconResolver *pResolver, DWORD cDone)
+{
+	for (int i = 0; i < 5000; i++)
+	{
+		ASSOC_ICON_COUNTS counts = pResolver->GetCounts();
+		if (counts.cResolved + counts.cFailed + counts.cTimedOut + counts.cCancelled >= cDone)
+		{
+			return true;
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	return false;
+}
+
+// Waits for the given number of workers to finish with the source, which
+// they may still be doing after the resolver has gone.
+static bool WaitForWorkers(CFakeIconSource *pSource, int cWorkers)
+{
+	for (int i = 0; i < 5000; i++)
+	{
+		if (pSource->_cEnded.load() >= cWorkers)
+		{
+			return true;
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	return false;
+}
+
+static bool ResultLess(const ASSOC_ICON_RESULT &a, const ASSOC_ICON_RESULT &b)
+{
+	return a.iItem < b.iItem;
+}
+
+static bool TestResolveIcons()
+{
+	CAtomicFakeClock clock;
+	CFakeIconSource source;
+	CFakeIconSink sink;
+
+	std::vector<ASSOC_ICON_RESULT> results;
+	{
+		CAssocIconResolver resolver(&source, &sink, &clock, c_ullTestBudget, 3);
+		resolver.Start();
+
+		for (int i = 0; i < 8; i++)
+		{
+			resolver.Request(i, IconPath(i).c_str(), i % 2);
+		}
+		resolver.Request(8, WTEXT("missing"), 0);
+
+		EXPECT(WaitForDone(&resolver, 9));
+		EXPECT(sink._cWakes.load() >= 1);
+		EXPECT(resolver.TakeResults(&results));
+
+		// Nothing is left once taken.
+		std::vector<ASSOC_ICON_RESULT> more;
+		EXPECT(!resolver.TakeResults(&more));
+		EXPECT(more.empty());
+
+		ASSOC_ICON_COUNTS counts = resolver.GetCounts();
+		EXPECT(counts.cRequested == 9);
+		EXPECT(counts.cResolved == 8);
+		EXPECT(counts.cFailed == 1);
+		EXPECT(counts.cTimedOut == 0);
+		EXPECT(counts.cCancelled == 0);
+		EXPECT(counts.cWakes == (DWORD)sink._cWakes.load());
+	}
+
+	// Each worker began and ended once.
+	EXPECT(WaitForWorkers(&source, 3));
+	EXPECT(source._cBegun.load() == 3);
+	EXPECT(source._cEnded.load() == 3);
+
+	// Icons that couldn't be found aren't reported; the item keeps the
+	// generic one.
+	EXPECT(results.size() == 8);
+	std::sort(results.begin(), results.end(), ResultLess);
+	for (int i = 0; i < 8; i++)
+	{
+		EXPECT(results[i].iItem == (size_t)i);
+		EXPECT(results[i].iImage == i * 10 + i % 2);
+	}
+
+	return true;
+}
+
+static bool TestWakeOncePerTake()
+{
+	CAtomicFakeClock clock;
+	CFakeIconSource source;
+	CFakeIconSink sink;
+	CAssocIconResolver resolver(&source, &sink, &clock, c_ullTestBudget, 1);
+
+	// Requests can be made before the workers start.
+	for (int i = 0; i < 6; i++)
+	{
+		resolver.Request(i, IconPath(i).c_str(), 0);
+	}
+	resolver.Start();
+
+	EXPECT(WaitForDone(&resolver, 6));
+
+	// However many icons were ready, the dialog was only woken once.
+	EXPECT(sink._cWakes.load() == 1);
+
+	std::vector<ASSOC_ICON_RESULT> results;
+	EXPECT(resolver.TakeResults(&results));
+	EXPECT(results.size() == 6);
+
+	// Having taken them, the next icon wakes it again.
+	resolver.Request(6, IconPath(6).c_str(), 0);
+	EXPECT(WaitForDone(&resolver, 7));
+	EXPECT(sink._cWakes.load() == 2);
+	EXPECT(resolver.TakeResults(&results));
+	EXPECT(results.size() == 1);
+	EXPECT(results[0].iItem == 6 && results[0].iImage == 60);
+
+	resolver.Stop();
+	EXPECT(WaitForWorkers(&source, 1));
+
+	return true;
+}
+
+static bool TestBudget()
+{
+	CAtomicFakeClock clock;
+	CFakeIconSource source;
+	CFakeIconSink sink;
+	CAssocIconResolver resolver(&source, &sink, &clock, c_ullTestBudget, 1);
+
+	// The only worker is held up by a slow lookup while the others wait.
+	resolver.Request(0, WTEXT("slow"), 2);
+	resolver.Request(1, IconPath(1).c_str(), 0);
+	resolver.Request(2, IconPath(2).c_str(), 0);
+	resolver.Start();
+
+	source.WaitForSlow();
+
+	// A request made while the worker is busy, but with time to spare.
+	clock._ullNow += c_ullTestBudget - USERCHOICE_FILETIME_PER_MS;
+	resolver.Request(3, IconPath(3).c_str(), 0);
+
+	// The first three run out of time; the slow one still finishes.
+	clock._ullNow += 2 * USERCHOICE_FILETIME_PER_MS;
+	source.ReleaseSlow();
+
+	EXPECT(WaitForDone(&resolver, 4));
+
+	ASSOC_ICON_COUNTS counts = resolver.GetCounts();
+	EXPECT(counts.cResolved == 2);
+	EXPECT(counts.cTimedOut == 2);
+	EXPECT(source._cLookups.load() == 2);
+
+	std::vector<ASSOC_ICON_RESULT> results;
+	EXPECT(resolver.TakeResults(&results));
+	std::sort(results.begin(), results.end(), ResultLess);
+	EXPECT(results.size() == 2);
+	EXPECT(results[0].iItem == 0 && results[0].iImage == 1002);
+	EXPECT(results[1].iItem == 3 && results[1].iImage == 30);
+
+	resolver.Stop();
+	EXPECT(WaitForWorkers(&source, 1));
+
+	return true;
+}
+
+static bool TestStop()
+{
+	CAtomicFakeClock clock;
+	CFakeIconSource source;
+	CFakeIconSink sink;
+	CAssocIconResolver resolver(&source, &sink, &clock, c_ullTestBudget, 1);
+
+	resolver.Request(0, WTEXT("slow"), 0);
+	resolver.Request(1, IconPath(1).c_str(), 0);
+	resolver.Request(2, IconPath(2).c_str(), 0);
+	resolver.Start();
+	source.WaitForSlow();
+
+	// Stop doesn't wait for the slow lookup, only drops what's waiting.
+	resolver.Stop();
+	EXPECT(resolver.GetCounts().cCancelled == 2);
+	EXPECT(source._cEnded.load() == 0);
+
+	// The slow lookup finishes after Stop, so its icon is dropped too.
+	source.ReleaseSlow();
+	EXPECT(WaitForWorkers(&source, 1));
+
+	ASSOC_ICON_COUNTS counts = resolver.GetCounts();
+	EXPECT(counts.cCancelled == 3);
+	EXPECT(counts.cResolved == 0);
+	EXPECT(sink._cWakes.load() == 0);
+
+	// Nothing more is accepted.
+	resolver.Request(3, IconPath(3).c_str(), 0);
+	EXPECT(resolver.GetCounts().cRequested == 3);
+
+	std::vector<ASSOC_ICON_RESULT> results;
+	EXPECT(!resolver.TakeResults(&results));
+
+	return true;
+}
+
+static bool TestOutliveResolver()
+{
+	CAtomicFakeClock clock;
+	CFakeIconSource source;
+	CFakeIconSink sink;
+
+	// The resolver goes away while its worker is still looking an icon up,
+	// as it does when the dialog is closed.
+	{
+		CAssocIconResolver resolver(&source, &sink, &clock, c_ullTestBudget, 1);
+		resolver.Request(0, WTEXT("slow"), 0);
+		resolver.Start();
+		source.WaitForSlow();
+	}
+
+	source.ReleaseSlow();
+	EXPECT(WaitForWorkers(&source, 1));
+	EXPECT(sink._cWakes.load() == 0);
+
+	return true;
+}
+
+static bool TestGenerations()
+{
+	CAtomicFakeClock clock;
+	CFakeIconSource source;
+	CFakeIconSink sink;
+	CAssocIconResolver resolver(&source, &sink, &clock, c_ullTestBudget, 1);
+
+	resolver.Request(0, WTEXT("slow"), 0);
+	resolver.Request(1, IconPath(1).c_str(), 0);
+	resolver.Start();
+	source.WaitForSlow();
+
+	// The items are rebuilt while the slow lookup runs; the request still
+	// waiting is for an old index, so it's dropped.
+	EXPECT(resolver.NextGeneration() == 1);
+	EXPECT(resolver.GetCounts().cCancelled == 1);
+	resolver.Request(0, IconPath(2).c_str(), 0);
+
+	source.ReleaseSlow();
+	EXPECT(WaitForDone(&resolver, 3));
+
+	// Both icons come back for item 0, and the generation tells them apart.
+	std::vector<ASSOC_ICON_RESULT> results;
+	EXPECT(resolver.TakeResults(&results));
+	EXPECT(results.size() == 2);
+	EXPECT(results[0].iItem == 0 && results[0].iImage == 1000 && results[0].dwGeneration == 0);
+	EXPECT(results[1].iItem == 0 && results[1].iImage == 20 && results[1].dwGeneration == 1);
+
+	resolver.Stop();
+	EXPECT(WaitForWorkers(&source, 1));
+
+	return true;
+}
+
+static bool TestCachingSource()
+{
+	CFakeIconSource source;
+	CCachingAssocIconSource cache(&source);
+
+	cache.BeginThread();
+	EXPECT(source._cBegun.load() == 1);
+
+	EXPECT(cache.ResolveIcon(IconPath(1).c_str(), 0) == 10);
+	EXPECT(cache.ResolveIcon(IconPath(1).c_str(), 0) == 10);
+	EXPECT(source._cLookups.load() == 1);
+
+	// The index is part of the key.
+	EXPECT(cache.ResolveIcon(IconPath(1).c_str(), 2) == 12);
+	EXPECT(source._cLookups.load() == 2);
+
+	// Failures are looked up every time.
+	EXPECT(cache.ResolveIcon(WTEXT("missing"), 0) == -1);
+	EXPECT(cache.ResolveIcon(WTEXT("missing"), 0) == -1);
+	EXPECT(source._cLookups.load() == 4);
+
+	DWORD cHits, cMisses;
+	cache.GetCounts(&cHits, &cMisses);
+	EXPECT(cHits == 1);
+	EXPECT(cMisses == 4);
+
+	cache.Clear();
+	EXPECT(cache.ResolveIcon(IconPath(1).c_str(), 0) == 10);
+	EXPECT(source._cLookups.load() == 5);
+
+	// Two resolvers, as two dialogs would have, share what the cache knows.
+	CAtomicFakeClock clock;
+	CFakeIconSink sink;
+	for (int iDialog = 0; iDialog < 2; iDialog++)
+	{
+		CAssocIconResolver resolver(&cache, &sink, &clock, c_ullTestBudget, 2);
+		for (int i = 0; i < 4; i++)
+		{
+			resolver.Request(i, IconPath(i + 2).c_str(), 0);
+		}
+		resolver.Start();
+		EXPECT(WaitForDone(&resolver, 4));
+		resolver.Stop();
+		EXPECT(WaitForWorkers(&source, 2 * (iDialog + 1)));
+	}
+	EXPECT(source._cLookups.load() == 9);
+
+	cache.EndThread();
+	EXPECT(source._cEnded.load() == 5);
+
+	return true;
+}
+
+bool TestAssocIconResolver()
+{
+	return TestResolveIcons() &&
+		TestWakeOncePerTake() &&
+		TestBudget() &&
+		TestStop() &&
+		TestOutliveResolver() &&
+		TestGenerations() &&
+		TestCachingSource();
+}
\ No newline at end of file
@@ -0,0 +1,8 @@
+#pragma once
+
+/**
+ * Tests for CAssocIconResolver with a fake icon source: resolving icons on
+ * the worker pool, waking the dialog once per batch of results, the time
+ * budget, and stopping with lookups in flight.
+ */
+bool TestAssocIconResolver();
\ No newline at end of file
@@ -0,0 +1,248 @@
+#include "test_associdentity.h"
+
+#include "../associdentity.h"
+#include "../assocregistry.h"
+#include "../memoryregistry.h"
+#include "fakeclock.h"
+#include "testutil.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+// S-1-5-18, LocalSystem.
+static const BYTE c_rgbSystemSid[] = {
+	1, 1, 0, 0, 0, 0, 0, 5,
+	18, 0, 0, 0,
+};
+
+// S-1-5-21-1004336348-1177238915-682003330-1001
+static const BYTE c_rgbUserSid[] = {
+	1, 5, 0, 0, 0, 0, 0, 5,
+	21, 0, 0, 0,
+	0xDC, 0xF4, 0xDC, 0x3B,
+	0x83, 0x3D, 0x2B, 0x46,
+	0x82, 0x8B, 0xA6, 0x28,
+	0xE9, 0x03, 0x00, 0x00,
+};
+
+// The SID of the impersonation token of each thread, if it has one.
+static thread_local const std::vector<BYTE> *t_pImpersonatedSid = nullptr;
+
+/**
+ * Hands out fixed SIDs for the process and for impersonating threads.
+ */
+class CFakeIdentitySource : public IAssocIdentitySource
+{
+public:
+	std::vector<BYTE> _processSid;
+	LSTATUS           _lsProcess;
+
+	CFakeIdentitySource()
+		: _processSid(c_rgbUserSid, c_rgbUserSid + sizeof(c_rgbUserSid))
+		, _lsProcess(ERROR_SUCCESS)
+	{
+	}
+
+	LSTATUS QueryUserSid(AssocTokenKind kind, std::vector<BYTE> *pSid) override
+	{
+		if (kind == AssocTokenKind::THREAD)
+		{
+			if (!t_pImpersonatedSid)
+				return ERROR_NO_TOKEN;
+
+			*pSid = *t_pImpersonatedSid;
+			return ERROR_SUCCESS;
+		}
+
+		if (_lsProcess != ERROR_SUCCESS)
+			return _lsProcess;
+
+		*pSid = _processSid;
+		return ERROR_SUCCESS;
+	}
+};
+
+static bool TestFormatStringSid()
+{
+	WCHAR szSid[ASSOC_STRING_SID_CCH_MAX];
+	EXPECT(AssocFormatStringSid(c_rgbSystemSid, sizeof(c_rgbSystemSid), szSid, ARRAYSIZE(szSid)) == 8);
+	EXPECT(StringEquals(szSid, WTEXT("S-1-5-18")));
+
+	EXPECT(AssocFormatStringSid(c_rgbUserSid, sizeof(c_rgbUserSid), szSid, ARRAYSIZE(szSid)));
+	EXPECT(StringEquals(szSid, c_szTestSid));
+
+	// No sub-authorities at all.
+	static const BYTE c_rgbNullAuthority[] = { 1, 0, 0, 0, 0, 0, 0, 1 };
+	EXPECT(AssocFormatStringSid(c_rgbNullAuthority, sizeof(c_rgbNullAuthority), szSid, ARRAYSIZE(szSid)));
+	EXPECT(StringEquals(szSid, WTEXT("S-1-1")));
+
+	// Authorities which don't fit in 32 bits are written in hex.
+	static const BYTE c_rgbWideAuthority[] = {
+		1, 1, 0, 0x12, 0x34, 0x56, 0x78, 0x9A,
+		1, 0, 0, 0,
+	};
+	EXPECT(AssocFormatStringSid(c_rgbWideAuthority, sizeof(c_rgbWideAuthority), szSid, ARRAYSIZE(szSid)));
+	EXPECT(StringEquals(szSid, WTEXT("S-1-0x00123456789a-1")));
+
+	// The longest SID there can be just fits.
+	BYTE rgbLongest[8 + 4 * 15];
+	memset(rgbLongest, 0xFF, sizeof(rgbLongest));
+	rgbLongest[0] = 1;
+	rgbLongest[1] = 15;
+	EXPECT(AssocFormatStringSid(rgbLongest, sizeof(rgbLongest), szSid, ARRAYSIZE(szSid)) == ASSOC_STRING_SID_CCH_MAX - 1);
+	EXPECT(!AssocFormatStringSid(rgbLongest, sizeof(rgbLongest), szSid, ARRAYSIZE(szSid) - 1));
+
+	// Not SIDs.
+	static const BYTE c_rgbBadRevision[] = { 2, 0, 0, 0, 0, 0, 0, 1 };
+	EXPECT(!AssocFormatStringSid(c_rgbBadRevision, sizeof(c_rgbBadRevision), szSid, ARRAYSIZE(szSid)));
+	EXPECT(!AssocFormatStringSid(c_rgbUserSid, sizeof(c_rgbUserSid) - 1, szSid, ARRAYSIZE(szSid)));
+	EXPECT(!AssocFormatStringSid(nullptr, 0, szSid, ARRAYSIZE(szSid)));
+	return true;
+}
+
+static bool TestIdentityCache()
+{
+	CFakeIdentitySource source;
+	CAssocIdentityCache cache(&source);
+
+	std::shared_ptr<const CAssocIdentity> pProcess = cache.GetCurrent();
+	EXPECT(pProcess);
+	EXPECT(StringEquals(pProcess->GetStringSid(), c_szTestSid));
+	EXPECT(pProcess->GetSidLength() == sizeof(c_rgbUserSid));
+	EXPECT(memcmp(pProcess->GetSid(), c_rgbUserSid, sizeof(c_rgbUserSid)) == 0);
+	EXPECT(!pProcess->IsImpersonating());
+	EXPECT(!pProcess->IsLocalSystem());
+
+	// Once resolved, the thread doesn't query anything again.
+	for (int i = 0; i < 100; i++)
+	{
+		EXPECT(cache.GetCurrent() == pProcess);
+	}
+
+	ASSOC_IDENTITY_COUNTS counts = cache.GetCounts();
+	EXPECT(counts.cProcessQueries == 1);
+	EXPECT(counts.cThreadQueries == 1);
+	EXPECT(counts.cHits == 100);
+
+	// Other threads check their own token, and share the process identity
+	// if they aren't impersonating.
+	std::shared_ptr<const CAssocIdentity> pOther;
+	std::shared_ptr<const CAssocIdentity> pImpersonated;
+	std::vector<BYTE> systemSid(c_rgbSystemSid, c_rgbSystemSid + sizeof(c_rgbSystemSid));
+	std::thread([&]()
+	{
+		pOther = cache.GetCurrent();
+	}).join();
+	std::thread([&]()
+	{
+		t_pImpersonatedSid = &systemSid;
+		pImpersonated = cache.GetCurrent();
+	}).join();
+
+	EXPECT(pOther == pProcess);
+	EXPECT(pImpersonated && pImpersonated != pProcess);
+	EXPECT(pImpersonated->IsImpersonating());
+	EXPECT(pImpersonated->IsLocalSystem());
+	EXPECT(StringEquals(pImpersonated->GetStringSid(), WTEXT("S-1-5-18")));
+
+	counts = cache.GetCounts();
+	EXPECT(counts.cProcessQueries == 1);
+	EXPECT(counts.cThreadQueries == 3);
+
+	// Impersonation only shows up on this thread once it is invalidated.
+	t_pImpersonatedSid = &systemSid;
+	EXPECT(cache.GetCurrent() == pProcess);
+	cache.InvalidateThread();
+	EXPECT(cache.GetCurrent()->IsLocalSystem());
+
+	// Reverting goes back to the process identity, which is still cached.
+	t_pImpersonatedSid = nullptr;
+	cache.InvalidateThread();
+	EXPECT(cache.GetCurrent() == pProcess);
+	counts = cache.GetCounts();
+	EXPECT(counts.cProcessQueries == 1);
+	EXPECT(counts.cThreadQueries == 5);
+
+	// Invalidating everything resolves the process again. Identities which
+	// are still held stay valid.
+	cache.Invalidate();
+	std::shared_ptr<const CAssocIdentity> pRefreshed = cache.GetCurrent();
+	EXPECT(pRefreshed && pRefreshed != pProcess);
+	EXPECT(StringEquals(pProcess->GetStringSid(), c_szTestSid));
+	EXPECT(cache.GetCounts().cProcessQueries == 2);
+	return true;
+}
+
+static bool TestIdentityCacheFailure()
+{
+	CFakeIdentitySource source;
+	source._lsProcess = ERROR_ACCESS_DENIED;
+	CAssocIdentityCache cache(&source);
+
+	EXPECT(!cache.GetCurrent());
+
+	// Failures aren't cached.
+	source._lsProcess = ERROR_SUCCESS;
+	EXPECT(cache.GetCurrent());
+	EXPECT(cache.GetCounts().cProcessQueries == 2);
+
+	// Nor are SIDs which can't be formatted.
+	CFakeIdentitySource badSource;
+	badSource._processSid.resize(4);
+	CAssocIdentityCache badCache(&badSource);
+	EXPECT(!badCache.GetCurrent());
+	return true;
+}
+
+static bool TestIdentityCacheWrites()
+{
+	CFakeClock clock(c_ullTestMinute);
+	CMemoryRegistry registry(&clock);
+	CUserChoiceWriteScheduler scheduler(&clock);
+
+	CFakeIdentitySource source;
+	CAssocIdentityCache cache(&source);
+	registry.SetIdentityCache(&cache);
+
+	// Only the first write queries any tokens: the thread's and the
+	// process's.
+	static LPCWSTR c_rgszExtensions[] = {
+		WTEXT(".txt"), WTEXT(".log"), WTEXT(".ini"), WTEXT(".md"),
+		WTEXT(".csv"), WTEXT(".xml"), WTEXT(".json"), WTEXT(".yml"),
+	};
+	for (LPCWSTR pszExtension : c_rgszExtensions)
+	{
+		EXPECT(AssocSetUserChoice(&registry, &scheduler, pszExtension, WTEXT("txtfile"), c_szTestSid));
+	}
+
+	EXPECT(registry.GetOpCounts().cToken == 2);
+	ASSOC_IDENTITY_COUNTS counts = cache.GetCounts();
+	EXPECT(counts.cProcessQueries == 1);
+	EXPECT(counts.cThreadQueries == 1);
+
+	// The keys are locked for the cached user.
+	WCHAR szKeyPath[ASSOC_KEY_PATH_CCH_MAX];
+	EXPECT(AssocFormatKeyPath(WTEXT(".md"), false, szKeyPath, ARRAYSIZE(szKeyPath)));
+	std::basic_string<WCHAR> strUserChoicePath = szKeyPath;
+	strUserChoicePath += WTEXT("\\UserChoice");
+
+	std::vector<MEMORY_REGISTRY_ACE> acl;
+	EXPECT(registry.GetAcl(HKEY_CURRENT_USER, strUserChoicePath.c_str(), &acl));
+	EXPECT(acl.size() == 1 && acl[0].fDeny);
+	EXPECT(acl[0].strSid == c_szTestSid);
+	return true;
+}
+
+bool TestAssocIdentity()
+{
+	bool fPassed = true;
+	fPassed &= TestFormatStringSid();
+	fPassed &= TestIdentityCache();
+	fPassed &= TestIdentityCacheFailure();
+	fPassed &= TestIdentityCacheWrites();
+	return fPassed;
+}
\ No newline at end of file
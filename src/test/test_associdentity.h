@@ -0,0 +1,7 @@
+#pragma once
+
+/**
+ * Tests for string SID formatting and CAssocIdentityCache: what is resolved
+ * once per process, once per thread, and again after invalidation.
+ */
+bool TestAssocIdentity();
\ No newline at end of file
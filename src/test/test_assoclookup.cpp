@@ -0,0 +1,152 @@
+#include "test_assoclookup.h"
+
+#include "../assoclookup.h"
+#include "../assocregistry.h"
+#include "../memoryregistry.h"
+#include "fakeclock.h"
+#include "testutil.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+static DWORD StringBytes(LPCWSTR psz)
+{
+	return (DWORD)((std::char_traits<WCHAR>::length(psz) + 1) * sizeof(WCHAR));
+}
+
+static LSTATUS SetDefault(CMemoryRegistry *pRegistry, LPCWSTR pszKey, LPCWSTR pszValue)
+{
+	return pRegistry->SetValue(HKEY_CLASSES_ROOT, pszKey, nullptr, REG_SZ, pszValue, StringBytes(pszValue));
+}
+
+static bool TestLookupEntries()
+{
+	CFakeClock clock(c_ullTestMinute);
+	CMemoryRegistry registry(&clock);
+
+	CRegistryKey hk(&registry);
+	EXPECT(SetDefault(&registry, WTEXT(".txt"), WTEXT("txtfile")) == ERROR_SUCCESS);
+	EXPECT(SetDefault(&registry, WTEXT("txtfile"), WTEXT("Text Document")) == ERROR_SUCCESS);
+	EXPECT(SetDefault(&registry, WTEXT(".sys"), WTEXT("sysfile")) == ERROR_SUCCESS);
+	EXPECT(registry.SetValue(HKEY_CLASSES_ROOT, WTEXT("sysfile"), WTEXT("NoOpen"), REG_SZ, WTEXT(""), StringBytes(WTEXT(""))) == ERROR_SUCCESS);
+	EXPECT(SetDefault(&registry, WTEXT(".dangling"), WTEXT("missing")) == ERROR_SUCCESS);
+	EXPECT(registry.CreateKey(
+		HKEY_CURRENT_USER,
+		WTEXT("SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Explorer\\FileExts\\.new"),
+		hk.put()
+	) == ERROR_SUCCESS);
+
+	CAssocLookupCache cache(&registry);
+
+	std::shared_ptr<const CAssocLookupEntry> pTxt = cache.Lookup(WTEXT(".txt"), false);
+	EXPECT(pTxt);
+	EXPECT(StringEquals(pTxt->GetProgId(), WTEXT("txtfile")));
+	EXPECT(pTxt->GetProgIdKey());
+	EXPECT(!pTxt->IsNoOpen());
+	EXPECT(!pTxt->HasUserAssoc());
+	EXPECT(pTxt->Exists());
+
+	// The ProgID key stays open for reading.
+	WCHAR szValue[32];
+	DWORD cbValue = sizeof(szValue);
+	EXPECT(registry.GetValue(pTxt->GetProgIdKey(), nullptr, nullptr, nullptr, szValue, &cbValue) == ERROR_SUCCESS);
+	EXPECT(StringEquals(szValue, WTEXT("Text Document")));
+
+	std::shared_ptr<const CAssocLookupEntry> pSys = cache.Lookup(WTEXT(".sys"), false);
+	EXPECT(pSys && pSys->IsNoOpen());
+
+	// Same answers as AssocExists.
+	static const LPCWSTR c_rgszExtensions[] = {
+		WTEXT(".txt"), WTEXT(".sys"), WTEXT(".dangling"), WTEXT(".new"), WTEXT(".unknown"),
+	};
+	for (LPCWSTR pszExtension : c_rgszExtensions)
+	{
+		for (bool fIsUri : { false, true })
+		{
+			std::shared_ptr<const CAssocLookupEntry> pEntry = cache.Lookup(pszExtension, fIsUri);
+			EXPECT(pEntry && pEntry->Exists() == AssocExists(&registry, pszExtension, fIsUri));
+		}
+	}
+
+	EXPECT(!cache.Lookup(WTEXT(""), false));
+	EXPECT(!cache.Lookup(nullptr, false));
+	return true;
+}
+
+static bool TestLookupHits()
+{
+	CFakeClock clock(c_ullTestMinute);
+	CMemoryRegistry registry(&clock);
+	EXPECT(SetDefault(&registry, WTEXT(".txt"), WTEXT("txtfile")) == ERROR_SUCCESS);
+	EXPECT(SetDefault(&registry, WTEXT("txtfile"), WTEXT("Text Document")) == ERROR_SUCCESS);
+
+	CAssocLookupCache cache(&registry);
+	std::shared_ptr<const CAssocLookupEntry> pTxt = cache.Lookup(WTEXT(".txt"), false);
+	EXPECT(pTxt);
+
+	// Later lookups, in any case, don't go to the registry at all.
+	registry.ResetOpCounts();
+	EXPECT(cache.Lookup(WTEXT(".txt"), false) == pTxt);
+	EXPECT(cache.Lookup(WTEXT(".TXT"), false) == pTxt);
+	EXPECT(registry.GetOpCounts().Total() == 0);
+
+	ASSOC_LOOKUP_COUNTS counts = cache.GetCounts();
+	EXPECT(counts.cMisses == 1);
+	EXPECT(counts.cHits == 2);
+
+	// Protocols are kept apart from extensions.
+	EXPECT(cache.Lookup(WTEXT(".txt"), true) != pTxt);
+	EXPECT(cache.GetCounts().cMisses == 2);
+	return true;
+}
+
+static bool TestLookupInvalidation()
+{
+	CFakeClock clock(c_ullTestMinute);
+	CMemoryRegistry registry(&clock);
+	EXPECT(SetDefault(&registry, WTEXT(".txt"), WTEXT("txtfile")) == ERROR_SUCCESS);
+	EXPECT(SetDefault(&registry, WTEXT("txtfile"), WTEXT("Text Document")) == ERROR_SUCCESS);
+	EXPECT(SetDefault(&registry, WTEXT("textfile"), WTEXT("Plain Text")) == ERROR_SUCCESS);
+
+	CAssocLookupCache cache(&registry);
+	std::shared_ptr<const CAssocLookupEntry> pOld = cache.Lookup(WTEXT(".txt"), false);
+	EXPECT(pOld);
+
+	// Changes aren't seen until the extension is invalidated.
+	EXPECT(SetDefault(&registry, WTEXT(".txt"), WTEXT("textfile")) == ERROR_SUCCESS);
+	EXPECT(StringEquals(cache.Lookup(WTEXT(".txt"), false)->GetProgId(), WTEXT("txtfile")));
+
+	cache.Invalidate(WTEXT(".TXT"));
+	std::shared_ptr<const CAssocLookupEntry> pNew = cache.Lookup(WTEXT(".txt"), false);
+	EXPECT(pNew && pNew != pOld);
+	EXPECT(StringEquals(pNew->GetProgId(), WTEXT("textfile")));
+
+	// An entry which is still held keeps its key open.
+	WCHAR szValue[32];
+	DWORD cbValue = sizeof(szValue);
+	EXPECT(registry.GetValue(pOld->GetProgIdKey(), nullptr, nullptr, nullptr, szValue, &cbValue) == ERROR_SUCCESS);
+	EXPECT(StringEquals(szValue, WTEXT("Text Document")));
+
+	// The key is closed along with the last reference to the entry.
+	registry.ResetOpCounts();
+	pOld.reset();
+	EXPECT(registry.GetOpCounts().cClose == 1);
+
+	pNew.reset();
+	cache.InvalidateAll();
+	EXPECT(registry.GetOpCounts().cClose == 2);
+	EXPECT(cache.Lookup(WTEXT(".txt"), false));
+	EXPECT(cache.GetCounts().cMisses == 3);
+	return true;
+}
+
+bool TestAssocLookup()
+{
+	bool fPassed = true;
+	fPassed &= TestLookupEntries();
+	fPassed &= TestLookupHits();
+	fPassed &= TestLookupInvalidation();
+	return fPassed;
+}
\ No newline at end of file
@@ -0,0 +1,7 @@
+#pragma once
+
+/**
+ * Tests for CAssocLookupCache: what it reads the first time, that later
+ * lookups don't touch the registry, and invalidation.
+ */
+bool TestAssocLookup();
\ No newline at end of file
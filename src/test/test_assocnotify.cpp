@@ -0,0 +1,142 @@
+#include "test_assocnotify.h"
+
+#include "../assocnotify.h"
+#include "fakeclock.h"
+#include "testutil.h"
+
+#include <stdio.h>
+
+static const ULONGLONG c_ullWindow = 250 * USERCHOICE_FILETIME_PER_MS;
+
+/**
+ * Counts notifications, and remembers the last poll asked for.
+ */
+class CStubAssocChangeSink : public IAssocChangeSink
+{
+public:
+	DWORD     _cSent;
+	ULONGLONG _ullPollTime;
+
+	CStubAssocChangeSink()
+		: _cSent(0)
+		, _ullPollTime(0)
+	{
+	}
+
+	void SendAssocChanged() override
+	{
+		_cSent++;
+	}
+
+	void RequestPoll(ULONGLONG ullTime) override
+	{
+		_ullPollTime = ullTime;
+	}
+};
+
+static bool TestDebounce()
+{
+	CFakeClock clock(c_ullTestMinute);
+	CStubAssocChangeSink sink;
+	CAssocChangeNotifier notifier(&sink, &clock, c_ullWindow);
+
+	// Nothing pending, nothing sent.
+	notifier.Poll();
+	notifier.Flush();
+	EXPECT(sink._cSent == 0);
+
+	// Three changes close together go out as one, a window after the last.
+	notifier.Post();
+	EXPECT(sink._ullPollTime == c_ullTestMinute + c_ullWindow);
+	clock._ullNow += c_ullWindow / 2;
+	notifier.Post();
+	clock._ullNow += c_ullWindow / 2;
+	notifier.Post();
+	EXPECT(sink._ullPollTime == clock._ullNow + c_ullWindow);
+
+	// A poll for a deadline that has since moved doesn't send, but asks to
+	// be called again.
+	notifier.Poll();
+	EXPECT(sink._cSent == 0);
+	EXPECT(sink._ullPollTime == clock._ullNow + c_ullWindow);
+
+	clock._ullNow += c_ullWindow;
+	notifier.Poll();
+	EXPECT(sink._cSent == 1);
+	notifier.Poll();
+	EXPECT(sink._cSent == 1);
+
+	ASSOC_NOTIFY_COUNTS counts = notifier.GetCounts();
+	EXPECT(counts.cPosted == 3);
+	EXPECT(counts.cSent == 1);
+	EXPECT(counts.Coalesced() == 2);
+
+	// A steady stream still gets a notification out after MAX_WINDOWS.
+	ULONGLONG ullFirst = clock._ullNow;
+	for (int i = 0; i < 20; i++)
+	{
+		notifier.Post();
+		clock._ullNow += c_ullWindow / 2;
+	}
+	EXPECT(sink._ullPollTime == ullFirst + CAssocChangeNotifier::MAX_WINDOWS * c_ullWindow);
+
+	// Flushing sends straight away.
+	notifier.Flush();
+	EXPECT(sink._cSent == 2);
+	return true;
+}
+
+static bool TestBatches()
+{
+	CFakeClock clock(c_ullTestMinute);
+	CStubAssocChangeSink sink;
+	CAssocChangeNotifier notifier(&sink, &clock, c_ullWindow);
+
+	{
+		CAssocChangeBatch batch(&notifier);
+		notifier.Post();
+		{
+			CAssocChangeBatch nested(&notifier);
+			notifier.Post();
+		}
+
+		// Neither the end of the nested batch nor the window sends anything.
+		EXPECT(sink._cSent == 0);
+		EXPECT(sink._ullPollTime == 0);
+		clock._ullNow += 10 * c_ullWindow;
+		notifier.Poll();
+		EXPECT(sink._cSent == 0);
+
+		notifier.Post();
+	}
+	EXPECT(sink._cSent == 1);
+
+	// A batch with no changes sends nothing.
+	{
+		CAssocChangeBatch batch(&notifier);
+	}
+	EXPECT(sink._cSent == 1);
+
+	// A change posted before the batch goes out with it.
+	notifier.Post();
+	{
+		CAssocChangeBatch batch(&notifier);
+		notifier.Post();
+	}
+	EXPECT(sink._cSent == 2);
+	notifier.Poll();
+	EXPECT(sink._cSent == 2);
+
+	ASSOC_NOTIFY_COUNTS counts = notifier.GetCounts();
+	EXPECT(counts.cPosted == 5);
+	EXPECT(counts.Coalesced() == 3);
+	return true;
+}
+
+bool TestAssocChangeNotifier()
+{
+	bool fPassed = true;
+	fPassed &= TestDebounce();
+	fPassed &= TestBatches();
+	return fPassed;
+}
\ No newline at end of file
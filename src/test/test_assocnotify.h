@@ -0,0 +1,7 @@
+#pragma once
+
+/**
+ * Tests for CAssocChangeNotifier, with a sink that records what would have
+ * gone to the shell.
+ */
+bool TestAssocChangeNotifier();
\ No newline at end of file
@@ -0,0 +1,172 @@
+#include "test_assocprofile.h"
+
+#include "../assocprofile.h"
+#include "../assocregistry.h"
+#include "../memoryregistry.h"
+#include "fakeclock.h"
+#include "testutil.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+static bool Parse(const char *pszXml, std::vector<ASSOC_PROFILE_ENTRY> *pEntries)
+{
+	return AssocParseProfile(pszXml, strlen(pszXml), pEntries);
+}
+
+static bool TestParse()
+{
+	std::vector<ASSOC_PROFILE_ENTRY> entries;
+
+	// What Dism exports, with a BOM and a comment thrown in.
+	EXPECT(Parse(
+		"\xEF\xBB\xBF<?xml version=\"1.0\" encoding=\"UTF-8\"?>\r\n"
+		"<DefaultAssociations>\r\n"
+		"  <!-- <Association Identifier=\".old\" ProgId=\"oldfile\" /> -->\r\n"
+		"  <Association Identifier=\".txt\" ProgId=\"txtfile\" ApplicationName=\"Notepad\" />\r\n"
+		"  <Association ApplicationName='Tom &amp; Jerry&#x2019;s' ProgId='Vendor.Doc&lt;1&gt;' Identifier='.tj'/>\r\n"
+		"  <Association Identifier=\"http\" ProgId=\"ChromeHTML\"></Association>\r\n"
+		"  <Association Identifier=\".caf\xC3\xA9\" ProgId=\"Caf\xC3\xA9.Doc\" />\r\n"
+		"</DefaultAssociations>\r\n",
+		&entries
+	));
+	EXPECT(entries.size() == 4);
+	EXPECT(entries[0].strIdentifier == WTEXT(".txt"));
+	EXPECT(entries[0].strProgId == WTEXT("txtfile"));
+	EXPECT(entries[1].strIdentifier == WTEXT(".tj"));
+	EXPECT(entries[1].strProgId == WTEXT("Vendor.Doc<1>"));
+	EXPECT(entries[2].strIdentifier == WTEXT("http"));
+	EXPECT(entries[3].strIdentifier == WTEXT(".caf\u00E9"));
+	EXPECT(entries[3].strProgId == WTEXT("Caf\u00E9.Doc"));
+
+	// The last of a duplicated identifier wins, in the first one's place.
+	EXPECT(Parse(
+		"<DefaultAssociations>"
+		"<Association Identifier=\".htm\" ProgId=\"htmlfile\" />"
+		"<Association Identifier=\".txt\" ProgId=\"txtfile\" />"
+		"<Association Identifier=\".HTM\" ProgId=\"ChromeHTML\" />"
+		"</DefaultAssociations>",
+		&entries
+	));
+	EXPECT(entries.size() == 2);
+	EXPECT(entries[0].strIdentifier == WTEXT(".HTM"));
+	EXPECT(entries[0].strProgId == WTEXT("ChromeHTML"));
+
+	// Incomplete associations are skipped, and a profile with none left is
+	// an error.
+	EXPECT(!Parse(
+		"<DefaultAssociations>"
+		"<Association Identifier=\".txt\" />"
+		"<Association ProgId=\"txtfile\" />"
+		"</DefaultAssociations>",
+		&entries
+	));
+	EXPECT(entries.empty());
+
+	// Malformed attributes, entities and UTF-8.
+	EXPECT(!Parse("<Association Identifier=.txt ProgId=\"txtfile\" />", &entries));
+	EXPECT(!Parse("<Association Identifier=\".txt ProgId=\"txtfile\" />", &entries));
+	EXPECT(!Parse("<Association Identifier=\".txt\" ProgId=\"a&nbsp;b\" />", &entries));
+	EXPECT(!Parse("<Association Identifier=\".txt\" ProgId=\"\xC0\xAF\" />", &entries));
+	EXPECT(!Parse("<Association Identifier=\".txt\" ProgId=\"\xE2\x82\" />", &entries));
+	return true;
+}
+
+/**
+ * Checks that an association is set to a ProgID with a hash that matches its
+ * last write time.
+ */
+static bool CheckStoredAssociation(CMemoryRegistry *pRegistry, LPCWSTR lpszExtension, LPCWSTR lpszProgId)
+{
+	WCHAR szProgId[256];
+	WCHAR szHash[USERCHOICE_HASH_CCH + 1];
+	ULONGLONG ullLastWrite = 0;
+	EXPECT(AssocReadUserChoice(pRegistry, lpszExtension, szProgId, ARRAYSIZE(szProgId), szHash, &ullLastWrite) == ERROR_SUCCESS);
+	EXPECT(std::basic_string<WCHAR>(szProgId) == lpszProgId);
+
+	CUserChoiceHashContext context;
+	WCHAR szExpected[USERCHOICE_HASH_CCH + 1];
+	EXPECT(context.Init(c_szTestSid, ullLastWrite));
+	EXPECT(context.Hash(lpszExtension, lpszProgId, szExpected));
+	EXPECT(std::basic_string<WCHAR>(szHash) == szExpected);
+	return true;
+}
+
+static bool TestApply()
+{
+	CFakeClock clock(c_ullTestMinute + 20 * 1000 * USERCHOICE_FILETIME_PER_MS);
+	CMemoryRegistry registry(&clock);
+	registry.SetUserSid(c_szTestSid);
+	CUserChoiceWriteScheduler scheduler(&clock);
+
+	// Set up beforehand: .txt as the profile wants it, .htm to something
+	// else.
+	EXPECT(AssocSetUserChoice(&registry, &scheduler, WTEXT(".txt"), WTEXT("txtfile"), c_szTestSid));
+	EXPECT(AssocSetUserChoice(&registry, &scheduler, WTEXT(".htm"), WTEXT("htmlfile"), c_szTestSid));
+	clock._ullNow += USERCHOICE_FILETIME_PER_MINUTE;
+
+	std::vector<ASSOC_PROFILE_ENTRY> entries = {
+		{ WTEXT(".txt"), WTEXT("TXTFILE") },
+		{ WTEXT(".htm"), WTEXT("ChromeHTML") },
+		{ WTEXT("http"), WTEXT("ChromeHTML") },
+	};
+
+	ASSOC_PROFILE_REPORT report;
+	EXPECT(AssocApplyProfile(&registry, &scheduler, entries.data(), entries.size(), c_szTestSid, &report));
+	EXPECT(report.cUnchanged == 1);
+	EXPECT(report.cWritten == 2);
+	EXPECT(report.cFailed == 0);
+	EXPECT(report.results[0] == AssocProfileEntryResult::UNCHANGED);
+	EXPECT(report.results[1] == AssocProfileEntryResult::WRITTEN);
+	EXPECT(report.results[2] == AssocProfileEntryResult::WRITTEN);
+	EXPECT(report.write.cAttempts == 1);
+
+	EXPECT(CheckStoredAssociation(&registry, WTEXT(".txt"), WTEXT("txtfile")));
+	EXPECT(CheckStoredAssociation(&registry, WTEXT(".htm"), WTEXT("ChromeHTML")));
+	EXPECT(CheckStoredAssociation(&registry, WTEXT("http"), WTEXT("ChromeHTML")));
+
+	// Protocols live under UrlAssociations.
+	CRegistryKey hk(&registry);
+	EXPECT(registry.OpenKey(
+		HKEY_CURRENT_USER,
+		WTEXT("SOFTWARE\\Microsoft\\Windows\\Shell\\Associations\\UrlAssociations\\http\\UserChoice"),
+		hk.put()
+	) == ERROR_SUCCESS);
+
+	// Applying the same profile again only reads.
+	clock._ullNow += USERCHOICE_FILETIME_PER_MINUTE;
+	registry.ResetOpCounts();
+	EXPECT(AssocApplyProfile(&registry, &scheduler, entries.data(), entries.size(), c_szTestSid, &report));
+	EXPECT(report.cUnchanged == 3);
+	EXPECT(report.cWritten == 0);
+	REGISTRY_OP_COUNTS counts = registry.GetOpCounts();
+	EXPECT(counts.cWrite == 0);
+	EXPECT(counts.cRename == 0);
+	EXPECT(counts.cSecurity == 0);
+
+	// An association with a hash that doesn't match is written again.
+	EXPECT(registry.OpenKey(
+		HKEY_CURRENT_USER,
+		WTEXT("SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Explorer\\FileExts\\.htm"),
+		hk.put()
+	) == ERROR_SUCCESS);
+	static const WCHAR c_szBadHash[] = WTEXT("AAAAAAAAAAA=");
+	EXPECT(registry.SetProtectedValue(hk.get(), WTEXT("Hash"), c_szBadHash, sizeof(c_szBadHash)) == ERROR_SUCCESS);
+
+	EXPECT(AssocApplyProfile(&registry, &scheduler, entries.data(), entries.size(), c_szTestSid, &report));
+	EXPECT(report.cUnchanged == 2);
+	EXPECT(report.results[1] == AssocProfileEntryResult::WRITTEN);
+	EXPECT(CheckStoredAssociation(&registry, WTEXT(".htm"), WTEXT("ChromeHTML")));
+	return true;
+}
+
+bool TestAssocProfile()
+{
+	bool fPassed = true;
+	fPassed &= TestParse();
+	fPassed &= TestApply();
+	return fPassed;
+}
\ No newline at end of file
@@ -0,0 +1,7 @@
+#pragma once
+
+/**
+ * Tests for parsing default association profiles, and for applying them to
+ * an in-memory registry.
+ */
+bool TestAssocProfile();
\ No newline at end of file
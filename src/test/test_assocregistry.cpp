@@ -0,0 +1,416 @@
+#include "test_assocregistry.h"
+
+#include "../assocregistry.h"
+#include "../memoryregistry.h"
+#include "fakeclock.h"
+#include "testutil.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+static DWORD StringBytes(LPCWSTR psz)
+{
+	return (DWORD)((std::char_traits<WCHAR>::length(psz) + 1) * sizeof(WCHAR));
+}
+
+static bool TestKeys()
+{
+	CFakeClock clock(c_ullTestMinute);
+	CMemoryRegistry registry(&clock);
+
+	CRegistryKey hk(&registry);
+	EXPECT(registry.OpenKey(HKEY_CURRENT_USER, WTEXT("Software\\Test"), hk.put()) == ERROR_FILE_NOT_FOUND);
+	EXPECT(!hk.get());
+	EXPECT(registry.CreateKey(HKEY_CURRENT_USER, WTEXT("Software\\Test\\Child"), hk.put()) == ERROR_SUCCESS);
+
+	// Names are case-insensitive, and empty path parts are skipped.
+	CRegistryKey hkParent(&registry);
+	EXPECT(registry.OpenKey(HKEY_CURRENT_USER, WTEXT("SOFTWARE\\test\\"), hkParent.put()) == ERROR_SUCCESS);
+
+	// A key with subkeys can't be deleted.
+	EXPECT(registry.DeleteKey(HKEY_CURRENT_USER, WTEXT("Software\\Test")) == ERROR_ACCESS_DENIED);
+
+	// Renames move the key and everything in it, and the open handle
+	// follows.
+	EXPECT(registry.SetValue(hk.get(), nullptr, WTEXT("Name"), REG_SZ, WTEXT("x"), StringBytes(WTEXT("x"))) == ERROR_SUCCESS);
+	EXPECT(registry.RenameKey(hk.get(), WTEXT("Renamed")) == ERROR_SUCCESS);
+	CRegistryKey hkRenamed(&registry);
+	EXPECT(registry.OpenKey(hkParent.get(), WTEXT("renamed"), hkRenamed.put()) == ERROR_SUCCESS);
+	EXPECT(registry.OpenKey(hkParent.get(), WTEXT("Child"), hkRenamed.put()) == ERROR_FILE_NOT_FOUND);
+	EXPECT(registry.GetValue(hk.get(), nullptr, WTEXT("NAME"), nullptr, nullptr, nullptr) == ERROR_SUCCESS);
+
+	CRegistryKey hkOther(&registry);
+	EXPECT(registry.CreateKey(hkParent.get(), WTEXT("Other"), hkOther.put()) == ERROR_SUCCESS);
+	EXPECT(registry.RenameKey(hkOther.get(), WTEXT("RENAMED")) == ERROR_ALREADY_EXISTS);
+
+	// Deleted keys stay deleted for handles which are still open.
+	EXPECT(registry.DeleteKey(hkParent.get(), WTEXT("Other")) == ERROR_SUCCESS);
+	EXPECT(registry.SetValue(hkOther.get(), nullptr, nullptr, REG_SZ, WTEXT("x"), StringBytes(WTEXT("x"))) == ERROR_KEY_DELETED);
+	return true;
+}
+
+static bool TestValues()
+{
+	CFakeClock clock(c_ullTestMinute);
+	CMemoryRegistry registry(&clock);
+
+	CRegistryKey hk(&registry);
+	EXPECT(registry.CreateKey(HKEY_CLASSES_ROOT, WTEXT(".txt"), hk.put()) == ERROR_SUCCESS);
+
+	clock._ullNow += USERCHOICE_FILETIME_PER_MS;
+	EXPECT(registry.SetValue(hk.get(), nullptr, nullptr, REG_SZ, WTEXT("txtfile"), StringBytes(WTEXT("txtfile"))) == ERROR_SUCCESS);
+
+	ULONGLONG ullLastWrite = 0;
+	DWORD cValues = 0;
+	EXPECT(registry.QueryInfo(hk.get(), nullptr, &cValues, &ullLastWrite) == ERROR_SUCCESS);
+	EXPECT(cValues == 1);
+	EXPECT(ullLastWrite == clock._ullNow);
+
+	// Sizing, too small a buffer, and then a real read. The default value can
+	// be named by null or by an empty string.
+	DWORD dwType = REG_NONE;
+	DWORD cbData = 0;
+	EXPECT(registry.GetValue(HKEY_CLASSES_ROOT, WTEXT(".txt"), WTEXT(""), &dwType, nullptr, &cbData) == ERROR_SUCCESS);
+	EXPECT(dwType == REG_SZ && cbData == StringBytes(WTEXT("txtfile")));
+
+	WCHAR szData[16];
+	DWORD cbSmall = 4;
+	EXPECT(registry.GetValue(HKEY_CLASSES_ROOT, WTEXT(".txt"), nullptr, nullptr, szData, &cbSmall) == ERROR_MORE_DATA);
+	EXPECT(cbSmall == cbData);
+
+	cbData = sizeof(szData);
+	EXPECT(registry.GetValue(HKEY_CLASSES_ROOT, WTEXT(".txt"), nullptr, nullptr, szData, &cbData) == ERROR_SUCCESS);
+	EXPECT(StringEquals(szData, WTEXT("txtfile")));
+
+	EXPECT(registry.DeleteValue(hk.get(), nullptr, nullptr) == ERROR_SUCCESS);
+	EXPECT(registry.DeleteValue(hk.get(), nullptr, nullptr) == ERROR_FILE_NOT_FOUND);
+	return true;
+}
+
+static bool TestProtectedValues()
+{
+	CFakeClock clock(c_ullTestMinute);
+	CMemoryRegistry registry(&clock);
+	registry.SetUserSid(c_szTestSid);
+
+	CRegistryKey hk(&registry);
+	EXPECT(registry.CreateKey(HKEY_CURRENT_USER, WTEXT("Assoc"), hk.put()) == ERROR_SUCCESS);
+
+	EXPECT(registry.SetProtectedValue(hk.get(), WTEXT("ProgId"), WTEXT("txtfile"), StringBytes(WTEXT("txtfile"))) == ERROR_SUCCESS);
+
+	// The key is locked against the user afterwards...
+	std::vector<MEMORY_REGISTRY_ACE> acl;
+	EXPECT(registry.GetAcl(hk.get(), WTEXT("UserChoice"), &acl));
+	EXPECT(acl.size() == 1 && acl[0].fDeny && acl[0].dwMask == KEY_SET_VALUE && StringEquals(acl[0].strSid.c_str(), c_szTestSid));
+	EXPECT(registry.SetValue(hk.get(), WTEXT("UserChoice"), WTEXT("ProgId"), REG_SZ, WTEXT("x"), StringBytes(WTEXT("x"))) == ERROR_ACCESS_DENIED);
+
+	// ...but protected writes still go through, and don't pile up ACEs.
+	EXPECT(registry.SetProtectedValue(hk.get(), WTEXT("Hash"), WTEXT("abc"), StringBytes(WTEXT("abc"))) == ERROR_SUCCESS);
+	EXPECT(registry.GetAcl(hk.get(), WTEXT("UserChoice"), &acl));
+	EXPECT(acl.size() == 1);
+
+	// Deleting a value leaves the key locked while it has others...
+	EXPECT(registry.DeleteProtectedValue(hk.get(), WTEXT("Hash"), true) == ERROR_SUCCESS);
+	EXPECT(registry.GetAcl(hk.get(), WTEXT("UserChoice"), &acl));
+	EXPECT(acl.size() == 1);
+
+	// ...and deletes it once it's empty.
+	EXPECT(registry.DeleteProtectedValue(hk.get(), WTEXT("ProgId"), true) == ERROR_SUCCESS);
+	EXPECT(!registry.GetAcl(hk.get(), WTEXT("UserChoice"), &acl));
+
+	// LocalSystem's keys aren't locked.
+	registry.SetUserSid(WTEXT("S-1-5-18"));
+	EXPECT(registry.SetProtectedValue(hk.get(), WTEXT("ProgId"), WTEXT("txtfile"), StringBytes(WTEXT("txtfile"))) == ERROR_SUCCESS);
+	EXPECT(registry.GetAcl(hk.get(), WTEXT("UserChoice"), &acl));
+	EXPECT(acl.empty());
+	return true;
+}
+
+static bool TestProtectedValueSessions()
+{
+	CFakeClock clock(c_ullTestMinute);
+	CMemoryRegistry registry(&clock);
+	registry.SetUserSid(c_szTestSid);
+
+	CRegistryKey hk(&registry);
+	EXPECT(registry.CreateKey(HKEY_CURRENT_USER, WTEXT("Assoc"), hk.put()) == ERROR_SUCCESS);
+	EXPECT(registry.SetProtectedValue(hk.get(), WTEXT("ProgId"), WTEXT("txtfile"), StringBytes(WTEXT("txtfile"))) == ERROR_SUCCESS);
+
+	// Several values under one unlock and one lock.
+	REGISTRY_PROTECTED_VALUE rgValues[] = {
+		{ WTEXT("ProgId"), WTEXT("htmlfile"), StringBytes(WTEXT("htmlfile")) },
+		{ WTEXT("Hash"),   WTEXT("abc"),      StringBytes(WTEXT("abc")) },
+	};
+	registry.ResetOpCounts();
+	EXPECT(registry.SetProtectedValues(hk.get(), rgValues, ARRAYSIZE(rgValues)) == ERROR_SUCCESS);
+	REGISTRY_OP_COUNTS counts = registry.GetOpCounts();
+	EXPECT(counts.cToken == 1);
+	EXPECT(counts.cSecurity == 3);
+	EXPECT(counts.cWrite == 2);
+
+	WCHAR szValue[16];
+	DWORD cbValue = sizeof(szValue);
+	EXPECT(registry.GetValue(hk.get(), WTEXT("UserChoice"), WTEXT("ProgId"), nullptr, szValue, &cbValue) == ERROR_SUCCESS);
+	EXPECT(StringEquals(szValue, WTEXT("htmlfile")));
+
+	std::vector<MEMORY_REGISTRY_ACE> acl;
+	EXPECT(registry.GetAcl(hk.get(), WTEXT("UserChoice"), &acl));
+	EXPECT(acl.size() == 1 && acl[0].fDeny);
+
+	// In a batch, the token is only queried once across keys.
+	CRegistryKey hkOther(&registry);
+	EXPECT(registry.CreateKey(HKEY_CURRENT_USER, WTEXT("Other"), hkOther.put()) == ERROR_SUCCESS);
+	registry.ResetOpCounts();
+	{
+		CProtectedWriteBatch batch(&registry);
+		EXPECT(registry.SetProtectedValues(hk.get(), rgValues, ARRAYSIZE(rgValues)) == ERROR_SUCCESS);
+		EXPECT(registry.SetProtectedValues(hkOther.get(), rgValues, ARRAYSIZE(rgValues)) == ERROR_SUCCESS);
+	}
+	EXPECT(registry.GetOpCounts().cToken == 1);
+
+	registry.ResetOpCounts();
+	EXPECT(registry.SetProtectedValues(hkOther.get(), rgValues, ARRAYSIZE(rgValues)) == ERROR_SUCCESS);
+	EXPECT(registry.GetOpCounts().cToken == 1);
+	return true;
+}
+
+bool TestMemoryRegistry()
+{
+	bool fPassed = true;
+	fPassed &= TestKeys();
+	fPassed &= TestValues();
+	fPassed &= TestProtectedValues();
+	fPassed &= TestProtectedValueSessions();
+	return fPassed;
+}
+
+/**
+ * Reads the stored association back and checks its hash against the
+ * UserChoice key's last write time, like CheckUserChoiceHash does.
+ */
+static bool CheckStoredAssociation(CMemoryRegistry *pRegistry, LPCWSTR lpszExtension, LPCWSTR lpszProgId)
+{
+	WCHAR szKeyPath[ASSOC_KEY_PATH_CCH_MAX];
+	EXPECT(AssocFormatKeyPath(lpszExtension, false, szKeyPath, ARRAYSIZE(szKeyPath)));
+
+	CRegistryKey hkUserChoice(pRegistry);
+	std::basic_string<WCHAR> strUserChoicePath = szKeyPath;
+	strUserChoicePath += WTEXT("\\UserChoice");
+	EXPECT(pRegistry->OpenKey(HKEY_CURRENT_USER, strUserChoicePath.c_str(), hkUserChoice.put()) == ERROR_SUCCESS);
+
+	ULONGLONG ullLastWrite = 0;
+	EXPECT(pRegistry->QueryInfo(hkUserChoice.get(), nullptr, nullptr, &ullLastWrite) == ERROR_SUCCESS);
+
+	WCHAR szProgId[256];
+	DWORD cbProgId = sizeof(szProgId);
+	EXPECT(pRegistry->GetValue(hkUserChoice.get(), nullptr, WTEXT("ProgId"), nullptr, szProgId, &cbProgId) == ERROR_SUCCESS);
+	EXPECT(StringEquals(szProgId, lpszProgId));
+
+	WCHAR szStoredHash[USERCHOICE_HASH_CCH + 1];
+	DWORD cbStoredHash = sizeof(szStoredHash);
+	EXPECT(pRegistry->GetValue(hkUserChoice.get(), nullptr, WTEXT("Hash"), nullptr, szStoredHash, &cbStoredHash) == ERROR_SUCCESS);
+
+	CUserChoiceHashContext context;
+	WCHAR szComputedHash[USERCHOICE_HASH_CCH + 1];
+	EXPECT(context.Init(c_szTestSid, ullLastWrite));
+	EXPECT(context.Hash(lpszExtension, szProgId, szComputedHash));
+	EXPECT(StringEquals(szStoredHash, szComputedHash));
+	return true;
+}
+
+static bool TestSetUserChoice()
+{
+	CFakeClock clock(c_ullTestMinute + 20 * 1000 * USERCHOICE_FILETIME_PER_MS);
+	CMemoryRegistry registry(&clock);
+	registry.SetUserSid(c_szTestSid);
+	CUserChoiceWriteScheduler scheduler(&clock);
+
+	EXPECT(AssocSetUserChoice(&registry, &scheduler, WTEXT(".txt"), WTEXT("txtfile"), c_szTestSid));
+	EXPECT(CheckStoredAssociation(&registry, WTEXT(".txt"), WTEXT("txtfile")));
+
+	// The temporary name is gone; only the extension's key is left.
+	CRegistryKey hkFileExts(&registry);
+	EXPECT(registry.OpenKey(
+		HKEY_CURRENT_USER,
+		WTEXT("SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Explorer\\FileExts"),
+		hkFileExts.put()
+	) == ERROR_SUCCESS);
+	DWORD cSubKeys = 0;
+	EXPECT(registry.QueryInfo(hkFileExts.get(), &cSubKeys, nullptr, nullptr) == ERROR_SUCCESS);
+	EXPECT(cSubKeys == 1);
+
+	// Replacing a locked association, in a later minute. That takes one
+	// unlock and one lock of UserChoice for both values.
+	clock._ullNow += USERCHOICE_FILETIME_PER_MINUTE;
+	registry.ResetOpCounts();
+	EXPECT(AssocSetUserChoice(&registry, &scheduler, WTEXT(".txt"), WTEXT("Applications\\notepad++.exe"), c_szTestSid));
+	EXPECT(CheckStoredAssociation(&registry, WTEXT(".txt"), WTEXT("Applications\\notepad++.exe")));
+	REGISTRY_OP_COUNTS counts = registry.GetOpCounts();
+	EXPECT(counts.cToken == 1);
+	EXPECT(counts.cSecurity == 3);
+	EXPECT(registry.QueryInfo(hkFileExts.get(), &cSubKeys, nullptr, nullptr) == ERROR_SUCCESS);
+	EXPECT(cSubKeys == 1);
+	return true;
+}
+
+static bool TestSetUserChoiceUnchanged()
+{
+	CFakeClock clock(c_ullTestMinute + 20 * 1000 * USERCHOICE_FILETIME_PER_MS);
+	CMemoryRegistry registry(&clock);
+	registry.SetUserSid(c_szTestSid);
+	CUserChoiceWriteScheduler scheduler(&clock);
+
+	EXPECT(AssocSetUserChoice(&registry, &scheduler, WTEXT(".txt"), WTEXT("txtfile"), c_szTestSid));
+
+	// Confirming the same association, even in a later minute and with the
+	// ProgID in another case, only reads it.
+	clock._ullNow += USERCHOICE_FILETIME_PER_MINUTE;
+	registry.ResetOpCounts();
+	USERCHOICE_WRITE_REPORT report;
+	EXPECT(AssocSetUserChoice(&registry, &scheduler, WTEXT(".txt"), WTEXT("TXTFILE"), c_szTestSid, &report));
+	EXPECT(report.decision == UserChoiceWriteDecision::ALREADY_CURRENT);
+	EXPECT(report.cAttempts == 0);
+	REGISTRY_OP_COUNTS counts = registry.GetOpCounts();
+	EXPECT(counts.cWrite == 0);
+	EXPECT(counts.cRename == 0);
+	EXPECT(counts.cSecurity == 0);
+	EXPECT(counts.cToken == 0);
+	EXPECT(CheckStoredAssociation(&registry, WTEXT(".txt"), WTEXT("txtfile")));
+
+	// A hash which doesn't match is written again.
+	WCHAR szKeyPath[ASSOC_KEY_PATH_CCH_MAX];
+	EXPECT(AssocFormatKeyPath(WTEXT(".txt"), false, szKeyPath, ARRAYSIZE(szKeyPath)));
+	CRegistryKey hkAssoc(&registry);
+	EXPECT(registry.OpenKey(HKEY_CURRENT_USER, szKeyPath, hkAssoc.put()) == ERROR_SUCCESS);
+	EXPECT(registry.SetProtectedValue(hkAssoc.get(), WTEXT("Hash"), WTEXT("stale"), StringBytes(WTEXT("stale"))) == ERROR_SUCCESS);
+
+	registry.ResetOpCounts();
+	EXPECT(AssocSetUserChoice(&registry, &scheduler, WTEXT(".txt"), WTEXT("txtfile"), c_szTestSid, &report));
+	EXPECT(report.decision != UserChoiceWriteDecision::ALREADY_CURRENT);
+	EXPECT(report.cAttempts == 1);
+	EXPECT(registry.GetOpCounts().cRename == 2);
+	EXPECT(CheckStoredAssociation(&registry, WTEXT(".txt"), WTEXT("txtfile")));
+	return true;
+}
+
+static bool TestRenameProbe()
+{
+	CFakeClock clock(c_ullTestMinute + 20 * 1000 * USERCHOICE_FILETIME_PER_MS);
+	CMemoryRegistry registry(&clock);
+	registry.SetUserSid(c_szTestSid);
+	CUserChoiceWriteScheduler scheduler(&clock);
+
+	// Nothing blocks writes here, so keys are written in place from the
+	// first write on.
+	CAssocRenameProbe probe;
+	EXPECT(probe.GetMode() == AssocRenameMode::UNKNOWN);
+	EXPECT(AssocSetUserChoice(&registry, &scheduler, WTEXT(".txt"), WTEXT("txtfile"), c_szTestSid, nullptr, &probe));
+	EXPECT(probe.GetMode() == AssocRenameMode::DIRECT);
+	EXPECT(registry.GetOpCounts().cRename == 0);
+	EXPECT(CheckStoredAssociation(&registry, WTEXT(".txt"), WTEXT("txtfile")));
+
+	registry.ResetOpCounts();
+	EXPECT(AssocSetUserChoice(&registry, &scheduler, WTEXT(".txt"), WTEXT("Applications\\notepad++.exe"), c_szTestSid, nullptr, &probe));
+	REGISTRY_OP_COUNTS counts = registry.GetOpCounts();
+	EXPECT(counts.cRename == 0);
+	EXPECT(counts.cSecurity == 3);
+	EXPECT(CheckStoredAssociation(&registry, WTEXT(".txt"), WTEXT("Applications\\notepad++.exe")));
+
+	// A driver protecting .htm. Once a write in place is denied, that one
+	// and every one after it goes through a temporary name.
+	registry.ProtectKeyName(WTEXT(".HTM"));
+	registry.ResetOpCounts();
+	EXPECT(AssocSetUserChoice(&registry, &scheduler, WTEXT(".htm"), WTEXT("htmlfile"), c_szTestSid, nullptr, &probe));
+	EXPECT(probe.GetMode() == AssocRenameMode::RENAME);
+	EXPECT(registry.GetOpCounts().cRename == 2);
+	EXPECT(CheckStoredAssociation(&registry, WTEXT(".htm"), WTEXT("htmlfile")));
+
+	registry.ResetOpCounts();
+	EXPECT(AssocSetUserChoice(&registry, &scheduler, WTEXT(".log"), WTEXT("txtfile"), c_szTestSid, nullptr, &probe));
+	EXPECT(registry.GetOpCounts().cRename == 2);
+
+	// A later success doesn't go back on it.
+	EXPECT(!probe.Record(AssocRenameMode::DIRECT));
+	EXPECT(probe.GetMode() == AssocRenameMode::RENAME);
+
+	// Probing again, with the protected key written first, goes straight
+	// to renaming.
+	probe.Reset();
+	EXPECT(probe.GetMode() == AssocRenameMode::UNKNOWN);
+	clock._ullNow += USERCHOICE_FILETIME_PER_MINUTE;
+	EXPECT(AssocSetUserChoice(&registry, &scheduler, WTEXT(".htm"), WTEXT("txtfile"), c_szTestSid, nullptr, &probe));
+	EXPECT(probe.GetMode() == AssocRenameMode::RENAME);
+	EXPECT(CheckStoredAssociation(&registry, WTEXT(".htm"), WTEXT("txtfile")));
+	return true;
+}
+
+static bool TestProtectedKeyNames()
+{
+	CFakeClock clock(c_ullTestMinute);
+	CMemoryRegistry registry(&clock);
+	registry.ProtectKeyName(WTEXT("Protected"));
+
+	CRegistryKey hk(&registry);
+	EXPECT(registry.CreateKey(HKEY_CURRENT_USER, WTEXT("Software\\protected"), hk.put()) == ERROR_SUCCESS);
+	EXPECT(registry.SetValue(hk.get(), nullptr, WTEXT("Name"), REG_SZ, WTEXT("x"), StringBytes(WTEXT("x"))) == ERROR_ACCESS_DENIED);
+
+	CRegistryKey hkChild(&registry);
+	EXPECT(registry.CreateKey(hk.get(), WTEXT("Child"), hkChild.put()) == ERROR_ACCESS_DENIED);
+
+	// Under another name, the key is fair game.
+	EXPECT(registry.RenameKey(hk.get(), WTEXT("Unprotected")) == ERROR_SUCCESS);
+	EXPECT(registry.SetValue(hk.get(), nullptr, WTEXT("Name"), REG_SZ, WTEXT("x"), StringBytes(WTEXT("x"))) == ERROR_SUCCESS);
+	EXPECT(registry.CreateKey(hk.get(), WTEXT("Child"), hkChild.put()) == ERROR_SUCCESS);
+
+	EXPECT(registry.RenameKey(hk.get(), WTEXT("Protected")) == ERROR_SUCCESS);
+	EXPECT(registry.DeleteValue(hkChild.get(), nullptr, WTEXT("Name")) == ERROR_ACCESS_DENIED);
+	EXPECT(registry.GetValue(hk.get(), nullptr, WTEXT("Name"), nullptr, nullptr, nullptr) == ERROR_SUCCESS);
+	return true;
+}
+
+static bool TestLookups()
+{
+	CFakeClock clock(c_ullTestMinute);
+	CMemoryRegistry registry(&clock);
+
+	CRegistryKey hk(&registry);
+	EXPECT(registry.SetValue(HKEY_CLASSES_ROOT, WTEXT(".txt"), nullptr, REG_SZ, WTEXT("txtfile"), StringBytes(WTEXT("txtfile"))) == ERROR_SUCCESS);
+	EXPECT(registry.SetValue(HKEY_CLASSES_ROOT, WTEXT(".dangling"), nullptr, REG_SZ, WTEXT("missing"), StringBytes(WTEXT("missing"))) == ERROR_SUCCESS);
+	EXPECT(registry.CreateKey(HKEY_CLASSES_ROOT, WTEXT("txtfile"), hk.put()) == ERROR_SUCCESS);
+
+	EXPECT(AssocOpenProgIdKey(&registry, WTEXT(".txt"), hk.put()));
+	EXPECT(hk.get());
+	EXPECT(!AssocOpenProgIdKey(&registry, WTEXT(".dangling"), hk.put()));
+	EXPECT(!hk.get());
+
+	EXPECT(AssocExists(&registry, WTEXT(".txt"), false));
+	EXPECT(!AssocExists(&registry, WTEXT(".dangling"), false));
+	EXPECT(!AssocExists(&registry, WTEXT(".new"), false));
+
+	// A per-user association counts too.
+	EXPECT(registry.CreateKey(
+		HKEY_CURRENT_USER,
+		WTEXT("SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Explorer\\FileExts\\.new"),
+		hk.put()
+	) == ERROR_SUCCESS);
+	EXPECT(AssocExists(&registry, WTEXT(".new"), false));
+	EXPECT(!AssocExists(&registry, WTEXT(".new"), true));
+
+	EXPECT(AssocProgIdExists(&registry, WTEXT("TXTFILE")));
+	EXPECT(!AssocProgIdExists(&registry, WTEXT("missing")));
+	return true;
+}
+
+bool TestAssocRegistry()
+{
+	bool fPassed = true;
+	fPassed &= TestSetUserChoice();
+	fPassed &= TestSetUserChoiceUnchanged();
+	fPassed &= TestRenameProbe();
+	fPassed &= TestProtectedKeyNames();
+	fPassed &= TestLookups();
+	return fPassed;
+}
\ No newline at end of file
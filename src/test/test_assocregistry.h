@@ -0,0 +1,14 @@
+#pragma once
+
+/**
+ * Tests for CMemoryRegistry, and for the association read and write paths
+ * running against it.
+ */
+bool TestMemoryRegistry();
+
+/**
+ * Sets associations through AssocSetUserChoice on an in-memory registry and
+ * checks what ends up in it, including that the stored hash matches the
+ * UserChoice key's last write time.
+ */
+bool TestAssocRegistry();
\ No newline at end of file
@@ -0,0 +1,225 @@
+#include "test_launcherdispatcher.h"
+
+#include "../launcherdispatcher.h"
+#include "fakeclock.h"
+#include "testutil.h"
+
+#include <stdio.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Dialogs for paths starting with "hold" stay open until they're let go;
+ * any others close straight away.
+ */
+class CFakeLauncherTarget : public ILauncherTarget
+{
+private:
+	std::mutex              _mutex;
+	std::condition_variable _cv;
+	bool                    _fReleased;
+	int                     _cHolding;
+
+public:
+	std::atomic<int>                 _cBegun;
+	std::atomic<int>                 _cEnded;
+	std::set<std::thread::id>        _threads;
+	std::vector<OPENWITH_REQUEST>    _shown;
+
+	CFakeLauncherTarget()
+		: _fReleased(false)
+		, _cHolding(0)
+		, _cBegun(0)
+		, _cEnded(0)
+	{
+	}
+
+	void BeginThread() override
+	{
+		_cBegun++;
+	}
+
+	void EndThread() override
+	{
+		_cEnded++;
+	}
+
+	void ShowDialog(const OPENWITH_REQUEST &request) override
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_threads.insert(std::this_thread::get_id());
+		_shown.push_back(request);
+
+		if (request.strPath.compare(0, 4, WTEXT("hold")) == 0)
+		{
+			_cHolding++;
+			_cv.notify_all();
+			_cv.wait(lock, [this]() { return _fReleased; });
+		}
+	}
+
+	// Waits until this many dialogs are being held open.
+	bool WaitForHolding(int cHolding)
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		return _cv.wait_for(lock, std::chrono::seconds(10), [&]() { return _cHolding >= cHolding; });
+	}
+
+	void Release()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_fReleased = true;
+		_cv.notify_all();
+	}
+
+	size_t CountShown(LPCWSTR pszPath)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		size_t c = 0;
+		for (const OPENWITH_REQUEST &request : _shown)
+		{
+			if (request.strPath == pszPath)
+				c++;
+		}
+		return c;
+	}
+};
+
+class CFakeDispatchSink : public ILauncherDispatchSink
+{
+private:
+	std::mutex              _mutex;
+	std::condition_variable _cv;
+	int                     _cDone;
+
+public:
+	CFakeDispatchSink()
+		: _cDone(0)
+	{
+	}
+
+	void OnRequestDone() override
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_cDone++;
+		_cv.notify_all();
+	}
+
+	bool WaitForDone(int cDone)
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		return _cv.wait_for(lock, std::chrono::seconds(10), [&]() { return _cDone >= cDone; });
+	}
+};
+
+static OPENWITH_REQUEST MakeRequest(LPCWSTR pszPath, DWORD dwStyle)
+{
+	OPENWITH_REQUEST request;
+	request.hWndParent = nullptr;
+	request.strPath = pszPath;
+	request.dwFlags = 0x1;
+	request.dwStyle = dwStyle;
+	request.ullActivated = c_ullTestMinute;
+	return request;
+}
+
+static bool TestConcurrentDialogs()
+{
+	CAtomicFakeClock clock;
+	CLauncherLifetime lifetime(&clock, 1000 * USERCHOICE_FILETIME_PER_MS, c_ullTestMinute);
+	CFakeLauncherTarget target;
+	CFakeDispatchSink sink;
+	CLauncherDispatcher dispatcher(&target, &sink, &lifetime);
+
+	// The first two stay open, and the third opens and closes anyway.
+	dispatcher.Dispatch(MakeRequest(WTEXT("hold1.txt"), 0));
+	dispatcher.Dispatch(MakeRequest(WTEXT("hold2.txt"), 1));
+	EXPECT(target.WaitForHolding(2));
+	dispatcher.Dispatch(MakeRequest(WTEXT("quick.txt"), 2));
+	EXPECT(sink.WaitForDone(1));
+	EXPECT(target.CountShown(WTEXT("quick.txt")) == 1);
+
+	// The open dialogs keep the server up, however long they take.
+	EXPECT(dispatcher.GetActiveCount() == 2);
+	clock._ullNow += 60 * 1000 * USERCHOICE_FILETIME_PER_MS;
+	EXPECT(!lifetime.ShouldExit());
+
+	target.Release();
+	EXPECT(sink.WaitForDone(3));
+	dispatcher.WaitAll();
+	EXPECT(dispatcher.GetActiveCount() == 0);
+
+	// Each on its own thread, with its own request.
+	EXPECT(target._threads.size() == 3);
+	EXPECT(target._threads.count(std::this_thread::get_id()) == 0);
+	EXPECT(target._cBegun == 3 && target._cEnded == 3);
+	for (const OPENWITH_REQUEST &request : target._shown)
+	{
+		DWORD dwStyle = (request.strPath == WTEXT("hold1.txt")) ? 0 : (request.strPath == WTEXT("hold2.txt")) ? 1 : 2;
+		EXPECT(request.dwStyle == dwStyle);
+		EXPECT(request.dwFlags == 0x1);
+	}
+
+	LAUNCHER_DISPATCH_COUNTS counts = dispatcher.GetCounts();
+	EXPECT(counts.cDispatched == 3);
+	EXPECT(counts.cCompleted == 3);
+	EXPECT(counts.cMaxConcurrent == 3);
+	EXPECT(lifetime.GetCounts().cRequests == 3);
+
+	// Idle once they're all closed.
+	ULONGLONG ullTime;
+	EXPECT(lifetime.GetExitTime(&ullTime));
+	return true;
+}
+
+static bool TestOneShotExit()
+{
+	CAtomicFakeClock clock;
+	CLauncherLifetime lifetime(&clock, 0, c_ullTestMinute);
+	CFakeLauncherTarget target;
+	CFakeDispatchSink sink;
+	CLauncherDispatcher dispatcher(&target, &sink, &lifetime);
+
+	// Dispatching returns straight away, but the request is counted from
+	// then on.
+	dispatcher.Dispatch(MakeRequest(WTEXT("hold.txt"), 0));
+	EXPECT(!lifetime.ShouldExit());
+	EXPECT(target.WaitForHolding(1));
+	EXPECT(!lifetime.ShouldExit());
+
+	target.Release();
+	EXPECT(sink.WaitForDone(1));
+	EXPECT(lifetime.ShouldExit());
+	return true;
+}
+
+static bool TestManyRequests()
+{
+	CFakeLauncherTarget target;
+	{
+		// No sink or lifetime; the destructor waits for the dialogs.
+		CLauncherDispatcher dispatcher(&target, nullptr, nullptr);
+		for (int i = 0; i < 50; i++)
+		{
+			dispatcher.Dispatch(MakeRequest(WTEXT("quick.txt"), 0));
+		}
+	}
+
+	EXPECT(target.CountShown(WTEXT("quick.txt")) == 50);
+	EXPECT(target._cEnded == 50);
+	return true;
+}
+
+bool TestLauncherDispatcher()
+{
+	return TestConcurrentDialogs()
+		&& TestOneShotExit()
+		&& TestManyRequests();
+}
\ No newline at end of file
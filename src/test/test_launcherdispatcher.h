@@ -0,0 +1,8 @@
+#pragma once
+
+/**
+ * Tests for CLauncherDispatcher with a fake launcher: every request gets its
+ * own thread, dialogs don't wait on each other, and the server stays up
+ * while they are open.
+ */
+bool TestLauncherDispatcher();
\ No newline at end of file
@@ -0,0 +1,117 @@
+#include "test_launcherlifetime.h"
+
+#include "../launcherlifetime.h"
+#include "fakeclock.h"
+#include "testutil.h"
+
+#include <stdio.h>
+
+static const ULONGLONG c_ullSecond = 1000 * USERCHOICE_FILETIME_PER_MS;
+
+static bool TestOneShot()
+{
+	CFakeClock clock(c_ullTestMinute);
+	CLauncherLifetime lifetime(&clock, 0, c_ullTestMinute - c_ullSecond);
+	EXPECT(!lifetime.IsResident());
+
+	// Never before the request, however long it takes to come.
+	ULONGLONG ullTime;
+	EXPECT(!lifetime.GetExitTime(&ullTime));
+	clock._ullNow += 60 * c_ullSecond;
+	EXPECT(!lifetime.ShouldExit());
+
+	lifetime.AddRef();
+	lifetime.BeginRequest(clock._ullNow);
+	EXPECT(!lifetime.ShouldExit());
+
+	// A request nested in the first one's dialog.
+	lifetime.BeginRequest(clock._ullNow);
+	lifetime.EndRequest();
+	EXPECT(!lifetime.ShouldExit());
+
+	// The client still holds its object, which never kept the one-shot
+	// server up.
+	lifetime.EndRequest();
+	EXPECT(lifetime.GetExitTime(&ullTime));
+	EXPECT(lifetime.ShouldExit());
+
+	LAUNCHER_LIFETIME_COUNTS counts = lifetime.GetCounts();
+	EXPECT(counts.cRequests == 2);
+	EXPECT(counts.ullColdLatency == 61 * c_ullSecond);
+	return true;
+}
+
+static bool TestResident()
+{
+	const ULONGLONG ullTimeout = 30 * c_ullSecond;
+	CFakeClock clock(c_ullTestMinute);
+	CLauncherLifetime lifetime(&clock, ullTimeout, c_ullTestMinute - c_ullSecond);
+	EXPECT(lifetime.IsResident());
+
+	// Idle from the start, so a server nobody talks to goes away too.
+	ULONGLONG ullTime;
+	EXPECT(lifetime.GetExitTime(&ullTime));
+	EXPECT(ullTime == c_ullTestMinute + ullTimeout);
+
+	// The first client.
+	clock._ullNow += 100 * USERCHOICE_FILETIME_PER_MS;
+	lifetime.AddRef();
+	EXPECT(!lifetime.GetExitTime(&ullTime));
+	lifetime.BeginRequest(clock._ullNow);
+	clock._ullNow += 10 * c_ullSecond;
+	lifetime.EndRequest();
+
+	// Its object keeps the server up, however long it is held.
+	clock._ullNow += 5 * ullTimeout;
+	EXPECT(!lifetime.ShouldExit());
+	lifetime.Release();
+	EXPECT(lifetime.GetExitTime(&ullTime));
+	EXPECT(ullTime == clock._ullNow + ullTimeout);
+
+	// A second client before the timeout starts it again.
+	clock._ullNow += ullTimeout - 1;
+	EXPECT(!lifetime.ShouldExit());
+	lifetime.AddRef();
+	ULONGLONG ullActivated = clock._ullNow;
+	clock._ullNow += 20 * USERCHOICE_FILETIME_PER_MS;
+	lifetime.BeginRequest(ullActivated);
+	lifetime.EndRequest();
+	lifetime.Release();
+
+	// And a third, a little slower.
+	lifetime.AddRef();
+	ullActivated = clock._ullNow;
+	clock._ullNow += 40 * USERCHOICE_FILETIME_PER_MS;
+	lifetime.BeginRequest(ullActivated);
+	lifetime.EndRequest();
+	lifetime.Release();
+
+	// A lock keeps it up as well.
+	lifetime.AddRef();
+	clock._ullNow += 2 * ullTimeout;
+	EXPECT(!lifetime.ShouldExit());
+	lifetime.Release();
+
+	clock._ullNow += ullTimeout - 1;
+	EXPECT(!lifetime.ShouldExit());
+	clock._ullNow += 1;
+	EXPECT(lifetime.ShouldExit());
+
+	// Releasing more than was added doesn't wrap around.
+	lifetime.Release();
+	EXPECT(lifetime.ShouldExit());
+
+	LAUNCHER_LIFETIME_COUNTS counts = lifetime.GetCounts();
+	EXPECT(counts.cRequests == 3);
+	EXPECT(counts.cIdle == 4);
+	EXPECT(counts.ullColdLatency == c_ullSecond + 100 * USERCHOICE_FILETIME_PER_MS);
+	EXPECT(counts.AverageWarmLatency() == 30 * USERCHOICE_FILETIME_PER_MS);
+	EXPECT(counts.ullWarmLatencyMax == 40 * USERCHOICE_FILETIME_PER_MS);
+	return true;
+}
+
+bool TestLauncherLifetime()
+{
+	return TestOneShot()
+		&& TestResident();
+}
\ No newline at end of file
@@ -0,0 +1,7 @@
+#pragma once
+
+/**
+ * Tests for CLauncherLifetime: when one-shot and resident servers may exit,
+ * and the latencies they measure.
+ */
+bool TestLauncherLifetime();
\ No newline at end of file
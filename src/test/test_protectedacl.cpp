@@ -0,0 +1,173 @@
+#include "test_protectedacl.h"
+
+#include "../protectedacl.h"
+#include "testutil.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+// S-1-5-18, LocalSystem.
+static const BYTE c_rgbSystemSid[] = {
+	1, 1, 0, 0, 0, 0, 0, 5,
+	18, 0, 0, 0,
+};
+
+// S-1-5-21-1004336348-1177238915-682003330-1001
+static const BYTE c_rgbUserSid[] = {
+	1, 5, 0, 0, 0, 0, 0, 5,
+	21, 0, 0, 0,
+	0xDC, 0x9E, 0xDD, 0x3B,
+	0x83, 0x1C, 0x2B, 0x46,
+	0x82, 0x8B, 0xA6, 0x28,
+	0xE9, 0x03, 0x00, 0x00,
+};
+
+// KEY_ALL_ACCESS and KEY_READ.
+static const DWORD c_dwKeyAllAccess = 0xF003F;
+static const DWORD c_dwKeyRead = 0x20019;
+
+/**
+ * Builds ACLs the way GetSecurityInfo returns them.
+ */
+class CAclWriter
+{
+public:
+	std::vector<BYTE> _bytes;
+
+	CAclWriter()
+		: _bytes(PROTECTED_ACL_HEADER_CB, 0)
+	{
+		_bytes[0] = ACL_REVISION;
+		_bytes[2] = PROTECTED_ACL_HEADER_CB;
+	}
+
+	CAclWriter &Add(BYTE bType, BYTE bFlags, DWORD dwMask, const BYTE *pbSid, size_t cbSid)
+	{
+		size_t cbAce = PROTECTED_ACE_HEADER_CB + cbSid;
+		_bytes.push_back(bType);
+		_bytes.push_back(bFlags);
+		_bytes.push_back((BYTE)cbAce);
+		_bytes.push_back((BYTE)(cbAce >> 8));
+		for (int i = 0; i < 4; i++)
+			_bytes.push_back((BYTE)(dwMask >> (i * 8)));
+		_bytes.insert(_bytes.end(), pbSid, pbSid + cbSid);
+
+		_bytes[2] = (BYTE)_bytes.size();
+		_bytes[3] = (BYTE)(_bytes.size() >> 8);
+		_bytes[4]++;
+		return *this;
+	}
+};
+
+static bool TestUnlockAndLock()
+{
+	// The inherited ACEs of a UserChoice key, with the user's deny ACE in
+	// front and a stray one for another SID in the middle.
+	CAclWriter acl;
+	acl.Add(ACCESS_DENIED_ACE_TYPE, 0, KEY_SET_VALUE, c_rgbUserSid, sizeof(c_rgbUserSid))
+		.Add(ACCESS_ALLOWED_ACE_TYPE, 0x10, c_dwKeyAllAccess, c_rgbUserSid, sizeof(c_rgbUserSid))
+		.Add(ACCESS_DENIED_ACE_TYPE, 0, KEY_SET_VALUE, c_rgbSystemSid, sizeof(c_rgbSystemSid))
+		.Add(ACCESS_DENIED_ACE_TYPE, 0, c_dwKeyRead, c_rgbSystemSid, sizeof(c_rgbSystemSid))
+		.Add(ACCESS_ALLOWED_ACE_TYPE, 0x10, c_dwKeyAllAccess, c_rgbSystemSid, sizeof(c_rgbSystemSid));
+
+	CProtectedAcl editor;
+	DWORD cbAcl = 0;
+	EXPECT(!editor.BuildUnlocked(&cbAcl));
+	EXPECT(editor.Parse(acl._bytes.data(), acl._bytes.size()));
+	EXPECT(editor.GetRemovedCount() == 2);
+
+	// Unlocked: only the two deny set value ACEs are gone, and the rest keep
+	// their order.
+	CAclWriter unlocked;
+	unlocked.Add(ACCESS_ALLOWED_ACE_TYPE, 0x10, c_dwKeyAllAccess, c_rgbUserSid, sizeof(c_rgbUserSid))
+		.Add(ACCESS_DENIED_ACE_TYPE, 0, c_dwKeyRead, c_rgbSystemSid, sizeof(c_rgbSystemSid))
+		.Add(ACCESS_ALLOWED_ACE_TYPE, 0x10, c_dwKeyAllAccess, c_rgbSystemSid, sizeof(c_rgbSystemSid));
+
+	const BYTE *pbAcl = editor.BuildUnlocked(&cbAcl);
+	EXPECT(pbAcl);
+	EXPECT(cbAcl == unlocked._bytes.size());
+	EXPECT(memcmp(pbAcl, unlocked._bytes.data(), cbAcl) == 0);
+
+	// Locked: one deny ACE for the user in front of what unlocking left.
+	CAclWriter locked;
+	locked.Add(ACCESS_DENIED_ACE_TYPE, 0, KEY_SET_VALUE, c_rgbUserSid, sizeof(c_rgbUserSid))
+		.Add(ACCESS_ALLOWED_ACE_TYPE, 0x10, c_dwKeyAllAccess, c_rgbUserSid, sizeof(c_rgbUserSid))
+		.Add(ACCESS_DENIED_ACE_TYPE, 0, c_dwKeyRead, c_rgbSystemSid, sizeof(c_rgbSystemSid))
+		.Add(ACCESS_ALLOWED_ACE_TYPE, 0x10, c_dwKeyAllAccess, c_rgbSystemSid, sizeof(c_rgbSystemSid));
+
+	pbAcl = editor.BuildLocked(c_rgbUserSid, sizeof(c_rgbUserSid), &cbAcl);
+	EXPECT(pbAcl);
+	EXPECT(cbAcl == locked._bytes.size());
+	EXPECT(memcmp(pbAcl, locked._bytes.data(), cbAcl) == 0);
+
+	// Locking what was just locked gives the same ACL back, so the two
+	// transitions are stable.
+	std::vector<BYTE> relocked(pbAcl, pbAcl + cbAcl);
+	EXPECT(editor.Parse(relocked.data(), relocked.size()));
+	EXPECT(editor.GetRemovedCount() == 1);
+	pbAcl = editor.BuildLocked(c_rgbUserSid, sizeof(c_rgbUserSid), &cbAcl);
+	EXPECT(pbAcl);
+	EXPECT(cbAcl == relocked.size());
+	EXPECT(memcmp(pbAcl, relocked.data(), cbAcl) == 0);
+
+	// An empty ACL has nothing to remove, and locks to a single ACE.
+	CAclWriter empty;
+	EXPECT(editor.Parse(empty._bytes.data(), empty._bytes.size()));
+	EXPECT(editor.GetRemovedCount() == 0);
+	pbAcl = editor.BuildLocked(c_rgbSystemSid, sizeof(c_rgbSystemSid), &cbAcl);
+	EXPECT(pbAcl);
+	EXPECT(cbAcl == PROTECTED_ACL_HEADER_CB + PROTECTED_ACE_HEADER_CB + sizeof(c_rgbSystemSid));
+	EXPECT(pbAcl[4] == 1);
+
+	// A bad SID isn't locked in.
+	EXPECT(!editor.BuildLocked(c_rgbUserSid, 12, &cbAcl));
+	return true;
+}
+
+static bool TestMalformed()
+{
+	CProtectedAcl editor;
+	CAclWriter acl;
+	acl.Add(ACCESS_DENIED_ACE_TYPE, 0, KEY_SET_VALUE, c_rgbUserSid, sizeof(c_rgbUserSid));
+	EXPECT(editor.Parse(acl._bytes.data(), acl._bytes.size()));
+
+	std::vector<BYTE> bytes;
+
+	// Too short for the header, or for its own size.
+	EXPECT(!editor.Parse(acl._bytes.data(), 4));
+	EXPECT(!editor.Parse(acl._bytes.data(), acl._bytes.size() - 1));
+
+	// More ACEs claimed than there are.
+	bytes = acl._bytes;
+	bytes[4] = 2;
+	EXPECT(!editor.Parse(bytes.data(), bytes.size()));
+
+	// An ACE running past the end, and one with a size that isn't a
+	// multiple of four.
+	bytes = acl._bytes;
+	bytes[PROTECTED_ACL_HEADER_CB + 2] += 4;
+	EXPECT(!editor.Parse(bytes.data(), bytes.size()));
+	bytes = acl._bytes;
+	bytes[PROTECTED_ACL_HEADER_CB + 2] -= 2;
+	EXPECT(!editor.Parse(bytes.data(), bytes.size()));
+
+	// A failed parse leaves nothing to build from.
+	DWORD cbAcl = 0;
+	EXPECT(!editor.BuildUnlocked(&cbAcl));
+
+	// SIDs.
+	EXPECT(ProtectedAclSidLength(c_rgbUserSid, sizeof(c_rgbUserSid)) == sizeof(c_rgbUserSid));
+	EXPECT(ProtectedAclSidLength(c_rgbUserSid, sizeof(c_rgbUserSid) - 1) == 0);
+	EXPECT(ProtectedAclSidLength(nullptr, 0) == 0);
+	return true;
+}
+
+bool TestProtectedAcl()
+{
+	bool fPassed = true;
+	fPassed &= TestUnlockAndLock();
+	fPassed &= TestMalformed();
+	return fPassed;
+}
\ No newline at end of file
@@ -0,0 +1,7 @@
+#pragma once
+
+/**
+ * Tests for CProtectedAcl: parsing binary ACLs and building the unlocked
+ * and locked forms of them.
+ */
+bool TestProtectedAcl();
\ No newline at end of file
@@ -0,0 +1,209 @@
+#include "test_ringlog.h"
+
+#include "../ringlog.h"
+#include "fakeclock.h"
+#include "testutil.h"
+
+#include <stdio.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+template <typename... TArgs>
+static std::string Format(const char *pszFormat, const TArgs &...args)
+{
+	RING_LOG_PAYLOAD payload;
+	payload.cb = 0;
+	RingLogEncode(&payload, args...);
+
+	std::string str;
+	RingLogFormat(pszFormat, payload.rgb, payload.cb, &str);
+	return str;
+}
+
+static size_t CountLines(const std::string &strText, const std::string &strNeedle)
+{
+	size_t cLines = 0;
+	size_t ich = 0;
+	while ((ich = strText.find(strNeedle, ich)) != std::string::npos)
+	{
+		cLines++;
+		ich += strNeedle.size();
+	}
+	return cLines;
+}
+
+static bool TestFormat()
+{
+	EXPECT(Format("%d %i %u", -5, (short)-1, 42u) == "-5 -1 42");
+	EXPECT(Format("%x %04X %llu", 0xABu, 0x1Fu, 18446744073709551615ull) == "ab 001F 18446744073709551615");
+	EXPECT(Format("%lu, %5d|%-3d|", (DWORD)7, 12, 3) == "7,    12|3  |");
+	EXPECT(Format("<%s> <%s> %c%c", WTEXT("café"), (LPCWSTR)nullptr, (WCHAR)'o', (WCHAR)0x263A) == "<caf\xC3\xA9> <(null)> o\xE2\x98\xBA");
+	EXPECT(Format("100%% %q") == "100% %q");
+	EXPECT(Format("%p", (const void *)(uintptr_t)0x1234) == "0000000000001234");
+
+	GUID guid = { 0x66088CF9, 0x28EF, 0x4014, { 0xAD, 0x00, 0xDF, 0xFE, 0xCD, 0xAA, 0xCB, 0x06 } };
+	EXPECT(Format("riid = %g", guid) == "riid = {66088CF9-28EF-4014-AD00-DFFECDAACB06}");
+
+	// Arguments which weren't logged are decoded as missing.
+	EXPECT(Format("%d and %s", 1) == "1 and ?");
+
+	// Strings are cut short to fit, and arguments after them are left out.
+	std::basic_string<WCHAR> strLong(200, 'a');
+	std::string strFormatted = Format("%s %d", strLong.c_str(), 5);
+	EXPECT(strFormatted == std::string((RING_LOG_PAYLOAD_SIZE - 2) / 2, 'a') + "... ?");
+
+	return true;
+}
+
+static bool TestWrapAround()
+{
+	CFakeClock clock(c_ullTestMinute);
+	CRingLog log(&clock, 4);
+
+	for (int i = 1; i <= 10; i++)
+	{
+		RINGLOG_FROM(&log, WTEXT("CTest::Wrap"), 7, WTEXT("record %d\n"), i);
+		clock._ullNow += 10000000;
+	}
+
+	std::vector<BYTE> dump;
+	EXPECT(log.Dump(&dump));
+
+	RING_LOG_DUMP_HEADER header;
+	EXPECT(dump.size() >= sizeof(header));
+	memcpy(&header, dump.data(), sizeof(header));
+	EXPECT(header.dwMagic == RING_LOG_MAGIC);
+	EXPECT(header.cRings == 1);
+
+	std::string strText;
+	EXPECT(RingLogDecode(dump.data(), dump.size(), &strText));
+
+	// Only the newest four are kept, oldest first, each on one line.
+	EXPECT(strText.find("record 6") == std::string::npos);
+	size_t ich7 = strText.find("[CTest::Wrap:7] record 7\n");
+	size_t ich10 = strText.find("[CTest::Wrap:7] record 10\n");
+	EXPECT(ich7 != std::string::npos && ich10 != std::string::npos && ich7 < ich10);
+	EXPECT(CountLines(strText, "[CTest::Wrap:7]") == 4);
+	EXPECT(strText.find("2024-01-01 12:34:06.0000000") != std::string::npos);
+	EXPECT(strText.find("2024-01-01 12:34:09.0000000") != std::string::npos);
+
+	return true;
+}
+
+static bool TestThreads()
+{
+	const int c_cThreads = 4;
+	const int c_cRecords = 500;
+
+	CRingLog log(nullptr, 64);
+
+	// Threads which exited would hand their rings over to the rest, so none
+	// exits until they have all logged.
+	std::atomic<int> cDone(0);
+
+	std::vector<std::thread> threads;
+	for (int iThread = 0; iThread < c_cThreads; iThread++)
+	{
+		threads.emplace_back([&log, &cDone, iThread]()
+		{
+			for (int i = 0; i < c_cRecords; i++)
+			{
+				RINGLOG_FROM(&log, WTEXT("Worker"), iThread, WTEXT("%d of %s"), i, WTEXT("worker"));
+			}
+
+			cDone++;
+			while (cDone < c_cThreads)
+			{
+				std::this_thread::yield();
+			}
+		});
+	}
+
+	// Dumps can be taken while threads are logging.
+	for (int i = 0; i < 10; i++)
+	{
+		std::vector<BYTE> dump;
+		EXPECT(log.Dump(&dump));
+
+		std::string strText;
+		EXPECT(RingLogDecode(dump.data(), dump.size(), &strText));
+	}
+
+	for (std::thread &thread : threads)
+	{
+		thread.join();
+	}
+
+	std::vector<BYTE> dump;
+	EXPECT(log.Dump(&dump));
+
+	std::string strText;
+	EXPECT(RingLogDecode(dump.data(), dump.size(), &strText));
+
+	for (int iThread = 0; iThread < c_cThreads; iThread++)
+	{
+		std::string strSource = "[Worker:" + std::to_string(iThread) + "] ";
+		EXPECT(CountLines(strText, strSource) == 64);
+		EXPECT(strText.find(strSource + std::to_string(c_cRecords - 1) + " of worker\n") != std::string::npos);
+		EXPECT(strText.find(strSource + std::to_string(c_cRecords - 65) + " of worker\n") == std::string::npos);
+	}
+
+	// Threads which start after those exited reuse their rings.
+	std::thread later([&log]()
+	{
+		RINGLOG_FROM(&log, WTEXT("Later"), 0, WTEXT("reused"));
+	});
+	later.join();
+
+	EXPECT(log.Dump(&dump));
+	RING_LOG_DUMP_HEADER header;
+	memcpy(&header, dump.data(), sizeof(header));
+	EXPECT(header.cRings == c_cThreads);
+
+	EXPECT(RingLogDecode(dump.data(), dump.size(), &strText));
+	EXPECT(CountLines(strText, "[Later:0] reused\n") == 1);
+
+	// The reused ring only holds the new thread's records.
+	EXPECT(CountLines(strText, "[Worker:") == (c_cThreads - 1) * 64);
+
+	return true;
+}
+
+static bool TestDamagedDumps()
+{
+	CFakeClock clock(c_ullTestMinute);
+	CRingLog log(&clock);
+	RINGLOG_FROM(&log, nullptr, 0, WTEXT("first"));
+	RINGLOG_FROM(&log, nullptr, 0, WTEXT("second"));
+
+	std::vector<BYTE> dump;
+	EXPECT(log.Dump(&dump));
+
+	std::string strText;
+	EXPECT(RingLogDecode(dump.data(), dump.size(), &strText));
+	EXPECT(strText.find(" first\n") != std::string::npos);
+
+	// Whatever comes before the damage is still decoded.
+	EXPECT(!RingLogDecode(dump.data(), dump.size() - 1, &strText));
+	EXPECT(strText.find("# Process ") == 0);
+	EXPECT(strText.find(" first\n") != std::string::npos);
+	EXPECT(strText.find(" second\n") == std::string::npos);
+
+	std::vector<BYTE> other(dump);
+	other[0] ^= 0xFF;
+	EXPECT(!RingLogDecode(other.data(), other.size(), &strText));
+	EXPECT(!RingLogDecode(dump.data(), 4, &strText));
+
+	return true;
+}
+
+bool TestRingLog()
+{
+	return TestFormat()
+		&& TestWrapAround()
+		&& TestThreads()
+		&& TestDamagedDumps();
+}
\ No newline at end of file
@@ -0,0 +1,7 @@
+#pragma once
+
+/**
+ * Tests for CRingLog: how arguments are encoded and formatted, rings wrapping
+ * around, threads logging at once, and dumps decoding back into text.
+ */
+bool TestRingLog();
\ No newline at end of file
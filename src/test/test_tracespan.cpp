@@ -0,0 +1,229 @@
+#include "test_tracespan.h"
+
+#include "../tracespan.h"
+#include "../assocregistry.h"
+#include "../memoryregistry.h"
+#include "fakeclock.h"
+#include "testutil.h"
+
+#include <stdio.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * A sink which nothing is listening to.
+ */
+class CDisabledTraceSink : public CMemoryTraceSink
+{
+public:
+	bool IsEnabled() override
+	{
+		return false;
+	}
+};
+
+/**
+ * Sets the sink for a test, and clears it again however the test ends.
+ */
+class CTestTraceSink
+{
+public:
+	CTestTraceSink(ITraceSink *pSink, IUserChoiceClock *pClock)
+	{
+		TraceSetSink(pSink, pClock);
+	}
+
+	~CTestTraceSink()
+	{
+		TraceSetSink(nullptr, nullptr);
+	}
+};
+
+static const TRACE_SPAN *FindSpan(const std::vector<TRACE_SPAN> &spans, TRACE_PHASE phase)
+{
+	for (const TRACE_SPAN &span : spans)
+	{
+		if (span.phase == phase)
+		{
+			return &span;
+		}
+	}
+
+	return nullptr;
+}
+
+static bool TestActivities()
+{
+	CFakeClock clock(c_ullTestMinute);
+	CMemoryTraceSink sink;
+	CTestTraceSink testSink(&sink, &clock);
+
+	ULONGLONG ullOuterId = 0;
+	{
+		CTraceActivity outer(TRACE_GET_HANDLERS, WTEXT(".txt"));
+		EXPECT(outer.IsEnabled());
+		clock._ullNow += 10;
+
+		{
+			CTraceActivity inner(TRACE_RESOLVE_ICON, WTEXT("notepad.exe"));
+			clock._ullNow += 5;
+			inner.SetResult(ERROR_FILE_NOT_FOUND);
+		}
+
+		outer.SetCount(3);
+		clock._ullNow += 1;
+		outer.Stop();
+
+		// Only the first stop counts.
+		clock._ullNow += 100;
+		outer.Stop();
+
+		std::vector<TRACE_SPAN> spans = sink.GetSpans();
+		EXPECT(spans.size() == 2);
+		ullOuterId = spans[1].ullId;
+	}
+
+	std::vector<TRACE_SPAN> spans = sink.GetSpans();
+	EXPECT(spans.size() == 2);
+	EXPECT(sink.GetBegunCount() == 2);
+
+	const TRACE_SPAN &inner = spans[0];
+	EXPECT(inner.phase == TRACE_RESOLVE_ICON);
+	EXPECT(inner.strSubject == WTEXT("notepad.exe"));
+	EXPECT(inner.ullParentId == ullOuterId);
+	EXPECT(inner.ullStart == c_ullTestMinute + 10);
+	EXPECT(inner.ullDuration == 5);
+	EXPECT(inner.lResult == ERROR_FILE_NOT_FOUND);
+
+	const TRACE_SPAN &outer = spans[1];
+	EXPECT(outer.phase == TRACE_GET_HANDLERS);
+	EXPECT(outer.ullId != 0 && outer.ullId != inner.ullId);
+	EXPECT(outer.ullParentId == 0);
+	EXPECT(outer.ullStart == c_ullTestMinute);
+	EXPECT(outer.ullDuration == 16);
+	EXPECT(outer.ullCount == 3);
+	EXPECT(outer.lResult == 0);
+
+	// A span which started before it could be traced, kept open while
+	// others start and stop on another thread, and past one started after
+	// it on this thread.
+	sink.Clear();
+	{
+		CTraceActivity early(TRACE_PROCESS_START, nullptr, c_ullTestMinute - 50);
+		CTraceActivity *pLater = new CTraceActivity(TRACE_FIRST_PAINT);
+
+		std::thread worker([]()
+		{
+			CTraceActivity other(TRACE_HASH);
+		});
+		worker.join();
+
+		early.Stop();
+		delete pLater;
+
+		// Nothing is left running on this thread.
+		CTraceActivity after(TRACE_INVOKE);
+	}
+
+	spans = sink.GetSpans();
+	EXPECT(spans.size() == 4);
+	const TRACE_SPAN *pEarly = FindSpan(spans, TRACE_PROCESS_START);
+	const TRACE_SPAN *pLater = FindSpan(spans, TRACE_FIRST_PAINT);
+	EXPECT(pEarly && pLater);
+	EXPECT(pEarly->ullStart == c_ullTestMinute - 50);
+	EXPECT(pEarly->ullDuration == clock._ullNow - pEarly->ullStart);
+	EXPECT(pEarly->strSubject.empty());
+	EXPECT(pLater->ullParentId == pEarly->ullId);
+	EXPECT(FindSpan(spans, TRACE_HASH)->ullParentId == 0);
+	EXPECT(FindSpan(spans, TRACE_INVOKE)->ullParentId == 0);
+
+	return true;
+}
+
+static bool TestDisabled()
+{
+	CFakeClock clock(c_ullTestMinute);
+
+	{
+		CTraceActivity activity(TRACE_INVOKE, WTEXT("a.txt"));
+		EXPECT(!activity.IsEnabled());
+		activity.SetCount(1);
+	}
+
+	CDisabledTraceSink sink;
+	CTestTraceSink testSink(&sink, &clock);
+	{
+		CTraceActivity activity(TRACE_INVOKE, WTEXT("a.txt"));
+		EXPECT(!activity.IsEnabled());
+	}
+	EXPECT(sink.GetBegunCount() == 0);
+	EXPECT(sink.GetSpans().empty());
+
+	return true;
+}
+
+static bool TestSetUserChoiceSpans()
+{
+	CFakeClock clock(c_ullTestMinute + 20 * 1000 * USERCHOICE_FILETIME_PER_MS);
+	CMemoryRegistry registry(&clock);
+	registry.SetUserSid(c_szTestSid);
+	CUserChoiceWriteScheduler scheduler(&clock);
+
+	CMemoryTraceSink sink;
+	CTestTraceSink testSink(&sink, &clock);
+
+	EXPECT(AssocSetUserChoice(&registry, &scheduler, WTEXT(".txt"), WTEXT("txtfile"), c_szTestSid));
+
+	std::vector<TRACE_SPAN> spans = sink.GetSpans();
+	const TRACE_SPAN *pHash = FindSpan(spans, TRACE_HASH);
+	const TRACE_SPAN *pWrite = FindSpan(spans, TRACE_WRITE_USERCHOICE);
+	const TRACE_SPAN *pUnlock = FindSpan(spans, TRACE_ACL_UNLOCK);
+	const TRACE_SPAN *pLock = FindSpan(spans, TRACE_ACL_LOCK);
+	EXPECT(pHash && pWrite && pUnlock && pLock);
+
+	EXPECT(pHash->strSubject == WTEXT(".txt"));
+	EXPECT(pHash->ullCount == 1);
+	EXPECT(pWrite->strSubject == WTEXT(".txt"));
+	EXPECT(pWrite->lResult == ERROR_SUCCESS);
+
+	// The hash is made before the write, and the ACL is unlocked and
+	// locked inside it.
+	EXPECT(pHash->ullParentId == 0);
+	EXPECT(pUnlock->ullParentId == pWrite->ullId);
+	EXPECT(pLock->ullParentId == pWrite->ullId);
+
+	return true;
+}
+
+static bool TestFileSink()
+{
+	TRACE_SPAN span;
+	span.phase = TRACE_WRITE_USERCHOICE;
+	span.ullId = 7;
+	span.ullParentId = 3;
+	span.ullStart = 1000;
+	span.ullDuration = 25;
+	span.strSubject = WTEXT("caf\u00E9\t\U0001F600");
+	span.ullCount = 2;
+	span.lResult = ERROR_ACCESS_DENIED;
+
+	std::string strLine = CFileTraceSink::FormatSpan(span);
+	EXPECT(strLine == "WriteUserChoice\t7\t3\t1000\t25\t2\t5\tcaf\xC3\xA9 \xF0\x9F\x98\x80");
+
+	// A lone surrogate can't be written as it is.
+	span.strSubject = std::basic_string<WCHAR>(1, (WCHAR)0xD800);
+	strLine = CFileTraceSink::FormatSpan(span);
+	EXPECT(strLine.substr(strLine.size() - 3) == "\xEF\xBF\xBD");
+
+	return true;
+}
+
+bool TestTraceSpan()
+{
+	return TestActivities() &&
+		TestDisabled() &&
+		TestSetUserChoiceSpans() &&
+		TestFileSink();
+}
\ No newline at end of file
@@ -0,0 +1,7 @@
+#pragma once
+
+/**
+ * Tests for CTraceActivity and the portable trace sinks: how spans nest, what
+ * they record, and the spans that setting an association produces.
+ */
+bool TestTraceSpan();
\ No newline at end of file
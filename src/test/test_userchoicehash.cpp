@@ -0,0 +1,510 @@
+#include "test_userchoicehash.h"
+
+#include "../userchoicehash.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#ifdef _WIN32
+#include <wincrypt.h> // for CryptoAPI base64
+#include <bcrypt.h> // CNG MD5
+#include <winternl.h> // for NT_SUCCESS()
+#endif
+
+struct USERCHOICEHASH_VECTOR
+{
+	LPCWSTR   lpszExtension;
+	LPCWSTR   lpszProgId;
+	ULONGLONG ullTimestamp; // FILETIME, truncated to the minute
+	LPCWSTR   lpszExpected;
+};
+
+static LPCWSTR c_szTestSid = WTEXT("S-1-5-21-1004336348-1177238915-682003330-512");
+
+static const USERCHOICEHASH_VECTOR c_rgVectors[] = {
+	// 2024-01-01 12:34 UTC
+	{ WTEXT(".txt"),  WTEXT("txtfile"),                 0x01DA3CAECBADEC00uLL, WTEXT("WyCvPQz0ER0=") },
+	// 2023-06-15 08:05 UTC
+	{ WTEXT(".html"), WTEXT("ChromeHTML"),              0x01D99F6014DF5E00uLL, WTEXT("9tlt/jT+LZU=") },
+	// 2025-12-31 23:59 UTC
+	{ WTEXT("http"),  WTEXT("MSEdgeHTM"),               0x01DC7AB16EBDBA00uLL, WTEXT("RdL7wRpDbbo=") },
+	// 2022-02-02 02:02 UTC
+	{ WTEXT(".7z"),   WTEXT("Applications\\7zFM.exe"),  0x01D817D8DD439C00uLL, WTEXT("qLlv/bAbTXc=") },
+};
+
+static bool StrEqual(LPCWSTR psz1, LPCWSTR psz2)
+{
+	while (*psz1 && *psz1 == *psz2)
+	{
+		psz1++;
+		psz2++;
+	}
+	return *psz1 == *psz2;
+}
+
+static void PrintString(LPCWSTR psz)
+{
+	while (*psz)
+		putchar((char)*psz++);
+}
+
+/**
+ * Builds the hash input the same way Windows does: "%s%s%s%08lx%08lx%s" of
+ * the extension, SID, ProgID, FILETIME and User Experience string, lowercased.
+ * All of the test strings are ASCII, so lowercasing is trivial.
+ */
+static size_t BuildInput(const USERCHOICEHASH_VECTOR *pVector, WCHAR *pszOut, size_t cchOut)
+{
+	static const char c_szHex[] = "0123456789abcdef";
+	size_t cch = 0;
+
+	LPCWSTR rgpszParts[] = { pVector->lpszExtension, c_szTestSid, pVector->lpszProgId };
+	for (LPCWSTR psz : rgpszParts)
+	{
+		while (*psz && cch < cchOut - 1)
+			pszOut[cch++] = *psz++;
+	}
+
+	for (int i = 15; i >= 0 && cch < cchOut - 1; i--)
+		pszOut[cch++] = c_szHex[(pVector->ullTimestamp >> (i * 4)) & 0xF];
+
+	for (LPCWSTR psz = g_szConstantUserExperience; *psz && cch < cchOut - 1; psz++)
+		pszOut[cch++] = *psz;
+
+	pszOut[cch] = '\0';
+
+	for (size_t i = 0; i < cch; i++)
+	{
+		if (pszOut[i] >= 'A' && pszOut[i] <= 'Z')
+			pszOut[i] += 'a' - 'A';
+	}
+
+	return cch;
+}
+
+#ifdef _WIN32
+static inline DWORD WordSwap(DWORD v) { return (v >> 16) | (v << 16); }
+
+/**
+ * The CNG/CryptoAPI implementation of HashString from before the portable
+ * kernel, scramble and all. Kept here only to prove the two match.
+ */
+static bool LegacyHashString(LPCWSTR lpszInputString, WCHAR *pszOut, DWORD cchOut)
+{
+	LPCBYTE inputBytes = (LPCBYTE)lpszInputString;
+	ULONG inputByteCount = (lstrlenW(lpszInputString) + 1) * sizeof(WCHAR);
+
+	DWORD md5[4];
+	bool fHashed = false;
+
+	BCRYPT_ALG_HANDLE hAlg = nullptr;
+	if (NT_SUCCESS(BCryptOpenAlgorithmProvider(&hAlg, BCRYPT_MD5_ALGORITHM, nullptr, 0)))
+	{
+		BCRYPT_HASH_HANDLE hHash = nullptr;
+		if (NT_SUCCESS(BCryptCreateHash(hAlg, &hHash, nullptr, 0, nullptr, 0, 0)))
+		{
+			fHashed = NT_SUCCESS(BCryptHashData(hHash, (LPBYTE)inputBytes, inputByteCount, 0)) &&
+				NT_SUCCESS(BCryptFinishHash(hHash, (LPBYTE)md5, sizeof(md5), 0));
+			BCryptDestroyHash(hHash);
+		}
+		BCryptCloseAlgorithmProvider(hAlg, 0);
+	}
+
+	if (!fHashed)
+	{
+		return false;
+	}
+
+	constexpr size_t DWORDS_PER_BLOCK = 2;
+	constexpr size_t BLOCK_SIZE = sizeof(DWORD) * DWORDS_PER_BLOCK;
+
+	// Incomplete blocks are ignored.
+	int blockCount = inputByteCount / BLOCK_SIZE;
+
+	if (blockCount == 0)
+	{
+		return false;
+	}
+
+	// The following loop effectively computes two checksums, scrambled like
+	// a hash after every DWORD is added.
+
+	// Constant multipliers for the scramble, one set for each DWORD in a block:
+	const DWORD C0s[DWORDS_PER_BLOCK][5] = {
+		{md5[0] | 1, 0xCF98B111uL, 0x87085B9FuL, 0x12CEB96DuL, 0x257E1D83uL},
+		{md5[1] | 1, 0xA27416F5uL, 0xD38396FFuL, 0x7C932B89uL, 0xBFA49F69uL}
+	};
+
+	const DWORD C1s[DWORDS_PER_BLOCK][5] = {
+		{md5[0] | 1, 0xEF0569FBuL, 0x689B6B9FuL, 0x79F8A395uL, 0xC3EFEA97uL},
+		{md5[1] | 1, 0xC31713DBuL, 0xDDCD1F0FuL, 0x59C3AF2DuL, 0x35BD1EC9uL}
+	};
+
+	// The checksums:
+	DWORD h0 = 0;
+	DWORD h1 = 0;
+
+	// Accumulated total of the checksum after each DWORD:
+	DWORD h0Acc = 0;
+	DWORD h1Acc = 0;
+
+	for (int i = 0; i < blockCount; ++i)
+	{
+		for (size_t j = 0; j < DWORDS_PER_BLOCK; ++j)
+		{
+			const DWORD *C0 = C0s[j];
+			const DWORD *C1 = C1s[j];
+
+			DWORD input;
+			memcpy(&input, &inputBytes[(i * DWORDS_PER_BLOCK + j) * sizeof(DWORD)], sizeof(DWORD));
+
+			h0 += input;
+			// Scramble 0:
+			h0 *= C0[0];
+			h0 = WordSwap(h0) * C0[1];
+			h0 = WordSwap(h0) * C0[2];
+			h0 = WordSwap(h0) * C0[3];
+			h0 = WordSwap(h0) * C0[4];
+			h0Acc += h0;
+
+			h1 += input;
+			// Scramble 1:
+			h1 = WordSwap(h1) * C1[1] + h1 * C1[0];
+			h1 = (h1 >> 16) * C1[2] + h1 * C1[3];
+			h1 = WordSwap(h1) * C1[4] + h1;
+			h1Acc += h1;
+		}
+	}
+
+	DWORD hash[2] = { h0 ^ h1, h0Acc ^ h1Acc };
+
+	return CryptBinaryToStringW(
+		(LPCBYTE)hash,
+		sizeof(hash),
+		CRYPT_STRING_BASE64 | CRYPT_STRING_NOCRLF,
+		pszOut,
+		&cchOut
+	);
+}
+#endif
+
+static bool TestMD5()
+{
+	// From RFC 1321, appendix A.5.
+	struct
+	{
+		const char *pszInput;
+		DWORD       rgdwExpected[4];
+	} const c_rgMd5Vectors[] = {
+		{ "",    { 0xD98C1DD4uL, 0x04B2008FuL, 0x980980E9uL, 0x7E42F8ECuL } },
+		{ "abc", { 0x98500190uL, 0xB04FD23CuL, 0x7D3F96D6uL, 0x727FE128uL } },
+		{ "12345678901234567890123456789012345678901234567890123456789012345678901234567890",
+		         { 0xA2F4ED57uL, 0x55C9E32BuL, 0x2EDA49ACuL, 0x7AB60721uL } },
+	};
+
+	bool fPassed = true;
+	for (const auto &vector : c_rgMd5Vectors)
+	{
+		DWORD rgdwDigest[4];
+
+		// Feed it in uneven pieces so that the buffering gets exercised too.
+		CUserChoiceMD5 md5;
+		size_t cbInput = strlen(vector.pszInput);
+		for (size_t i = 0; i < cbInput; i += 7)
+		{
+			size_t cbPiece = (cbInput - i < 7) ? cbInput - i : 7;
+			md5.Update((const BYTE *)vector.pszInput + i, cbPiece);
+		}
+		md5.Final(rgdwDigest);
+
+		if (memcmp(rgdwDigest, vector.rgdwExpected, sizeof(rgdwDigest)) != 0)
+		{
+			printf("MD5 mismatch for \"%s\"\n", vector.pszInput);
+			fPassed = false;
+		}
+	}
+
+	return fPassed;
+}
+
+bool TestUserChoiceHashKnownAnswers()
+{
+	bool fPassed = TestMD5();
+
+	for (const USERCHOICEHASH_VECTOR &vector : c_rgVectors)
+	{
+		WCHAR szInput[512];
+		size_t cchInput = BuildInput(&vector, szInput, sizeof(szInput) / sizeof(szInput[0]));
+
+		WCHAR szHash[USERCHOICE_HASH_CCH + 1];
+		if (!UserChoiceHashBytes((LPCBYTE)szInput, (cchInput + 1) * sizeof(WCHAR), szHash) ||
+			!StrEqual(szHash, vector.lpszExpected))
+		{
+			printf("Hash mismatch for ");
+			PrintString(vector.lpszExtension);
+			printf("\n");
+			fPassed = false;
+			continue;
+		}
+
+#ifdef _WIN32
+		WCHAR szLegacyHash[USERCHOICE_HASH_CCH + 1];
+		if (!LegacyHashString(szInput, szLegacyHash, ARRAYSIZE(szLegacyHash)) ||
+			!StrEqual(szHash, szLegacyHash))
+		{
+			printf("Legacy hash mismatch for ");
+			PrintString(vector.lpszExtension);
+			printf("\n");
+			fPassed = false;
+		}
+#endif
+	}
+
+	// Anything shorter than one 8 byte block can't be hashed; "ab" plus its
+	// terminator is only 6 bytes.
+	WCHAR szHash[USERCHOICE_HASH_CCH + 1];
+	if (UserChoiceHashBytes((LPCBYTE)WTEXT("ab"), 3 * sizeof(WCHAR), szHash))
+	{
+		printf("Hashed an input shorter than one block\n");
+		fPassed = false;
+	}
+
+	return fPassed;
+}
+
+bool TestUserChoiceHashBatch()
+{
+	bool fPassed = true;
+
+	// The prepared context has to format exactly what Windows does, and hash
+	// to the same known answers.
+	for (const USERCHOICEHASH_VECTOR &vector : c_rgVectors)
+	{
+		WCHAR szExpectedInput[512];
+		BuildInput(&vector, szExpectedInput, ARRAYSIZE(szExpectedInput));
+
+		CUserChoiceHashContext context;
+		WCHAR szInput[USERCHOICE_INPUT_CCH_MAX];
+		WCHAR szHash[USERCHOICE_HASH_CCH + 1];
+		USERCHOICE_PAIR pair = { vector.lpszExtension, vector.lpszProgId };
+
+		// Seconds have to be ignored, so add some.
+		if (!context.Init(c_szTestSid, vector.ullTimestamp + 42 * 10000000uLL) ||
+			!context.Format(vector.lpszExtension, vector.lpszProgId, szInput, ARRAYSIZE(szInput)) ||
+			!StrEqual(szInput, szExpectedInput) ||
+			UserChoiceHashBatch(&context, &pair, 1, szHash) != 1 ||
+			!StrEqual(szHash, vector.lpszExpected))
+		{
+			printf("Batch mismatch for ");
+			PrintString(vector.lpszExtension);
+			printf("\n");
+			fPassed = false;
+		}
+	}
+
+	// A batch big enough to be split between threads has to give the same
+	// results as hashing one at a time.
+	constexpr size_t BATCH_SIZE = 5000;
+	std::vector<WCHAR> names(BATCH_SIZE * 2 * 16);
+	std::vector<USERCHOICE_PAIR> pairs(BATCH_SIZE);
+	for (size_t i = 0; i < BATCH_SIZE; i++)
+	{
+		WCHAR *pszExtension = &names[i * 32];
+		WCHAR *pszProgId = &names[i * 32 + 16];
+		char szExtension[16];
+		char szProgId[16];
+		snprintf(szExtension, sizeof(szExtension), ".Ext%u", (unsigned)i);
+		snprintf(szProgId, sizeof(szProgId), "Prog.Id%u", (unsigned)i);
+		for (size_t j = 0; j < sizeof(szExtension); j++)
+			pszExtension[j] = szExtension[j];
+		for (size_t j = 0; j < sizeof(szProgId); j++)
+			pszProgId[j] = szProgId[j];
+		pairs[i] = { pszExtension, pszProgId };
+	}
+
+	CUserChoiceHashContext context;
+	context.Init(c_szTestSid, c_rgVectors[0].ullTimestamp);
+
+	std::vector<WCHAR> hashes(BATCH_SIZE * (USERCHOICE_HASH_CCH + 1));
+	if (UserChoiceHashBatch(&context, pairs.data(), BATCH_SIZE, hashes.data()) != BATCH_SIZE)
+	{
+		printf("Batch didn't hash every pair\n");
+		return false;
+	}
+
+	for (size_t i = 0; i < BATCH_SIZE; i++)
+	{
+		WCHAR szHash[USERCHOICE_HASH_CCH + 1];
+		if (!context.Hash(pairs[i].lpszExtension, pairs[i].lpszProgId, szHash) ||
+			!StrEqual(szHash, &hashes[i * (USERCHOICE_HASH_CCH + 1)]))
+		{
+			printf("Batch mismatch at index %zu\n", i);
+			fPassed = false;
+			break;
+		}
+	}
+
+	return fPassed;
+}
+
+bool TestUserChoiceHashLanes()
+{
+	bool fPassed = true;
+
+	// Inputs of every length from nothing up to a few MD5 blocks, so that
+	// lanes finish at different times and the padding lands everywhere. Real
+	// input is always whole WCHARs, but the engines don't care.
+	constexpr size_t INPUT_COUNT = 301;
+	std::vector<BYTE> data(INPUT_COUNT);
+	std::vector<const BYTE *> inputs(INPUT_COUNT);
+	std::vector<size_t> sizes(INPUT_COUNT);
+
+	DWORD dwSeed = 0x12345678uL;
+	for (size_t i = 0; i < INPUT_COUNT; i++)
+	{
+		dwSeed = dwSeed * 1103515245uL + 12345;
+		data[i] = (BYTE)(dwSeed >> 16);
+	}
+	for (size_t i = 0; i < INPUT_COUNT; i++)
+	{
+		inputs[i] = data.data();
+		sizes[i] = i;
+	}
+
+	// Known answers have to come out of every engine too.
+	WCHAR rgszKnown[ARRAYSIZE(c_rgVectors)][512];
+	for (size_t i = 0; i < ARRAYSIZE(c_rgVectors); i++)
+	{
+		size_t cchInput = BuildInput(&c_rgVectors[i], rgszKnown[i], ARRAYSIZE(rgszKnown[i]));
+		inputs.push_back((const BYTE *)rgszKnown[i]);
+		sizes.push_back((cchInput + 1) * sizeof(WCHAR));
+	}
+
+	size_t cInputs = inputs.size();
+	std::vector<WCHAR> expected(cInputs * (USERCHOICE_HASH_CCH + 1));
+	size_t cExpected = 0;
+	for (size_t i = 0; i < cInputs; i++)
+	{
+		WCHAR *pszHash = &expected[i * (USERCHOICE_HASH_CCH + 1)];
+		if (UserChoiceHashBytes(inputs[i], sizes[i], pszHash))
+			cExpected++;
+		else
+			pszHash[0] = '\0';
+	}
+
+	for (size_t i = 0; i < ARRAYSIZE(c_rgVectors); i++)
+	{
+		if (!StrEqual(&expected[(INPUT_COUNT + i) * (USERCHOICE_HASH_CCH + 1)], c_rgVectors[i].lpszExpected))
+		{
+			printf("Scalar hash mismatch for ");
+			PrintString(c_rgVectors[i].lpszExtension);
+			printf("\n");
+			return false;
+		}
+	}
+
+	const size_t c_rgcLanes[] = { 1, 4, 8, 16 };
+	for (size_t cLanes : c_rgcLanes)
+	{
+		if (cLanes > UserChoiceGetMaxLanes())
+		{
+			printf("Skipping %u lanes, not supported by this CPU\n", (unsigned)cLanes);
+			continue;
+		}
+
+		std::vector<WCHAR> hashes(cInputs * (USERCHOICE_HASH_CCH + 1), 'x');
+		if (UserChoiceHashLanes(cLanes, inputs.data(), sizes.data(), cInputs, hashes.data()) != cExpected)
+		{
+			printf("%u lanes hashed the wrong number of inputs\n", (unsigned)cLanes);
+			fPassed = false;
+			continue;
+		}
+
+		for (size_t i = 0; i < cInputs; i++)
+		{
+			if (!StrEqual(&hashes[i * (USERCHOICE_HASH_CCH + 1)], &expected[i * (USERCHOICE_HASH_CCH + 1)]))
+			{
+				printf("%u lanes mismatch at index %u\n", (unsigned)cLanes, (unsigned)i);
+				fPassed = false;
+				break;
+			}
+		}
+	}
+
+	return fPassed;
+}
+
+bool TestUserChoiceHashStream()
+{
+	bool fPassed = true;
+
+	for (const USERCHOICEHASH_VECTOR &vector : c_rgVectors)
+	{
+		WCHAR szHash[USERCHOICE_HASH_CCH + 1];
+		CUserChoiceHashStream stream;
+		stream.Append(vector.lpszExtension);
+		stream.Append(c_szTestSid);
+		stream.Append(vector.lpszProgId);
+		stream.AppendHex64(vector.ullTimestamp);
+		stream.Append(g_szConstantUserExperience);
+
+		if (!stream.Finish(szHash) || !StrEqual(szHash, vector.lpszExpected))
+		{
+			printf("Stream mismatch for ");
+			PrintString(vector.lpszExtension);
+			printf("\n");
+			fPassed = false;
+		}
+	}
+
+	// However the input is split up, the hash has to be the same as hashing
+	// it in one go. Appending one character at a time crosses every block
+	// boundary mid-append.
+	WCHAR szInput[300];
+	for (size_t i = 0; i < ARRAYSIZE(szInput); i++)
+		szInput[i] = (WCHAR)('a' + i % 26);
+
+	for (size_t cch = 3; cch < ARRAYSIZE(szInput); cch += 7)
+	{
+		WCHAR szExpected[USERCHOICE_HASH_CCH + 1];
+		WCHAR szSaved = szInput[cch];
+		szInput[cch] = '\0';
+		UserChoiceHashBytes((LPCBYTE)szInput, (cch + 1) * sizeof(WCHAR), szExpected);
+
+		CUserChoiceHashStream stream;
+		for (size_t i = 0; i < cch; i++)
+			stream.AppendLowerCase(&szInput[i], 1);
+
+		WCHAR szHash[USERCHOICE_HASH_CCH + 1];
+		if (!stream.Finish(szHash) || !StrEqual(szHash, szExpected))
+		{
+			printf("Stream mismatch for %u characters\n", (unsigned)cch);
+			fPassed = false;
+		}
+
+		szInput[cch] = szSaved;
+	}
+
+	// Too short to hash, and too long to fit:
+	WCHAR szHash[USERCHOICE_HASH_CCH + 1];
+	CUserChoiceHashStream stream;
+	stream.Append(WTEXT("ab"));
+	if (stream.Finish(szHash))
+	{
+		printf("Streamed an input shorter than one block\n");
+		fPassed = false;
+	}
+
+	stream.Reset();
+	for (size_t i = 0; i < USERCHOICE_INPUT_CCH_MAX / 16; i++)
+		stream.AppendHex64(i);
+	if (stream.Finish(szHash))
+	{
+		printf("Streamed an input with no room for the terminator\n");
+		fPassed = false;
+	}
+
+	return fPassed;
+}
\ No newline at end of file
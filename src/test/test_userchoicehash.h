@@ -0,0 +1,32 @@
+#pragma once
+
+#include "../wincompat.h"
+
+/**
+ * Known-answer tests for the portable UserChoice hash kernel.
+ *
+ * The expected values were generated by an independent implementation of the
+ * algorithm. On Windows, each vector is additionally checked against the old
+ * CNG/CryptoAPI implementation which the kernel replaced.
+ *
+ * @return true if every vector matched, false otherwise.
+ */
+bool TestUserChoiceHashKnownAnswers();
+
+/**
+ * Checks that batch hashing matches the known answers and that splitting a
+ * batch between threads doesn't change the results.
+ */
+bool TestUserChoiceHashBatch();
+
+/**
+ * Differential test of every multi-buffer engine the CPU supports against
+ * the scalar kernel.
+ */
+bool TestUserChoiceHashLanes();
+
+/**
+ * Checks that streaming the input in pieces gives the known answers, and the
+ * same results as hashing the formatted string.
+ */
+bool TestUserChoiceHashStream();
\ No newline at end of file
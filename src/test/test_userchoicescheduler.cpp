@@ -0,0 +1,188 @@
+#include "test_userchoicescheduler.h"
+
+#include "../userchoicescheduler.h"
+#include "fakeclock.h"
+#include "testutil.h"
+
+#include <stdio.h>
+
+#include <vector>
+
+static const ULONGLONG c_ullMinute = c_ullTestMinute;
+
+static const ULONGLONG c_ullSecond = 1000 * USERCHOICE_FILETIME_PER_MS;
+
+/**
+ * Each write takes the next latency from a script.
+ */
+class CFakeWriter : public IUserChoiceWriter
+{
+public:
+	CFakeClock            *_pClock;
+	std::vector<ULONGLONG> _latencies;
+	size_t                 _iWrite;
+	bool                   _fFailWrites;
+
+	// Hash time of every Prepare call, and the times writes started.
+	std::vector<ULONGLONG> _hashTimes;
+	std::vector<ULONGLONG> _writeTimes;
+
+	CFakeWriter(CFakeClock *pClock, std::vector<ULONGLONG> latencies)
+		: _pClock(pClock)
+		, _latencies(latencies)
+		, _iWrite(0)
+		, _fFailWrites(false)
+	{
+	}
+
+	bool Prepare(ULONGLONG ullHashTime) override
+	{
+		_hashTimes.push_back(ullHashTime);
+		return true;
+	}
+
+	bool Write() override
+	{
+		_writeTimes.push_back(_pClock->_ullNow);
+		ULONGLONG ullLatency = _latencies[_iWrite < _latencies.size() ? _iWrite : _latencies.size() - 1];
+		_iWrite++;
+		_pClock->_ullNow += ullLatency;
+		return !_fFailWrites;
+	}
+};
+
+static ULONGLONG MinuteOf(ULONGLONG ullTime)
+{
+	return ullTime - ullTime % USERCHOICE_FILETIME_PER_MINUTE;
+}
+
+static bool TestWriteNow()
+{
+	CFakeClock clock(c_ullMinute + 10 * c_ullSecond);
+	CUserChoiceWriteScheduler scheduler(&clock);
+	CFakeWriter writer(&clock, { 200 * USERCHOICE_FILETIME_PER_MS });
+
+	USERCHOICE_WRITE_REPORT report;
+	EXPECT(scheduler.Write(&writer, &report));
+	EXPECT(report.decision == UserChoiceWriteDecision::WRITE_NOW);
+	EXPECT(report.cAttempts == 1);
+	EXPECT(report.ullWaited == 0);
+	EXPECT(report.ullBudget == CUserChoiceWriteScheduler::DEFAULT_BUDGET);
+	EXPECT(report.ullLatency == 200 * USERCHOICE_FILETIME_PER_MS);
+	EXPECT(writer._hashTimes.size() == 1 && writer._hashTimes[0] == c_ullMinute + 10 * c_ullSecond);
+	return true;
+}
+
+static bool TestWaitForNextMinute()
+{
+	// Half a second left, and the default budget is a whole second:
+	CFakeClock clock(c_ullMinute + 59500 * USERCHOICE_FILETIME_PER_MS);
+	CUserChoiceWriteScheduler scheduler(&clock);
+	CFakeWriter writer(&clock, { 200 * USERCHOICE_FILETIME_PER_MS });
+
+	USERCHOICE_WRITE_REPORT report;
+	EXPECT(scheduler.Write(&writer, &report));
+	EXPECT(report.decision == UserChoiceWriteDecision::WAIT_FOR_NEXT_MINUTE);
+	EXPECT(report.cAttempts == 1);
+	EXPECT(report.ullWaited == 500 * USERCHOICE_FILETIME_PER_MS);
+	EXPECT(clock._ullSlept == report.ullWaited);
+
+	// The hash is for the next minute and was made before waiting, so the
+	// write starts right on the boundary.
+	ULONGLONG ullNextMinute = c_ullMinute + USERCHOICE_FILETIME_PER_MINUTE;
+	EXPECT(writer._hashTimes.size() == 1 && writer._hashTimes[0] == ullNextMinute);
+	EXPECT(writer._writeTimes.size() == 1 && writer._writeTimes[0] == ullNextMinute);
+	return true;
+}
+
+static bool TestOverrunIsRedone()
+{
+	// Plenty of time by the default budget, but the first write takes five
+	// seconds and runs into the next minute.
+	CFakeClock clock(c_ullMinute + 57 * c_ullSecond);
+	CUserChoiceWriteScheduler scheduler(&clock);
+	CFakeWriter writer(&clock, { 5 * c_ullSecond, 5 * c_ullSecond });
+
+	USERCHOICE_WRITE_REPORT report;
+	EXPECT(scheduler.Write(&writer, &report));
+	EXPECT(report.cAttempts == 2);
+
+	// 2 seconds into the next minute with a 6.25 second budget still fits.
+	EXPECT(report.decision == UserChoiceWriteDecision::WRITE_NOW);
+	EXPECT(report.ullBudget == 5 * c_ullSecond + 5 * c_ullSecond / 4);
+	EXPECT(MinuteOf(writer._hashTimes[1]) == MinuteOf(clock._ullNow));
+
+	// The next write has learnt, and waits rather than trying at 55 seconds.
+	clock._ullNow = MinuteOf(clock._ullNow) + 55 * c_ullSecond;
+	CFakeWriter writer2(&clock, { 5 * c_ullSecond });
+	EXPECT(scheduler.Write(&writer2, &report));
+	EXPECT(report.decision == UserChoiceWriteDecision::WAIT_FOR_NEXT_MINUTE);
+	EXPECT(report.cAttempts == 1);
+	return true;
+}
+
+static bool TestFailures()
+{
+	CFakeClock clock(c_ullMinute);
+	CUserChoiceWriteScheduler scheduler(&clock);
+	USERCHOICE_WRITE_REPORT report;
+
+	// A failed write isn't retried.
+	CFakeWriter failing(&clock, { c_ullSecond });
+	failing._fFailWrites = true;
+	EXPECT(!scheduler.Write(&failing, &report));
+	EXPECT(report.cAttempts == 1);
+
+	// Nor is one which can never fit in a minute, which would otherwise go on
+	// forever.
+	CFakeWriter slow(&clock, { 61 * c_ullSecond });
+	EXPECT(!scheduler.Write(&slow, &report));
+	EXPECT(report.cAttempts == 1);
+	return true;
+}
+
+static bool TestBudget()
+{
+	CFakeClock clock(c_ullMinute);
+	CUserChoiceWriteScheduler scheduler(&clock);
+
+	// Fast writes are never planned for less than the minimum.
+	scheduler.RecordLatency(USERCHOICE_FILETIME_PER_MS);
+	EXPECT(scheduler.GetBudget() == CUserChoiceWriteScheduler::MIN_BUDGET);
+
+	// 31 writes of 200 ms and one outlier of 3 seconds. The 95th percentile
+	// of 32 samples is the 31st, so the outlier is ignored...
+	scheduler.RecordLatency(3 * c_ullSecond);
+	for (int i = 0; i < 30; i++)
+		scheduler.RecordLatency(200 * USERCHOICE_FILETIME_PER_MS);
+	EXPECT(scheduler.GetBudget() == 250 * USERCHOICE_FILETIME_PER_MS);
+
+	// ...but not once there are two.
+	scheduler.RecordLatency(3 * c_ullSecond);
+	EXPECT(scheduler.GetBudget() == 3 * c_ullSecond + 3 * c_ullSecond / 4);
+
+	// Old samples age out.
+	for (int i = 0; i < 32; i++)
+		scheduler.RecordLatency(400 * USERCHOICE_FILETIME_PER_MS);
+	EXPECT(scheduler.GetBudget() == 500 * USERCHOICE_FILETIME_PER_MS);
+
+	// Right on the edge: exactly the budget left isn't enough.
+	ULONGLONG ullHashTime;
+	ULONGLONG ullBudget = 500 * USERCHOICE_FILETIME_PER_MS;
+	EXPECT(CUserChoiceWriteScheduler::s_Decide(c_ullMinute + 59500 * USERCHOICE_FILETIME_PER_MS, ullBudget, &ullHashTime) ==
+		UserChoiceWriteDecision::WAIT_FOR_NEXT_MINUTE);
+	EXPECT(CUserChoiceWriteScheduler::s_Decide(c_ullMinute + 59499 * USERCHOICE_FILETIME_PER_MS, ullBudget, &ullHashTime) ==
+		UserChoiceWriteDecision::WRITE_NOW);
+	return true;
+}
+
+bool TestUserChoiceWriteScheduler()
+{
+	bool fPassed = true;
+	fPassed &= TestWriteNow();
+	fPassed &= TestWaitForNextMinute();
+	fPassed &= TestOverrunIsRedone();
+	fPassed &= TestFailures();
+	fPassed &= TestBudget();
+	return fPassed;
+}
\ No newline at end of file
@@ -0,0 +1,10 @@
+#pragma once
+
+/**
+ * Tests for CUserChoiceWriteScheduler, driven by a fake clock.
+ *
+ * Covers writing straight away, waiting for the next minute, redoing a write
+ * that ran over the boundary, and how the write budget follows the latency
+ * history.
+ */
+bool TestUserChoiceWriteScheduler();
\ No newline at end of file
@@ -0,0 +1,119 @@
+/**
+ * Console runner for the portable tests.
+ *
+ * This has its own entry point, so it isn't part of OpenWithEx.vcxproj. The
+ * tests only depend on the portable parts of the tree, so the runner can be
+ * built anywhere, e.g.:
+ *
+ *     g++ -std=c++14 -O2 -pthread -o owxtest src/userchoicehash.cpp \
+ *         src/userchoicehash_sse2.cpp src/userchoicehash_avx2.cpp \
+ *         src/userchoicehash_avx512.cpp src/userchoicescheduler.cpp \
+ *         src/memoryregistry.cpp src/assocregistry.cpp \
+ *         src/assocprofile.cpp src/assocnotify.cpp src/protectedacl.cpp \
+ *         src/associdentity.cpp src/assoclookup.cpp \
+ *         src/assochandlerstream.cpp src/assochandlertable.cpp \
+ *         src/associconresolver.cpp src/assochandlercache.cpp \
+ *         src/launcherlifetime.cpp src/launcherdispatcher.cpp \
+ *         src/tracespan.cpp src/ringlog.cpp src/assoccli.cpp \
+ *         src/test/test_userchoicehash.cpp \
+ *         src/test/test_userchoicescheduler.cpp \
+ *         src/test/test_assocregistry.cpp \
+ *         src/test/test_assocprofile.cpp \
+ *         src/test/test_assocnotify.cpp \
+ *         src/test/test_protectedacl.cpp \
+ *         src/test/test_associdentity.cpp \
+ *         src/test/test_assoclookup.cpp \
+ *         src/test/test_assochandlerstream.cpp \
+ *         src/test/test_assochandlertable.cpp \
+ *         src/test/test_associconresolver.cpp \
+ *         src/test/test_assochandlercache.cpp \
+ *         src/test/test_launcherlifetime.cpp \
+ *         src/test/test_launcherdispatcher.cpp \
+ *         src/test/test_tracespan.cpp \
+ *         src/test/test_ringlog.cpp \
+ *         src/test/test_assoccli.cpp \
+ *         src/test/bench_userchoice.cpp src/test/testmain.cpp
+ *
+ * Pass --bench to run the benchmarks instead of the tests.
+ */
+
+#include "test_userchoicehash.h"
+#include "test_userchoicescheduler.h"
+#include "test_assocregistry.h"
+#include "test_assocprofile.h"
+#include "test_assocnotify.h"
+#include "test_protectedacl.h"
+#include "test_associdentity.h"
+#include "test_assoclookup.h"
+#include "test_assochandlerstream.h"
+#include "test_assochandlertable.h"
+#include "test_associconresolver.h"
+#include "test_assochandlercache.h"
+#include "test_launcherlifetime.h"
+#include "test_launcherdispatcher.h"
+#include "test_tracespan.h"
+#include "test_ringlog.h"
+#include "test_assoccli.h"
+#include "bench_userchoice.h"
+
+#include <stdio.h>
+#include <string.h>
+
+struct TESTCASE
+{
+	const char *pszName;
+	bool (*pfnTest)();
+};
+
+static const TESTCASE c_rgTests[] = {
+	{ "UserChoiceHashKnownAnswers", TestUserChoiceHashKnownAnswers },
+	{ "UserChoiceHashBatch",        TestUserChoiceHashBatch },
+	{ "UserChoiceHashLanes",        TestUserChoiceHashLanes },
+	{ "UserChoiceHashStream",       TestUserChoiceHashStream },
+	{ "UserChoiceWriteScheduler",   TestUserChoiceWriteScheduler },
+	{ "MemoryRegistry",             TestMemoryRegistry },
+	{ "AssocRegistry",              TestAssocRegistry },
+	{ "AssocProfile",               TestAssocProfile },
+	{ "AssocChangeNotifier",        TestAssocChangeNotifier },
+	{ "ProtectedAcl",               TestProtectedAcl },
+	{ "AssocIdentity",              TestAssocIdentity },
+	{ "AssocLookup",                TestAssocLookup },
+	{ "AssocHandlerStream",         TestAssocHandlerStream },
+	{ "AssocHandlerTable",          TestAssocHandlerTable },
+	{ "AssocIconResolver",          TestAssocIconResolver },
+	{ "AssocHandlerCache",          TestAssocHandlerCache },
+	{ "LauncherLifetime",           TestLauncherLifetime },
+	{ "LauncherDispatcher",         TestLauncherDispatcher },
+	{ "TraceSpan",                  TestTraceSpan },
+	{ "RingLog",                    TestRingLog },
+	{ "AssocCli",                   TestAssocCli },
+};
+
+int main(int argc, char **argv)
+{
+	// Benchmarks are only run on request since they take a while.
+	if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+	{
+		BenchUserChoiceHash();
+		BenchUserChoiceHashStream();
+		BenchUserChoiceWrite();
+		BenchAssocProfile();
+		BenchProtectedAcl();
+		BenchAssocHandlerStream();
+		BenchAssocHandlerTable();
+		return 0;
+	}
+
+	int cFailed = 0;
+
+	for (const TESTCASE &test : c_rgTests)
+	{
+		bool fPassed = test.pfnTest();
+		printf("[%s] %s\n", fPassed ? "PASS" : "FAIL", test.pszName);
+
+		if (!fPassed)
+			cFailed++;
+	}
+
+	return cFailed ? 1 : 0;
+}
\ No newline at end of file
@@ -0,0 +1,27 @@
+#pragma once
+
+/**
+ * What every portable test uses.
+ */
+
+#include "../wincompat.h"
+
+#include <stdio.h>
+
+#include <string>
+
+// Fails the test, saying where, unless f holds.
+#define EXPECT(f) \
+	if (!(f)) \
+	{ \
+		printf("%s:%d: expected %s\n", __FILE__, __LINE__, #f); \
+		return false; \
+	}
+
+// An ordinary user's SID, which associations are set for.
+static LPCWSTR const c_szTestSid = WTEXT("S-1-5-21-1004336348-1177238915-682003330-1001");
+
+inline bool StringEquals(LPCWSTR psz1, LPCWSTR psz2)
+{
+	return std::basic_string<WCHAR>(psz1) == psz2;
+}
\ No newline at end of file
@@ -0,0 +1,124 @@
+/**
+ * Runs the per-operation benchmarks from test/bench_suite.h.
+ *
+ * This has its own entry point, so it isn't part of OpenWithEx.vcxproj, and
+ * it has to be its own program to count allocations, which it does by
+ * replacing operator new. It only depends on the portable parts of the tree,
+ * so it can be built anywhere, e.g.:
+ *
+ *     g++ -std=c++14 -O2 -pthread -o owxbench src/userchoicehash.cpp \
+ *         src/userchoicehash_sse2.cpp src/userchoicehash_avx2.cpp \
+ *         src/userchoicehash_avx512.cpp src/userchoicescheduler.cpp \
+ *         src/memoryregistry.cpp src/assocregistry.cpp \
+ *         src/assocprofile.cpp src/protectedacl.cpp src/associdentity.cpp \
+ *         src/assochandlertable.cpp src/tracespan.cpp src/ringlog.cpp \
+ *         src/test/bench_suite.cpp src/tools/owxbench.cpp
+ *
+ * Usage: owxbench [--json] [--min-time <ms>] [<filter>]
+ *
+ * --json writes the results as JSON, which can be kept and diffed against a
+ * later release's. Operations which are meant not to allocate fail the run
+ * if they do. Only operations whose names contain the filter, e.g.
+ * "write/", are run. Each is run for at least 100 ms unless told otherwise.
+ */
+
+#include "../test/bench_suite.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <new>
+
+static std::atomic<ULONGLONG> s_cAllocs(0);
+
+void *operator new(size_t cb)
+{
+	s_cAllocs.fetch_add(1, std::memory_order_relaxed);
+
+	void *pv = malloc(cb ? cb : 1);
+	if (!pv)
+	{
+		throw std::bad_alloc();
+	}
+	return pv;
+}
+
+void *operator new(size_t cb, const std::nothrow_t &) noexcept
+{
+	s_cAllocs.fetch_add(1, std::memory_order_relaxed);
+	return malloc(cb ? cb : 1);
+}
+
+void operator delete(void *pv) noexcept
+{
+	free(pv);
+}
+
+void operator delete(void *pv, size_t) noexcept
+{
+	free(pv);
+}
+
+void operator delete(void *pv, const std::nothrow_t &) noexcept
+{
+	free(pv);
+}
+
+class CGlobalAllocCounter : public IBenchAllocCounter
+{
+public:
+	ULONGLONG GetAllocCount() override
+	{
+		return s_cAllocs.load(std::memory_order_relaxed);
+	}
+};
+
+int main(int argc, char **argv)
+{
+	bool fJson = false;
+	unsigned long ulMinMs = 100;
+	const char *pszFilter = nullptr;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--json") == 0)
+		{
+			fJson = true;
+		}
+		else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc)
+		{
+			ulMinMs = strtoul(argv[++i], nullptr, 10);
+		}
+		else if (argv[i][0] != '-' && !pszFilter)
+		{
+			pszFilter = argv[i];
+		}
+		else
+		{
+			fprintf(stderr, "Usage: %s [--json] [--min-time <ms>] [<filter>]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	CGlobalAllocCounter counter;
+	CBenchRunner runner(&counter, (ULONGLONG)ulMinMs * 1000000, pszFilter);
+	BenchSuiteRun(&runner);
+
+	std::string strOutput = fJson ? runner.FormatJson() : runner.FormatTable();
+	fputs(strOutput.c_str(), stdout);
+
+	int cOverBudget = 0;
+	for (const BENCH_RESULT &result : runner.GetResults())
+	{
+		if (result.IsOverBudget())
+		{
+			fprintf(stderr, "%s: %.2f allocations/op, over its budget of %.2f\n",
+				result.strName.c_str(), result.dAllocsPerOp, result.dMaxAllocsPerOp);
+			cOverBudget++;
+		}
+	}
+
+	return (runner.GetResults().empty() || cOverBudget) ? 1 : 0;
+}
\ No newline at end of file
@@ -0,0 +1,84 @@
+/**
+ * Turns dumps of OpenWithEx's ring log into text.
+ *
+ * Dumps are written to %LOCALAPPDATA%\OpenWithEx\Logs when OpenWithEx
+ * crashes, or when its Local\OpenWithEx-DumpLog-<pid> event is set. This has
+ * its own entry point, so it isn't part of OpenWithEx.vcxproj; it only
+ * depends on the portable log, so it can be built anywhere, e.g.:
+ *
+ *     g++ -std=c++14 -O2 -pthread -o owxlogdump src/ringlog.cpp \
+ *         src/tools/owxlogdump.cpp
+ *
+ * Usage: owxlogdump <dump>...
+ *
+ * Each dump is written to standard output, one record on each line, oldest
+ * first.
+ */
+
+#include "../ringlog.h"
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+static bool ReadDump(const char *pszPath, std::vector<BYTE> *pData)
+{
+	FILE *pFile = fopen(pszPath, "rb");
+	if (!pFile)
+	{
+		return false;
+	}
+
+	BYTE rgb[4096];
+	size_t cb;
+	while ((cb = fread(rgb, 1, sizeof(rgb), pFile)) > 0)
+	{
+		pData->insert(pData->end(), rgb, rgb + cb);
+	}
+
+	bool fOk = !ferror(pFile);
+	fclose(pFile);
+	return fOk;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <dump>...\n", argv[0]);
+		return 2;
+	}
+
+	int cFailed = 0;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::vector<BYTE> data;
+		if (!ReadDump(argv[i], &data))
+		{
+			fprintf(stderr, "%s: can't read it\n", argv[i]);
+			cFailed++;
+			continue;
+		}
+
+		// Damaged dumps, e.g. ones cut short by a crash, are still decoded
+		// as far as they go.
+		std::string strText;
+		bool fOk = RingLogDecode(data.data(), data.size(), &strText);
+
+		if (argc > 2)
+		{
+			printf("==> %s <==\n", argv[i]);
+		}
+		fputs(strText.c_str(), stdout);
+
+		if (!fOk)
+		{
+			fprintf(stderr, "%s: isn't a dump, or is damaged\n", argv[i]);
+			cFailed++;
+		}
+	}
+
+	return cFailed ? 1 : 0;
+}
\ No newline at end of file
@@ -0,0 +1,265 @@
+#include "tracespan.h"
+
+#include <algorithm>
+#include <atomic>
+
+// The clock is set before the sink, and only read once the sink has been.
+static std::atomic<ITraceSink *> s_pSink(nullptr);
+static IUserChoiceClock         *s_pClock = nullptr;
+
+static std::atomic<ULONGLONG>    s_ullNextId(1);
+
+// The spans running on this thread, innermost last. An activity kept in a
+// member can outlive ones started after it, so they don't always stop in
+// order.
+static thread_local std::vector<ULONGLONG> t_runningIds;
+
+const char *TracePhaseName(TRACE_PHASE phase)
+{
+	static const char *const c_rgszNames[] = {
+		"ProcessStart",
+		"Activation",
+		"GetHandlers",
+		"ResolveIcon",
+		"FirstPaint",
+		"Hash",
+		"WriteUserChoice",
+		"AclUnlock",
+		"AclLock",
+		"Invoke",
+	};
+	static_assert(ARRAYSIZE(c_rgszNames) == TRACE_PHASE_COUNT, "Every phase needs a name");
+
+	return ((unsigned)phase < TRACE_PHASE_COUNT) ? c_rgszNames[phase] : "Unknown";
+}
+
+void TraceSetSink(ITraceSink *pSink, IUserChoiceClock *pClock)
+{
+	if (pSink)
+	{
+		s_pClock = pClock;
+	}
+
+	s_pSink.store(pSink, std::memory_order_release);
+}
+
+#pragma region CTraceActivity
+CTraceActivity::CTraceActivity(TRACE_PHASE phase, LPCWSTR lpszSubject)
+{
+	_Begin(phase, lpszSubject, 0, true);
+}
+
+CTraceActivity::CTraceActivity(TRACE_PHASE phase, LPCWSTR lpszSubject, ULONGLONG ullStart)
+{
+	_Begin(phase, lpszSubject, ullStart, false);
+}
+
+void CTraceActivity::_Begin(TRACE_PHASE phase, LPCWSTR lpszSubject, ULONGLONG ullStart, bool fNow)
+{
+	_pSink = s_pSink.load(std::memory_order_acquire);
+	if (_pSink && !_pSink->IsEnabled())
+	{
+		_pSink = nullptr;
+	}
+
+	if (!_pSink)
+	{
+		_pClock = nullptr;
+		return;
+	}
+
+	_pClock = s_pClock;
+
+	_span.phase = phase;
+	_span.ullId = s_ullNextId++;
+	_span.ullParentId = t_runningIds.empty() ? 0 : t_runningIds.back();
+	_span.ullStart = fNow ? _pClock->Now() : ullStart;
+	_span.ullDuration = 0;
+	if (lpszSubject)
+	{
+		_span.strSubject = lpszSubject;
+	}
+	_span.ullCount = 0;
+	_span.lResult = 0;
+
+	t_runningIds.push_back(_span.ullId);
+
+	_pSink->OnSpanBegin(_span);
+}
+
+CTraceActivity::~CTraceActivity()
+{
+	Stop();
+}
+
+void CTraceActivity::SetSubject(LPCWSTR lpszSubject)
+{
+	if (_pSink)
+	{
+		_span.strSubject = lpszSubject ? lpszSubject : WTEXT("");
+	}
+}
+
+void CTraceActivity::SetCount(ULONGLONG ullCount)
+{
+	if (_pSink)
+	{
+		_span.ullCount = ullCount;
+	}
+}
+
+void CTraceActivity::SetResult(LONG lResult)
+{
+	if (_pSink)
+	{
+		_span.lResult = lResult;
+	}
+}
+
+void CTraceActivity::Stop()
+{
+	if (!_pSink)
+	{
+		return;
+	}
+
+	ULONGLONG ullNow = _pClock->Now();
+	_span.ullDuration = (ullNow > _span.ullStart) ? ullNow - _span.ullStart : 0;
+
+	// Stopping on another thread than the one it started on leaves nothing
+	// to remove.
+	auto it = std::find(t_runningIds.rbegin(), t_runningIds.rend(), _span.ullId);
+	if (it != t_runningIds.rend())
+	{
+		t_runningIds.erase(std::next(it).base());
+	}
+
+	ITraceSink *pSink = _pSink;
+	_pSink = nullptr;
+	pSink->OnSpanEnd(_span);
+}
+#pragma endregion
+
+#pragma region CMemoryTraceSink
+CMemoryTraceSink::CMemoryTraceSink()
+	: _cBegun(0)
+{
+}
+
+void CMemoryTraceSink::OnSpanBegin(const TRACE_SPAN &span)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_cBegun++;
+}
+
+void CMemoryTraceSink::OnSpanEnd(const TRACE_SPAN &span)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_spans.push_back(span);
+}
+
+std::vector<TRACE_SPAN> CMemoryTraceSink::GetSpans()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _spans;
+}
+
+DWORD CMemoryTraceSink::GetBegunCount()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _cBegun;
+}
+
+void CMemoryTraceSink::Clear()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_spans.clear();
+	_cBegun = 0;
+}
+#pragma endregion
+
+#pragma region CFileTraceSink
+CFileTraceSink::CFileTraceSink(FILE *pFile)
+	: _pFile(pFile)
+{
+}
+
+// Appends UTF-16 as UTF-8. Unpaired surrogates become U+FFFD.
+static void AppendUtf8(std::string *pstr, const std::basic_string<WCHAR> &str)
+{
+	for (size_t i = 0; i < str.size(); i++)
+	{
+		DWORD ch = str[i];
+		if (ch >= 0xD800 && ch <= 0xDFFF)
+		{
+			if (ch <= 0xDBFF && i + 1 < str.size() && str[i + 1] >= 0xDC00 && str[i + 1] <= 0xDFFF)
+			{
+				ch = 0x10000 + ((ch - 0xD800) << 10) + (str[i + 1] - 0xDC00);
+				i++;
+			}
+			else
+			{
+				ch = 0xFFFD;
+			}
+		}
+
+		// Tabs and newlines would split the line.
+		if (ch == '\t' || ch == '\r' || ch == '\n')
+		{
+			ch = ' ';
+		}
+
+		if (ch < 0x80)
+		{
+			pstr->push_back((char)ch);
+		}
+		else if (ch < 0x800)
+		{
+			pstr->push_back((char)(0xC0 | (ch >> 6)));
+			pstr->push_back((char)(0x80 | (ch & 0x3F)));
+		}
+		else if (ch < 0x10000)
+		{
+			pstr->push_back((char)(0xE0 | (ch >> 12)));
+			pstr->push_back((char)(0x80 | ((ch >> 6) & 0x3F)));
+			pstr->push_back((char)(0x80 | (ch & 0x3F)));
+		}
+		else
+		{
+			pstr->push_back((char)(0xF0 | (ch >> 18)));
+			pstr->push_back((char)(0x80 | ((ch >> 12) & 0x3F)));
+			pstr->push_back((char)(0x80 | ((ch >> 6) & 0x3F)));
+			pstr->push_back((char)(0x80 | (ch & 0x3F)));
+		}
+	}
+}
+
+std::string CFileTraceSink::FormatSpan(const TRACE_SPAN &span)
+{
+	char szFields[160];
+	snprintf(
+		szFields,
+		sizeof(szFields),
+		"%s\t%llu\t%llu\t%llu\t%llu\t%llu\t%ld\t",
+		TracePhaseName(span.phase),
+		(unsigned long long)span.ullId,
+		(unsigned long long)span.ullParentId,
+		(unsigned long long)span.ullStart,
+		(unsigned long long)span.ullDuration,
+		(unsigned long long)span.ullCount,
+		(long)span.lResult
+	);
+
+	std::string strLine(szFields);
+	AppendUtf8(&strLine, span.strSubject);
+	return strLine;
+}
+
+void CFileTraceSink::OnSpanEnd(const TRACE_SPAN &span)
+{
+	std::string strLine = FormatSpan(span);
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	fprintf(_pFile, "%s\n", strLine.c_str());
+}
+#pragma endregion
\ No newline at end of file
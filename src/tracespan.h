@@ -0,0 +1,236 @@
+#pragma once
+
+/**
+ * Times the phases that an Open With goes through.
+ *
+ * Apart from the debug console, there was no way to see where the time
+ * between asking for Open With and the program opening went. Each phase is
+ * now wrapped in a CTraceActivity, which measures it and hands it to the
+ * trace sink as a span once it is over: what it was, how long it took, and a
+ * few key fields.
+ *
+ * On Windows, the sink writes each span as a TraceLogging activity, which
+ * costs nothing until a trace session listens for it. Tests and benchmarks
+ * collect the same spans with CMemoryTraceSink or CFileTraceSink instead.
+ *
+ * Spans nest: one started while another is running on the same thread is
+ * its child.
+ */
+
+#include "wincompat.h"
+#include "userchoicescheduler.h" // for IUserChoiceClock
+
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+enum TRACE_PHASE
+{
+	// From the process being created to it being ready for its first
+	// request.
+	TRACE_PROCESS_START,
+
+	// From COM handing an object out to its request being dispatched.
+	TRACE_ACTIVATION,
+
+	// Enumerating an extension or protocol's handlers.
+	TRACE_GET_HANDLERS,
+
+	// Looking a handler's icon up.
+	TRACE_RESOLVE_ICON,
+
+	// From the dialog being created to it first being painted.
+	TRACE_FIRST_PAINT,
+
+	// Generating UserChoice hashes.
+	TRACE_HASH,
+
+	// Writing a UserChoice key.
+	TRACE_WRITE_USERCHOICE,
+
+	// Taking the deny ACE off a UserChoice key, and putting it back.
+	TRACE_ACL_UNLOCK,
+	TRACE_ACL_LOCK,
+
+	// Opening the file or URL with the chosen handler.
+	TRACE_INVOKE,
+
+	TRACE_PHASE_COUNT
+};
+
+/**
+ * The name a phase is traced under.
+ */
+const char *TracePhaseName(TRACE_PHASE phase);
+
+/**
+ * A phase which has been traced. Times are in FILETIME units, on the clock
+ * the sink was set with.
+ */
+struct TRACE_SPAN
+{
+	TRACE_PHASE               phase;
+
+	// Unique in the process, and never zero.
+	ULONGLONG                 ullId;
+
+	// The span this one is nested in, or zero.
+	ULONGLONG                 ullParentId;
+
+	ULONGLONG                 ullStart;
+
+	// Zero until the span has ended.
+	ULONGLONG                 ullDuration;
+
+	// What the phase worked on: a path, an extension or protocol, or an
+	// icon. May be empty.
+	std::basic_string<WCHAR>  strSubject;
+
+	// How many things it handled, if it handled more than one.
+	ULONGLONG                 ullCount;
+
+	// A Win32 error or an HRESULT, or zero if the phase succeeded.
+	LONG                      lResult;
+};
+
+/**
+ * Where spans go. Spans end on whichever thread they ran on, so a sink has
+ * to be thread-safe.
+ */
+class ITraceSink
+{
+public:
+	virtual ~ITraceSink() {}
+
+	/**
+	 * Whether anything is listening. Activities started while it isn't
+	 * aren't measured at all.
+	 */
+	virtual bool IsEnabled()
+	{
+		return true;
+	}
+
+	/**
+	 * Called when a span starts, with its duration still zero. Spans which
+	 * started before they could be traced have their start in the past.
+	 */
+	virtual void OnSpanBegin(const TRACE_SPAN &span) {}
+
+	virtual void OnSpanEnd(const TRACE_SPAN &span) = 0;
+};
+
+/**
+ * Sets where spans go, and the clock which times them. Set it before
+ * anything is traced, and only clear it, with null, once nothing is; both
+ * have to outlive their use.
+ */
+void TraceSetSink(ITraceSink *pSink, IUserChoiceClock *pClock);
+
+/**
+ * Times a phase, from when it is created until it is stopped or destroyed.
+ */
+class CTraceActivity
+{
+private:
+	// Null if nothing is listening, in which case nothing else is set.
+	ITraceSink       *_pSink;
+	IUserChoiceClock *_pClock;
+	TRACE_SPAN        _span;
+
+	void _Begin(TRACE_PHASE phase, LPCWSTR lpszSubject, ULONGLONG ullStart, bool fNow);
+
+public:
+	CTraceActivity(TRACE_PHASE phase, LPCWSTR lpszSubject = nullptr);
+
+	/**
+	 * For phases which started before they could be traced, like the
+	 * process starting.
+	 *
+	 * @param ullStart  When the phase started, on the sink's clock.
+	 */
+	CTraceActivity(TRACE_PHASE phase, LPCWSTR lpszSubject, ULONGLONG ullStart);
+
+	// Stops the activity if it is still running.
+	~CTraceActivity();
+
+	CTraceActivity(const CTraceActivity &) = delete;
+	CTraceActivity &operator=(const CTraceActivity &) = delete;
+
+	bool IsEnabled() const
+	{
+		return _pSink != nullptr;
+	}
+
+	void SetSubject(LPCWSTR lpszSubject);
+	void SetCount(ULONGLONG ullCount);
+	void SetResult(LONG lResult);
+
+	/**
+	 * Ends the span and hands it to the sink. It only does anything the
+	 * first time.
+	 */
+	void Stop();
+};
+
+/**
+ * Keeps every span which ends, for tests and benchmarks.
+ */
+class CMemoryTraceSink : public ITraceSink
+{
+private:
+	std::mutex               _mutex;
+	std::vector<TRACE_SPAN>  _spans;
+	DWORD                    _cBegun;
+
+public:
+	CMemoryTraceSink();
+
+	void OnSpanBegin(const TRACE_SPAN &span) override;
+	void OnSpanEnd(const TRACE_SPAN &span) override;
+
+	// The spans which have ended, in the order they ended.
+	std::vector<TRACE_SPAN> GetSpans();
+
+	// Spans which have begun, whether they have ended or not.
+	DWORD GetBegunCount();
+
+	void Clear();
+};
+
+/**
+ * Writes a line for every span which ends, with its fields separated by
+ * tabs: the phase, its id and its parent's, its start and duration, its
+ * count and result, and its subject in UTF-8.
+ */
+class CFileTraceSink : public ITraceSink
+{
+private:
+	std::mutex  _mutex;
+	FILE       *_pFile;
+
+public:
+	// The file is left open; it has to outlive the sink.
+	CFileTraceSink(FILE *pFile);
+
+	void OnSpanEnd(const TRACE_SPAN &span) override;
+
+	/**
+	 * Formats a span as the line written for it, without the newline.
+	 */
+	static std::string FormatSpan(const TRACE_SPAN &span);
+};
+
+#ifdef _WIN32
+/**
+ * Writes spans as TraceLogging activities from the OpenWithEx provider.
+ */
+ITraceSink *GetShellTraceSink();
+
+/**
+ * Times spans with GetSystemTimePreciseAsFileTime, so that they line up with
+ * GetProcessTimes.
+ */
+IUserChoiceClock *GetShellTraceClock();
+#endif
\ No newline at end of file
@@ -0,0 +1,844 @@
+/**
+ * Portable UserChoice hash kernel.
+ *
+ * Previously, this was done with CNG for MD5 and CryptoAPI for base64, which
+ * meant opening and closing an algorithm provider and making a handful of
+ * heap allocations for every single hash. The algorithms are small enough
+ * that it's simpler to just have them here.
+ *
+ * The scramble is the same as in Mozilla's implementation; see the notes at
+ * the top of assocuserchoice.cpp.
+ */
+
+#include "userchoicehash.h"
+#include "userchoicehashlanes.h"
+
+#include <string.h>
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h> // __cpuid, _xgetbv
+#endif
+
+#include <thread>
+#include <vector>
+
+LPCWSTR g_szConstantUserExperience =
+	WTEXT("User Choice set via Windows User Experience ")
+	WTEXT("{D18B6DD5-6124-4341-9318-804003BAFA0B}");
+
+#pragma region MD5
+static inline DWORD ReadLE32(const BYTE *pb)
+{
+	return (DWORD)pb[0] |
+		((DWORD)pb[1] << 8) |
+		((DWORD)pb[2] << 16) |
+		((DWORD)pb[3] << 24);
+}
+
+static inline void WriteLE32(BYTE *pb, DWORD v)
+{
+	pb[0] = (BYTE)v;
+	pb[1] = (BYTE)(v >> 8);
+	pb[2] = (BYTE)(v >> 16);
+	pb[3] = (BYTE)(v >> 24);
+}
+
+static inline DWORD RotateLeft(DWORD v, int n)
+{
+	return (v << n) | (v >> (32 - n));
+}
+
+#define MD5_F(x, y, z) (((x) & (y)) | (~(x) & (z)))
+#define MD5_G(x, y, z) (((x) & (z)) | ((y) & ~(z)))
+#define MD5_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD5_I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+#define MD5_STEP(f, a, b, c, d, x, t, s) \
+	(a) += f((b), (c), (d)) + (x) + (t); \
+	(a) = RotateLeft((a), (s)) + (b);
+
+CUserChoiceMD5::CUserChoiceMD5()
+{
+	Reset();
+}
+
+void CUserChoiceMD5::Reset()
+{
+	_rgdwState[0] = 0x67452301uL;
+	_rgdwState[1] = 0xEFCDAB89uL;
+	_rgdwState[2] = 0x98BADCFEuL;
+	_rgdwState[3] = 0x10325476uL;
+	_cbTotal = 0;
+}
+
+// static
+void CUserChoiceMD5::s_Transform(DWORD rgdwState[4], const BYTE *pbBlock)
+{
+	DWORD x[16];
+	for (int i = 0; i < 16; i++)
+	{
+		x[i] = ReadLE32(&pbBlock[i * sizeof(DWORD)]);
+	}
+
+	DWORD a = rgdwState[0];
+	DWORD b = rgdwState[1];
+	DWORD c = rgdwState[2];
+	DWORD d = rgdwState[3];
+
+	// Round 1
+	MD5_STEP(MD5_F, a, b, c, d, x[ 0], 0xD76AA478uL,  7)
+	MD5_STEP(MD5_F, d, a, b, c, x[ 1], 0xE8C7B756uL, 12)
+	MD5_STEP(MD5_F, c, d, a, b, x[ 2], 0x242070DBuL, 17)
+	MD5_STEP(MD5_F, b, c, d, a, x[ 3], 0xC1BDCEEEuL, 22)
+	MD5_STEP(MD5_F, a, b, c, d, x[ 4], 0xF57C0FAFuL,  7)
+	MD5_STEP(MD5_F, d, a, b, c, x[ 5], 0x4787C62AuL, 12)
+	MD5_STEP(MD5_F, c, d, a, b, x[ 6], 0xA8304613uL, 17)
+	MD5_STEP(MD5_F, b, c, d, a, x[ 7], 0xFD469501uL, 22)
+	MD5_STEP(MD5_F, a, b, c, d, x[ 8], 0x698098D8uL,  7)
+	MD5_STEP(MD5_F, d, a, b, c, x[ 9], 0x8B44F7AFuL, 12)
+	MD5_STEP(MD5_F, c, d, a, b, x[10], 0xFFFF5BB1uL, 17)
+	MD5_STEP(MD5_F, b, c, d, a, x[11], 0x895CD7BEuL, 22)
+	MD5_STEP(MD5_F, a, b, c, d, x[12], 0x6B901122uL,  7)
+	MD5_STEP(MD5_F, d, a, b, c, x[13], 0xFD987193uL, 12)
+	MD5_STEP(MD5_F, c, d, a, b, x[14], 0xA679438EuL, 17)
+	MD5_STEP(MD5_F, b, c, d, a, x[15], 0x49B40821uL, 22)
+
+	// Round 2
+	MD5_STEP(MD5_G, a, b, c, d, x[ 1], 0xF61E2562uL,  5)
+	MD5_STEP(MD5_G, d, a, b, c, x[ 6], 0xC040B340uL,  9)
+	MD5_STEP(MD5_G, c, d, a, b, x[11], 0x265E5A51uL, 14)
+	MD5_STEP(MD5_G, b, c, d, a, x[ 0], 0xE9B6C7AAuL, 20)
+	MD5_STEP(MD5_G, a, b, c, d, x[ 5], 0xD62F105DuL,  5)
+	MD5_STEP(MD5_G, d, a, b, c, x[10], 0x02441453uL,  9)
+	MD5_STEP(MD5_G, c, d, a, b, x[15], 0xD8A1E681uL, 14)
+	MD5_STEP(MD5_G, b, c, d, a, x[ 4], 0xE7D3FBC8uL, 20)
+	MD5_STEP(MD5_G, a, b, c, d, x[ 9], 0x21E1CDE6uL,  5)
+	MD5_STEP(MD5_G, d, a, b, c, x[14], 0xC33707D6uL,  9)
+	MD5_STEP(MD5_G, c, d, a, b, x[ 3], 0xF4D50D87uL, 14)
+	MD5_STEP(MD5_G, b, c, d, a, x[ 8], 0x455A14EDuL, 20)
+	MD5_STEP(MD5_G, a, b, c, d, x[13], 0xA9E3E905uL,  5)
+	MD5_STEP(MD5_G, d, a, b, c, x[ 2], 0xFCEFA3F8uL,  9)
+	MD5_STEP(MD5_G, c, d, a, b, x[ 7], 0x676F02D9uL, 14)
+	MD5_STEP(MD5_G, b, c, d, a, x[12], 0x8D2A4C8AuL, 20)
+
+	// Round 3
+	MD5_STEP(MD5_H, a, b, c, d, x[ 5], 0xFFFA3942uL,  4)
+	MD5_STEP(MD5_H, d, a, b, c, x[ 8], 0x8771F681uL, 11)
+	MD5_STEP(MD5_H, c, d, a, b, x[11], 0x6D9D6122uL, 16)
+	MD5_STEP(MD5_H, b, c, d, a, x[14], 0xFDE5380CuL, 23)
+	MD5_STEP(MD5_H, a, b, c, d, x[ 1], 0xA4BEEA44uL,  4)
+	MD5_STEP(MD5_H, d, a, b, c, x[ 4], 0x4BDECFA9uL, 11)
+	MD5_STEP(MD5_H, c, d, a, b, x[ 7], 0xF6BB4B60uL, 16)
+	MD5_STEP(MD5_H, b, c, d, a, x[10], 0xBEBFBC70uL, 23)
+	MD5_STEP(MD5_H, a, b, c, d, x[13], 0x289B7EC6uL,  4)
+	MD5_STEP(MD5_H, d, a, b, c, x[ 0], 0xEAA127FAuL, 11)
+	MD5_STEP(MD5_H, c, d, a, b, x[ 3], 0xD4EF3085uL, 16)
+	MD5_STEP(MD5_H, b, c, d, a, x[ 6], 0x04881D05uL, 23)
+	MD5_STEP(MD5_H, a, b, c, d, x[ 9], 0xD9D4D039uL,  4)
+	MD5_STEP(MD5_H, d, a, b, c, x[12], 0xE6DB99E5uL, 11)
+	MD5_STEP(MD5_H, c, d, a, b, x[15], 0x1FA27CF8uL, 16)
+	MD5_STEP(MD5_H, b, c, d, a, x[ 2], 0xC4AC5665uL, 23)
+
+	// Round 4
+	MD5_STEP(MD5_I, a, b, c, d, x[ 0], 0xF4292244uL,  6)
+	MD5_STEP(MD5_I, d, a, b, c, x[ 7], 0x432AFF97uL, 10)
+	MD5_STEP(MD5_I, c, d, a, b, x[14], 0xAB9423A7uL, 15)
+	MD5_STEP(MD5_I, b, c, d, a, x[ 5], 0xFC93A039uL, 21)
+	MD5_STEP(MD5_I, a, b, c, d, x[12], 0x655B59C3uL,  6)
+	MD5_STEP(MD5_I, d, a, b, c, x[ 3], 0x8F0CCC92uL, 10)
+	MD5_STEP(MD5_I, c, d, a, b, x[10], 0xFFEFF47DuL, 15)
+	MD5_STEP(MD5_I, b, c, d, a, x[ 1], 0x85845DD1uL, 21)
+	MD5_STEP(MD5_I, a, b, c, d, x[ 8], 0x6FA87E4FuL,  6)
+	MD5_STEP(MD5_I, d, a, b, c, x[15], 0xFE2CE6E0uL, 10)
+	MD5_STEP(MD5_I, c, d, a, b, x[ 6], 0xA3014314uL, 15)
+	MD5_STEP(MD5_I, b, c, d, a, x[13], 0x4E0811A1uL, 21)
+	MD5_STEP(MD5_I, a, b, c, d, x[ 4], 0xF7537E82uL,  6)
+	MD5_STEP(MD5_I, d, a, b, c, x[11], 0xBD3AF235uL, 10)
+	MD5_STEP(MD5_I, c, d, a, b, x[ 2], 0x2AD7D2BBuL, 15)
+	MD5_STEP(MD5_I, b, c, d, a, x[ 9], 0xEB86D391uL, 21)
+
+	rgdwState[0] += a;
+	rgdwState[1] += b;
+	rgdwState[2] += c;
+	rgdwState[3] += d;
+}
+
+void CUserChoiceMD5::Update(const BYTE *pbData, size_t cbData)
+{
+	size_t cbBuffered = (size_t)(_cbTotal & 63);
+	_cbTotal += cbData;
+
+	// Top up a partially-filled buffer first:
+	if (cbBuffered)
+	{
+		size_t cbFill = 64 - cbBuffered;
+		if (cbData < cbFill)
+		{
+			memcpy(&_rgbBuffer[cbBuffered], pbData, cbData);
+			return;
+		}
+
+		memcpy(&_rgbBuffer[cbBuffered], pbData, cbFill);
+		s_Transform(_rgdwState, _rgbBuffer);
+		pbData += cbFill;
+		cbData -= cbFill;
+	}
+
+	// Whole blocks are hashed straight from the input:
+	while (cbData >= 64)
+	{
+		s_Transform(_rgdwState, pbData);
+		pbData += 64;
+		cbData -= 64;
+	}
+
+	if (cbData)
+	{
+		memcpy(_rgbBuffer, pbData, cbData);
+	}
+}
+
+void CUserChoiceMD5::s_Finish(DWORD rgdwState[4], const BYTE *pbTail, size_t cbTail, ULONGLONG cbTotal)
+{
+	ULONGLONG cBits = cbTotal * 8;
+	BYTE rgbBlock[64];
+
+	memcpy(rgbBlock, pbTail, cbTail);
+	rgbBlock[cbTail++] = 0x80;
+
+	// If there isn't room for the length, pad out this block and start a
+	// new one:
+	if (cbTail > 56)
+	{
+		memset(&rgbBlock[cbTail], 0, 64 - cbTail);
+		s_Transform(rgdwState, rgbBlock);
+		cbTail = 0;
+	}
+
+	memset(&rgbBlock[cbTail], 0, 56 - cbTail);
+	WriteLE32(&rgbBlock[56], (DWORD)cBits);
+	WriteLE32(&rgbBlock[60], (DWORD)(cBits >> 32));
+	s_Transform(rgdwState, rgbBlock);
+}
+
+void CUserChoiceMD5::Final(DWORD rgdwDigest[4])
+{
+	s_Finish(_rgdwState, _rgbBuffer, (size_t)(_cbTotal & 63), _cbTotal);
+
+	// The digest is the state in little endian byte order, so reading it back
+	// as DWORDs (which is what the old CNG code did) just gives the state.
+	for (int i = 0; i < 4; i++)
+	{
+		rgdwDigest[i] = _rgdwState[i];
+	}
+	Reset();
+}
+#pragma endregion
+
+#pragma region Scramble
+static inline DWORD WordSwap(DWORD v) { return (v >> 16) | (v << 16); }
+
+void UserChoiceScramble(
+	const BYTE  *pbData,
+	size_t       cbData,
+	const DWORD  rgdwMd5[2],
+	DWORD        rgdwHashOut[2]
+)
+{
+	constexpr size_t DWORDS_PER_BLOCK = 2;
+	constexpr size_t BLOCK_SIZE = sizeof(DWORD) * DWORDS_PER_BLOCK;
+
+	// Incomplete blocks are ignored.
+	size_t blockCount = cbData / BLOCK_SIZE;
+
+	// Constant multipliers for the scramble, one set for each DWORD in a block:
+	const DWORD C0s[DWORDS_PER_BLOCK][5] = {
+		{rgdwMd5[0] | 1, 0xCF98B111uL, 0x87085B9FuL, 0x12CEB96DuL, 0x257E1D83uL},
+		{rgdwMd5[1] | 1, 0xA27416F5uL, 0xD38396FFuL, 0x7C932B89uL, 0xBFA49F69uL}
+	};
+
+	const DWORD C1s[DWORDS_PER_BLOCK][5] = {
+		{rgdwMd5[0] | 1, 0xEF0569FBuL, 0x689B6B9FuL, 0x79F8A395uL, 0xC3EFEA97uL},
+		{rgdwMd5[1] | 1, 0xC31713DBuL, 0xDDCD1F0FuL, 0x59C3AF2DuL, 0x35BD1EC9uL}
+	};
+
+	// The checksums:
+	DWORD h0 = 0;
+	DWORD h1 = 0;
+
+	// Accumulated total of the checksum after each DWORD:
+	DWORD h0Acc = 0;
+	DWORD h1Acc = 0;
+
+	for (size_t i = 0; i < blockCount; ++i)
+	{
+		for (size_t j = 0; j < DWORDS_PER_BLOCK; ++j)
+		{
+			const DWORD *C0 = C0s[j];
+			const DWORD *C1 = C1s[j];
+
+			DWORD input = ReadLE32(&pbData[(i * DWORDS_PER_BLOCK + j) * sizeof(DWORD)]);
+
+			h0 += input;
+			// Scramble 0:
+			h0 *= C0[0];
+			h0 = WordSwap(h0) * C0[1];
+			h0 = WordSwap(h0) * C0[2];
+			h0 = WordSwap(h0) * C0[3];
+			h0 = WordSwap(h0) * C0[4];
+			h0Acc += h0;
+
+			h1 += input;
+			// Scramble 1:
+			h1 = WordSwap(h1) * C1[1] + h1 * C1[0];
+			h1 = (h1 >> 16) * C1[2] + h1 * C1[3];
+			h1 = WordSwap(h1) * C1[4] + h1;
+			h1Acc += h1;
+		}
+	}
+
+	rgdwHashOut[0] = h0 ^ h1;
+	rgdwHashOut[1] = h0Acc ^ h1Acc;
+}
+#pragma endregion
+
+#pragma region Base64
+void UserChoiceBase64Encode(
+	const DWORD rgdwHash[2],
+	WCHAR       pszOut[USERCHOICE_HASH_CCH + 1]
+)
+{
+	static const char c_szAlphabet[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	BYTE rgb[8];
+	WriteLE32(&rgb[0], rgdwHash[0]);
+	WriteLE32(&rgb[4], rgdwHash[1]);
+
+	// 8 bytes is two full 3 byte groups and one group of 2, which leaves one
+	// padding character at the end.
+	WCHAR *pch = pszOut;
+	for (int i = 0; i < 6; i += 3)
+	{
+		DWORD v = ((DWORD)rgb[i] << 16) | ((DWORD)rgb[i + 1] << 8) | rgb[i + 2];
+		*pch++ = c_szAlphabet[(v >> 18) & 63];
+		*pch++ = c_szAlphabet[(v >> 12) & 63];
+		*pch++ = c_szAlphabet[(v >> 6) & 63];
+		*pch++ = c_szAlphabet[v & 63];
+	}
+
+	DWORD v = ((DWORD)rgb[6] << 16) | ((DWORD)rgb[7] << 8);
+	*pch++ = c_szAlphabet[(v >> 18) & 63];
+	*pch++ = c_szAlphabet[(v >> 12) & 63];
+	*pch++ = c_szAlphabet[(v >> 6) & 63];
+	*pch++ = '=';
+	*pch = '\0';
+}
+#pragma endregion
+
+bool UserChoiceHashBytes(
+	const BYTE *pbData,
+	size_t      cbData,
+	WCHAR       pszOut[USERCHOICE_HASH_CCH + 1]
+)
+{
+	if (cbData < sizeof(DWORD) * 2)
+	{
+		return false;
+	}
+
+	// Compute an MD5 hash. md5[0] and md5[1] will be used as constant
+	// multipliers in the scramble.
+	DWORD md5[4];
+	CUserChoiceMD5 hasher;
+	hasher.Update(pbData, cbData);
+	hasher.Final(md5);
+
+	DWORD hash[2];
+	UserChoiceScramble(pbData, cbData, md5, hash);
+	UserChoiceBase64Encode(hash, pszOut);
+
+	return true;
+}
+
+#pragma region Streaming
+CUserChoiceHashStream::CUserChoiceHashStream()
+{
+	Reset();
+}
+
+void CUserChoiceHashStream::Reset()
+{
+	_rgdwState[0] = 0x67452301uL;
+	_rgdwState[1] = 0xEFCDAB89uL;
+	_rgdwState[2] = 0x98BADCFEuL;
+	_rgdwState[3] = 0x10325476uL;
+	_cchInput = 0;
+	_cbHashed = 0;
+	_fOverflow = false;
+}
+
+bool CUserChoiceHashStream::_Reserve(size_t cch)
+{
+	if (_fOverflow || cch > ARRAYSIZE(_rgchInput) - _cchInput)
+	{
+		_fOverflow = true;
+		return false;
+	}
+	return true;
+}
+
+void CUserChoiceHashStream::_HashCompleteBlocks()
+{
+	const BYTE *pbInput = (const BYTE *)_rgchInput;
+	size_t cbInput = _cchInput * sizeof(WCHAR);
+
+	while (cbInput - _cbHashed >= 64)
+	{
+		CUserChoiceMD5::s_Transform(_rgdwState, &pbInput[_cbHashed]);
+		_cbHashed += 64;
+	}
+}
+
+void CUserChoiceHashStream::Append(LPCWSTR psz)
+{
+	size_t cch = 0;
+	while (psz[cch])
+		cch++;
+
+	if (!_Reserve(cch))
+		return;
+
+	memcpy(&_rgchInput[_cchInput], psz, cch * sizeof(WCHAR));
+	UserChoiceLowerCase(&_rgchInput[_cchInput], cch);
+	_cchInput += cch;
+	_HashCompleteBlocks();
+}
+
+void CUserChoiceHashStream::AppendLowerCase(LPCWSTR pch, size_t cch)
+{
+	if (!_Reserve(cch))
+		return;
+
+	memcpy(&_rgchInput[_cchInput], pch, cch * sizeof(WCHAR));
+	_cchInput += cch;
+	_HashCompleteBlocks();
+}
+
+void CUserChoiceHashStream::AppendHex64(ULONGLONG ullValue)
+{
+	static const char c_szHex[] = "0123456789abcdef";
+
+	if (!_Reserve(16))
+		return;
+
+	for (int i = 15; i >= 0; i--)
+		_rgchInput[_cchInput++] = c_szHex[(ullValue >> (i * 4)) & 0xF];
+	_HashCompleteBlocks();
+}
+
+bool CUserChoiceHashStream::Finish(WCHAR pszOut[USERCHOICE_HASH_CCH + 1])
+{
+	// The terminator is part of the input.
+	if (!_Reserve(1))
+		return false;
+	_rgchInput[_cchInput++] = '\0';
+
+	const BYTE *pbInput = (const BYTE *)_rgchInput;
+	size_t cbInput = _cchInput * sizeof(WCHAR);
+	if (cbInput < sizeof(DWORD) * 2)
+		return false;
+
+	_HashCompleteBlocks();
+	CUserChoiceMD5::s_Finish(_rgdwState, &pbInput[_cbHashed], cbInput - _cbHashed, cbInput);
+
+	// Everything MD5 just read is still in cache for the scramble.
+	DWORD hash[2];
+	UserChoiceScramble(pbInput, cbInput, _rgdwState, hash);
+	UserChoiceBase64Encode(hash, pszOut);
+
+	return true;
+}
+#pragma endregion
+
+#pragma region Lanes
+typedef void (*PFNHASHLANES)(const BYTE *const *ppbData, const size_t *pcbData, DWORD (*rgHash)[2]);
+
+/**
+ * Checks which multi-buffer engines the CPU and OS support.
+ */
+static size_t DetectMaxLanes()
+{
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+	int rgInfo[4];
+	__cpuid(rgInfo, 0);
+	int nMaxLeaf = rgInfo[0];
+
+	__cpuid(rgInfo, 1);
+	bool fSSE2 = (rgInfo[3] & (1 << 26)) != 0;
+	bool fOSXSave = (rgInfo[2] & (1 << 27)) != 0;
+	bool fAVX = (rgInfo[2] & (1 << 28)) != 0;
+
+	if (!fSSE2)
+		return 1;
+
+	// The OS has to save the wider registers on context switches too, which
+	// is what XCR0 says.
+	if (nMaxLeaf < 7 || !fOSXSave || !fAVX)
+		return 4;
+
+	unsigned __int64 ullXcr0 = _xgetbv(0);
+	__cpuidex(rgInfo, 7, 0);
+
+	// XMM, YMM, opmask and both halves of ZMM state:
+	if ((ullXcr0 & 0xE6) == 0xE6 && (rgInfo[1] & (1 << 16)))
+		return 16;
+	// XMM and YMM state:
+	if ((ullXcr0 & 0x06) == 0x06 && (rgInfo[1] & (1 << 5)))
+		return 8;
+	return 4;
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+	// These check OS support as well.
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return 16;
+	if (__builtin_cpu_supports("avx2"))
+		return 8;
+	if (__builtin_cpu_supports("sse2"))
+		return 4;
+	return 1;
+#else
+	return 1;
+#endif
+}
+
+size_t UserChoiceGetMaxLanes()
+{
+	static const size_t s_cMaxLanes = DetectMaxLanes();
+	return s_cMaxLanes;
+}
+
+static PFNHASHLANES GetLanesEngine(size_t *pcLanes)
+{
+	size_t cMaxLanes = UserChoiceGetMaxLanes();
+	if (*pcLanes > cMaxLanes)
+		*pcLanes = cMaxLanes;
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+	if (*pcLanes >= 16)
+	{
+		*pcLanes = 16;
+		return UserChoiceHashLanes_AVX512;
+	}
+	if (*pcLanes >= 8)
+	{
+		*pcLanes = 8;
+		return UserChoiceHashLanes_AVX2;
+	}
+	if (*pcLanes >= 4)
+	{
+		*pcLanes = 4;
+		return UserChoiceHashLanes_SSE2;
+	}
+#endif
+
+	*pcLanes = 1;
+	return nullptr;
+}
+
+size_t UserChoiceHashLanes(
+	size_t              cLanes,
+	const BYTE *const  *ppbData,
+	const size_t       *pcbData,
+	size_t              cInputs,
+	WCHAR              *pszHashesOut
+)
+{
+	size_t cHashed = 0;
+	size_t i = 0;
+
+	DWORD rgHash[USERCHOICE_LANES_MAX][2];
+
+	while (i < cInputs)
+	{
+		// Whatever is left at the end goes through narrower engines, and
+		// finally the scalar kernel, rather than wasting most of the lanes.
+		size_t cGroup = (cInputs - i < cLanes) ? cInputs - i : cLanes;
+		PFNHASHLANES pfnHashLanes = GetLanesEngine(&cGroup);
+		if (!pfnHashLanes)
+			break;
+
+		pfnHashLanes(&ppbData[i], &pcbData[i], rgHash);
+
+		for (size_t lane = 0; lane < cGroup; lane++)
+		{
+			WCHAR *pszHash = &pszHashesOut[(i + lane) * (USERCHOICE_HASH_CCH + 1)];
+			if (pcbData[i + lane] < sizeof(DWORD) * 2)
+			{
+				pszHash[0] = '\0';
+				continue;
+			}
+
+			UserChoiceBase64Encode(rgHash[lane], pszHash);
+			cHashed++;
+		}
+
+		i += cGroup;
+	}
+
+	for (; i < cInputs; i++)
+	{
+		WCHAR *pszHash = &pszHashesOut[i * (USERCHOICE_HASH_CCH + 1)];
+		if (UserChoiceHashBytes(ppbData[i], pcbData[i], pszHash))
+			cHashed++;
+		else
+			pszHash[0] = '\0';
+	}
+
+	return cHashed;
+}
+#pragma endregion
+
+#pragma region Formatting
+void UserChoiceLowerCase(WCHAR *pch, size_t cch)
+{
+#ifdef _WIN32
+	CharLowerBuffW(pch, (DWORD)cch);
+#else
+	for (size_t i = 0; i < cch; i++)
+	{
+		WCHAR ch = pch[i];
+
+		if ((ch >= 'A' && ch <= 'Z') ||
+			(ch >= 0x00C0 && ch <= 0x00DE && ch != 0x00D7) || // Latin-1
+			(ch >= 0x0391 && ch <= 0x03AB && ch != 0x03A2) || // Greek
+			(ch >= 0x0410 && ch <= 0x042F))                   // Cyrillic
+		{
+			ch += 0x20;
+		}
+		else if (ch >= 0x0400 && ch <= 0x040F)
+		{
+			ch += 0x50;
+		}
+		else if (ch >= 0x0100 && ch <= 0x017F && ch != 0x0130 && ch != 0x0131 &&
+			ch != 0x0138 && ch != 0x0149 && ch != 0x017F)
+		{
+			// Latin Extended-A is mostly upper/lower pairs, but the pairs
+			// switch from even/odd to odd/even between U+0139 and U+0148 and
+			// again from U+0179.
+			bool fOddUpper = (ch >= 0x0139 && ch <= 0x0148) || ch >= 0x0179;
+			if ((ch & 1) == (fOddUpper ? 1 : 0) && ch != 0x0178)
+				ch += 1;
+			else if (ch == 0x0178)
+				ch = 0x00FF;
+		}
+
+		pch[i] = ch;
+	}
+#endif
+}
+
+static size_t AppendString(WCHAR *pszOut, size_t cch, size_t cchOut, LPCWSTR psz)
+{
+	while (*psz)
+	{
+		if (cch >= cchOut - 1)
+			return 0;
+		pszOut[cch++] = *psz++;
+	}
+	return cch;
+}
+
+CUserChoiceHashContext::CUserChoiceHashContext()
+	: _szSid{ 0 }
+	, _cchSid(0)
+	, _szSuffix{ 0 }
+	, _cchSuffix(0)
+{
+}
+
+bool CUserChoiceHashContext::Init(LPCWSTR lpszUserSid, ULONGLONG ullTimestamp)
+{
+	constexpr ULONGLONG FILETIME_PER_MINUTE = 60ull * 1000 * 1000 * 10;
+	static const char c_szHex[] = "0123456789abcdef";
+
+	_cchSid = AppendString(_szSid, 0, ARRAYSIZE(_szSid), lpszUserSid);
+	if (!_cchSid)
+	{
+		return false;
+	}
+	_szSid[_cchSid] = '\0';
+	UserChoiceLowerCase(_szSid, _cchSid);
+
+	// This is "%08lx%08lx" of the high and low parts of the FILETIME, which
+	// is just the whole thing as 16 hex digits.
+	ullTimestamp -= ullTimestamp % FILETIME_PER_MINUTE;
+	for (int i = 15; i >= 0; i--)
+	{
+		_szSuffix[15 - i] = c_szHex[(ullTimestamp >> (i * 4)) & 0xF];
+	}
+
+	_cchSuffix = AppendString(_szSuffix, 16, ARRAYSIZE(_szSuffix), g_szConstantUserExperience);
+	_szSuffix[_cchSuffix] = '\0';
+	UserChoiceLowerCase(_szSuffix, _cchSuffix);
+
+	return true;
+}
+
+size_t CUserChoiceHashContext::Format(
+	LPCWSTR lpszExtension,
+	LPCWSTR lpszProgId,
+	WCHAR  *pszOut,
+	size_t  cchOut
+) const
+{
+	size_t cchExtension = AppendString(pszOut, 0, cchOut, lpszExtension);
+	if (!cchExtension || cchExtension + _cchSid >= cchOut)
+	{
+		return 0;
+	}
+	UserChoiceLowerCase(pszOut, cchExtension);
+
+	memcpy(&pszOut[cchExtension], _szSid, _cchSid * sizeof(WCHAR));
+	size_t cch = cchExtension + _cchSid;
+
+	size_t cchProgIdEnd = AppendString(pszOut, cch, cchOut, lpszProgId);
+	if (!cchProgIdEnd || cchProgIdEnd + _cchSuffix >= cchOut)
+	{
+		return 0;
+	}
+	UserChoiceLowerCase(&pszOut[cch], cchProgIdEnd - cch);
+	cch = cchProgIdEnd;
+
+	memcpy(&pszOut[cch], _szSuffix, _cchSuffix * sizeof(WCHAR));
+	cch += _cchSuffix;
+	pszOut[cch] = '\0';
+
+	return cch;
+}
+
+bool CUserChoiceHashContext::Hash(
+	LPCWSTR lpszExtension,
+	LPCWSTR lpszProgId,
+	WCHAR   pszOut[USERCHOICE_HASH_CCH + 1]
+) const
+{
+	// Same as Format, which has no use for an association without an
+	// extension or protocol.
+	if (!*lpszExtension)
+	{
+		return false;
+	}
+
+	CUserChoiceHashStream stream;
+	stream.Append(lpszExtension);
+	stream.AppendLowerCase(_szSid, _cchSid);
+	stream.Append(lpszProgId);
+	stream.AppendLowerCase(_szSuffix, _cchSuffix);
+
+	return stream.Finish(pszOut);
+}
+#pragma endregion
+
+#pragma region Batch
+static size_t HashRange(
+	const CUserChoiceHashContext *pContext,
+	const USERCHOICE_PAIR        *pPairs,
+	size_t                        cPairs,
+	WCHAR                        *pszHashesOut
+)
+{
+	size_t cLanes = UserChoiceGetMaxLanes();
+
+	// Format a group of inputs, then hash them all at once.
+	WCHAR rgszInputs[USERCHOICE_LANES_MAX][USERCHOICE_INPUT_CCH_MAX];
+	const BYTE *rgpbInputs[USERCHOICE_LANES_MAX];
+	size_t rgcbInputs[USERCHOICE_LANES_MAX];
+
+	size_t cHashed = 0;
+	for (size_t i = 0; i < cPairs; i += cLanes)
+	{
+		size_t cGroup = (cPairs - i < cLanes) ? cPairs - i : cLanes;
+		for (size_t j = 0; j < cGroup; j++)
+		{
+			// Inputs that don't fit are given a size of zero, which leaves
+			// their hash empty.
+			size_t cchInput = pContext->Format(
+				pPairs[i + j].lpszExtension,
+				pPairs[i + j].lpszProgId,
+				rgszInputs[j],
+				USERCHOICE_INPUT_CCH_MAX
+			);
+			rgpbInputs[j] = (const BYTE *)rgszInputs[j];
+			rgcbInputs[j] = cchInput ? (cchInput + 1) * sizeof(WCHAR) : 0;
+		}
+
+		cHashed += UserChoiceHashLanes(
+			cLanes,
+			rgpbInputs,
+			rgcbInputs,
+			cGroup,
+			&pszHashesOut[i * (USERCHOICE_HASH_CCH + 1)]
+		);
+	}
+	return cHashed;
+}
+
+size_t UserChoiceHashBatch(
+	const CUserChoiceHashContext *pContext,
+	const USERCHOICE_PAIR        *pPairs,
+	size_t                        cPairs,
+	WCHAR                        *pszHashesOut
+)
+{
+	// A hash takes well under a microsecond, so anything smaller than this
+	// isn't worth starting a thread for.
+	constexpr size_t MIN_PAIRS_PER_THREAD = 256;
+
+	// Querying this isn't free on every platform, so only do it once.
+	static const size_t s_cProcessors = std::thread::hardware_concurrency();
+
+	size_t cThreads = s_cProcessors;
+	if (cThreads > cPairs / MIN_PAIRS_PER_THREAD)
+		cThreads = cPairs / MIN_PAIRS_PER_THREAD;
+
+	if (cThreads <= 1)
+	{
+		return HashRange(pContext, pPairs, cPairs, pszHashesOut);
+	}
+
+	// The calling thread takes the first slice, and workers take the rest.
+	size_t cPairsPerThread = (cPairs + cThreads - 1) / cThreads;
+	std::vector<size_t> rgcHashed(cThreads, 0);
+	std::vector<std::thread> workers;
+	workers.reserve(cThreads - 1);
+
+	for (size_t t = 1; t < cThreads; t++)
+	{
+		size_t iFirst = t * cPairsPerThread;
+		if (iFirst >= cPairs)
+			break;
+
+		size_t cSlice = (cPairs - iFirst < cPairsPerThread) ? cPairs - iFirst : cPairsPerThread;
+		workers.emplace_back([=, &rgcHashed]()
+		{
+			rgcHashed[t] = HashRange(
+				pContext,
+				&pPairs[iFirst],
+				cSlice,
+				&pszHashesOut[iFirst * (USERCHOICE_HASH_CCH + 1)]
+			);
+		});
+	}
+
+	rgcHashed[0] = HashRange(pContext, pPairs, cPairsPerThread, pszHashesOut);
+
+	size_t cHashed = 0;
+	for (std::thread &worker : workers)
+		worker.join();
+	for (size_t c : rgcHashed)
+		cHashed += c;
+
+	return cHashed;
+}
+#pragma endregion
\ No newline at end of file
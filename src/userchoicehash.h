@@ -0,0 +1,269 @@
+#pragma once
+
+/**
+ * Portable UserChoice hash kernel.
+ *
+ * This is the part of the UserChoice hash which doesn't depend on Windows:
+ * MD5, the two-lane checksum scramble and the base64 encoding of the result.
+ * Nothing in here allocates; all output goes to caller-provided storage.
+ *
+ * @see assocuserchoice.cpp for how the hash input is built.
+ */
+
+#include "wincompat.h"
+
+// Length of a UserChoice hash in characters, excluding the terminator. The
+// hash is always 8 bytes, which is always 12 characters of padded base64.
+#define USERCHOICE_HASH_CCH 12
+
+// Upper bound on the formatted hash input, including the terminator. Registry
+// key names (and so extensions and ProgIDs) are limited to 255 characters and
+// string SIDs to 184, so real input never gets close to this.
+#define USERCHOICE_INPUT_CCH_MAX 1024
+
+/**
+ * A constant copy of the User Experience string.
+ *
+ * This string is stored internally in shell32.dll and is used in generating
+ * UserChoice hashes.
+ *
+ * In the future, this should be restructured to be pulled from shell32.dll
+ * during runtime instead of being hardcoded.
+ */
+extern LPCWSTR g_szConstantUserExperience;
+
+/**
+ * Incremental MD5 (RFC 1321).
+ *
+ * This only exists because the UserChoice hash needs it, and it is not
+ * meant to be used for anything security-related.
+ */
+class CUserChoiceMD5
+{
+private:
+	DWORD     _rgdwState[4];
+	ULONGLONG _cbTotal;
+	BYTE      _rgbBuffer[64];
+
+public:
+	CUserChoiceMD5();
+
+	void Reset();
+	void Update(const BYTE *pbData, size_t cbData);
+	void Final(DWORD rgdwDigest[4]);
+
+	// Processes one 64-byte block.
+	static void s_Transform(DWORD rgdwState[4], const BYTE *pbBlock);
+
+	// Pads and processes the last partial block of a message of cbTotal
+	// bytes. cbTail must be less than 64.
+	static void s_Finish(DWORD rgdwState[4], const BYTE *pbTail, size_t cbTail, ULONGLONG cbTotal);
+};
+
+/**
+ * Runs the UserChoice checksum scramble over the input.
+ *
+ * @param pbData       Hash input. Only whole 8-byte blocks are used.
+ * @param cbData       Size of the hash input in bytes.
+ * @param rgdwMd5      The first two DWORDs of the MD5 digest of the input.
+ * @param rgdwHashOut  Receives the two resulting checksum DWORDs.
+ */
+void UserChoiceScramble(
+	const BYTE  *pbData,
+	size_t       cbData,
+	const DWORD  rgdwMd5[2],
+	DWORD        rgdwHashOut[2]
+);
+
+/**
+ * Base64 encodes the 8 byte UserChoice hash.
+ *
+ * @param rgdwHash  The two checksum DWORDs.
+ * @param pszOut    Receives the 12 character encoding and a terminator.
+ */
+void UserChoiceBase64Encode(
+	const DWORD rgdwHash[2],
+	WCHAR       pszOut[USERCHOICE_HASH_CCH + 1]
+);
+
+/**
+ * Hashes the UserChoice input string.
+ *
+ * @param pbData  The formatted, lowercased UserChoice string as UTF-16,
+ *                including its null terminator.
+ * @param cbData  Size of pbData in bytes.
+ * @param pszOut  Receives the hash and a terminator.
+ *
+ * @return true on success, false if the input is shorter than one block.
+ */
+bool UserChoiceHashBytes(
+	const BYTE *pbData,
+	size_t      cbData,
+	WCHAR       pszOut[USERCHOICE_HASH_CCH + 1]
+);
+
+/**
+ * Builds and hashes UserChoice input in one go, from its separate pieces.
+ *
+ * Each piece is lowercased as it is appended and MD5 runs over every block as
+ * soon as it is complete, so the input is never formatted up front or read
+ * twice from cold memory. The scramble needs the finished MD5 digest for its
+ * very first multiply, so the lowercased input is kept here for it to run
+ * over at the end.
+ */
+class CUserChoiceHashStream
+{
+private:
+	DWORD  _rgdwState[4];
+	size_t _cchInput;
+	size_t _cbHashed;
+	bool   _fOverflow;
+	WCHAR  _rgchInput[USERCHOICE_INPUT_CCH_MAX];
+
+	// Makes room for cch more characters, or marks the stream as overflowed.
+	bool _Reserve(size_t cch);
+
+	// Runs MD5 over any blocks completed by the last append.
+	void _HashCompleteBlocks();
+
+public:
+	CUserChoiceHashStream();
+
+	void Reset();
+
+	// Appends a piece of the input, lowercasing it.
+	void Append(LPCWSTR psz);
+
+	// Appends a piece of the input which is already lowercase.
+	void AppendLowerCase(LPCWSTR pch, size_t cch);
+
+	// Appends a value as 16 lowercase hex digits, which is what "%08lx%08lx"
+	// of the high and low halves gives.
+	void AppendHex64(ULONGLONG ullValue);
+
+	/**
+	 * Adds the terminator and finishes the hash. The stream has to be reset
+	 * before it is used again.
+	 *
+	 * @return false if the input didn't fit or is shorter than one block.
+	 */
+	bool Finish(WCHAR pszOut[USERCHOICE_HASH_CCH + 1]);
+};
+
+// Widest multi-buffer engine; see UserChoiceHashLanes.
+#define USERCHOICE_LANES_MAX 16
+
+/**
+ * Returns how many inputs the widest multi-buffer engine this CPU supports
+ * hashes at once: 16 with AVX-512, 8 with AVX2, 4 with SSE2, or 1 if there is
+ * only the scalar kernel.
+ */
+size_t UserChoiceGetMaxLanes();
+
+/**
+ * Hashes many UserChoice inputs, several at a time in SIMD lanes. The
+ * results are identical to calling UserChoiceHashBytes on each input.
+ *
+ * @param cLanes        1, 4, 8 or 16. Widths the CPU doesn't support fall back
+ *                      to the widest one it does.
+ * @param ppbData       Hash inputs, see UserChoiceHashBytes.
+ * @param pcbData       Sizes of the hash inputs in bytes.
+ * @param cInputs       Number of inputs.
+ * @param pszHashesOut  Receives cInputs null-terminated hashes, each taking up
+ *                      USERCHOICE_HASH_CCH + 1 characters. Inputs shorter than
+ *                      one block are left empty.
+ *
+ * @return The number of hashes generated.
+ */
+size_t UserChoiceHashLanes(
+	size_t              cLanes,
+	const BYTE *const  *ppbData,
+	const size_t       *pcbData,
+	size_t              cInputs,
+	WCHAR              *pszHashesOut
+);
+
+/**
+ * Lowercases UserChoice hash input in place, the same way CharLowerW does.
+ *
+ * Off Windows, only ASCII, Latin-1, Latin Extended-A, Greek and Cyrillic are
+ * mapped, which covers every extension and ProgID seen in practice.
+ */
+void UserChoiceLowerCase(WCHAR *pch, size_t cch);
+
+/**
+ * Holds everything about a UserChoice hash that doesn't depend on the
+ * association itself: the user's SID and the timestamp. Preparing this once
+ * means that each hash only has to copy in its extension and ProgID.
+ *
+ * A prepared context is read-only, so it can be shared between threads.
+ */
+class CUserChoiceHashContext
+{
+private:
+	// String SIDs are at most 184 characters.
+	WCHAR  _szSid[192];
+	size_t _cchSid;
+
+	// FILETIME as hex followed by the User Experience string.
+	WCHAR  _szSuffix[128];
+	size_t _cchSuffix;
+
+public:
+	CUserChoiceHashContext();
+
+	/**
+	 * @param lpszUserSid   String SID of the user.
+	 * @param ullTimestamp  Approximate write time of the UserChoice key as a
+	 *                      FILETIME; anything below the minute is ignored.
+	 *
+	 * @return false if the SID is too long.
+	 */
+	bool Init(LPCWSTR lpszUserSid, ULONGLONG ullTimestamp);
+
+	/**
+	 * Formats the hash input for an association.
+	 *
+	 * @return Length of the input excluding the terminator, or zero if it
+	 *         doesn't fit in cchOut.
+	 */
+	size_t Format(LPCWSTR lpszExtension, LPCWSTR lpszProgId, WCHAR *pszOut, size_t cchOut) const;
+
+	/**
+	 * Generates the hash for an association.
+	 *
+	 * @return true on success, false if the input was too long to format.
+	 */
+	bool Hash(LPCWSTR lpszExtension, LPCWSTR lpszProgId, WCHAR pszOut[USERCHOICE_HASH_CCH + 1]) const;
+};
+
+/**
+ * An association to generate a hash for.
+ */
+struct USERCHOICE_PAIR
+{
+	LPCWSTR lpszExtension;
+	LPCWSTR lpszProgId;
+};
+
+/**
+ * Generates hashes for many associations of the same user at once.
+ *
+ * Large batches are split between worker threads, and each thread hashes
+ * with the widest multi-buffer engine available.
+ *
+ * @param pContext      Prepared SID and timestamp.
+ * @param pPairs        The associations to hash.
+ * @param cPairs        Number of associations.
+ * @param pszHashesOut  Receives cPairs null-terminated hashes, each taking up
+ *                      USERCHOICE_HASH_CCH + 1 characters. Entries which
+ *                      couldn't be hashed are left empty.
+ *
+ * @return The number of hashes generated.
+ */
+size_t UserChoiceHashBatch(
+	const CUserChoiceHashContext *pContext,
+	const USERCHOICE_PAIR        *pPairs,
+	size_t                        cPairs,
+	WCHAR                        *pszHashesOut
+);
\ No newline at end of file
@@ -0,0 +1,66 @@
+/**
+ * 8-lane UserChoice hash engine using AVX2.
+ *
+ * Only called after userchoicehash.cpp has checked that the CPU and OS
+ * support AVX2.
+ */
+
+#include "userchoicehash.h"
+
+#include <string.h>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx2"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC target("avx2")
+#endif
+
+#include <immintrin.h>
+
+// After the target pragma, so that the engine is compiled for it too.
+#include "userchoicehashlanes.h"
+
+namespace
+{
+
+struct CLanesAVX2
+{
+	typedef __m256i T;
+	static constexpr size_t LANES = 8;
+
+	static T Load(const DWORD *p) { return _mm256_load_si256((const __m256i *)p); }
+	static void Store(DWORD *p, T v) { _mm256_store_si256((__m256i *)p, v); }
+	static T Set1(DWORD v) { return _mm256_set1_epi32((int)v); }
+
+	static T Add(T a, T b) { return _mm256_add_epi32(a, b); }
+	static T And(T a, T b) { return _mm256_and_si256(a, b); }
+	static T Or(T a, T b) { return _mm256_or_si256(a, b); }
+	static T Xor(T a, T b) { return _mm256_xor_si256(a, b); }
+	static T AndNot(T a, T b) { return _mm256_andnot_si256(a, b); }
+	static T Not(T a) { return _mm256_xor_si256(a, _mm256_set1_epi32(-1)); }
+
+	template <int n>
+	static T Rotl(T v) { return _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - n)); }
+
+	template <int n>
+	static T Shr(T v) { return _mm256_srli_epi32(v, n); }
+
+	static T MulLo(T a, T b) { return _mm256_mullo_epi32(a, b); }
+
+	static T Select(T mask, T a, T b) { return _mm256_blendv_epi8(b, a, mask); }
+};
+
+} // namespace
+
+void UserChoiceHashLanes_AVX2(const BYTE *const *ppbData, const size_t *pcbData, DWORD (*rgHash)[2])
+{
+	HashLanes<CLanesAVX2>(ppbData, pcbData, rgHash);
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#endif
+
+#endif // x86
\ No newline at end of file
@@ -0,0 +1,72 @@
+/**
+ * 16-lane UserChoice hash engine using AVX-512F.
+ *
+ * Only called after userchoicehash.cpp has checked that the CPU and OS
+ * support AVX-512F, which also brings a real rotate instruction.
+ */
+
+#include "userchoicehash.h"
+
+#include <string.h>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx512f"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC target("avx512f")
+// GCC's own headers trip this on _mm512_undefined_epi32().
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+#include <immintrin.h>
+
+// After the target pragma, so that the engine is compiled for it too.
+#include "userchoicehashlanes.h"
+
+namespace
+{
+
+struct CLanesAVX512
+{
+	typedef __m512i T;
+	static constexpr size_t LANES = 16;
+
+	static T Load(const DWORD *p) { return _mm512_load_si512((const void *)p); }
+	static void Store(DWORD *p, T v) { _mm512_store_si512((void *)p, v); }
+	static T Set1(DWORD v) { return _mm512_set1_epi32((int)v); }
+
+	static T Add(T a, T b) { return _mm512_add_epi32(a, b); }
+	static T And(T a, T b) { return _mm512_and_si512(a, b); }
+	static T Or(T a, T b) { return _mm512_or_si512(a, b); }
+	static T Xor(T a, T b) { return _mm512_xor_si512(a, b); }
+	static T AndNot(T a, T b) { return _mm512_andnot_si512(a, b); }
+	static T Not(T a) { return _mm512_ternarylogic_epi32(a, a, a, 0x55); }
+
+	template <int n>
+	static T Rotl(T v) { return _mm512_rol_epi32(v, n); }
+
+	template <int n>
+	static T Shr(T v) { return _mm512_srli_epi32(v, n); }
+
+	static T MulLo(T a, T b) { return _mm512_mullo_epi32(a, b); }
+
+	static T Select(T mask, T a, T b)
+	{
+		return _mm512_mask_blend_epi32(_mm512_test_epi32_mask(mask, mask), b, a);
+	}
+};
+
+} // namespace
+
+void UserChoiceHashLanes_AVX512(const BYTE *const *ppbData, const size_t *pcbData, DWORD (*rgHash)[2])
+{
+	HashLanes<CLanesAVX512>(ppbData, pcbData, rgHash);
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#endif
+
+#endif // x86
\ No newline at end of file
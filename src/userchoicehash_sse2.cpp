@@ -0,0 +1,74 @@
+/**
+ * 4-lane UserChoice hash engine using SSE2.
+ *
+ * SSE2 is part of x64, so this is always available there. It has no 32-bit
+ * multiply, so MulLo is put together from two 32x32->64 multiplies.
+ */
+
+#include "userchoicehash.h"
+
+#include <string.h>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("sse2"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC target("sse2")
+#endif
+
+#include <emmintrin.h>
+
+// After the target pragma, so that the engine is compiled for it too.
+#include "userchoicehashlanes.h"
+
+namespace
+{
+
+struct CLanesSSE2
+{
+	typedef __m128i T;
+	static constexpr size_t LANES = 4;
+
+	static T Load(const DWORD *p) { return _mm_load_si128((const __m128i *)p); }
+	static void Store(DWORD *p, T v) { _mm_store_si128((__m128i *)p, v); }
+	static T Set1(DWORD v) { return _mm_set1_epi32((int)v); }
+
+	static T Add(T a, T b) { return _mm_add_epi32(a, b); }
+	static T And(T a, T b) { return _mm_and_si128(a, b); }
+	static T Or(T a, T b) { return _mm_or_si128(a, b); }
+	static T Xor(T a, T b) { return _mm_xor_si128(a, b); }
+	static T AndNot(T a, T b) { return _mm_andnot_si128(a, b); }
+	static T Not(T a) { return _mm_xor_si128(a, _mm_set1_epi32(-1)); }
+
+	template <int n>
+	static T Rotl(T v) { return _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - n)); }
+
+	template <int n>
+	static T Shr(T v) { return _mm_srli_epi32(v, n); }
+
+	static T MulLo(T a, T b)
+	{
+		__m128i even = _mm_mul_epu32(a, b);
+		__m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+		return _mm_unpacklo_epi32(
+			_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+			_mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0))
+		);
+	}
+
+	static T Select(T mask, T a, T b) { return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b)); }
+};
+
+} // namespace
+
+void UserChoiceHashLanes_SSE2(const BYTE *const *ppbData, const size_t *pcbData, DWORD (*rgHash)[2])
+{
+	HashLanes<CLanesSSE2>(ppbData, pcbData, rgHash);
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#endif
+
+#endif // x86
\ No newline at end of file
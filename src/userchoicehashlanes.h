@@ -0,0 +1,329 @@
+#pragma once
+
+/**
+ * Multi-buffer UserChoice hash engine.
+ *
+ * The scalar kernel is stuck on one long dependency chain per string: MD5 and
+ * then the h0/h1 scramble, where every step depends on the previous one.
+ * Nothing depends on the *other* strings though, so this runs the exact same
+ * code over 4, 8 or 16 strings at once with one string per SIMD lane.
+ *
+ * Strings don't need to be the same length. Each lane keeps its own block
+ * count, and lanes which have run out of input stop updating their state.
+ *
+ * The per-instruction-set translation units (userchoicehash_sse2.cpp and
+ * friends) instantiate the engine with their vector type, and the dispatcher
+ * in userchoicehash.cpp picks one of them at runtime. Everything in here is a
+ * template or has internal linkage so that code compiled for one instruction
+ * set can never be picked up by a translation unit compiled for another.
+ */
+
+#include "userchoicehash.h"
+
+#include <string.h>
+
+/**
+ * Per-instruction-set entry points. Each one hashes exactly as many inputs as
+ * it has lanes.
+ *
+ * @param ppbData  Hash inputs, see UserChoiceHashBytes.
+ * @param pcbData  Sizes of the hash inputs in bytes.
+ * @param rgHash   Receives the checksum DWORDs for each lane.
+ */
+void UserChoiceHashLanes_SSE2(const BYTE *const *ppbData, const size_t *pcbData, DWORD (*rgHash)[2]);
+void UserChoiceHashLanes_AVX2(const BYTE *const *ppbData, const size_t *pcbData, DWORD (*rgHash)[2]);
+void UserChoiceHashLanes_AVX512(const BYTE *const *ppbData, const size_t *pcbData, DWORD (*rgHash)[2]);
+
+#if defined(_MSC_VER)
+#define LANES_ALIGN(n) __declspec(align(n))
+#else
+#define LANES_ALIGN(n) __attribute__((aligned(n)))
+#endif
+
+namespace
+{
+
+/**
+ * Reads the tail of one lane's input into MD5 padding blocks.
+ *
+ * @return The number of padding blocks (1 or 2).
+ */
+inline size_t BuildMD5Tail(const BYTE *pbData, size_t cbData, BYTE rgbTail[128])
+{
+	size_t cbFull = cbData & ~(size_t)63;
+	size_t cbRemaining = cbData - cbFull;
+	size_t cTailBlocks = (cbRemaining + 1 + 8 > 64) ? 2 : 1;
+
+	memset(rgbTail, 0, 128);
+	if (cbRemaining)
+		memcpy(rgbTail, &pbData[cbFull], cbRemaining);
+	rgbTail[cbRemaining] = 0x80;
+
+	ULONGLONG cBits = (ULONGLONG)cbData * 8;
+	BYTE *pbLength = &rgbTail[cTailBlocks * 64 - 8];
+	for (int i = 0; i < 8; i++)
+		pbLength[i] = (BYTE)(cBits >> (i * 8));
+
+	return cTailBlocks;
+}
+
+inline DWORD ReadLaneDword(const BYTE *pb)
+{
+	return (DWORD)pb[0] |
+		((DWORD)pb[1] << 8) |
+		((DWORD)pb[2] << 16) |
+		((DWORD)pb[3] << 24);
+}
+
+/**
+ * The engine itself.
+ *
+ * V provides the vector type and operations:
+ *
+ *     V::LANES, V::T
+ *     Load(const DWORD *), Store(DWORD *, T), Set1(DWORD)
+ *     Add, And, Or, Xor, AndNot(a, b) = ~a & b, Not
+ *     Rotl<n>, Shr<n>, MulLo
+ *     Select(mask, a, b) = mask ? a : b, per lane
+ */
+template <class V>
+void HashLanes(const BYTE *const *ppbData, const size_t *pcbData, DWORD (*rgHash)[2])
+{
+	typedef typename V::T T;
+	constexpr size_t N = V::LANES;
+
+	//
+	// MD5
+	//
+
+	BYTE rgbTails[N][128];
+	size_t rgcFullBlocks[N];
+	size_t rgcBlocks[N];
+	size_t cMaxBlocks = 0;
+
+	for (size_t lane = 0; lane < N; lane++)
+	{
+		rgcFullBlocks[lane] = pcbData[lane] / 64;
+		rgcBlocks[lane] = rgcFullBlocks[lane] + BuildMD5Tail(ppbData[lane], pcbData[lane], rgbTails[lane]);
+		if (rgcBlocks[lane] > cMaxBlocks)
+			cMaxBlocks = rgcBlocks[lane];
+	}
+
+	T state[4] = {
+		V::Set1(0x67452301uL),
+		V::Set1(0xEFCDAB89uL),
+		V::Set1(0x98BADCFEuL),
+		V::Set1(0x10325476uL),
+	};
+
+	LANES_ALIGN(64) DWORD rgdwWords[16][N];
+	LANES_ALIGN(64) DWORD rgdwMask[N];
+
+	for (size_t block = 0; block < cMaxBlocks; block++)
+	{
+		// Transpose this block of every lane so that each vector holds the
+		// same word of all lanes:
+		for (size_t lane = 0; lane < N; lane++)
+		{
+			const BYTE *pbBlock;
+			if (block < rgcFullBlocks[lane])
+				pbBlock = &ppbData[lane][block * 64];
+			else if (block < rgcBlocks[lane])
+				pbBlock = &rgbTails[lane][(block - rgcFullBlocks[lane]) * 64];
+			else
+				pbBlock = rgbTails[lane]; // Finished; the result is discarded.
+
+			for (size_t i = 0; i < 16; i++)
+				rgdwWords[i][lane] = ReadLaneDword(&pbBlock[i * 4]);
+
+			rgdwMask[lane] = (block < rgcBlocks[lane]) ? 0xFFFFFFFFuL : 0;
+		}
+
+		T x[16];
+		for (size_t i = 0; i < 16; i++)
+			x[i] = V::Load(rgdwWords[i]);
+
+		T a = state[0];
+		T b = state[1];
+		T c = state[2];
+		T d = state[3];
+
+#define LANES_F(x, y, z) V::Or(V::And(x, y), V::AndNot(x, z))
+#define LANES_G(x, y, z) V::Or(V::And(x, z), V::AndNot(z, y))
+#define LANES_H(x, y, z) V::Xor(V::Xor(x, y), z)
+#define LANES_I(x, y, z) V::Xor(y, V::Or(x, V::Not(z)))
+#define LANES_STEP(f, a, b, c, d, x, t, s) \
+		a = V::Add(a, V::Add(f(b, c, d), V::Add(x, V::Set1(t)))); \
+		a = V::Add(V::template Rotl<s>(a), b);
+
+		// Round 1
+		LANES_STEP(LANES_F, a, b, c, d, x[ 0], 0xD76AA478uL,  7)
+		LANES_STEP(LANES_F, d, a, b, c, x[ 1], 0xE8C7B756uL, 12)
+		LANES_STEP(LANES_F, c, d, a, b, x[ 2], 0x242070DBuL, 17)
+		LANES_STEP(LANES_F, b, c, d, a, x[ 3], 0xC1BDCEEEuL, 22)
+		LANES_STEP(LANES_F, a, b, c, d, x[ 4], 0xF57C0FAFuL,  7)
+		LANES_STEP(LANES_F, d, a, b, c, x[ 5], 0x4787C62AuL, 12)
+		LANES_STEP(LANES_F, c, d, a, b, x[ 6], 0xA8304613uL, 17)
+		LANES_STEP(LANES_F, b, c, d, a, x[ 7], 0xFD469501uL, 22)
+		LANES_STEP(LANES_F, a, b, c, d, x[ 8], 0x698098D8uL,  7)
+		LANES_STEP(LANES_F, d, a, b, c, x[ 9], 0x8B44F7AFuL, 12)
+		LANES_STEP(LANES_F, c, d, a, b, x[10], 0xFFFF5BB1uL, 17)
+		LANES_STEP(LANES_F, b, c, d, a, x[11], 0x895CD7BEuL, 22)
+		LANES_STEP(LANES_F, a, b, c, d, x[12], 0x6B901122uL,  7)
+		LANES_STEP(LANES_F, d, a, b, c, x[13], 0xFD987193uL, 12)
+		LANES_STEP(LANES_F, c, d, a, b, x[14], 0xA679438EuL, 17)
+		LANES_STEP(LANES_F, b, c, d, a, x[15], 0x49B40821uL, 22)
+
+		// Round 2
+		LANES_STEP(LANES_G, a, b, c, d, x[ 1], 0xF61E2562uL,  5)
+		LANES_STEP(LANES_G, d, a, b, c, x[ 6], 0xC040B340uL,  9)
+		LANES_STEP(LANES_G, c, d, a, b, x[11], 0x265E5A51uL, 14)
+		LANES_STEP(LANES_G, b, c, d, a, x[ 0], 0xE9B6C7AAuL, 20)
+		LANES_STEP(LANES_G, a, b, c, d, x[ 5], 0xD62F105DuL,  5)
+		LANES_STEP(LANES_G, d, a, b, c, x[10], 0x02441453uL,  9)
+		LANES_STEP(LANES_G, c, d, a, b, x[15], 0xD8A1E681uL, 14)
+		LANES_STEP(LANES_G, b, c, d, a, x[ 4], 0xE7D3FBC8uL, 20)
+		LANES_STEP(LANES_G, a, b, c, d, x[ 9], 0x21E1CDE6uL,  5)
+		LANES_STEP(LANES_G, d, a, b, c, x[14], 0xC33707D6uL,  9)
+		LANES_STEP(LANES_G, c, d, a, b, x[ 3], 0xF4D50D87uL, 14)
+		LANES_STEP(LANES_G, b, c, d, a, x[ 8], 0x455A14EDuL, 20)
+		LANES_STEP(LANES_G, a, b, c, d, x[13], 0xA9E3E905uL,  5)
+		LANES_STEP(LANES_G, d, a, b, c, x[ 2], 0xFCEFA3F8uL,  9)
+		LANES_STEP(LANES_G, c, d, a, b, x[ 7], 0x676F02D9uL, 14)
+		LANES_STEP(LANES_G, b, c, d, a, x[12], 0x8D2A4C8AuL, 20)
+
+		// Round 3
+		LANES_STEP(LANES_H, a, b, c, d, x[ 5], 0xFFFA3942uL,  4)
+		LANES_STEP(LANES_H, d, a, b, c, x[ 8], 0x8771F681uL, 11)
+		LANES_STEP(LANES_H, c, d, a, b, x[11], 0x6D9D6122uL, 16)
+		LANES_STEP(LANES_H, b, c, d, a, x[14], 0xFDE5380CuL, 23)
+		LANES_STEP(LANES_H, a, b, c, d, x[ 1], 0xA4BEEA44uL,  4)
+		LANES_STEP(LANES_H, d, a, b, c, x[ 4], 0x4BDECFA9uL, 11)
+		LANES_STEP(LANES_H, c, d, a, b, x[ 7], 0xF6BB4B60uL, 16)
+		LANES_STEP(LANES_H, b, c, d, a, x[10], 0xBEBFBC70uL, 23)
+		LANES_STEP(LANES_H, a, b, c, d, x[13], 0x289B7EC6uL,  4)
+		LANES_STEP(LANES_H, d, a, b, c, x[ 0], 0xEAA127FAuL, 11)
+		LANES_STEP(LANES_H, c, d, a, b, x[ 3], 0xD4EF3085uL, 16)
+		LANES_STEP(LANES_H, b, c, d, a, x[ 6], 0x04881D05uL, 23)
+		LANES_STEP(LANES_H, a, b, c, d, x[ 9], 0xD9D4D039uL,  4)
+		LANES_STEP(LANES_H, d, a, b, c, x[12], 0xE6DB99E5uL, 11)
+		LANES_STEP(LANES_H, c, d, a, b, x[15], 0x1FA27CF8uL, 16)
+		LANES_STEP(LANES_H, b, c, d, a, x[ 2], 0xC4AC5665uL, 23)
+
+		// Round 4
+		LANES_STEP(LANES_I, a, b, c, d, x[ 0], 0xF4292244uL,  6)
+		LANES_STEP(LANES_I, d, a, b, c, x[ 7], 0x432AFF97uL, 10)
+		LANES_STEP(LANES_I, c, d, a, b, x[14], 0xAB9423A7uL, 15)
+		LANES_STEP(LANES_I, b, c, d, a, x[ 5], 0xFC93A039uL, 21)
+		LANES_STEP(LANES_I, a, b, c, d, x[12], 0x655B59C3uL,  6)
+		LANES_STEP(LANES_I, d, a, b, c, x[ 3], 0x8F0CCC92uL, 10)
+		LANES_STEP(LANES_I, c, d, a, b, x[10], 0xFFEFF47DuL, 15)
+		LANES_STEP(LANES_I, b, c, d, a, x[ 1], 0x85845DD1uL, 21)
+		LANES_STEP(LANES_I, a, b, c, d, x[ 8], 0x6FA87E4FuL,  6)
+		LANES_STEP(LANES_I, d, a, b, c, x[15], 0xFE2CE6E0uL, 10)
+		LANES_STEP(LANES_I, c, d, a, b, x[ 6], 0xA3014314uL, 15)
+		LANES_STEP(LANES_I, b, c, d, a, x[13], 0x4E0811A1uL, 21)
+		LANES_STEP(LANES_I, a, b, c, d, x[ 4], 0xF7537E82uL,  6)
+		LANES_STEP(LANES_I, d, a, b, c, x[11], 0xBD3AF235uL, 10)
+		LANES_STEP(LANES_I, c, d, a, b, x[ 2], 0x2AD7D2BBuL, 15)
+		LANES_STEP(LANES_I, b, c, d, a, x[ 9], 0xEB86D391uL, 21)
+
+#undef LANES_F
+#undef LANES_G
+#undef LANES_H
+#undef LANES_I
+#undef LANES_STEP
+
+		T mask = V::Load(rgdwMask);
+		state[0] = V::Select(mask, V::Add(state[0], a), state[0]);
+		state[1] = V::Select(mask, V::Add(state[1], b), state[1]);
+		state[2] = V::Select(mask, V::Add(state[2], c), state[2]);
+		state[3] = V::Select(mask, V::Add(state[3], d), state[3]);
+	}
+
+	//
+	// Scramble; see UserChoiceScramble for the scalar version.
+	//
+
+	size_t rgcScrambleBlocks[N];
+	size_t cMaxScrambleBlocks = 0;
+	for (size_t lane = 0; lane < N; lane++)
+	{
+		rgcScrambleBlocks[lane] = pcbData[lane] / 8;
+		if (rgcScrambleBlocks[lane] > cMaxScrambleBlocks)
+			cMaxScrambleBlocks = rgcScrambleBlocks[lane];
+	}
+
+	const T one = V::Set1(1);
+	const T C0s[2][5] = {
+		{ V::Or(state[0], one), V::Set1(0xCF98B111uL), V::Set1(0x87085B9FuL), V::Set1(0x12CEB96DuL), V::Set1(0x257E1D83uL) },
+		{ V::Or(state[1], one), V::Set1(0xA27416F5uL), V::Set1(0xD38396FFuL), V::Set1(0x7C932B89uL), V::Set1(0xBFA49F69uL) },
+	};
+	const T C1s[2][5] = {
+		{ V::Or(state[0], one), V::Set1(0xEF0569FBuL), V::Set1(0x689B6B9FuL), V::Set1(0x79F8A395uL), V::Set1(0xC3EFEA97uL) },
+		{ V::Or(state[1], one), V::Set1(0xC31713DBuL), V::Set1(0xDDCD1F0FuL), V::Set1(0x59C3AF2DuL), V::Set1(0x35BD1EC9uL) },
+	};
+
+	T h0 = V::Set1(0);
+	T h1 = V::Set1(0);
+	T h0Acc = V::Set1(0);
+	T h1Acc = V::Set1(0);
+
+	for (size_t block = 0; block < cMaxScrambleBlocks; block++)
+	{
+		for (size_t lane = 0; lane < N; lane++)
+		{
+			if (block < rgcScrambleBlocks[lane])
+			{
+				rgdwWords[0][lane] = ReadLaneDword(&ppbData[lane][block * 8]);
+				rgdwWords[1][lane] = ReadLaneDword(&ppbData[lane][block * 8 + 4]);
+				rgdwMask[lane] = 0xFFFFFFFFuL;
+			}
+			else
+			{
+				rgdwWords[0][lane] = 0;
+				rgdwWords[1][lane] = 0;
+				rgdwMask[lane] = 0;
+			}
+		}
+
+		T mask = V::Load(rgdwMask);
+
+		for (size_t j = 0; j < 2; j++)
+		{
+			const T *C0 = C0s[j];
+			const T *C1 = C1s[j];
+			T input = V::Load(rgdwWords[j]);
+
+			T h0New = V::Add(h0, input);
+			h0New = V::MulLo(h0New, C0[0]);
+			h0New = V::MulLo(V::template Rotl<16>(h0New), C0[1]);
+			h0New = V::MulLo(V::template Rotl<16>(h0New), C0[2]);
+			h0New = V::MulLo(V::template Rotl<16>(h0New), C0[3]);
+			h0New = V::MulLo(V::template Rotl<16>(h0New), C0[4]);
+
+			T h1New = V::Add(h1, input);
+			h1New = V::Add(V::MulLo(V::template Rotl<16>(h1New), C1[1]), V::MulLo(h1New, C1[0]));
+			h1New = V::Add(V::MulLo(V::template Shr<16>(h1New), C1[2]), V::MulLo(h1New, C1[3]));
+			h1New = V::Add(V::MulLo(V::template Rotl<16>(h1New), C1[4]), h1New);
+
+			h0 = V::Select(mask, h0New, h0);
+			h1 = V::Select(mask, h1New, h1);
+			h0Acc = V::Select(mask, V::Add(h0Acc, h0New), h0Acc);
+			h1Acc = V::Select(mask, V::Add(h1Acc, h1New), h1Acc);
+		}
+	}
+
+	LANES_ALIGN(64) DWORD rgdwHash0[N];
+	LANES_ALIGN(64) DWORD rgdwHash1[N];
+	V::Store(rgdwHash0, V::Xor(h0, h1));
+	V::Store(rgdwHash1, V::Xor(h0Acc, h1Acc));
+
+	for (size_t lane = 0; lane < N; lane++)
+	{
+		rgHash[lane][0] = rgdwHash0[lane];
+		rgHash[lane][1] = rgdwHash1[lane];
+	}
+}
+
+} // namespace
\ No newline at end of file
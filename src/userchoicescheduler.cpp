@@ -0,0 +1,131 @@
+#include "userchoicescheduler.h"
+
+#include <algorithm>
+
+// C++14 still wants these defined somewhere if they're ever bound to a
+// reference.
+constexpr size_t CUserChoiceWriteScheduler::LATENCY_HISTORY;
+constexpr ULONGLONG CUserChoiceWriteScheduler::DEFAULT_BUDGET;
+constexpr ULONGLONG CUserChoiceWriteScheduler::MIN_BUDGET;
+
+static inline ULONGLONG MinuteOf(ULONGLONG ullTime)
+{
+	return ullTime - ullTime % USERCHOICE_FILETIME_PER_MINUTE;
+}
+
+CUserChoiceWriteScheduler::CUserChoiceWriteScheduler(IUserChoiceClock *pClock)
+	: _pClock(pClock)
+	, _rgullLatencies{ 0 }
+	, _cLatencies(0)
+	, _iNextLatency(0)
+{
+}
+
+void CUserChoiceWriteScheduler::RecordLatency(ULONGLONG ullLatency)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	_rgullLatencies[_iNextLatency] = ullLatency;
+	_iNextLatency = (_iNextLatency + 1) % LATENCY_HISTORY;
+	if (_cLatencies < LATENCY_HISTORY)
+		_cLatencies++;
+}
+
+ULONGLONG CUserChoiceWriteScheduler::GetBudget()
+{
+	ULONGLONG rgullSorted[LATENCY_HISTORY];
+	size_t cLatencies;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		cLatencies = _cLatencies;
+		std::copy(_rgullLatencies, _rgullLatencies + cLatencies, rgullSorted);
+	}
+
+	if (!cLatencies)
+	{
+		return DEFAULT_BUDGET;
+	}
+
+	// With only a few samples, this is just the slowest one.
+	size_t iPercentile = (cLatencies * 95 + 99) / 100 - 1;
+	std::nth_element(rgullSorted, rgullSorted + iPercentile, rgullSorted + cLatencies);
+
+	ULONGLONG ullBudget = rgullSorted[iPercentile] + rgullSorted[iPercentile] / 4;
+	return (ullBudget < MIN_BUDGET) ? MIN_BUDGET : ullBudget;
+}
+
+UserChoiceWriteDecision CUserChoiceWriteScheduler::s_Decide(
+	ULONGLONG  ullNow,
+	ULONGLONG  ullBudget,
+	ULONGLONG *pullHashTime
+)
+{
+	ULONGLONG ullNextMinute = MinuteOf(ullNow) + USERCHOICE_FILETIME_PER_MINUTE;
+
+	if (ullNextMinute - ullNow > ullBudget)
+	{
+		*pullHashTime = ullNow;
+		return UserChoiceWriteDecision::WRITE_NOW;
+	}
+
+	*pullHashTime = ullNextMinute;
+	return UserChoiceWriteDecision::WAIT_FOR_NEXT_MINUTE;
+}
+
+bool CUserChoiceWriteScheduler::Write(IUserChoiceWriter *pWriter, USERCHOICE_WRITE_REPORT *pReport)
+{
+	USERCHOICE_WRITE_REPORT report = {};
+
+	for (;;)
+	{
+		report.ullBudget = GetBudget();
+
+		ULONGLONG ullHashTime;
+		ULONGLONG ullNow = _pClock->Now();
+		report.decision = s_Decide(ullNow, report.ullBudget, &ullHashTime);
+
+		if (!pWriter->Prepare(ullHashTime))
+		{
+			break;
+		}
+
+		if (report.decision == UserChoiceWriteDecision::WAIT_FOR_NEXT_MINUTE)
+		{
+			_pClock->SleepUntil(ullHashTime);
+			report.ullWaited += ullHashTime - ullNow;
+		}
+
+		ULONGLONG ullWriteStart = _pClock->Now();
+		bool fWritten = pWriter->Write();
+		ULONGLONG ullWriteEnd = _pClock->Now();
+
+		report.cAttempts++;
+		report.ullLatency = ullWriteEnd - ullWriteStart;
+		RecordLatency(report.ullLatency);
+
+		if (!fWritten)
+		{
+			break;
+		}
+
+		if (MinuteOf(ullWriteEnd) == MinuteOf(ullHashTime))
+		{
+			if (pReport)
+				*pReport = report;
+			return true;
+		}
+
+		// The write ran into the next minute, so the hash it wrote is already
+		// stale. The slow write is in the history now, so the next attempt
+		// gives it more room. A write which can't fit in a whole minute never
+		// will though.
+		if (report.ullLatency >= USERCHOICE_FILETIME_PER_MINUTE)
+		{
+			break;
+		}
+	}
+
+	if (pReport)
+		*pReport = report;
+	return false;
+}
\ No newline at end of file
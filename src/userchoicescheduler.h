@@ -0,0 +1,169 @@
+#pragma once
+
+/**
+ * Schedules UserChoice writes around minute boundaries.
+ *
+ * A UserChoice hash includes the minute it was written in, so a write has to
+ * finish in the same minute that its hash was generated for. Rather than
+ * assuming every write takes under a second, the scheduler keeps track of how
+ * long recent writes actually took. If the current minute doesn't have enough
+ * time left, it generates the hash for the *next* minute instead and waits
+ * for the boundary, which gives the write a whole minute.
+ *
+ * Time comes from an IUserChoiceClock, so tests can drive it by hand.
+ */
+
+#include "wincompat.h"
+
+#include <mutex>
+
+// FILETIME units (100 ns) in a millisecond and in a minute.
+#define USERCHOICE_FILETIME_PER_MS     10000uLL
+#define USERCHOICE_FILETIME_PER_MINUTE (60uLL * 1000 * USERCHOICE_FILETIME_PER_MS)
+
+/**
+ * Source of the current UTC time as a FILETIME.
+ */
+class IUserChoiceClock
+{
+public:
+	virtual ~IUserChoiceClock() {}
+
+	virtual ULONGLONG Now() = 0;
+
+	// Returns once Now() has reached ullTime.
+	virtual void SleepUntil(ULONGLONG ullTime) = 0;
+};
+
+/**
+ * The write being scheduled.
+ */
+class IUserChoiceWriter
+{
+public:
+	virtual ~IUserChoiceWriter() {}
+
+	/**
+	 * Generates the hash for the given time. This is called before waiting
+	 * for a minute boundary, so that only the write itself is left after it.
+	 *
+	 * @return false if the hash couldn't be generated.
+	 */
+	virtual bool Prepare(ULONGLONG ullHashTime) = 0;
+
+	/**
+	 * Writes the association with the hash from the last Prepare call.
+	 *
+	 * @return false if the write failed.
+	 */
+	virtual bool Write() = 0;
+};
+
+/**
+ * What the scheduler did for a write.
+ */
+enum class UserChoiceWriteDecision
+{
+	// There was enough time left in the minute to write straight away.
+	WRITE_NOW,
+
+	// The hash was generated for the next minute, and the write waited until
+	// that minute began.
+	WAIT_FOR_NEXT_MINUTE,
+
+	// The association was already set with a valid hash, so nothing was
+	// written. The scheduler itself never decides this.
+	ALREADY_CURRENT,
+};
+
+/**
+ * Outcome of CUserChoiceWriteScheduler::Write.
+ */
+struct USERCHOICE_WRITE_REPORT
+{
+	// Decision taken for the last attempt.
+	UserChoiceWriteDecision decision;
+
+	// Number of writes made. More than one means a write ran into the next
+	// minute and had to be redone.
+	DWORD cAttempts;
+
+	// Time the write was expected to take when it was planned, in FILETIME
+	// units.
+	ULONGLONG ullBudget;
+
+	// Total time spent waiting for minute boundaries.
+	ULONGLONG ullWaited;
+
+	// How long the last write took.
+	ULONGLONG ullLatency;
+};
+
+class CUserChoiceWriteScheduler
+{
+private:
+	// Number of recent write latencies kept.
+	static constexpr size_t LATENCY_HISTORY = 32;
+
+	IUserChoiceClock *_pClock;
+
+	std::mutex _mutex;
+	ULONGLONG  _rgullLatencies[LATENCY_HISTORY];
+	size_t     _cLatencies;
+	size_t     _iNextLatency;
+
+public:
+	// With no history, writes are expected to take this long, which is what
+	// SetUserChoiceAndHash always assumed before.
+	static constexpr ULONGLONG DEFAULT_BUDGET = 1000 * USERCHOICE_FILETIME_PER_MS;
+
+	// Never plan on less than this, however fast writes have been.
+	static constexpr ULONGLONG MIN_BUDGET = 100 * USERCHOICE_FILETIME_PER_MS;
+
+	/**
+	 * @param pClock  Clock to use; it has to outlive the scheduler.
+	 */
+	CUserChoiceWriteScheduler(IUserChoiceClock *pClock);
+
+	/**
+	 * Adds a write latency to the history.
+	 */
+	void RecordLatency(ULONGLONG ullLatency);
+
+	/**
+	 * Returns how much time a write should be given: the 95th percentile of
+	 * recent write latencies plus a quarter on top, or DEFAULT_BUDGET if no
+	 * write has been recorded yet.
+	 */
+	ULONGLONG GetBudget();
+
+	/**
+	 * Decides whether a write starting at ullNow has to wait for the next
+	 * minute.
+	 *
+	 * @param ullNow       Current time.
+	 * @param ullBudget    Expected write time.
+	 * @param pullHashTime Receives the time to generate the hash for.
+	 */
+	static UserChoiceWriteDecision s_Decide(ULONGLONG ullNow, ULONGLONG ullBudget, ULONGLONG *pullHashTime);
+
+	/**
+	 * Prepares and writes an association, waiting for a minute boundary when
+	 * needed. A write which ends up finishing in a later minute than its hash
+	 * is redone; this only gives up if the writer fails, or if a single write
+	 * takes longer than a whole minute.
+	 *
+	 * @param pWriter  The write to make.
+	 * @param pReport  Optional; receives what was done.
+	 *
+	 * @return true if the association was written with a valid hash.
+	 */
+	bool Write(IUserChoiceWriter *pWriter, USERCHOICE_WRITE_REPORT *pReport = nullptr);
+};
+
+#ifdef _WIN32
+/**
+ * The real clock, from GetSystemTimeAsFileTime.
+ */
+IUserChoiceClock *GetSystemUserChoiceClock();
+#endif
\ No newline at end of file
@@ -2,7 +2,10 @@
 #include "openwithex.h"
 #include <stdio.h>
 
-#include "assocuserchoice.h"
+#include "registrybackend.h"
+#include "assocregistry.h"
+#include "assoclookup.h"
+#include "assochandlercache.h"
 #include "wil/com.h"
 #include "wil/resource.h"
 
@@ -33,49 +36,7 @@ bool GetExtensionRegKey(
 	HKEY    *pHkOut
 )
 {
-	if (!lpszExtension || !*lpszExtension || !pHkOut)
-	{
-		return false;
-	}
-	*pHkOut = NULL;
-
-	wil::unique_hkey hk = NULL;
-	RegOpenKeyExW(
-		HKEY_CLASSES_ROOT,
-		lpszExtension,
-		NULL,
-		KEY_READ,
-		&hk
-	);
-
-	WCHAR szKeyName[MAX_PATH] = { 0 };
-	DWORD dwKeyNameSize = sizeof(szKeyName);
-	RegQueryValueExW(
-		hk.get(),
-		L"",
-		NULL,
-		NULL,
-		(LPBYTE)szKeyName,
-		&dwKeyNameSize
-	);
-
-	hk.reset();
-
-	if (!*szKeyName)
-	{
-		return false;
-	}
-
-	HKEY hkResult = NULL;
-	RegOpenKeyExW(
-		HKEY_CLASSES_ROOT,
-		szKeyName,
-		NULL,
-		KEY_READ,
-		&hkResult
-	);
-	*pHkOut = hkResult;
-	return (hkResult != NULL);
+	return AssocOpenProgIdKey(GetSystemRegistryBackend(), lpszExtension, pHkOut);
 }
 
 /**
@@ -84,22 +45,27 @@ bool GetExtensionRegKey(
   */
 bool AssociationExists(LPCWSTR lpszExtension, bool fIsUri)
 {
-	if (!lpszExtension)
-		return false;
-
-	wil::unique_hkey hk;
-	if (GetExtensionRegKey(lpszExtension, &hk) && hk.get())
-		return true;
+	std::shared_ptr<const CAssocLookupEntry> pLookup = GetAssocLookupCache()->Lookup(lpszExtension, fIsUri);
+	return pLookup && pLookup->Exists();
+}
 
-	std::unique_ptr<WCHAR[]> lpszKeyPath = GetAssociationKeyPath(lpszExtension, fIsUri);
-	if (STATUS_SUCCESS == RegOpenKeyExW(
-		HKEY_CURRENT_USER,
-		lpszKeyPath.get(),
-		NULL,
-		KEY_READ,
-		&hk
-	) && hk.get())
-		return true;
+/**
+  * Get the process-wide cache of extension and protocol lookups.
+  * 
+  * Anything that changes an association invalidates it here.
+  */
+CAssocLookupCache *GetAssocLookupCache()
+{
+	static CAssocLookupCache s_lookupCache(GetSystemRegistryBackend());
+	return &s_lookupCache;
+}
 
-	return false;
+/**
+  * Get the handlers each extension and protocol had when the dialog last
+  * enumerated them.
+  */
+CAssocHandlerCache *GetAssocHandlerCache()
+{
+	static CAssocHandlerCache s_handlerCache(GetShellAssocHandlerCacheStore(), GetSystemRegistryBackend());
+	return &s_handlerCache;
 }
\ No newline at end of file
@@ -2,6 +2,11 @@
 
 #include <windows.h>
 
+class CAssocLookupCache;
+class CAssocHandlerCache;
+
 int LocalizedMessageBox(HWND hWndParent, UINT uMsgId, UINT uType);
 bool GetExtensionRegKey(LPCWSTR lpszExtension, HKEY *pHkOut);
-bool AssociationExists(LPCWSTR lpszExtension, bool fIsUri);
\ No newline at end of file
+bool AssociationExists(LPCWSTR lpszExtension, bool fIsUri);
+CAssocLookupCache *GetAssocLookupCache();
+CAssocHandlerCache *GetAssocHandlerCache();
\ No newline at end of file
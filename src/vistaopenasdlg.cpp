@@ -139,8 +139,7 @@ void CVistaOpenAsDlg::_SelectItemByIndex(int index)
 		(LPARAM)&lvi
 	);
 
-	wil::com_ptr<IAssocHandler> pHandler = m_handlers.at(index);
-	if (pHandler)
+	if ((size_t)index < m_handlerTable.GetCount())
 	{
 		LVGROUP lvg = { sizeof(LVGROUP) };
 		lvg.mask = LVGF_STATE;
@@ -149,7 +148,7 @@ void CVistaOpenAsDlg::_SelectItemByIndex(int index)
 		SendDlgItemMessageW(
 			m_hWnd, IDD_OPENWITH_PROGLIST,
 			LVM_SETGROUPINFO,
-			(S_OK == pHandler->IsRecommended()) ? I_RECOMMENDED : I_OTHER,
+			m_handlerTable.IsRecommended(index) ? I_RECOMMENDED : I_OTHER,
 			(LPARAM)&lvg
 		);
 	}
@@ -205,19 +204,19 @@ void CVistaOpenAsDlg::_SetupCategories()
 	);
 }
 
-void CVistaOpenAsDlg::_AddItem(wil::com_ptr<IAssocHandler> pItem, int index, bool fForceSelect)
+void CVistaOpenAsDlg::_AddItem(int index, bool fForceSelect)
 {
+	wil::com_ptr<IAssocHandler> pItem = m_handlers.at(index);
+
 	LVITEMW lvi = { 0 };
-	wil::unique_cotaskmem_string pszDisplayName;
 	lvi.mask = LVIF_TEXT | LVIF_PARAM | LVIF_IMAGE;
 	lvi.iItem = index;
 	if (m_fRecommended)
 	{
 		lvi.mask |= LVIF_GROUPID;
-		lvi.iGroupId = (S_OK == pItem->IsRecommended()) ? I_RECOMMENDED : I_OTHER;
+		lvi.iGroupId = m_handlerTable.IsRecommended(index) ? I_RECOMMENDED : I_OTHER;
 	}
-	pItem->GetUIName(&pszDisplayName);
-	lvi.pszText = pszDisplayName.get();
+	lvi.pszText = (LPWSTR)m_handlerTable.GetUIName(index);
 	lvi.cchTextMax = wcslen(lvi.pszText) + 1;
 
 	// This is somewhat unsafe, but we're expecting that the item doesn't get
@@ -231,16 +230,7 @@ void CVistaOpenAsDlg::_AddItem(wil::com_ptr<IAssocHandler> pItem, int index, boo
 		lvi.state = LVIS_SELECTED;
 	}
 
-	wil::unique_cotaskmem_string pszIconPath = nullptr;
-	int iIndex = 0;
-	pItem->GetIconLocation(
-		&pszIconPath,
-		&iIndex
-	);
-
-	lvi.iImage = GetAppIconIndex(
-		pszIconPath.get(), iIndex
-	);
+	lvi.iImage = m_iGenericIcon;
 
 	SendDlgItemMessageW(
 		m_hWnd,
@@ -250,6 +240,16 @@ void CVistaOpenAsDlg::_AddItem(wil::com_ptr<IAssocHandler> pItem, int index, boo
 		(LPARAM)&lvi
 	);
 
+	// Items shown from the handler cache get theirs once their handler has
+	// been enumerated.
+	if (pItem)
+		_SetItemCompany(index);
+}
+
+void CVistaOpenAsDlg::_SetItemCompany(int index)
+{
+	wil::com_ptr<IAssocHandler> pItem = m_handlers.at(index);
+
 	wil::com_ptr_nothrow<IAssocHandlerWithCompanyName> pCompanyNameInfo = nullptr;
 	HRESULT hr = pItem->QueryInterface(IID_PPV_ARGS(&pCompanyNameInfo));
 	std::unique_ptr<WCHAR[]> pszCompanyName = nullptr;
@@ -274,15 +274,10 @@ void CVistaOpenAsDlg::_AddItem(wil::com_ptr<IAssocHandler> pItem, int index, boo
 		// If we failed to get the IAssocHandlerWithCompanyName object, or failed to
 		// query the company name from that, then we will attempt to query it from
 		// the shell item properties instead.
-		wil::unique_cotaskmem_string pszPath = nullptr;
-
 		// BUGBUG: UWP applications report their display names (i.e. "Photos") instead
-		// of their location when calling this function. Thus, they will fail this
-		// procedure.
-		pItem->GetName(&pszPath);
-
+		// of their location as their name. Thus, they will fail this procedure.
 		wil::com_ptr<IShellItem2> psi = nullptr;
-		hr = SHCreateItemFromParsingName(pszPath.get(), nullptr, IID_PPV_ARGS(&psi));
+		hr = SHCreateItemFromParsingName(m_handlerTable.GetName(index), nullptr, IID_PPV_ARGS(&psi));
 
 		if (SUCCEEDED(hr))
 		{
@@ -326,8 +321,58 @@ void CVistaOpenAsDlg::_AddItem(wil::com_ptr<IAssocHandler> pItem, int index, boo
 	}
 }
 
+void CVistaOpenAsDlg::_UpdateItem(int index)
+{
+	LVITEMW lvi = { 0 };
+	lvi.iItem = index;
+	lvi.mask = LVIF_TEXT | LVIF_PARAM;
+	lvi.pszText = (LPWSTR)m_handlerTable.GetUIName(index);
+	lvi.lParam = (LPARAM)m_handlers.at(index).get();
+
+	SendDlgItemMessageW(
+		m_hWnd, IDD_OPENWITH_PROGLIST,
+		LVM_SETITEMW, NULL,
+		(LPARAM)&lvi
+	);
+
+	_SetItemCompany(index);
+}
+
+void CVistaOpenAsDlg::_ClearItems()
+{
+	SendDlgItemMessageW(
+		m_hWnd, IDD_OPENWITH_PROGLIST,
+		LVM_DELETEALLITEMS, NULL,
+		NULL
+	);
+	SendDlgItemMessageW(
+		m_hWnd, IDD_OPENWITH_PROGLIST,
+		LVM_REMOVEALLGROUPS, NULL,
+		NULL
+	);
+	SendDlgItemMessageW(
+		m_hWnd, IDD_OPENWITH_PROGLIST,
+		LVM_ENABLEGROUPVIEW, FALSE,
+		NULL
+	);
+}
+
+void CVistaOpenAsDlg::_SetItemIcon(int index, int iImage)
+{
+	LVITEMW lvi = { 0 };
+	lvi.iItem = index;
+	lvi.mask = LVIF_IMAGE;
+	lvi.iImage = iImage;
+
+	SendDlgItemMessageW(
+		m_hWnd, IDD_OPENWITH_PROGLIST,
+		LVM_SETITEMW, NULL,
+		(LPARAM)&lvi
+	);
+}
+
 CVistaOpenAsDlg::CVistaOpenAsDlg(LPCWSTR lpszPath, IMMERSIVE_OPENWITH_FLAGS flags, bool fUri, bool fPreregistered)
-	: CBaseOpenAsDlg(lpszPath, flags, fUri, fPreregistered, IDD_OPENWITH, IDD_OPENWITH_WITHDESC, IDD_OPENWITH_PROTOCOL)
+	: CBaseOpenAsDlg(lpszPath, flags, OWXS_VISTA, fUri, fPreregistered, IDD_OPENWITH, IDD_OPENWITH_WITHDESC, IDD_OPENWITH_PROTOCOL)
 {
 
 }
\ No newline at end of file
@@ -0,0 +1,91 @@
+#pragma once
+
+/**
+ * Minimal Win32 type definitions for the portable parts of OpenWithEx.
+ *
+ * The association core (hashing, and anything else that does not need to
+ * talk to the shell) includes this instead of <windows.h> so that it can be
+ * built and tested on other hosts. On Windows, this is just <windows.h>.
+ *
+ * Only what the portable code actually uses is defined here. Don't grow this
+ * into a Win32 reimplementation.
+ */
+
+#ifdef _WIN32
+
+#include <windows.h>
+
+// Wide string literal in the platform's WCHAR type.
+#define WTEXT(s) L##s
+
+#else // !_WIN32
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint8_t        BYTE;
+typedef uint16_t       WORD;
+typedef uint32_t       DWORD;
+typedef uint64_t       ULONGLONG;
+typedef int32_t        LONG;
+typedef int            BOOL;
+
+// Windows' WCHAR is always UTF-16, which wchar_t isn't on other hosts.
+typedef char16_t       WCHAR;
+
+typedef BYTE          *LPBYTE;
+typedef const BYTE    *LPCBYTE;
+typedef WCHAR         *LPWSTR;
+typedef const WCHAR   *LPCWSTR;
+
+#define WTEXT(s) u##s
+
+#define ARRAYSIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+// Registry, for IRegistryBackend. Keys are opaque handles.
+typedef struct HKEY__ *HKEY;
+typedef LONG           LSTATUS;
+
+#define HKEY_CLASSES_ROOT  ((HKEY)(uintptr_t)0x80000000)
+#define HKEY_CURRENT_USER  ((HKEY)(uintptr_t)0x80000001)
+
+#define REG_NONE   0
+#define REG_SZ     1
+#define REG_DWORD  4
+
+#define KEY_SET_VALUE 0x0002
+
+// Windows, for CLauncherDispatcher. Only ever passed through.
+typedef struct HWND__ *HWND;
+
+// COM, for the interface IDs that CRingLog records.
+typedef struct _GUID
+{
+	DWORD  Data1;
+	WORD   Data2;
+	WORD   Data3;
+	BYTE   Data4[8];
+} GUID;
+
+// Paths, for CAssocHandlerTable's name keys.
+#define MAX_PATH 260
+
+// Access control lists, for CProtectedAcl.
+#define MAXWORD 0xFFFF
+
+#define ACL_REVISION 2
+
+#define ACCESS_ALLOWED_ACE_TYPE 0x0
+#define ACCESS_DENIED_ACE_TYPE  0x1
+
+#define ERROR_SUCCESS           0L
+#define ERROR_FILE_NOT_FOUND    2L
+#define ERROR_ACCESS_DENIED     5L
+#define ERROR_INVALID_HANDLE    6L
+#define ERROR_INVALID_PARAMETER 87L
+#define ERROR_ALREADY_EXISTS    183L
+#define ERROR_MORE_DATA         234L
+#define ERROR_NO_TOKEN          1008L
+#define ERROR_KEY_DELETED       1018L
+
+#endif // _WIN32
\ No newline at end of file
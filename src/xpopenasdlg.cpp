@@ -95,27 +95,16 @@ void CXPOpenAsDlg::_SetupCategories()
 	);
 }
 
-void CXPOpenAsDlg::_AddItem(wil::com_ptr<IAssocHandler> pItem, int index, bool fForceSelect)
+void CXPOpenAsDlg::_AddItem(int index, bool fForceSelect)
 {
 	TVITEMW tvi = { 0 };
-	wil::unique_cotaskmem_string pszDisplayName;
 	tvi.mask = TVIF_TEXT | TVIF_PARAM | TVIF_IMAGE | TVIF_SELECTEDIMAGE;
-	pItem->GetUIName(&pszDisplayName);
-	tvi.pszText = pszDisplayName.get();
+	tvi.pszText = (LPWSTR)m_handlerTable.GetUIName(index);
 	tvi.cchTextMax = MAX_PATH;
 
-	tvi.lParam = (LPARAM)pItem.get();
+	tvi.lParam = (LPARAM)m_handlers.at(index).get();
 
-	LPWSTR pszPath = nullptr;
-	int iIndex = 0;
-	pItem->GetIconLocation(
-		&pszPath,
-		&iIndex
-	);
-
-	tvi.iImage = GetAppIconIndex(
-		pszPath, iIndex
-	);
+	tvi.iImage = m_iGenericIcon;
 	tvi.iSelectedImage = tvi.iImage;
 
 	TVINSERTSTRUCTW insert = { 0 };
@@ -123,7 +112,7 @@ void CXPOpenAsDlg::_AddItem(wil::com_ptr<IAssocHandler> pItem, int index, bool f
 	insert.hInsertAfter = TVI_LAST;
 	if (m_fRecommended)
 	{
-		insert.hParent = (S_OK == pItem->IsRecommended()) ? m_hRecommended : m_hOther;
+		insert.hParent = m_handlerTable.IsRecommended(index) ? m_hRecommended : m_hOther;
 	}
 
 	m_treeItems.push_back((HTREEITEM)SendDlgItemMessageW(
@@ -135,8 +124,57 @@ void CXPOpenAsDlg::_AddItem(wil::com_ptr<IAssocHandler> pItem, int index, bool f
 	));
 }
 
+void CXPOpenAsDlg::_UpdateItem(int index)
+{
+	if ((size_t)index >= m_treeItems.size() || !m_treeItems.at(index))
+		return;
+
+	TVITEMW tvi = { 0 };
+	tvi.mask = TVIF_HANDLE | TVIF_TEXT | TVIF_PARAM;
+	tvi.hItem = m_treeItems.at(index);
+	tvi.pszText = (LPWSTR)m_handlerTable.GetUIName(index);
+	tvi.lParam = (LPARAM)m_handlers.at(index).get();
+
+	SendDlgItemMessageW(
+		m_hWnd, IDD_OPENWITH_PROGLIST,
+		TVM_SETITEMW, NULL,
+		(LPARAM)&tvi
+	);
+}
+
+void CXPOpenAsDlg::_ClearItems()
+{
+	// This takes the categories with it.
+	SendDlgItemMessageW(
+		m_hWnd, IDD_OPENWITH_PROGLIST,
+		TVM_DELETEITEM, NULL,
+		(LPARAM)TVI_ROOT
+	);
+	m_treeItems.clear();
+	m_hRecommended = nullptr;
+	m_hOther = nullptr;
+}
+
+void CXPOpenAsDlg::_SetItemIcon(int index, int iImage)
+{
+	if ((size_t)index >= m_treeItems.size() || !m_treeItems.at(index))
+		return;
+
+	TVITEMW tvi = { 0 };
+	tvi.mask = TVIF_HANDLE | TVIF_IMAGE | TVIF_SELECTEDIMAGE;
+	tvi.hItem = m_treeItems.at(index);
+	tvi.iImage = iImage;
+	tvi.iSelectedImage = iImage;
+
+	SendDlgItemMessageW(
+		m_hWnd, IDD_OPENWITH_PROGLIST,
+		TVM_SETITEMW, NULL,
+		(LPARAM)&tvi
+	);
+}
+
 CXPOpenAsDlg::CXPOpenAsDlg(LPCWSTR lpszPath, IMMERSIVE_OPENWITH_FLAGS flags, bool fUri, bool fPreregistered)
-	: CBaseOpenAsDlg(lpszPath, flags, fUri, fPreregistered, IDD_OPENWITH_XP, IDD_OPENWITH_WITHDESC_XP, IDD_OPENWITH_PROTOCOL_XP)
+	: CBaseOpenAsDlg(lpszPath, flags, OWXS_XP, fUri, fPreregistered, IDD_OPENWITH_XP, IDD_OPENWITH_WITHDESC_XP, IDD_OPENWITH_PROTOCOL_XP)
 {
 
 }
\ No newline at end of file
@@ -15,7 +15,10 @@ private:
 	wil::com_ptr<IAssocHandler> _GetSelectedItem();
 	void _SelectItemByIndex(int index);
 	void _SetupCategories();
-	void _AddItem(wil::com_ptr<IAssocHandler> pItem, int index, bool fForceSelect);
+	void _AddItem(int index, bool fForceSelect);
+	void _UpdateItem(int index);
+	void _ClearItems();
+	void _SetItemIcon(int index, int iImage);
 
 public:
 	CXPOpenAsDlg(LPCWSTR lpszPath, IMMERSIVE_OPENWITH_FLAGS flags, bool fUri, bool fPreregistered);